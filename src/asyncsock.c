@@ -0,0 +1,313 @@
+/**
+   \file asyncsock.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione della lettura non bloccante dei messaggi.
+ */
+/*recvmmsg, sendmmsg*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "errors.h"
+#include "asyncsock.h"
+#include "proto2.h"
+#include "packet.h"
+
+/** Buffer in cui ogni thread riceve i datagrammi di una recvmmsg, prima
+ * di accodarli al lettore della loro connessione: cosi` un lettore non
+ * deve riservare PACKET_BATCH*PACKET_MAX byte */
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+/** Crea la chiave del buffer, liberato all'uscita del thread.*/
+static void createScratch(void) {
+	if ((errno = pthread_key_create(&scratch_key, &free)) != 0) {
+		perror("asyncsock, createScratch");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** Restituisce il buffer del thread chiamante, creandolo al primo uso.*/
+static char *threadScratch(void) {
+	char *p;
+	(void) pthread_once(&scratch_once, &createScratch);
+	if ((p = pthread_getspecific(scratch_key)) == NULL) {
+		p = Malloc(sizeof(char)*PACKET_BATCH*PACKET_MAX);
+		(void) pthread_setspecific(scratch_key, p);
+	}
+	return p;
+}
+
+void initialize_Reader(frame_reader *r) {
+	if (r == NULL) return;
+	r->data = Malloc(sizeof(char)*READER_SIZE);
+	r->size = READER_SIZE;
+	r->start = r->end = 0;
+	r->frames = 0;
+	r->version = 1;
+	r->packet = 0;
+}
+
+void free_Reader(frame_reader *r) {
+	if (r == NULL) return;
+	free(r->data);
+	r->data = NULL;
+	r->size = r->start = r->end = 0;
+}
+
+/** Se in r è presente un messaggio completo lo copia in msg.
+ * \retval 1 se il messaggio è stato estratto, 0 altrimenti
+ * \retval -1 se il messaggio non è valido (sets errno) */
+static int extractFrame(frame_reader *r, message_t *msg) {
+	int available = r->end - r->start, length, body;
+	char *p = r->data + r->start;
+	if (r->version == PROTO_VERSION) {
+		if ((body = frameSize2(p, available)) <= 0 || available < body) return (body == -1) ? -1 : 0;
+		if (decodeFrame2(p, body, msg) == -1) return -1;
+		r->start += body;
+		if (r->start == r->end) r->start = r->end = 0;
+		__atomic_store_n(&r->frames, r->frames+1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	if (available < (int) HEADER_SIZE) return 0;
+	memcpy(&length, p+sizeof(char), sizeof(int));
+	/*Come in sendMessage, il corpo viaggia con il terminatore*/
+	body = (length > 0) ? length+1 : 0;
+	if (available < (int) HEADER_SIZE + body) return 0;
+	msg->type = p[0];
+	msg->length = length;
+	if (length > 0) {
+		msg->buffer = Malloc(sizeof(char)*body);
+		memcpy(msg->buffer, p+HEADER_SIZE, body);
+		msg->buffer[length] = '\0';
+		if (msg->buffer[msg->length-1] == '\n')
+			msg->buffer[--msg->length] = '\0';
+	} else msg->buffer = NULL;
+	r->start += HEADER_SIZE + body;
+	if (r->start == r->end) r->start = r->end = 0;
+	/*Un solo scrittore: basta una store atomica, senza lock del bus*/
+	__atomic_store_n(&r->frames, r->frames+1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/** Garantisce che dopo end ci sia spazio per almeno un'altra lettura,
+ * compattando o ingrandendo il buffer.*/
+static void reserveReader(frame_reader *r) {
+	int used = r->end - r->start, length, needed = READER_SIZE;
+	if (r->version == PROTO_VERSION) {
+		if ((length = frameSize2(r->data+r->start, used)) > 0) needed = length;
+	} else if (used >= (int) HEADER_SIZE) {
+		memcpy(&length, r->data+r->start+sizeof(char), sizeof(int));
+		if (length > 0) needed = HEADER_SIZE + length + 1;
+	}
+	if (r->start > 0 && r->size - r->end < needed - used) {
+		memmove(r->data, r->data+r->start, used);
+		r->start = 0;
+		r->end = used;
+	}
+	if (r->size < needed || r->size == r->end) {
+		char *old = r->data;
+		int size = (needed > 2*r->size) ? needed : 2*r->size;
+		r->data = Malloc(sizeof(char)*size);
+		memcpy(r->data, old+r->start, used);
+		free(old);
+		r->size = size;
+		r->start = 0;
+		r->end = used;
+	}
+}
+
+int nextFrame(frame_reader *r, message_t *msg) {
+	int res;
+	if (r == NULL || msg == NULL || r->data == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	while ((res = extractFrame(r, msg)) == 1) {
+		if (msg->type != MSG_PING) return 1;
+		free(msg->buffer);
+	}
+	return res;
+}
+
+void feedReader(frame_reader *r, const char *data, int n) {
+	int used;
+	if (r == NULL || data == NULL || n <= 0) return;
+	if (r->size - r->end < n) {
+		char *old = r->data;
+		used = r->end - r->start;
+		if (r->size < used + n) {
+			r->size = (used + n > 2*r->size) ? used + n : 2*r->size;
+			r->data = Malloc(sizeof(char)*r->size);
+		}
+		memmove(r->data, old+r->start, used);
+		if (old != r->data) free(old);
+		r->start = 0;
+		r->end = used;
+	}
+	memcpy(r->data+r->end, data, n);
+	r->end += n;
+}
+
+/** Riceve fino a PACKET_BATCH datagrammi con una sola recvmmsg e li
+ * accoda a r.
+ * \retval il numero di datagrammi, 0 se la lettura bloccherebbe
+ * \retval SEOF se il peer ha chiuso la connessione
+ * \retval -1 in caso di errore o di datagramma troncato (sets errno) */
+static int readPackets(int sc, frame_reader *r) {
+	struct mmsghdr mm[PACKET_BATCH];
+	struct iovec iov[PACKET_BATCH];
+	char *scratch = threadScratch();
+	int i, n;
+	memset(mm, 0, sizeof(mm));
+	for (i = 0; i < PACKET_BATCH; i++) {
+		iov[i].iov_base = scratch + i*PACKET_MAX;
+		iov[i].iov_len = PACKET_MAX;
+		mm[i].msg_hdr.msg_iov = iov+i;
+		mm[i].msg_hdr.msg_iovlen = 1;
+	}
+	while ((n = recvmmsg(sc, mm, PACKET_BATCH, MSG_DONTWAIT, NULL)) == -1 && errno == EINTR);
+	if (n == -1) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	for (i = 0; i < n; i++) {
+		/*Un messaggio non e` mai vuoto: un datagramma vuoto e` la chiusura*/
+		if (mm[i].msg_len == 0) return (i > 0) ? i : SEOF;
+		if (mm[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		feedReader(r, iov[i].iov_base, mm[i].msg_len);
+	}
+	return n;
+}
+
+int readFrame(int sc, frame_reader *r, message_t *msg) {
+	int n;
+	if (r == NULL || msg == NULL || r->data == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (1) {
+		if ((n = nextFrame(r, msg)) != 0) return n;
+		if (r->packet) {
+			if ((n = readPackets(sc, r)) <= 0) return n;
+			continue;
+		}
+		reserveReader(r);
+		n = recv(sc, r->data+r->end, r->size-r->end, MSG_DONTWAIT);
+		if (n == 0) return SEOF;
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		r->end += n;
+	}
+}
+
+void initialize_Writer(frame_writer *w) {
+	if (w == NULL) return;
+	w->data = Malloc(sizeof(char)*READER_SIZE);
+	w->size = READER_SIZE;
+	w->start = w->end = 0;
+	w->version = 1;
+	w->packet = 0;
+}
+
+void free_Writer(frame_writer *w) {
+	if (w == NULL) return;
+	free(w->data);
+	w->data = NULL;
+	w->size = w->start = w->end = 0;
+}
+
+int queueFrame(frame_writer *w, message_t *msg) {
+	char header[PROTO_HEADER_SIZE];
+	int head, body, used;
+	if (w == NULL || msg == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	head = replyHeader(header, msg, w->version, &body);
+	/*Non entrerebbe in un datagramma: flushWriter non potrebbe inviarlo*/
+	if (w->packet && head + body > PACKET_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (w->size - w->end < head + body) {
+		char *old = w->data;
+		used = w->end - w->start;
+		if (w->size < used + head + body) {
+			w->size = (used + head + body > 2*w->size) ? used + head + body : 2*w->size;
+			w->data = Malloc(sizeof(char)*w->size);
+		}
+		memmove(w->data, old+w->start, used);
+		if (old != w->data) free(old);
+		w->start = 0;
+		w->end = used;
+	}
+	memcpy(w->data+w->end, header, head);
+	if (body > 0)
+		memcpy(w->data+w->end+head, msg->buffer, body);
+	w->end += head + body;
+	return 0;
+}
+
+/** Invia i messaggi accodati in w, ciascuno nel suo datagramma, fino a
+ * PACKET_BATCH per sendmmsg.
+ * \retval come flushWriter */
+static int flushPackets(int sc, frame_writer *w) {
+	struct mmsghdr mm[PACKET_BATCH];
+	struct iovec iov[PACKET_BATCH];
+	int i, n, pos, length;
+	while (w->start < w->end) {
+		memset(mm, 0, sizeof(mm));
+		/*I messaggi accodati da queueFrame sono completi: le lunghezze
+		 * nelle intestazioni li separano*/
+		for (n = 0, pos = w->start; n < PACKET_BATCH && pos < w->end; n++) {
+			if (w->version >= PROTO_VERSION) length = frameSize2(w->data+pos, w->end-pos);
+			else {
+				memcpy(&length, w->data+pos+sizeof(char), sizeof(int));
+				length = HEADER_SIZE + ((length > 0) ? length+1 : 0);
+			}
+			iov[n].iov_base = w->data+pos;
+			iov[n].iov_len = length;
+			mm[n].msg_hdr.msg_iov = iov+n;
+			mm[n].msg_hdr.msg_iovlen = 1;
+			pos += iov[n].iov_len;
+		}
+		if ((n = sendmmsg(sc, mm, n, MSG_DONTWAIT|MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		for (i = 0; i < n; i++) w->start += iov[i].iov_len;
+	}
+	w->start = w->end = 0;
+	return 1;
+}
+
+int flushWriter(int sc, frame_writer *w) {
+	int n;
+	if (w == NULL || w->data == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (w->packet) return flushPackets(sc, w);
+	while (w->start < w->end) {
+		n = send(sc, w->data+w->start, w->end-w->start, MSG_DONTWAIT|MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		w->start += n;
+	}
+	w->start = w->end = 0;
+	return 1;
+}
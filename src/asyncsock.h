@@ -0,0 +1,120 @@
+/**
+   \file asyncsock.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  lettura non bloccante dei messaggi del protocollo di comsock.h
+
+Il formato dei messaggi è il medesimo di receiveMessage/sendMessage
+(tipo, lunghezza, buffer terminato da '\\0'); la differenza è che i byte
+vengono accumulati in un buffer per connessione, così che un messaggio
+possa arrivare in più letture senza bloccare il thread chiamante.
+Simmetricamente, un frame_writer accumula i messaggi da inviare e li
+scrive quando la socket è pronta a riceverli.
+
+Su una socket SOCK_SEQPACKET (packet.h) lettore e scrittore lavorano a
+datagrammi: il lettore ne riceve fino a PACKET_BATCH con una recvmmsg, lo
+scrittore invia ogni messaggio accodato nel suo datagramma, fino a
+PACKET_BATCH per sendmmsg.
+ */
+#ifndef __ASYNCSOCK_H
+#define __ASYNCSOCK_H
+
+#include "comsock.h"
+
+/** Dimensione iniziale del buffer di lettura di una connessione */
+#define READER_SIZE 4096
+/** Numero di byte dell'intestazione (tipo + lunghezza) */
+#define HEADER_SIZE (sizeof(char)+sizeof(int))
+
+/** <H3>Lettore di messaggi</H3>
+ * - \c data i byte ricevuti e non ancora consumati
+ * - \c size la capacità di data
+ * - \c start inizio dei byte non consumati
+ * - \c end fine dei byte ricevuti
+ * - \c frames i messaggi estratti, MSG_PING compresi: chi controlla se il
+ *   peer e` vivo lo legge da un altro thread
+ * - \c version il formato dei messaggi in arrivo: 1 (quello di
+ *   sendMessage, il default) o PROTO_VERSION (proto2.h)
+ * - \c packet 1 se la socket e` SOCK_SEQPACKET
+ */
+typedef struct {
+	char *data;
+	int size;
+	int start;
+	int end;
+	unsigned long frames;
+	int version;
+	int packet;
+} frame_reader;
+
+/** <H3>Scrittore di messaggi</H3>
+ * - \c data i byte dei messaggi accodati e non ancora inviati
+ * - \c size la capacità di data
+ * - \c start inizio dei byte da inviare
+ * - \c end fine dei byte accodati
+ * - \c version il formato dei messaggi in uscita: 1 (quello di
+ *   sendMessage, il default) o PROTO_VERSION (sendReply, proto2.h)
+ * - \c packet 1 se la socket e` SOCK_SEQPACKET
+ */
+typedef struct {
+	char *data;
+	int size;
+	int start;
+	int end;
+	int version;
+	int packet;
+} frame_writer;
+
+/** Byte accodati e non ancora inviati da uno scrittore */
+#define pendingWriter(w) ((w)->end - (w)->start)
+
+/** Inizializza un lettore vuoto. */
+void initialize_Reader(frame_reader *r);
+
+/** Libera il buffer del lettore. */
+void free_Reader(frame_reader *r);
+
+/** Estrae il prossimo messaggio completo per la socket sc, leggendo dalla
+ * socket solo se i dati accumulati non sono sufficienti. La lettura avviene
+ * con MSG_DONTWAIT, quindi la socket può rimanere bloccante per gli altri
+ * thread che vi scrivono.
+ * Come receiveMessage, i MSG_PING vengono scartati.
+ * \param sc file descriptor della socket
+ * \param r il lettore associato alla socket
+ * \param msg struttura in cui copiare il messaggio (buffer allocato qui)
+ *
+ * \retval 1 se msg contiene un messaggio
+ * \retval 0 se non ci sono messaggi completi e la lettura bloccherebbe
+ * \retval SEOF se il peer ha chiuso la connessione
+ * \retval -1 in caso di errore o di messaggio non valido (sets errno)
+ */
+int readFrame(int sc, frame_reader *r, message_t *msg);
+
+/** Estrae il prossimo messaggio completo già accumulato in r, senza
+ * leggere dalla socket (i MSG_PING vengono scartati).
+ * \retval 1 se msg contiene un messaggio, 0 se non ce ne sono
+ * \retval -1 se il prossimo messaggio non è valido (sets errno) */
+int nextFrame(frame_reader *r, message_t *msg);
+
+/** Accoda a r n byte ricevuti per altra via (ad esempio da io_uring). */
+void feedReader(frame_reader *r, const char *data, int n);
+
+/** Inizializza uno scrittore vuoto. */
+void initialize_Writer(frame_writer *w);
+
+/** Libera il buffer dello scrittore. */
+void free_Writer(frame_writer *w);
+
+/** Accoda msg allo scrittore w, nel formato della sua versione.
+ * \retval 0 se il messaggio e` stato accodato
+ * \retval -1 se non e` valido o, su una socket SOCK_SEQPACKET, se e` piu`
+ * lungo di PACKET_MAX e non entrerebbe in un datagramma (sets errno) */
+int queueFrame(frame_writer *w, message_t *msg);
+
+/** Invia alla socket sc quanto più possibile dei byte accodati in w,
+ * senza bloccare (MSG_DONTWAIT).
+ * \retval 1 se non restano byte da inviare
+ * \retval 0 se la socket non accetta altri byte per ora
+ * \retval -1 in caso di errore (sets errno) */
+int flushWriter(int sc, frame_writer *w);
+
+#endif
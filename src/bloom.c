@@ -0,0 +1,81 @@
+/**
+   \file bloom.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione del filtro di Bloom a blocchi.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "errors.h"
+#include "bloom.h"
+
+/** Hash a 64 bit di key: FNV-1a seguito dal rimescolamento finale di
+ * MurmurHash3, cosi` che anche i bit alti dipendano da tutta la chiave. */
+static uint64_t hash_Key(const char *key) {
+	uint64_t h = 14695981039346656037ULL;
+	while (*key != '\0') {
+		h ^= (unsigned char) *key++;
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+bloom_filter *initialize_Bloom(int keys) {
+	bloom_filter *b;
+	unsigned long n = 1;
+	if (keys <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (n*BLOOM_LINE*8 < (unsigned long) keys*BLOOM_BITS) n <<= 1;
+	b = Malloc(sizeof(bloom_filter));
+	if ((errno = posix_memalign((void **) &b->blocks, BLOOM_LINE, n*BLOOM_LINE)) != 0) {
+		perror("bloom, initialize_Bloom");
+		free(b);
+		return NULL;
+	}
+	memset(b->blocks, 0, n*BLOOM_LINE);
+	b->mask = n-1;
+	return b;
+}
+
+void add_Bloom(bloom_filter *b, const char *key) {
+	uint64_t h = hash_Key(key), *block;
+	uint32_t h1 = h, h2 = (h >> 16) | 1;
+	int i;
+	/*Il blocco si sceglie con i bit alti dell'hash, i bit nel blocco con
+	 * il doppio hashing dei bit bassi: h1 + i*h2, modulo i bit del blocco*/
+	block = b->blocks[(h >> 32) & b->mask];
+	for (i = 0; i < BLOOM_PROBES; i++, h1 += h2)
+		block[(h1 >> 6) % BLOOM_WORDS] |= 1ULL << (h1 & 63);
+}
+
+int check_Bloom(bloom_filter *b, const char *key) {
+	uint64_t h, *block;
+	uint32_t h1, h2;
+	int i;
+	if (b == NULL) return 1;
+	h = hash_Key(key);
+	h1 = h;
+	h2 = (h >> 16) | 1;
+	block = b->blocks[(h >> 32) & b->mask];
+	for (i = 0; i < BLOOM_PROBES; i++, h1 += h2)
+		if ((block[(h1 >> 6) % BLOOM_WORDS] & (1ULL << (h1 & 63))) == 0)
+			return 0;
+	return 1;
+}
+
+void free_Bloom(bloom_filter **b) {
+	if (b == NULL || *b == NULL) return;
+	free((*b)->blocks);
+	free(*b);
+	*b = NULL;
+}
@@ -0,0 +1,50 @@
+/**
+   \file bloom.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  filtro di Bloom a blocchi per insiemi di stringhe.
+
+Il filtro è diviso in blocchi di una linea di cache: l'hash di una chiave
+sceglie un blocco, e tutti i bit della chiave stanno in quel blocco. Una
+verifica legge così una sola linea. Il filtro può dare falsi positivi (una
+chiave mai inserita sembra presente) ma non falsi negativi: se dice che
+una chiave manca, manca davvero. Le chiavi non si possono togliere.
+ */
+#ifndef __BLOOM_H
+#define __BLOOM_H
+
+#include <stdint.h>
+
+/** Dimensione di un blocco (una linea di cache) */
+#define BLOOM_LINE 64
+/** Parole da 64 bit in un blocco */
+#define BLOOM_WORDS (BLOOM_LINE/sizeof(uint64_t))
+/** Bit del filtro per ogni chiave prevista */
+#define BLOOM_BITS 16
+/** Bit impostati nel blocco per ogni chiave */
+#define BLOOM_PROBES 8
+
+/** <H3>Filtro di Bloom</H3>
+ * - \c blocks i blocchi, allineati alla linea di cache
+ * - \c mask il numero di blocchi meno uno (potenza di due)
+ */
+typedef struct {
+	uint64_t (*blocks)[BLOOM_WORDS];
+	unsigned long mask;
+} bloom_filter;
+
+/** Crea un filtro vuoto dimensionato per keys chiavi.
+ * \retval NULL in caso di errore (sets errno) */
+bloom_filter *initialize_Bloom(int keys);
+
+/** Inserisce la chiave key nel filtro b. */
+void add_Bloom(bloom_filter *b, const char *key);
+
+/** Verifica se la chiave key puo` essere nel filtro b.
+ * \retval 0 se key non e` stata inserita
+ * \retval 1 se potrebbe esserlo (sempre, se b e` NULL) */
+int check_Bloom(bloom_filter *b, const char *key);
+
+/** Libera il filtro. */
+void free_Bloom(bloom_filter **b);
+
+#endif
@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <pthread.h>
 #include "errors.h"
@@ -343,28 +344,30 @@ int receiveMessage(int sc, message_t * msg) {
  
  */
 int sendMessage(int sc, message_t *msg) {
-	int c = 0;
+	struct iovec iov[3];
+	int c, n = 2;
 	if (msg == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
-	if (write(sc, &(msg->type), sizeof(char)) == -1) {
-		if (EPIPE == errno) return SEOF;
-		return -1;
+	/*Tipo, lunghezza e buffer partono con una sola scrittura: su una
+	 * socket SOCK_SEQPACKET (packet.h) formano un solo datagramma*/
+	iov[0].iov_base = &(msg->type);
+	iov[0].iov_len = sizeof(char);
+	iov[1].iov_base = &(msg->length);
+	iov[1].iov_len = sizeof(int);
+	if (msg->length > 0 && msg->buffer != NULL) {
+		iov[2].iov_base = msg->buffer;
+		iov[2].iov_len = sizeof(char)*(msg->length+1);
+		n = 3;
 	}
-	if (write(sc, &(msg->length), sizeof(int)) == -1){
+	if ((c = writev(sc, iov, n)) == -1) {
 		if (EPIPE == errno) return SEOF;
 		return -1;
 	}
-
-	if (msg->length > 0 && msg->buffer != NULL) {
-		if((c = write(sc, msg->buffer, sizeof(char)*(msg->length+1))) == -1){
-			if (EPIPE == errno) return SEOF;
-			return -1;
-		}
-	}
-
-	return c;
+	/*Come prima, si restituiscono i byte del buffer*/
+	c -= sizeof(char)+sizeof(int);
+	return (c > 0) ? c : 0;
 }
 /** crea una connessione all socket del server. In caso di errore funzione tenta NTRIALCONN volte la connessione (a distanza di 1 secondo l'una dall'altra) prima di ritornare errore.
  *   \param  path  nome del socket su cui il server accetta le connessioni
@@ -0,0 +1,292 @@
+/**
+   \file coro.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione delle coroutine e dei loro scheduler.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "errors.h"
+#include "coro.h"
+
+/** Lo scheduler eseguito dal thread corrente (NULL fuori dagli scheduler) */
+static __thread coro_sched *self = NULL;
+
+/** Accoda c tra le coroutine pronte, se non lo e` gia`. */
+static void push_Ready(coro_sched *s, coroutine *c) {
+	if (c->queued) return;
+	c->queued = 1;
+	c->next = NULL;
+	if (s->ready_tail == NULL) s->ready_head = c;
+	else s->ready_tail->next = c;
+	s->ready_tail = c;
+}
+
+/** Primo contesto di ogni coroutine: esegue la funzione e la segna come
+ * terminata; uc_link riporta poi il controllo allo scheduler.*/
+static void coro_Start(void) {
+	coroutine *c = self->current;
+	c->fn(c->arg);
+	c->done = 1;
+}
+
+/** Alloca lo stack di una coroutine, preceduto da una pagina di guardia
+ * senza permessi: chi lo esaurisce riceve SIGSEGV invece di scrivere sulla
+ * memoria vicina.
+ * \retval l'inizio dello stack, NULL in caso di errore (sets errno) */
+static char *alloc_Stack(void) {
+	long page = sysconf(_SC_PAGESIZE);
+	char *base = mmap(NULL, CORO_STACK + page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+	if (base == MAP_FAILED) return NULL;
+	if (mprotect(base, page, PROT_NONE) == -1) {
+		(void) munmap(base, CORO_STACK + page);
+		return NULL;
+	}
+	return base + page;
+}
+
+/** Libera uno stack allocato da alloc_Stack, con la sua pagina di guardia */
+static void free_Stack(char *stack) {
+	long page = sysconf(_SC_PAGESIZE);
+	(void) munmap(stack - page, CORO_STACK + page);
+}
+
+static void destroy_Coroutine(coro_sched *s, coroutine *c) {
+	if (c->fd >= 0) (void) epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	if (c->prev_all == NULL) s->all = c->next_all;
+	else c->prev_all->next_all = c->next_all;
+	if (c->next_all != NULL) c->next_all->prev_all = c->prev_all;
+	free_Stack(c->stack);
+	free(c);
+}
+
+/** Sposta tra le coroutine dello scheduler quelle create da altri thread.*/
+static void take_Incoming(coro_sched *s) {
+	coroutine *c, *next;
+	pthread_mutex_lock(&s->mtx);
+		c = s->incoming;
+		s->incoming = NULL;
+	pthread_mutex_unlock(&s->mtx);
+	for (; c != NULL; c = next) {
+		next = c->next;
+		c->prev_all = NULL;
+		if ((c->next_all = s->all) != NULL) s->all->prev_all = c;
+		s->all = c;
+		push_Ready(s, c);
+	}
+}
+
+/** Esegue le coroutine pronte finché la coda non si svuota.*/
+static void run_Ready(coro_sched *s) {
+	coroutine *c;
+	while ((c = s->ready_head) != NULL) {
+		if ((s->ready_head = c->next) == NULL) s->ready_tail = NULL;
+		c->next = NULL;
+		c->queued = 0;
+		s->current = c;
+		swapcontext(&s->main, &c->ctx);
+		s->current = NULL;
+		if (c->done) destroy_Coroutine(s, c);
+	}
+}
+
+static void *run_Sched(void *arg) {
+	coro_sched *s = arg;
+	struct epoll_event events[CORO_EVENTS];
+	int n, i;
+	self = s;
+	while (!s->stop) {
+		take_Incoming(s);
+		run_Ready(s);
+		if (s->stop) break;
+		if ((n = epoll_wait(s->epfd, events, CORO_EVENTS, -1)) == -1) {
+			if (errno == EINTR) continue;
+			perror("coro, run_Sched");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			/*Il dato NULL identifica l'eventfd di risveglio*/
+			if (events[i].data.ptr == NULL) {
+				uint64_t v;
+				(void) read(s->wakefd, &v, sizeof(v));
+				continue;
+			}
+			push_Ready(s, events[i].data.ptr);
+		}
+	}
+	/*Le coroutine ancora vive vengono riprese finché non terminano:
+	 * ora wait_Coro restituisce subito -1.*/
+	take_Incoming(s);
+	while (s->all != NULL) {
+		coroutine *c;
+		for (c = s->all; c != NULL; c = c->next_all)
+			push_Ready(s, c);
+		run_Ready(s);
+	}
+	return (void *) 0;
+}
+
+coro_group *initialize_Coro(int n) {
+	coro_group *g;
+	struct epoll_event ev;
+	int i;
+	if (n < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	g = Malloc(sizeof(coro_group));
+	g->scheds = Malloc(sizeof(coro_sched)*n);
+	g->size = n;
+	g->next = 0;
+	pthread_mutex_init(&g->mtx, NULL);
+	for (i = 0; i < n; i++) {
+		coro_sched *s = g->scheds+i;
+		s->stop = 0;
+		s->id = i;
+		s->current = s->ready_head = s->ready_tail = NULL;
+		s->all = s->incoming = NULL;
+		pthread_mutex_init(&s->mtx, NULL);
+		if ((s->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+			(s->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			perror("coro, initialize_Coro");
+			g->size = i;
+			free_Coro(&g);
+			return NULL;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wakefd, &ev);
+	}
+	return g;
+}
+
+int start_Coro(coro_group *g) {
+	int i;
+	if (g == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < g->size; i++) {
+		if ((errno = pthread_create(&g->scheds[i].tid, NULL, &run_Sched, g->scheds+i)) != 0) {
+			perror("coro, start_Coro");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int spawn_Coro(coro_group *g, coro_fn fn, void *arg) {
+	coro_sched *s;
+	coroutine *c;
+	uint64_t one = 1;
+	if (g == NULL || fn == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&g->mtx);
+		s = g->scheds + (g->next++ % g->size);
+	pthread_mutex_unlock(&g->mtx);
+	c = Malloc(sizeof(coroutine));
+	if ((c->stack = alloc_Stack()) == NULL) {
+		free(c);
+		return -1;
+	}
+	c->fn = fn;
+	c->arg = arg;
+	c->fd = -1;
+	c->done = c->queued = 0;
+	c->sched = s;
+	c->next = c->prev_all = c->next_all = NULL;
+	if (getcontext(&c->ctx) == -1) {
+		free_Stack(c->stack);
+		free(c);
+		return -1;
+	}
+	c->ctx.uc_stack.ss_sp = c->stack;
+	c->ctx.uc_stack.ss_size = CORO_STACK;
+	c->ctx.uc_link = &s->main;
+	makecontext(&c->ctx, &coro_Start, 0);
+	pthread_mutex_lock(&s->mtx);
+		c->next = s->incoming;
+		s->incoming = c;
+	pthread_mutex_unlock(&s->mtx);
+	(void) write(s->wakefd, &one, sizeof(one));
+	return 0;
+}
+
+int wait_Coro(int fd, unsigned int events) {
+	coro_sched *s = self;
+	coroutine *c;
+	struct epoll_event ev;
+	int op = EPOLL_CTL_MOD;
+	if (s == NULL || (c = s->current) == NULL || fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (s->stop) {
+		errno = ECANCELED;
+		return -1;
+	}
+	/*EPOLLONESHOT: il fd viene disarmato dopo la prima notifica*/
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = c;
+	if (c->fd != fd) {
+		if (c->fd >= 0) (void) epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+		c->fd = fd;
+		op = EPOLL_CTL_ADD;
+	}
+	if (epoll_ctl(s->epfd, op, fd, &ev) == -1) {
+		c->fd = -1;
+		return -1;
+	}
+	swapcontext(&c->ctx, &s->main);
+	if (s->stop) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return 0;
+}
+
+void yield_Coro(void) {
+	coro_sched *s = self;
+	coroutine *c;
+	if (s == NULL || (c = s->current) == NULL) return;
+	push_Ready(s, c);
+	swapcontext(&c->ctx, &s->main);
+}
+
+void stop_Coro(coro_group *g) {
+	int i;
+	uint64_t one = 1;
+	if (g == NULL) return;
+	for (i = 0; i < g->size; i++) {
+		g->scheds[i].stop = 1;
+		(void) write(g->scheds[i].wakefd, &one, sizeof(one));
+	}
+	for (i = 0; i < g->size; i++)
+		pthread_join(g->scheds[i].tid, NULL);
+}
+
+void free_Coro(coro_group **g) {
+	int i;
+	if (g == NULL || *g == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	for (i = 0; i < (*g)->size; i++) {
+		close((*g)->scheds[i].epfd);
+		close((*g)->scheds[i].wakefd);
+	}
+	free((*g)->scheds);
+	free(*g);
+	*g = NULL;
+}
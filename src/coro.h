@@ -0,0 +1,113 @@
+/**
+   \file coro.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  coroutine con stack proprio eseguite da scheduler basati su epoll.
+
+Ogni scheduler è un thread che esegue a turno le proprie coroutine
+(ucontext). Una coroutine che dovrebbe bloccarsi su un file descriptor
+chiama wait_Coro: il controllo torna allo scheduler, che la riprende quando
+epoll segnala il fd pronto. In questo modo il codice delle coroutine resta
+sequenziale come quello di un thread, ma ne costa solo lo stack.
+ */
+#ifndef __CORO_H
+#define __CORO_H
+
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+
+/** Dimensione dello stack di una coroutine, esclusa la pagina di guardia
+ * che lo precede */
+#define CORO_STACK (64*1024)
+/** Numero massimo di eventi restituiti da una singola epoll_wait */
+#define CORO_EVENTS 64
+
+/** Corpo di una coroutine */
+typedef void (*coro_fn)(void *arg);
+
+struct coro_sched;
+
+/** <H3>Coroutine</H3>
+ * - \c ctx il contesto salvato, \c stack lo stack
+ * - \c fn, \c arg la funzione eseguita e il suo argomento
+ * - \c fd il fd su cui la coroutine e` registrata in epoll (-1 se nessuno)
+ * - \c done 1 quando fn e` terminata, \c queued 1 se e` tra le pronte
+ * - \c next la coroutine successiva nella coda dei pronti
+ * - \c prev_all, \c next_all le altre coroutine dello scheduler
+ */
+typedef struct coroutine {
+	ucontext_t ctx;
+	char *stack;
+	coro_fn fn;
+	void *arg;
+	int fd;
+	int done;
+	int queued;
+	struct coro_sched *sched;
+	struct coroutine *next;
+	struct coroutine *prev_all;
+	struct coroutine *next_all;
+} coroutine;
+
+/** <H3>Scheduler</H3>
+ * - \c epfd l'istanza epoll, \c wakefd eventfd per risvegliarlo
+ * - \c main il contesto del thread dello scheduler
+ * - \c current la coroutine in esecuzione
+ * - \c ready_head, \c ready_tail la coda delle coroutine pronte
+ * - \c all tutte le coroutine dello scheduler
+ * - \c incoming coroutine create da altri thread e non ancora avviate
+ */
+typedef struct coro_sched {
+	int epfd;
+	int wakefd;
+	int stop;
+	int id;
+	ucontext_t main;
+	coroutine *current;
+	coroutine *ready_head;
+	coroutine *ready_tail;
+	coroutine *all;
+	coroutine *incoming;
+	pthread_mutex_t mtx;
+	pthread_t tid;
+} coro_sched;
+
+/** <H3>Gruppo di scheduler</H3> */
+typedef struct {
+	coro_sched *scheds;
+	int size;
+	unsigned int next;
+	pthread_mutex_t mtx;
+} coro_group;
+
+/** Crea un gruppo di n scheduler (non ancora avviati).
+ * \retval NULL in caso di errore (sets errno) */
+coro_group *initialize_Coro(int n);
+
+/** Avvia un thread per ogni scheduler del gruppo.
+ * \retval 0 se tutto ok, -1 in caso di errore */
+int start_Coro(coro_group *g);
+
+/** Crea una coroutine che esegue fn(arg) sul prossimo scheduler del gruppo.
+ * Può essere chiamata da qualunque thread.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int spawn_Coro(coro_group *g, coro_fn fn, void *arg);
+
+/** Sospende la coroutine corrente finché fd non è pronto per events
+ * (EPOLLIN, EPOLLOUT). Va chiamata solo da una coroutine.
+ * \retval 0 quando fd è pronto
+ * \retval -1 se lo scheduler sta terminando o in caso di errore */
+int wait_Coro(int fd, unsigned int events);
+
+/** Cede il processore alle altre coroutine pronte dello scheduler. */
+void yield_Coro(void);
+
+/** Chiede agli scheduler di terminare: le coroutine in attesa vengono
+ * riprese (wait_Coro restituisce -1) finché non terminano, poi ne attende
+ * l'uscita. */
+void stop_Coro(coro_group *g);
+
+/** Libera le risorse del gruppo (gli scheduler devono essere già fermi). */
+void free_Coro(coro_group **g);
+
+#endif
@@ -0,0 +1,119 @@
+/**
+   \file cowset.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione dell'insieme copy-on-write.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "errors.h"
+#include "cowset.h"
+
+/** Alloca un'istantanea di size elementi con un solo riferimento. */
+static cow_snapshot *new_Snapshot(int size) {
+	cow_snapshot *snap = Malloc(sizeof(cow_snapshot)+sizeof(void*)*size);
+	snap->refs = 1;
+	snap->generation = 0;
+	snap->size = size;
+	return snap;
+}
+
+/** Pubblica next come istantanea corrente e rilascia quella sostituita.
+ * Va chiamata con s->mtx acquisito.
+ * \retval la generazione di next */
+static long publish_Snapshot(cow_set *s, cow_snapshot *next) {
+	cow_snapshot *old;
+	next->generation = s->current->generation+1;
+	old = __atomic_exchange_n(&s->current, next, __ATOMIC_SEQ_CST);
+	/*Un lettore che ha letto old puo` non averne ancora preso un
+	 * riferimento: si attende che chi sta acquisendo abbia finito*/
+	while (__atomic_load_n(&s->readers, __ATOMIC_SEQ_CST) > 0) sched_yield();
+	release_Snapshot(old);
+	return next->generation;
+}
+
+cow_set *initialize_CowSet(void) {
+	cow_set *s = Malloc(sizeof(cow_set));
+	if ((errno = pthread_mutex_init(&s->mtx, NULL)) != 0) {
+		perror("cowset, initialize_CowSet");
+		free(s);
+		return NULL;
+	}
+	s->current = new_Snapshot(0);
+	s->readers = 0;
+	return s;
+}
+
+long add_CowSet(cow_set *s, void *item) {
+	cow_snapshot *old, *next;
+	long generation;
+	int i;
+	if (s == NULL || item == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&s->mtx);
+		old = s->current;
+		for (i = 0; i < old->size; i++)
+			if (old->items[i] == item) {
+				pthread_mutex_unlock(&s->mtx);
+				errno = EEXIST;
+				return -1;
+			}
+		next = new_Snapshot(old->size+1);
+		for (i = 0; i < old->size; i++) next->items[i] = old->items[i];
+		next->items[old->size] = item;
+		generation = publish_Snapshot(s, next);
+	pthread_mutex_unlock(&s->mtx);
+	return generation;
+}
+
+long remove_CowSet(cow_set *s, void *item) {
+	cow_snapshot *old, *next;
+	long generation;
+	int i, j;
+	if (s == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&s->mtx);
+		old = s->current;
+		for (i = 0; i < old->size && old->items[i] != item; i++);
+		if (i == old->size) {
+			pthread_mutex_unlock(&s->mtx);
+			errno = ENOENT;
+			return -1;
+		}
+		next = new_Snapshot(old->size-1);
+		for (i = 0, j = 0; i < old->size; i++)
+			if (old->items[i] != item) next->items[j++] = old->items[i];
+		generation = publish_Snapshot(s, next);
+	pthread_mutex_unlock(&s->mtx);
+	return generation;
+}
+
+cow_snapshot *acquire_CowSet(cow_set *s) {
+	cow_snapshot *snap;
+	__atomic_add_fetch(&s->readers, 1, __ATOMIC_SEQ_CST);
+		snap = __atomic_load_n(&s->current, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&s->readers, 1, __ATOMIC_RELEASE);
+	return snap;
+}
+
+void release_Snapshot(cow_snapshot *snap) {
+	if (snap == NULL) return;
+	if (__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0) free(snap);
+}
+
+void free_CowSet(cow_set **s) {
+	if (s == NULL || *s == NULL) return;
+	release_Snapshot((*s)->current);
+	pthread_mutex_destroy(&(*s)->mtx);
+	free(*s);
+	*s = NULL;
+}
@@ -0,0 +1,70 @@
+/**
+   \file cowset.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  insieme di puntatori copy-on-write, letto senza lock.
+
+Il contenuto dell'insieme è un'istantanea immutabile: un array compatto
+di puntatori. Chi modifica l'insieme (sotto il mutex) ne costruisce una
+copia e la pubblica con un solo store atomico; chi legge prende
+l'istantanea corrente con un incremento e un load atomici e la scorre
+senza alcun lock, trattenendola finché non la rilascia. L'istantanea
+sostituita viene liberata quando l'ultimo lettore la rilascia.
+
+Aggiunte e rimozioni costano una copia dell'array: l'insieme è pensato
+per contenuti che cambiano poco rispetto a quanto vengono letti.
+ */
+#ifndef __COWSET_H
+#define __COWSET_H
+
+#include <pthread.h>
+
+/** <H3>Istantanea dell'insieme</H3>
+ * - \c refs i riferimenti: uno dell'insieme finché è quella corrente, uno per ogni lettore
+ * - \c generation il numero di modifiche dell'insieme che l'hanno prodotta:
+ *   cresce con ogni istantanea pubblicata
+ * - \c size il numero di elementi
+ * - \c items gli elementi
+ */
+typedef struct {
+	int refs;
+	unsigned long generation;
+	int size;
+	void *items[];
+} cow_snapshot;
+
+/** <H3>Insieme copy-on-write</H3>
+ * - \c current l'istantanea corrente
+ * - \c readers i lettori che stanno acquisendo l'istantanea corrente
+ * - \c mtx serializza chi modifica l'insieme
+ */
+typedef struct {
+	cow_snapshot *current;
+	int readers;
+	pthread_mutex_t mtx;
+} cow_set;
+
+/** Crea un insieme vuoto.
+ * \retval NULL in caso di errore (sets errno) */
+cow_set *initialize_CowSet(void);
+
+/** Aggiunge item (non NULL) all'insieme.
+ * \retval la generazione dell'istantanea pubblicata
+ * \retval -1 in caso di errore (sets errno; EEXIST se item è già presente) */
+long add_CowSet(cow_set *s, void *item);
+
+/** Rimuove item dall'insieme.
+ * \retval la generazione dell'istantanea pubblicata
+ * \retval -1 se item non è presente (errno = ENOENT) */
+long remove_CowSet(cow_set *s, void *item);
+
+/** Restituisce l'istantanea corrente, da rilasciare con release_Snapshot. */
+cow_snapshot *acquire_CowSet(cow_set *s);
+
+/** Rilascia un'istantanea, liberandola se era l'ultimo riferimento. */
+void release_Snapshot(cow_snapshot *snap);
+
+/** Libera l'insieme (non gli elementi). Le istantanee ancora acquisite
+ * restano valide fino al loro rilascio. */
+void free_CowSet(cow_set **s);
+
+#endif
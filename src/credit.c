@@ -0,0 +1,118 @@
+/**
+   \file credit.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione del controllo di flusso a crediti.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "errors.h"
+#include "credit.h"
+
+/** Cifre sufficienti per un int */
+#define CREDIT_DIGITS 12
+
+int buildConnect(message_t *msg, char *name, int window) {
+	int name_length;
+	if (msg == NULL || name == NULL || window < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	name_length = strlen(name);
+	msg->type = MSG_CONNECT;
+	msg->buffer = Malloc(sizeof(char)*(name_length+1+CREDIT_DIGITS+1));
+	strcpy(msg->buffer, name);
+	msg->length = name_length+1;
+	/*La finestra segue il '\0' del nome: un server che non la conosce la ignora*/
+	if (window > 0)
+		msg->length += snprintf(msg->buffer+name_length+1, CREDIT_DIGITS+1, "%d", window);
+	else
+		msg->buffer[name_length+1] = '\0';
+	return 0;
+}
+
+int connectWindow(message_t *msg) {
+	int name_length, window;
+	if (msg == NULL || msg->buffer == NULL) return 0;
+	name_length = strlen(msg->buffer);
+	if (msg->length <= name_length+1) return 0;
+	window = atoi(msg->buffer+name_length+1);
+	return (window > 0) ? window : 0;
+}
+
+int buildCredit(message_t *msg, char type, int n) {
+	if (msg == NULL || n <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	msg->type = type;
+	msg->buffer = Malloc(sizeof(char)*(CREDIT_DIGITS+1));
+	msg->length = snprintf(msg->buffer, CREDIT_DIGITS+1, "%d", n);
+	return 0;
+}
+
+int creditValue(message_t *msg) {
+	int n;
+	if (msg == NULL || msg->buffer == NULL || msg->length <= 0) return 0;
+	n = atoi(msg->buffer);
+	return (n > 0) ? n : 0;
+}
+
+void initialize_Credit(credit_t *cr, int window) {
+	if (cr == NULL) return;
+	cr->window = cr->avail = (window > 0) ? window : 0;
+	cr->used = cr->closed = 0;
+	pthread_mutex_init(&cr->mtx, NULL);
+	pthread_cond_init(&cr->cond, NULL);
+}
+
+int acquire_Credit(credit_t *cr) {
+	int r = 0;
+	if (cr == NULL || cr->window == 0) return 0;
+	pthread_mutex_lock(&cr->mtx);
+		while (cr->avail == 0 && !cr->closed)
+			pthread_cond_wait(&cr->cond, &cr->mtx);
+		if (cr->closed) r = -1;
+		else cr->avail--;
+	pthread_mutex_unlock(&cr->mtx);
+	return r;
+}
+
+void grant_Credit(credit_t *cr, int n) {
+	if (cr == NULL || n <= 0) return;
+	pthread_mutex_lock(&cr->mtx);
+		cr->avail += n;
+		pthread_cond_broadcast(&cr->cond);
+	pthread_mutex_unlock(&cr->mtx);
+}
+
+int consume_Credit(credit_t *cr) {
+	int n = 0;
+	if (cr == NULL || cr->window == 0) return 0;
+	pthread_mutex_lock(&cr->mtx);
+		/*I crediti tornano a meta` finestra, cosi` che l'altro lato non resti mai senza*/
+		if (++cr->used >= (cr->window+1)/2) {
+			n = cr->used;
+			cr->used = 0;
+		}
+	pthread_mutex_unlock(&cr->mtx);
+	return n;
+}
+
+void close_Credit(credit_t *cr) {
+	if (cr == NULL) return;
+	pthread_mutex_lock(&cr->mtx);
+		cr->closed = 1;
+		pthread_cond_broadcast(&cr->cond);
+	pthread_mutex_unlock(&cr->mtx);
+}
+
+void free_Credit(credit_t *cr) {
+	if (cr == NULL) return;
+	pthread_mutex_destroy(&cr->mtx);
+	pthread_cond_destroy(&cr->cond);
+}
@@ -0,0 +1,88 @@
+/**
+   \file credit.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  controllo di flusso a crediti tra client e server.
+
+Ciascun lato concede all'altro una finestra: il numero di messaggi che
+può inviargli prima di dover attendere nuovi crediti. La finestra viene
+negoziata con MSG_CONNECT: il client accoda al proprio nome (dopo il suo
+'\\0') la finestra che concede al server, in cifre decimali; se il server
+ha il controllo di flusso attivo risponde con un MSG_OK il cui buffer è
+la finestra concessa al client. Un client che non propone una finestra,
+o un server che risponde con un MSG_OK vuoto, non usano il controllo di
+flusso.
+
+Chi riceve restituisce i crediti con un MSG_CREDIT (il buffer è il numero
+di crediti, in cifre decimali) ogni volta che ha consumato metà della
+finestra. Contano come crediti i messaggi MSG_TO_ONE e MSG_BCAST inviati
+dal server e tutti i messaggi inviati dal client tranne MSG_EXIT,
+MSG_CREDIT e MSG_PRESENCE; i messaggi di controllo del server (MSG_EXIT,
+MSG_ERROR, le risposte a MSG_LIST, gli eventi di presenza, gli stessi
+MSG_CREDIT) non consumano crediti.
+ */
+#ifndef __CREDIT_H
+#define __CREDIT_H
+
+#include <pthread.h>
+
+#include "comsock.h"
+
+/** restituzione di crediti */
+#define MSG_CREDIT 'K'
+/** Finestra concessa dal client al server */
+#define CREDIT_WINDOW 64
+/** Messaggio inviato al client che supera la finestra concessa */
+#define CREDIT_EXCEEDED "[ERROR] superata la finestra di messaggi concessa dal server: connessione chiusa"
+
+/** <H3>Crediti di un lato della connessione</H3>
+ * - \c window la finestra (0: controllo di flusso non attivo)
+ * - \c avail i crediti di invio disponibili
+ * - \c used i messaggi ricevuti i cui crediti non sono ancora stati restituiti
+ * - \c closed 1 se la connessione è terminata: nessuno attende più crediti
+ */
+typedef struct {
+	int window;
+	int avail;
+	int used;
+	int closed;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+} credit_t;
+
+/** Prepara il MSG_CONNECT di name, proponendo window (0: nessuna finestra).
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int buildConnect(message_t *msg, char *name, int window);
+
+/** Restituisce la finestra proposta da un MSG_CONNECT, 0 se assente. */
+int connectWindow(message_t *msg);
+
+/** Prepara un messaggio di tipo type (MSG_OK o MSG_CREDIT) che porta n
+ * crediti: il buffer viene allocato.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int buildCredit(message_t *msg, char type, int n);
+
+/** Restituisce i crediti portati da un MSG_OK o MSG_CREDIT, 0 se assenti. */
+int creditValue(message_t *msg);
+
+/** Inizializza i crediti di una connessione con la finestra window
+ * (0: controllo di flusso non attivo). */
+void initialize_Credit(credit_t *cr, int window);
+
+/** Consuma un credito di invio, attendendo se non ce ne sono.
+ * \retval 0 se tutto ok, -1 se la connessione è terminata */
+int acquire_Credit(credit_t *cr);
+
+/** Aggiunge n crediti di invio, risvegliando chi li attende. */
+void grant_Credit(credit_t *cr, int n);
+
+/** Conta un messaggio ricevuto.
+ * \retval i crediti da restituire ora all'altro lato (0 se nessuno) */
+int consume_Credit(credit_t *cr);
+
+/** Segnala la fine della connessione a chi attende crediti. */
+void close_Credit(credit_t *cr);
+
+/** Libera le risorse dei crediti. */
+void free_Credit(credit_t *cr);
+
+#endif
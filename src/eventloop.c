@@ -0,0 +1,177 @@
+/**
+   \file eventloop.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione dei gruppi di event loop basati su epoll.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "errors.h"
+#include "eventloop.h"
+
+/** Corpo del thread di un event loop: attende eventi e li passa
+ * all'handler finché non viene richiesta la terminazione.*/
+static void *run_Loop(void *arg) {
+	event_loop *l = arg;
+	struct epoll_event events[LOOP_EVENTS];
+	int n, i;
+	while (!l->stop) {
+		int timeout = (l->hook != NULL) ? l->hook(l) : -1;
+		if (l->stop) break;
+		if ((n = epoll_wait(l->epfd, events, LOOP_EVENTS, timeout)) == -1) {
+			if (errno == EINTR) continue;
+			perror("eventloop, run_Loop");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			/*Il dato NULL identifica l'eventfd di risveglio*/
+			if (events[i].data.ptr == NULL) {
+				uint64_t v;
+				(void) read(l->wakefd, &v, sizeof(v));
+				continue;
+			}
+			l->handler(l, events[i].data.ptr, events[i].events);
+		}
+	}
+	return (void *) 0;
+}
+
+loop_group *initialize_Loops(int n, event_handler handler) {
+	loop_group *g;
+	int i;
+	struct epoll_event ev;
+	if (n < 1 || handler == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	g = Malloc(sizeof(loop_group));
+	g->loops = Malloc(sizeof(event_loop)*n);
+	g->size = n;
+	g->next = 0;
+	pthread_mutex_init(&g->mtx, NULL);
+	for (i = 0; i < n; i++) {
+		event_loop *l = g->loops+i;
+		l->stop = 0;
+		l->id = i;
+		l->handler = handler;
+		l->hook = NULL;
+		if ((l->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+			(l->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			perror("eventloop, initialize_Loops");
+			g->size = i;
+			free_Loops(&g);
+			return NULL;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->wakefd, &ev);
+	}
+	return g;
+}
+
+void set_LoopHook(loop_group *g, loop_hook hook) {
+	int i;
+	if (g == NULL) return;
+	for (i = 0; i < g->size; i++)
+		g->loops[i].hook = hook;
+}
+
+int start_Loops(loop_group *g) {
+	int i;
+	if (g == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < g->size; i++) {
+		if ((errno = pthread_create(&g->loops[i].tid, NULL, &run_Loop, g->loops+i)) != 0) {
+			perror("eventloop, start_Loops");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+event_loop *add_LoopFd(loop_group *g, int fd, void *data) {
+	event_loop *l;
+	if (g == NULL || fd < 0 || data == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	pthread_mutex_lock(&g->mtx);
+		l = g->loops + (g->next++ % g->size);
+	pthread_mutex_unlock(&g->mtx);
+	if (attach_LoopFd(l, fd, data) == -1) {
+		perror("eventloop, add_LoopFd");
+		return NULL;
+	}
+	return l;
+}
+
+int attach_LoopFd(event_loop *l, int fd, void *data) {
+	struct epoll_event ev;
+	if (l == NULL || fd < 0 || data == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = data;
+	return epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void wake_Loop(event_loop *l) {
+	uint64_t one = 1;
+	if (l == NULL) return;
+	(void) write(l->wakefd, &one, sizeof(one));
+}
+
+int modify_LoopFd(event_loop *l, int fd, void *data, unsigned int events) {
+	struct epoll_event ev;
+	if (l == NULL || fd < 0 || data == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	ev.events = events;
+	ev.data.ptr = data;
+	return epoll_ctl(l->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int remove_LoopFd(event_loop *l, int fd) {
+	if (l == NULL || fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return epoll_ctl(l->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void stop_Loops(loop_group *g) {
+	int i;
+	if (g == NULL) return;
+	for (i = 0; i < g->size; i++) {
+		g->loops[i].stop = 1;
+		wake_Loop(g->loops+i);
+	}
+	for (i = 0; i < g->size; i++)
+		pthread_join(g->loops[i].tid, NULL);
+}
+
+void free_Loops(loop_group **g) {
+	int i;
+	if (g == NULL || *g == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	for (i = 0; i < (*g)->size; i++) {
+		close((*g)->loops[i].epfd);
+		close((*g)->loops[i].wakefd);
+	}
+	free((*g)->loops);
+	free(*g);
+	*g = NULL;
+}
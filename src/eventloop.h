@@ -0,0 +1,97 @@
+/**
+   \file eventloop.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  gruppo di thread che multiplexano file descriptor tramite epoll.
+
+Ogni event_loop possiede una propria istanza epoll e un eventfd usato per
+risvegliarlo (ad esempio in fase di terminazione). I file descriptor vengono
+distribuiti tra i loop del gruppo secondo una politica round robin.
+ */
+#ifndef __EVENTLOOP_H
+#define __EVENTLOOP_H
+
+#include <pthread.h>
+#include <sys/epoll.h>
+
+/** Numero massimo di eventi restituiti da una singola epoll_wait */
+#define LOOP_EVENTS 64
+
+struct event_loop;
+
+/** Funzione che gestisce gli eventi di un file descriptor.
+ * \param l il loop che ha ricevuto l'evento
+ * \param data il dato associato al fd al momento della registrazione
+ * \param events la maschera degli eventi epoll */
+typedef void (*event_handler)(struct event_loop *l, void *data, unsigned int events);
+
+/** Funzione chiamata da un loop prima di ogni attesa degli eventi.
+ * \param l il loop
+ * \retval il timeout in millisecondi della prossima attesa (-1: infinito) */
+typedef int (*loop_hook)(struct event_loop *l);
+
+/** <H3>Event loop</H3>
+ * - \c epfd istanza epoll del loop
+ * - \c wakefd eventfd utilizzato per risvegliare il thread
+ * - \c stop diventa 1 quando il loop deve terminare
+ * - \c handler la funzione chiamata per ogni evento
+ * - \c hook la funzione chiamata prima di ogni attesa (NULL se assente)
+ * - \c id indice del loop all'interno del gruppo
+ */
+typedef struct event_loop {
+	int epfd;
+	int wakefd;
+	int stop;
+	int id;
+	event_handler handler;
+	loop_hook hook;
+	pthread_t tid;
+} event_loop;
+
+/** <H3>Gruppo di event loop</H3>
+ * - \c loops array dei loop
+ * - \c size numero di loop
+ * - \c next indice del prossimo loop a cui assegnare un fd
+ */
+typedef struct {
+	event_loop *loops;
+	int size;
+	unsigned int next;
+	pthread_mutex_t mtx;
+} loop_group;
+
+/** Crea un gruppo di n event loop (non ancora avviati).
+ * \retval NULL in caso di errore (sets errno) */
+loop_group *initialize_Loops(int n, event_handler handler);
+
+/** Imposta la funzione chiamata dai loop del gruppo prima di ogni attesa
+ * degli eventi (da chiamare prima di start_Loops). */
+void set_LoopHook(loop_group *g, loop_hook hook);
+
+/** Avvia un thread per ogni loop del gruppo.
+ * \retval 0 se tutto ok, -1 in caso di errore */
+int start_Loops(loop_group *g);
+
+/** Registra fd (in lettura) nel prossimo loop del gruppo.
+ * \retval il loop a cui è stato assegnato fd, NULL in caso di errore */
+event_loop *add_LoopFd(loop_group *g, int fd, void *data);
+
+/** Registra fd (in lettura) nel loop l.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int attach_LoopFd(event_loop *l, int fd, void *data);
+
+/** Risveglia il loop l, che richiamera` il suo hook. */
+void wake_Loop(event_loop *l);
+
+/** Modifica la maschera degli eventi di un fd già registrato in l. */
+int modify_LoopFd(event_loop *l, int fd, void *data, unsigned int events);
+
+/** Rimuove fd dal loop l. */
+int remove_LoopFd(event_loop *l, int fd);
+
+/** Risveglia tutti i loop, chiede loro di terminare e ne attende l'uscita. */
+void stop_Loops(loop_group *g);
+
+/** Libera le risorse del gruppo (i loop devono essere già fermi). */
+void free_Loops(loop_group **g);
+
+#endif
@@ -0,0 +1,227 @@
+/**
+   \file handshake.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione dell'attesa non bloccante dei MSG_CONNECT.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "errors.h"
+#include "handshake.h"
+
+/** Capacità iniziale dell'insieme */
+#define HANDSHAKE_SIZE 16
+
+/** Istante corrente, in microsecondi, dell'orologio monotono */
+static long long now_Us(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (long long) t.tv_sec*1000000 + t.tv_nsec/1000;
+}
+
+handshake_set *initialize_Handshakes(int timeout, int packet) {
+	handshake_set *s;
+	if (timeout <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	s = Malloc(sizeof(handshake_set));
+	s->capacity = HANDSHAKE_SIZE;
+	s->pending = Malloc(sizeof(handshake_t)*s->capacity);
+	s->fds = Malloc(sizeof(struct pollfd)*(s->capacity+1));
+	s->size = 0;
+	s->timeout = timeout;
+	s->accepted = s->completed = s->expired = s->failed = 0;
+	s->latency_total = s->latency_max = 0;
+	s->created = s->window_start = now_Us();
+	s->window_count = s->peak_rate = 0;
+	s->packet = packet;
+	return s;
+}
+
+void add_Handshake(handshake_set *s, int fd) {
+	handshake_t *h;
+	long long now = now_Us();
+	if (s->size == s->capacity) {
+		s->capacity *= 2;
+		if ((s->pending = realloc(s->pending, sizeof(handshake_t)*s->capacity)) == NULL ||
+			(s->fds = realloc(s->fds, sizeof(struct pollfd)*(s->capacity+1))) == NULL) {
+			perror("handshake, add_Handshake");
+			exit(EXIT_FAILURE);
+		}
+	}
+	h = s->pending + s->size++;
+	h->fd = fd;
+	h->started = now;
+	h->got = 0;
+	h->ready = 0;
+	h->msg.buffer = NULL;
+	s->accepted++;
+	/*Il ritmo delle accettazioni si misura a finestre di un secondo*/
+	if (now - s->window_start >= 1000000) {
+		s->window_start = now;
+		s->window_count = 0;
+	}
+	if (++s->window_count > s->peak_rate) s->peak_rate = s->window_count;
+}
+
+int poll_Handshakes(handshake_set *s, int listen_fd) {
+	long long now = now_Us(), first = -1;
+	int i, n, timeout = -1;
+	s->fds[0].fd = listen_fd;
+	s->fds[0].events = POLLIN;
+	for (i = 0; i < s->size; i++) {
+		s->fds[i+1].fd = s->pending[i].fd;
+		s->fds[i+1].events = POLLIN;
+		s->fds[i+1].revents = 0;
+		if (first == -1 || s->pending[i].started < first) first = s->pending[i].started;
+	}
+	/*Si attende al piu` fino alla scadenza della connessione piu` vecchia*/
+	if (first != -1) {
+		timeout = (first + (long long) s->timeout*1000 - now + 999) / 1000;
+		if (timeout < 0) timeout = 0;
+	}
+	if ((n = poll(s->fds, s->size+1, timeout)) > 0)
+		for (i = 0; i < s->size; i++)
+			s->pending[i].ready = (s->fds[i+1].revents != 0);
+	return n;
+}
+
+/** Legge senza bloccare i byte mancanti del primo messaggio di h, senza
+ * andare oltre la sua fine.
+ * \retval 1 se il messaggio e` completo, 0 se mancano dei byte
+ * \retval SEOF se il client ha chiuso la connessione
+ * \retval -1 in caso di errore o di messaggio non valido (sets errno) */
+static int read_Handshake(handshake_t *h) {
+	int n, body;
+	while (h->got < (int) HEADER_SIZE) {
+		if ((n = recv(h->fd, h->header+h->got, HEADER_SIZE-h->got, MSG_DONTWAIT)) == 0) return SEOF;
+		if (n == -1) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		if ((h->got += n) < (int) HEADER_SIZE) continue;
+		h->msg.type = h->header[0];
+		memcpy(&h->msg.length, h->header+sizeof(char), sizeof(int));
+		/*Come receiveMessage, si ignorano i MSG_PING*/
+		if (h->msg.type == MSG_PING) h->got = 0;
+	}
+	if (h->msg.length < 0 || h->msg.length > READER_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	/*Come in sendMessage, il corpo viaggia con il terminatore*/
+	body = (h->msg.length > 0) ? h->msg.length+1 : 0;
+	if (body > 0 && h->msg.buffer == NULL) h->msg.buffer = Malloc(sizeof(char)*body);
+	while (h->got < (int) HEADER_SIZE + body) {
+		n = recv(h->fd, h->msg.buffer+h->got-HEADER_SIZE, HEADER_SIZE+body-h->got, MSG_DONTWAIT);
+		if (n == 0) return SEOF;
+		if (n == -1) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		h->got += n;
+	}
+	if (body > 0) {
+		h->msg.buffer[h->msg.length] = '\0';
+		if (h->msg.buffer[h->msg.length-1] == '\n')
+			h->msg.buffer[--h->msg.length] = '\0';
+	}
+	return 1;
+}
+
+/** Come read_Handshake, per una socket SOCK_SEQPACKET: il primo messaggio
+ * e` un datagramma, letto per intero con una sola recvmsg.*/
+static int read_HandshakePacket(handshake_t *h) {
+	struct iovec iov[2];
+	struct msghdr mh;
+	ssize_t n;
+	int body;
+	if (h->msg.buffer == NULL) h->msg.buffer = Malloc(sizeof(char)*(READER_SIZE+1));
+	do {
+		iov[0].iov_base = h->header;
+		iov[0].iov_len = HEADER_SIZE;
+		iov[1].iov_base = h->msg.buffer;
+		iov[1].iov_len = READER_SIZE+1;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = 2;
+		if ((n = recvmsg(h->fd, &mh, MSG_DONTWAIT)) == 0) return SEOF;
+		if (n == -1) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		h->msg.type = h->header[0];
+		memcpy(&h->msg.length, h->header+sizeof(char), sizeof(int));
+		/*Come receiveMessage, si ignorano i MSG_PING*/
+	} while (h->msg.type == MSG_PING);
+	body = (h->msg.length > 0) ? h->msg.length+1 : 0;
+	if ((mh.msg_flags & MSG_TRUNC) || h->msg.length < 0 || h->msg.length > READER_SIZE ||
+		n != (ssize_t) HEADER_SIZE + body) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (body == 0) {
+		free(h->msg.buffer);
+		h->msg.buffer = NULL;
+		return 1;
+	}
+	h->msg.buffer[h->msg.length] = '\0';
+	if (h->msg.buffer[h->msg.length-1] == '\n')
+		h->msg.buffer[--h->msg.length] = '\0';
+	return 1;
+}
+
+void serve_Handshakes(handshake_set *s, handshake_done done, void *arg) {
+	long long now = now_Us(), latency;
+	handshake_t h;
+	int i = 0, res;
+	while (i < s->size) {
+		if (!s->pending[i].ready) res = 0;
+		else res = (s->packet) ? read_HandshakePacket(s->pending+i) : read_Handshake(s->pending+i);
+		s->pending[i].ready = 0;
+		if (res == 0 && now - s->pending[i].started < (long long) s->timeout*1000) {
+			i++;
+			continue;
+		}
+		/*La connessione lascia l'insieme prima di passare a done: l'ultima
+		 * prende il suo posto*/
+		h = s->pending[i];
+		s->pending[i] = s->pending[--s->size];
+		if (res == 1) {
+			s->completed++;
+			latency = now - h.started;
+			s->latency_total += latency;
+			if (latency > s->latency_max) s->latency_max = latency;
+			done(h.fd, &h.msg, arg);
+		} else {
+			if (res == 0) s->expired++;
+			else s->failed++;
+			free(h.msg.buffer);
+			closeSocket(h.fd);
+		}
+	}
+}
+
+void report_Handshakes(handshake_set *s, FILE *f) {
+	long long elapsed;
+	long completed;
+	if (s == NULL) return;
+	elapsed = now_Us() - s->created;
+	completed = s->completed;
+	fprintf(f, "accessi: accettati %ld (%.1f/s, massimo %ld/s), completati %ld, scaduti %ld, falliti %ld, in attesa %d; attesa media %lld us, massima %lld us\n",
+		s->accepted, (elapsed > 0) ? s->accepted*1e6/elapsed : 0.0, s->peak_rate,
+		completed, s->expired, s->failed, s->size,
+		(completed > 0) ? s->latency_total/completed : 0, s->latency_max);
+	fflush(f);
+}
+
+void free_Handshakes(handshake_set **s) {
+	int i;
+	if (s == NULL || *s == NULL) return;
+	for (i = 0; i < (*s)->size; i++) {
+		free((*s)->pending[i].msg.buffer);
+		closeSocket((*s)->pending[i].fd);
+	}
+	free((*s)->pending);
+	free((*s)->fds);
+	free(*s);
+	*s = NULL;
+}
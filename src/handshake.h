@@ -0,0 +1,112 @@
+/**
+   \file handshake.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  attesa non bloccante dei MSG_CONNECT delle connessioni appena accettate.
+
+Una connessione accettata resta nell'insieme delle connessioni in attesa
+finché non ha inviato il suo primo messaggio, o finché non scade il tempo
+concessole. Il thread che possiede l'insieme attende con poll sia la
+socket di ascolto sia tutte le sue connessioni in attesa: un client che si
+connette e tace non blocca gli accessi degli altri. Più thread possono
+accettare dalla stessa socket di ascolto, ciascuno con il proprio insieme.
+
+Il primo messaggio viene letto senza bloccare e senza andare oltre la sua
+fine: i byte successivi restano nella socket per chi gestirà l'utente.
+Su una socket SOCK_SEQPACKET (packet.h) il messaggio è un datagramma,
+letto per intero con una sola recvmsg.
+ */
+#ifndef __HANDSHAKE_H
+#define __HANDSHAKE_H
+
+#include <stdio.h>
+#include <poll.h>
+
+#include "comsock.h"
+#include "asyncsock.h"
+
+/** Millisecondi concessi di default a una connessione per il MSG_CONNECT */
+#define HANDSHAKE_TIMEOUT 5000
+
+/** <H3>Connessione in attesa del primo messaggio</H3>
+ * - \c fd la socket
+ * - \c started l'istante dell'accettazione (in microsecondi)
+ * - \c got i byte ricevuti finora (intestazione e buffer)
+ * - \c ready 1 se l'ultima poll l'ha trovata leggibile
+ * - \c header l'intestazione ricevuta
+ * - \c msg il messaggio in arrivo
+ */
+typedef struct {
+	int fd;
+	long long started;
+	int got;
+	int ready;
+	char header[HEADER_SIZE];
+	message_t msg;
+} handshake_t;
+
+/** Funzione che riceve il primo messaggio msg (di qualunque tipo) arrivato
+ * sulla socket fd: la socket e il buffer di msg passano a lei. arg è
+ * quello passato a serve_Handshakes. */
+typedef void (*handshake_done)(int fd, message_t *msg, void *arg);
+
+/** <H3>Connessioni in attesa</H3>
+ * - \c pending le connessioni, \c size quante sono, \c capacity la
+ *   capacità di pending
+ * - \c fds gli fd attesi da poll: fds[0] è la socket di ascolto, fds[i+1]
+ *   la connessione pending[i]
+ * - \c timeout i millisecondi concessi a ogni connessione
+ * - \c accepted le connessioni accettate, \c completed quelle che hanno
+ *   inviato il primo messaggio, \c expired quelle scadute, \c failed
+ *   quelle chiuse dal client o con un errore
+ * - \c latency_total, \c latency_max la somma e il massimo delle attese
+ *   dei messaggi completati (in microsecondi)
+ * - \c created l'istante di creazione; \c window_start, \c window_count
+ *   l'inizio e le accettazioni del secondo in corso; \c peak_rate il
+ *   massimo di accettazioni in un secondo
+ * - \c packet 1 se le connessioni sono SOCK_SEQPACKET
+ */
+typedef struct {
+	handshake_t *pending;
+	struct pollfd *fds;
+	int size;
+	int capacity;
+	int timeout;
+	long accepted;
+	long completed;
+	long expired;
+	long failed;
+	long long latency_total;
+	long long latency_max;
+	long long created;
+	long long window_start;
+	long window_count;
+	long peak_rate;
+	int packet;
+} handshake_set;
+
+/** Crea un insieme vuoto: ogni connessione avrà timeout millisecondi per
+ * inviare il primo messaggio.
+ * \param packet 1 se le connessioni sono SOCK_SEQPACKET
+ * \retval NULL in caso di errore (sets errno) */
+handshake_set *initialize_Handshakes(int timeout, int packet);
+
+/** Aggiunge all'insieme s la connessione appena accettata fd. */
+void add_Handshake(handshake_set *s, int fd);
+
+/** Attende che listen_fd o una delle connessioni di s siano leggibili,
+ * al più fino alla prima scadenza. Dopo il ritorno, s->fds[0].revents
+ * indica se listen_fd è pronta.
+ * \retval come poll */
+int poll_Handshakes(handshake_set *s, int listen_fd);
+
+/** Legge dalle connessioni pronte e chiama done (con arg) per ogni primo
+ * messaggio completo; chiude le connessioni scadute, terminate o in errore. */
+void serve_Handshakes(handshake_set *s, handshake_done done, void *arg);
+
+/** Scrive su f le misure degli accessi di s. */
+void report_Handshakes(handshake_set *s, FILE *f);
+
+/** Chiude tutte le connessioni ancora in attesa e libera l'insieme. */
+void free_Handshakes(handshake_set **s);
+
+#endif
@@ -0,0 +1,149 @@
+/**
+   \file lz.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione della compressione LZ77 a blocchi.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+/** Le ripetizioni non iniziano negli ultimi LZ_MATCH_LIMIT byte */
+#define LZ_MATCH_LIMIT 12
+
+/** Legge 4 byte di p, senza vincoli di allineamento */
+static inline uint32_t read32(const char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/** Indice nella tabella hash di 4 byte (hash moltiplicativo di Knuth) */
+static inline int hash32(uint32_t v) {
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/** Scrive in dst il resto n di una lunghezza (byte 255 e un byte finale
+ * minore), a partire da op.
+ * \retval la nuova posizione in dst */
+static int putLength(char *dst, int op, int n) {
+	while (n >= 255) {
+		dst[op++] = (char) 255;
+		n -= 255;
+	}
+	dst[op++] = (char) n;
+	return op;
+}
+
+/** Scrive in dst una sequenza: lit letterali da src e, se len > 0, una
+ * ripetizione di len byte a distanza offset.
+ * \retval la nuova posizione in dst, -1 se la sequenza non sta in cap */
+static int putSequence(char *dst, int op, int cap, const char *src, int lit, int offset, int len) {
+	/*Token, letterali, resto della loro lunghezza, distanza, resto della ripetizione*/
+	if (op + 1 + lit + lit/255 + 1 + 2 + len/255 + 1 > cap) return -1;
+	dst[op++] = (char) (((lit < 15) ? lit : 15) << 4 |
+		((len == 0) ? 0 : (len - LZ_MIN_MATCH < 15) ? len - LZ_MIN_MATCH : 15));
+	if (lit >= 15) op = putLength(dst, op, lit - 15);
+	memcpy(dst+op, src, lit);
+	op += lit;
+	if (len == 0) return op;
+	dst[op++] = (char) (offset & 0xff);
+	dst[op++] = (char) (offset >> 8);
+	if (len - LZ_MIN_MATCH >= 15) op = putLength(dst, op, len - LZ_MIN_MATCH - 15);
+	return op;
+}
+
+/** Tabella hash di lzCompress: 16 KiB, troppi per lo stack di una
+ * coroutine (coro.h), quindi una per thread */
+static __thread int table[1 << LZ_HASH_BITS];
+
+int lzCompress(const char *src, int n, char *dst, int cap) {
+	int ip = 0, anchor = 0, op = 0, ref, len, h;
+	uint32_t seq;
+	if (src == NULL || dst == NULL || n < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(table, 0xff, sizeof(table));
+	while (ip < n - LZ_MATCH_LIMIT) {
+		seq = read32(src+ip);
+		h = hash32(seq);
+		ref = table[h];
+		table[h] = ip;
+		if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(src+ref) != seq) {
+			ip++;
+			continue;
+		}
+		/*La ripetizione si estende all'indietro sui letterali in attesa...*/
+		while (ip > anchor && ref > 0 && src[ip-1] == src[ref-1]) {
+			ip--;
+			ref--;
+		}
+		/*...e in avanti fino agli ultimi letterali*/
+		len = LZ_MIN_MATCH;
+		while (ip + len < n - LZ_LAST_LITERALS && src[ref+len] == src[ip+len]) len++;
+		if ((op = putSequence(dst, op, cap, src+anchor, ip-anchor, ip-ref, len)) == -1) return -1;
+		ip += len;
+		anchor = ip;
+		/*La posizione appena prima della fine aiuta la ripetizione successiva*/
+		if (ip - 2 < n - LZ_MATCH_LIMIT) table[hash32(read32(src+ip-2))] = ip-2;
+	}
+	return putSequence(dst, op, cap, src+anchor, n-anchor, 0, 0);
+}
+
+/** Legge da src il resto di una lunghezza, a partire da *ip.
+ * \retval il resto, -1 se il blocco finisce prima o il resto supera max */
+static int getLength(const char *src, int n, int *ip, int max) {
+	int length = 0, b;
+	do {
+		if (*ip >= n) return -1;
+		b = (unsigned char) src[(*ip)++];
+		length += b;
+		if (length > max) return -1;
+	} while (b == 255);
+	return length;
+}
+
+int lzDecompress(const char *src, int n, char *dst, int raw) {
+	int ip = 0, op = 0, token, lit, len, offset, extra;
+	if (src == NULL || dst == NULL || n <= 0 || raw < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (ip < n) {
+		token = (unsigned char) src[ip++];
+		lit = token >> 4;
+		if (lit == 15) {
+			if ((extra = getLength(src, n, &ip, raw)) == -1) break;
+			lit += extra;
+		}
+		if (lit > n - ip || lit > raw - op) break;
+		memcpy(dst+op, src+ip, lit);
+		ip += lit;
+		op += lit;
+		/*L'ultima sequenza ha solo letterali*/
+		if (ip == n) {
+			if (op == raw) return raw;
+			break;
+		}
+		if (n - ip < 2) break;
+		offset = (unsigned char) src[ip] | (unsigned char) src[ip+1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > op) break;
+		len = (token & 15) + LZ_MIN_MATCH;
+		if ((token & 15) == 15) {
+			if ((extra = getLength(src, n, &ip, raw)) == -1) break;
+			len += extra;
+		}
+		if (len > raw - op) break;
+		/*La ripetizione puo` sovrapporsi a se stessa: si copia un byte alla volta*/
+		while (len-- > 0) {
+			dst[op] = dst[op-offset];
+			op++;
+		}
+	}
+	errno = EPROTO;
+	return -1;
+}
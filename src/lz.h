@@ -0,0 +1,42 @@
+/**
+   \file lz.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  compressione LZ77 a blocchi, nel formato dei blocchi di LZ4.
+
+Un blocco compresso è una serie di sequenze. Ogni sequenza inizia con un
+byte (token): i 4 bit alti sono il numero di byte letterali, i 4 bit
+bassi la lunghezza della ripetizione meno LZ_MIN_MATCH; il valore 15
+indica che la lunghezza prosegue nei byte successivi (255 finché ne
+segue un altro). Seguono i letterali, la distanza della ripetizione (2
+byte, little endian) ed eventualmente il resto della sua lunghezza.
+L'ultima sequenza ha solo letterali, almeno LZ_LAST_LITERALS.
+
+La compressione trova le ripetizioni con una tabella hash delle posizioni
+di gruppi di 4 byte, senza cercare la più lunga: è veloce e lineare nella
+lunghezza del testo, a scapito del rapporto di compressione. La
+decompressione controlla ogni lunghezza e ogni distanza, così che un
+blocco corrotto o malevolo non possa leggere o scrivere fuori dai buffer.
+ */
+#ifndef __LZ_H
+#define __LZ_H
+
+/** Lunghezza minima di una ripetizione */
+#define LZ_MIN_MATCH 4
+/** Byte finali sempre letterali */
+#define LZ_LAST_LITERALS 5
+/** Distanza massima di una ripetizione */
+#define LZ_MAX_OFFSET 65535
+/** Bit dell'indice della tabella hash */
+#define LZ_HASH_BITS 12
+
+/** Comprime n byte di src in dst, che ne può contenere cap.
+ * \retval i byte del blocco compresso
+ * \retval -1 se il blocco non starebbe in cap byte */
+int lzCompress(const char *src, int n, char *dst, int cap);
+
+/** Decomprime il blocco di n byte src in dst, che deve ricevere
+ * esattamente raw byte.
+ * \retval raw se tutto ok, -1 se il blocco non è valido (errno = EPROTO) */
+int lzDecompress(const char *src, int n, char *dst, int raw);
+
+#endif
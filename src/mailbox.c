@@ -0,0 +1,1167 @@
+/**
+   \file mailbox.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione delle mailbox e dei corrieri che le svuotano.
+ */
+/*sendmmsg*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "errors.h"
+#include "mailbox.h"
+#include "packet.h"
+
+/** Byte di un messaggio accodato */
+#define frameSize(f) ((f)->header_size + (f)->body_size)
+
+/** Nomi delle politiche, nell'ordine dei valori MAILBOX_* */
+static const char *policy_names[MAILBOX_POLICIES] = {"drop-oldest", "drop-newest", "disconnect", "park"};
+
+static int enqueue_Frame(mailbox *mb, out_frame *f);
+
+/** Libera un messaggio accodato, rilasciandone il corpo se condiviso.*/
+static void free_Frame(out_frame *f) {
+	if (f->shared != NULL) release_Shared(f->shared);
+	else free(f->body);
+	free(f);
+}
+
+/** Libera una lista di messaggi.*/
+static void free_Frames(out_frame *f) {
+	out_frame *next;
+	for (; f != NULL; f = next) {
+		next = f->next;
+		free_Frame(f);
+	}
+}
+
+/** Scarta i messaggi accodati a mb (mb->mtx acquisito).*/
+static void drop_Frames(mailbox *mb) {
+	out_flow *fl, *next;
+	free_Frames(mb->head);
+	free_Frames(mb->ctl_head);
+	for (fl = mb->flows; fl != NULL; fl = next) {
+		next = fl->next;
+		free_Frames(fl->head);
+		free(fl);
+	}
+	mb->head = mb->tail = mb->ctl_head = mb->ctl_tail = NULL;
+	mb->flows = mb->flows_tail = NULL;
+	memset(mb->buckets, 0, sizeof(mb->buckets));
+	mb->wired = mb->offset = mb->frames = 0;
+	mb->bytes = 0;
+}
+
+/** Rilascia un riferimento a mb: l'ultimo la libera.*/
+static void release_Mailbox(mailbox *mb) {
+	int refs;
+	pthread_mutex_lock(&mb->mtx);
+		refs = --mb->refs;
+	pthread_mutex_unlock(&mb->mtx);
+	if (refs > 0) return;
+	drop_Frames(mb);
+	if (mb->spill_fd >= 0) close(mb->spill_fd);
+	pthread_mutex_destroy(&mb->mtx);
+	free(mb);
+}
+
+/** Accoda mb tra le mailbox pronte del suo corriere, risvegliandolo se
+ * non ne aveva altre.*/
+static void push_Ready(courier *c, mailbox *mb, int wake) {
+	uint64_t one = 1;
+	int idle;
+	pthread_mutex_lock(&c->mtx);
+		mb->next_ready = NULL;
+		idle = (c->ready_head == NULL);
+		if (idle) c->ready_head = mb;
+		else c->ready_tail->next_ready = mb;
+		c->ready_tail = mb;
+	pthread_mutex_unlock(&c->mtx);
+	if (idle && wake) (void) write(c->wakefd, &one, sizeof(one));
+}
+
+/** Crea un messaggio da accodare a mb con il contenuto di msg.*/
+static out_frame *new_Frame(mailbox *mb, message_t *msg, const void *flow) {
+	out_frame *f = Malloc(sizeof(out_frame));
+	f->flow = flow;
+	f->shared = NULL;
+	f->header_size = replyHeader(f->header, msg, mb->version, &f->body_size);
+	f->body = NULL;
+	if (f->body_size > 0) {
+		f->body = Malloc(sizeof(char)*f->body_size);
+		memcpy(f->body, msg->buffer, f->body_size);
+	}
+	f->next = NULL;
+	return f;
+}
+
+/** Crea un messaggio da accodare a mb che condivide il corpo di s (della
+ * sua versione compressa, se mb la accetta e s ne ha una).*/
+static out_frame *new_SharedFrame(mailbox *mb, shared_msg *s, const void *flow) {
+	out_frame *f = Malloc(sizeof(out_frame));
+	message_t *msg = (mb->packed && s->packed.buffer != NULL) ? &s->packed : &s->msg;
+	f->flow = flow;
+	f->header_size = replyHeader(f->header, msg, mb->version, &f->body_size);
+	f->body = msg->buffer;
+	f->shared = s;
+	__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+	f->next = NULL;
+	return f;
+}
+
+/** Aggiunge f ai messaggi scelti per l'invio (mb->mtx acquisito).*/
+static void wire_Frame(mailbox *mb, out_frame *f) {
+	f->next = NULL;
+	if (mb->tail == NULL) mb->head = f;
+	else mb->tail->next = f;
+	mb->tail = f;
+	mb->wired++;
+}
+
+/** Lista di trabocco della coda del mittente key.*/
+static out_flow **flow_Bucket(mailbox *mb, const void *key) {
+	return mb->buckets + (((uintptr_t) key >> 4) % MAILBOX_FLOWS);
+}
+
+/** Toglie la coda fl, rimasta vuota, dal giro e dalla tabella dei
+ * mittenti e la libera (mb->mtx acquisito).*/
+static void remove_Flow(mailbox *mb, out_flow *fl) {
+	out_flow **pp, *prev = NULL;
+	for (pp = &mb->flows; *pp != fl; prev = *pp, pp = &(*pp)->next) ;
+	*pp = fl->next;
+	if (mb->flows_tail == fl) mb->flows_tail = prev;
+	for (pp = flow_Bucket(mb, fl->key); *pp != fl; pp = &(*pp)->hnext) ;
+	*pp = fl->hnext;
+	free(fl);
+}
+
+/** Accoda f alla corsia di controllo o alla coda del suo mittente, creata
+ * se non ha altri messaggi in attesa (mb->mtx acquisito).*/
+static void append_Frame(mailbox *mb, out_frame *f) {
+	out_flow **bucket, *fl;
+	f->next = NULL;
+	mb->frames++;
+	mb->bytes += frameSize(f);
+	if (f->flow == NULL) {
+		if (mb->ctl_tail == NULL) mb->ctl_head = f;
+		else mb->ctl_tail->next = f;
+		mb->ctl_tail = f;
+		return;
+	}
+	bucket = flow_Bucket(mb, f->flow);
+	for (fl = *bucket; fl != NULL && fl->key != f->flow; fl = fl->hnext) ;
+	if (fl == NULL) {
+		/*Un mittente che entra nel giro ha gia` il credito del suo turno*/
+		fl = Malloc(sizeof(out_flow));
+		fl->key = f->flow;
+		fl->head = fl->tail = NULL;
+		fl->bytes = 0;
+		fl->deficit = MAILBOX_QUANTUM;
+		fl->next = NULL;
+		fl->hnext = *bucket;
+		*bucket = fl;
+		if (mb->flows_tail == NULL) mb->flows = fl;
+		else mb->flows_tail->next = fl;
+		mb->flows_tail = fl;
+	}
+	if (fl->tail == NULL) fl->head = f;
+	else fl->tail->next = f;
+	fl->tail = f;
+	fl->bytes += frameSize(f);
+}
+
+/** 1 se accodare un messaggio di size byte porterebbe mb oltre i limiti
+ * del suo gruppo.*/
+static int over_Limits(mailbox *mb, int size) {
+	courier_group *g = mb->group;
+	return (g->max_frames > 0 && mb->frames + 1 > g->max_frames) ||
+		(g->max_bytes > 0 && mb->bytes + size > g->max_bytes);
+}
+
+/** Broadcast pubblicati sull'anello di g.*/
+static long ring_Head(courier_group *g) {
+	return __atomic_load_n(&g->ring_head, __ATOMIC_ACQUIRE);
+}
+
+/** Comunica l'esito result del broadcast di slot per mb (mb->mtx
+ * acquisito): subito se positivo, altrimenti tramite un corriere.*/
+static void report_Ring(mailbox *mb, ring_slot *slot, int result) {
+	courier_group *g = mb->group;
+	ring_notice *n;
+	uint64_t one = 1;
+	if (g->hook == NULL || slot->orig == NULL) return;
+	if (result > 0) {
+		g->hook(slot->orig, slot->flow, mb->user, result);
+		return;
+	}
+	n = Malloc(sizeof(ring_notice));
+	n->orig = slot->orig;
+	__atomic_add_fetch(&n->orig->refs, 1, __ATOMIC_RELAXED);
+	n->flow = slot->flow;
+	n->user = mb->user;
+	n->result = result;
+	n->next = NULL;
+	pthread_mutex_lock(&g->notice_mtx);
+		if (g->notices_tail != NULL) g->notices_tail->next = n;
+		else __atomic_store_n(&g->notices, n, __ATOMIC_RELAXED);
+		g->notices_tail = n;
+	pthread_mutex_unlock(&g->notice_mtx);
+	(void) write(mb->owner->wakefd, &one, sizeof(one));
+}
+
+/** Passa alla funzione di g gli esiti negativi in attesa (senza lock).*/
+static void notify_Ring(courier_group *g) {
+	ring_notice *n, *next;
+	if (__atomic_load_n(&g->notices, __ATOMIC_RELAXED) == NULL) return;
+	pthread_mutex_lock(&g->notice_mtx);
+		n = g->notices;
+		__atomic_store_n(&g->notices, NULL, __ATOMIC_RELAXED);
+		g->notices_tail = NULL;
+	pthread_mutex_unlock(&g->notice_mtx);
+	for (; n != NULL; n = next) {
+		next = n->next;
+		g->hook(n->orig, n->flow, n->user, n->result);
+		release_Shared(n->orig);
+		free(n);
+	}
+}
+
+/** Porta nelle code di mb i broadcast dell'anello dal suo cursore fino a
+ * upto (mb->mtx acquisito), comunicandone gli esiti. Le posizioni tra il
+ * cursore e la testa dell'anello non vengono liberate ne` riscritte: si
+ * leggono senza ring_mtx.
+ * \param forced 1 se vanno portati tutti, applicando se serve la politica
+ *        del gruppo; 0 se solo quanti servono ai prossimi invii, entro i
+ *        limiti della mailbox */
+static void pull_Ring(mailbox *mb, long upto, int forced) {
+	ring_slot *slot;
+	out_frame *f;
+	for (; mb->cursor < upto; mb->cursor++) {
+		slot = mb->group->ring + (mb->cursor % MAILBOX_RING);
+		/*Chi non riceve piu` messaggi salta i broadcast*/
+		if (mb->broken || mb->closed || mb->evicted) {
+			report_Ring(mb, slot, SEOF);
+			continue;
+		}
+		f = new_SharedFrame(mb, slot->msg, slot->flow);
+		if (!forced && mb->frames > 0 &&
+			(mb->frames >= 2*MAILBOX_BATCH || over_Limits(mb, frameSize(f)))) {
+			free_Frame(f);
+			return;
+		}
+		report_Ring(mb, slot, enqueue_Frame(mb, f));
+	}
+}
+
+/** Sceglie i prossimi messaggi da inviare, finche` quelli scelti non sono
+ * MAILBOX_BATCH: prima la corsia di controllo, poi, se il client ha ancora
+ * crediti, le code dei mittenti a turno (deficit round robin) (mb->mtx
+ * acquisito).
+ * \retval il numero di messaggi scelti per l'invio */
+static int pick_Frames(mailbox *mb) {
+	out_flow *fl;
+	out_frame *f;
+	/*Finche` ci sono messaggi parcheggiati i broadcast attendono nell'anello*/
+	if (mb->reader && mb->spill_frames == 0 && mb->credits != 0)
+		pull_Ring(mb, ring_Head(mb->group), 0);
+	while (mb->wired < MAILBOX_BATCH) {
+		if ((f = mb->ctl_head) != NULL) {
+			if ((mb->ctl_head = f->next) == NULL) mb->ctl_tail = NULL;
+		} else if ((fl = mb->flows) != NULL && mb->credits != 0) {
+			f = fl->head;
+			if (fl->deficit < frameSize(f)) {
+				/*Turno finito: il mittente passa in fondo al giro con un nuovo credito*/
+				fl->deficit += MAILBOX_QUANTUM;
+				if (fl->next != NULL) {
+					mb->flows = fl->next;
+					fl->next = NULL;
+					mb->flows_tail->next = fl;
+					mb->flows_tail = fl;
+				}
+				continue;
+			}
+			fl->deficit -= frameSize(f);
+			fl->bytes -= frameSize(f);
+			if (mb->credits > 0) mb->credits--;
+			if ((fl->head = f->next) == NULL) {
+				fl->tail = NULL;
+				remove_Flow(mb, fl);
+			}
+		} else
+			break;
+		wire_Frame(mb, f);
+	}
+	return mb->wired;
+}
+
+/** Affida mb al suo corriere, se non lo e` gia` (mb->mtx acquisito).*/
+static void schedule_Mailbox(mailbox *mb) {
+	if (mb->scheduled) return;
+	/*Il riferimento del corriere*/
+	mb->scheduled = 1;
+	mb->refs++;
+	push_Ready(mb->owner, mb, 1);
+}
+
+/** Scarta il messaggio piu` vecchio del mittente con piu` byte in attesa
+ * o, se tutti i messaggi sono gia` stati scelti per l'invio, il primo il
+ * cui invio non e` iniziato. I messaggi di controllo non vengono scartati.
+ * \retval 1 se un messaggio e` stato scartato, 0 se non ce ne sono */
+static int drop_Oldest(mailbox *mb) {
+	out_flow *fl, *big = NULL;
+	out_frame **pp, *f, *prev = NULL;
+	for (fl = mb->flows; fl != NULL; fl = fl->next)
+		if (big == NULL || fl->bytes > big->bytes) big = fl;
+	if (big != NULL) {
+		f = big->head;
+		big->bytes -= frameSize(f);
+		if ((big->head = f->next) == NULL) {
+			big->tail = NULL;
+			remove_Flow(mb, big);
+		}
+	} else {
+		/*Un messaggio inviato in parte va completato*/
+		for (pp = &mb->head; (f = *pp) != NULL; prev = f, pp = &f->next)
+			if ((f != mb->head || mb->offset == 0) && f->flow != NULL) break;
+		if (f == NULL) return 0;
+		*pp = f->next;
+		if (mb->tail == f) mb->tail = prev;
+		mb->wired--;
+	}
+	mb->frames--;
+	mb->bytes -= frameSize(f);
+	free_Frame(f);
+	return 1;
+}
+
+/** Scarta i messaggi parcheggiati di mb.*/
+static void drop_Spill(mailbox *mb) {
+	if (mb->spill_fd >= 0) (void) ftruncate(mb->spill_fd, 0);
+	mb->spill_frames = 0;
+	mb->spill_read = mb->spill_write = 0;
+}
+
+/** Campi di un messaggio parcheggiato che precedono il corpo */
+#define SPILL_FIELDS 4
+/** Byte dei campi che precedono il corpo */
+#define SPILL_PREFIX ((ssize_t) (sizeof(((out_frame *) 0)->header) + 2*sizeof(int) + sizeof(void *)))
+
+/** Prepara in iov i campi di f che nel file precedono il corpo:
+ * l'intestazione, la sua lunghezza, quella del corpo e il mittente.*/
+static void spill_Fields(out_frame *f, struct iovec *iov) {
+	iov[0].iov_base = f->header;
+	iov[0].iov_len = sizeof(f->header);
+	iov[1].iov_base = &f->header_size;
+	iov[1].iov_len = sizeof(int);
+	iov[2].iov_base = &f->body_size;
+	iov[2].iov_len = sizeof(int);
+	iov[3].iov_base = &f->flow;
+	iov[3].iov_len = sizeof(f->flow);
+}
+
+/** Parcheggia f in fondo al file di mb, che viene creato (e subito
+ * rimosso dal filesystem) al primo uso.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+static int park_Frame(mailbox *mb, out_frame *f) {
+	char path[] = "/tmp/msgserv-mailbox-XXXXXX";
+	struct iovec iov[SPILL_FIELDS+1];
+	ssize_t size = SPILL_PREFIX + f->body_size;
+	if (mb->spill_fd == -1) {
+		if ((mb->spill_fd = mkstemp(path)) == -1) return -1;
+		unlink(path);
+	}
+	spill_Fields(f, iov);
+	iov[SPILL_FIELDS].iov_base = f->body;
+	iov[SPILL_FIELDS].iov_len = f->body_size;
+	errno = 0;
+	if (pwritev(mb->spill_fd, iov, (f->body_size > 0) ? SPILL_FIELDS+1 : SPILL_FIELDS, mb->spill_write) != size) {
+		if (errno == 0) errno = EIO;
+		return -1;
+	}
+	mb->spill_write += size;
+	mb->spill_frames++;
+	return 0;
+}
+
+/** Riprende i messaggi parcheggiati da mb finche` la mailbox resta nei
+ * limiti (almeno uno).
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+static int unpark_Frames(mailbox *mb) {
+	struct iovec iov[SPILL_FIELDS];
+	out_frame *f;
+	do {
+		f = Malloc(sizeof(out_frame));
+		f->body = NULL;
+		f->shared = NULL;
+		spill_Fields(f, iov);
+		/*Una lettura corta non imposta errno*/
+		errno = 0;
+		if (preadv(mb->spill_fd, iov, SPILL_FIELDS, mb->spill_read) != SPILL_PREFIX ||
+			(f->body_size > 0 && (f->body = Malloc(f->body_size)) != NULL &&
+			pread(mb->spill_fd, f->body, f->body_size, mb->spill_read + SPILL_PREFIX) != f->body_size)) {
+			free_Frame(f);
+			if (errno == 0) errno = EIO;
+			return -1;
+		}
+		mb->spill_read += SPILL_PREFIX + f->body_size;
+		mb->spill_frames--;
+		append_Frame(mb, f);
+	} while (mb->spill_frames > 0 && !over_Limits(mb, 0));
+	if (mb->spill_frames == 0) drop_Spill(mb);
+	return 0;
+}
+
+/** Disconnette l'utente di mb (MAILBOX_DISCONNECT): i messaggi accodati
+ * vengono sostituiti da un MSG_ERROR, dopo il quale la socket viene chiusa.
+ * La chiusura in lettura fa terminare subito la connessione al suo gestore.*/
+static void evict_Mailbox(mailbox *mb) {
+	out_frame *partial = NULL;
+	message_t err;
+	int offset = mb->offset;
+	/*Un messaggio inviato in parte va completato*/
+	if (offset > 0) {
+		partial = mb->head;
+		mb->head = partial->next;
+	}
+	drop_Frames(mb);
+	drop_Spill(mb);
+	if (partial != NULL) {
+		wire_Frame(mb, partial);
+		mb->frames++;
+		mb->bytes += frameSize(partial);
+		mb->offset = offset;
+	}
+	err.type = MSG_ERROR;
+	err.buffer = MAILBOX_EVICTED;
+	err.length = strlen(err.buffer);
+	append_Frame(mb, new_Frame(mb, &err, NULL));
+	mb->evicted = mb->closing = 1;
+	if (mb->fd >= 0) shutdown(mb->fd, SHUT_RD);
+	schedule_Mailbox(mb);
+}
+
+/** Rimuove da mb il primo dei messaggi scelti, appena inviato
+ * (mb->mtx acquisito).*/
+static void sent_Frame(mailbox *mb) {
+	out_frame *f = mb->head;
+	mb->offset = 0;
+	mb->wired--;
+	mb->frames--;
+	mb->bytes -= frameSize(f);
+	if ((mb->head = f->next) == NULL) mb->tail = NULL;
+	free_Frame(f);
+}
+
+/** Come flush_Mailbox per una socket SOCK_SEQPACKET: ogni messaggio e` un
+ * datagramma, e una sendmmsg ne invia fino a PACKET_BATCH. Un datagramma
+ * parte intero o non parte: mb->offset resta 0.*/
+static int flush_Packets(mailbox *mb, int *sent) {
+	struct mmsghdr mm[PACKET_BATCH];
+	struct iovec iov[2*PACKET_BATCH];
+	out_frame *f;
+	int i, n;
+	while (pick_Frames(mb) > 0) {
+		memset(mm, 0, sizeof(mm));
+		for (n = 0, f = mb->head; f != NULL && n < PACKET_BATCH; f = f->next, n++) {
+			iov[2*n].iov_base = f->header;
+			iov[2*n].iov_len = f->header_size;
+			iov[2*n+1].iov_base = f->body;
+			iov[2*n+1].iov_len = f->body_size;
+			mm[n].msg_hdr.msg_iov = iov+2*n;
+			mm[n].msg_hdr.msg_iovlen = (f->body_size > 0) ? 2 : 1;
+		}
+		if ((n = sendmmsg(mb->fd, mm, n, MSG_DONTWAIT|MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			sent_Frame(mb);
+			(*sent)++;
+		}
+	}
+	return 1;
+}
+
+/** Invia quanto possibile dei messaggi di mb (mb->mtx acquisito),
+ * scegliendone fino a MAILBOX_BATCH per ogni sendmsg.
+ * \param sent incrementato dei messaggi inviati completamente
+ * \retval 1 se non restano messaggi che si possano inviare ora
+ * \retval 0 se la socket non accetta altri byte per ora
+ * \retval -1 in caso di errore (sets errno) */
+static int flush_Mailbox(mailbox *mb, int *sent) {
+	struct iovec iov[2*MAILBOX_BATCH];
+	struct msghdr mh;
+	out_frame *f;
+	ssize_t w;
+	int n, skip;
+	if (mb->packet) return flush_Packets(mb, sent);
+	while (pick_Frames(mb) > 0) {
+		n = 0;
+		skip = mb->offset;
+		for (f = mb->head; f != NULL && n < 2*MAILBOX_BATCH; f = f->next) {
+			/*Del primo messaggio potrebbe essere gia` stata inviata una parte*/
+			if (skip < f->header_size) {
+				iov[n].iov_base = f->header + skip;
+				iov[n++].iov_len = f->header_size - skip;
+				skip = 0;
+			} else
+				skip -= f->header_size;
+			if (f->body_size > skip) {
+				iov[n].iov_base = f->body + skip;
+				iov[n++].iov_len = f->body_size - skip;
+			}
+			skip = 0;
+		}
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = n;
+		if ((w = sendmsg(mb->fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		while (w > 0) {
+			f = mb->head;
+			if (w < frameSize(f) - mb->offset) {
+				mb->offset += w;
+				break;
+			}
+			w -= frameSize(f) - mb->offset;
+			sent_Frame(mb);
+			(*sent)++;
+		}
+	}
+	return 1;
+}
+
+/** Invia i messaggi di una mailbox pronta. Se la socket non è scrivibile
+ * la mailbox resta al corriere, in attesa di EPOLLOUT; altrimenti il
+ * corriere ne rilascia il riferimento.*/
+static void drain_Mailbox(courier *c, mailbox *mb, int *sent) {
+	struct epoll_event ev;
+	int r, keep = 0;
+	pthread_mutex_lock(&mb->mtx);
+	if (!mb->broken) {
+		/*Svuotata la mailbox, si riprendono i messaggi parcheggiati (non se
+		 * quelli in memoria attendono i crediti del client)*/
+		while ((r = flush_Mailbox(mb, sent)) == 1 && mb->spill_frames > 0 && mb->flows == NULL)
+			if (unpark_Frames(mb) == -1) {
+				perror("mailbox, drain_Mailbox");
+				r = -1;
+				break;
+			}
+		if (r == 0) {
+			ev.events = EPOLLOUT | EPOLLONESHOT;
+			ev.data.ptr = mb;
+			if (epoll_ctl(c->epfd, EPOLL_CTL_MOD, mb->fd, &ev) == 0 ||
+				(errno == ENOENT && epoll_ctl(c->epfd, EPOLL_CTL_ADD, mb->fd, &ev) == 0)) {
+				mb->armed = keep = 1;
+			} else
+				r = -1;
+		}
+		if (r == -1) {
+			mb->broken = 1;
+			drop_Frames(mb);
+		}
+	}
+	if (!keep) {
+		if (mb->closing && mb->fd >= 0) shutdown(mb->fd, SHUT_RDWR);
+		/*La mailbox e` stata chiusa in attesa dell'ultimo messaggio*/
+		if (mb->owns_fd && mb->fd >= 0) {
+			(void) epoll_ctl(c->epfd, EPOLL_CTL_DEL, mb->fd, NULL);
+			closeSocket(mb->fd);
+			mb->fd = -1;
+		}
+		mb->scheduled = 0;
+	}
+	pthread_mutex_unlock(&mb->mtx);
+	if (!keep) release_Mailbox(mb);
+}
+
+/** Stacca dal corriere la lista delle mailbox pronte.*/
+static mailbox *take_Ready(courier *c) {
+	mailbox *list;
+	pthread_mutex_lock(&c->mtx);
+		list = c->ready_head;
+		c->ready_head = c->ready_tail = NULL;
+	pthread_mutex_unlock(&c->mtx);
+	return list;
+}
+
+/** Affida al corriere le sue mailbox che hanno nuovi broadcast da inviare.*/
+static void scan_Ring(courier *c) {
+	courier_group *g = c->group;
+	mailbox *mb;
+	long head = ring_Head(g);
+	if (head == c->ring_seen) return;
+	pthread_mutex_lock(&g->ring_mtx);
+	c->ring_seen = head;
+	for (mb = c->readers; mb != NULL; mb = mb->ring_next) {
+		pthread_mutex_lock(&mb->mtx);
+			if (mb->cursor < head && mb->credits != 0 && !mb->broken && !mb->closed)
+				schedule_Mailbox(mb);
+		pthread_mutex_unlock(&mb->mtx);
+	}
+	pthread_mutex_unlock(&g->ring_mtx);
+}
+
+/** 1 se mb non puo` avanzare nell'anello finche` il client non legge
+ * (mb->mtx acquisito).*/
+static int stuck_Mailbox(mailbox *mb) {
+	return mb->armed || mb->credits == 0 || mb->spill_frames > 0 ||
+		mb->broken || mb->closed || mb->evicted;
+}
+
+/** Libera le posizioni dell'anello superate da tutti i cursori (ring_mtx
+ * acquisito). Chi e` rimasto indietro di meta` anello perche` il client non
+ * legge riceve prima tutti i suoi broadcast, che contano nei limiti della
+ * mailbox; chi invece li sta ancora inviando non viene toccato.*/
+static void reclaim_Ring(courier_group *g) {
+	mailbox *mb;
+	long head = g->ring_head, low = head;
+	int i;
+	for (i = 0; i < g->size; i++)
+		for (mb = g->couriers[i].readers; mb != NULL; mb = mb->ring_next) {
+			pthread_mutex_lock(&mb->mtx);
+				if (mb->cursor - g->ring_tail < MAILBOX_RING/2 && stuck_Mailbox(mb))
+					pull_Ring(mb, head, 1);
+				if (mb->cursor < low) low = mb->cursor;
+			pthread_mutex_unlock(&mb->mtx);
+		}
+	for (; g->ring_tail < low; g->ring_tail++) {
+		ring_slot *slot = g->ring + (g->ring_tail % MAILBOX_RING);
+		release_Shared(slot->msg);
+		release_Shared(slot->orig);
+		slot->msg = slot->orig = NULL;
+	}
+}
+
+/** Toglie mb dall'anello dei broadcast.
+ * \param deliver 1 se i broadcast gia` pubblicati vanno prima accodati, 0
+ *        se vanno persi (con l'esito SEOF) */
+static void leave_Ring(mailbox *mb, int deliver) {
+	courier_group *g = mb->group;
+	pthread_mutex_lock(&g->ring_mtx);
+	pthread_mutex_lock(&mb->mtx);
+	if (mb->reader) {
+		if (deliver) pull_Ring(mb, g->ring_head, 1);
+		for (; mb->cursor < g->ring_head; mb->cursor++)
+			report_Ring(mb, g->ring + (mb->cursor % MAILBOX_RING), SEOF);
+		if (mb->ring_prev != NULL) mb->ring_prev->ring_next = mb->ring_next;
+		else mb->owner->readers = mb->ring_next;
+		if (mb->ring_next != NULL) mb->ring_next->ring_prev = mb->ring_prev;
+		mb->reader = 0;
+	}
+	pthread_mutex_unlock(&mb->mtx);
+	pthread_mutex_unlock(&g->ring_mtx);
+}
+
+static void *run_Courier(void *arg) {
+	courier *c = arg;
+	struct epoll_event events[MAILBOX_BATCH];
+	mailbox *list, *more, *mb, *next;
+	int n, i, sent;
+	while (!c->stop) {
+		notify_Ring(c->group);
+		scan_Ring(c);
+		if ((list = take_Ready(c)) == NULL) {
+			if ((n = epoll_wait(c->epfd, events, MAILBOX_BATCH, -1)) == -1) {
+				if (errno == EINTR) continue;
+				perror("mailbox, run_Courier");
+				break;
+			}
+			for (i = 0; i < n; i++) {
+				/*Il dato NULL identifica l'eventfd di risveglio*/
+				if ((mb = events[i].data.ptr) == NULL) {
+					uint64_t v;
+					(void) read(c->wakefd, &v, sizeof(v));
+					continue;
+				}
+				pthread_mutex_lock(&mb->mtx);
+					mb->armed = 0;
+				pthread_mutex_unlock(&mb->mtx);
+				push_Ready(c, mb, 0);
+			}
+			continue;
+		}
+		/*Sotto carico attendiamo che le mailbox raccolgano altri messaggi*/
+		if (c->window > 0) {
+			usleep(c->window);
+			if ((more = take_Ready(c)) != NULL) {
+				for (mb = list; mb->next_ready != NULL; mb = mb->next_ready) ;
+				mb->next_ready = more;
+			}
+		}
+		sent = 0;
+		for (mb = list; mb != NULL; mb = next) {
+			next = mb->next_ready;
+			drain_Mailbox(c, mb, &sent);
+		}
+		/*I cursori sono avanzati: chi pubblica sull'anello pieno puo` riprovare*/
+		if (__atomic_load_n(&c->group->ring_waiters, __ATOMIC_RELAXED) > 0) {
+			pthread_mutex_lock(&c->group->ring_mtx);
+				pthread_cond_broadcast(&c->group->ring_cond);
+			pthread_mutex_unlock(&c->group->ring_mtx);
+		}
+		if (sent >= MAILBOX_BUSY)
+			c->window = (2*c->window + 50 > MAILBOX_WINDOW_MAX) ? MAILBOX_WINDOW_MAX : 2*c->window + 50;
+		else if (sent < MAILBOX_IDLE)
+			c->window = (c->window > 50) ? c->window / 2 : 0;
+	}
+	return (void *) 0;
+}
+
+courier_group *initialize_Couriers(int n) {
+	courier_group *g;
+	struct epoll_event ev;
+	int i;
+	if (n < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	g = Malloc(sizeof(courier_group));
+	g->couriers = Malloc(sizeof(courier)*n);
+	g->size = n;
+	g->next = 0;
+	g->max_frames = 0;
+	g->max_bytes = 0;
+	g->policy = MAILBOX_DROP_OLDEST;
+	memset(g->fired, 0, sizeof(g->fired));
+	pthread_mutex_init(&g->mtx, NULL);
+	memset(g->ring, 0, sizeof(g->ring));
+	g->ring_head = g->ring_tail = 0;
+	g->ring_waiters = 0;
+	pthread_mutex_init(&g->ring_mtx, NULL);
+	pthread_cond_init(&g->ring_cond, NULL);
+	g->hook = NULL;
+	g->notices = g->notices_tail = NULL;
+	pthread_mutex_init(&g->notice_mtx, NULL);
+	for (i = 0; i < n; i++) {
+		courier *c = g->couriers+i;
+		c->stop = 0;
+		c->ready_head = c->ready_tail = NULL;
+		c->window = 0;
+		c->readers = NULL;
+		c->ring_seen = 0;
+		c->group = g;
+		pthread_mutex_init(&c->mtx, NULL);
+		if ((c->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+			(c->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			perror("mailbox, initialize_Couriers");
+			g->size = i;
+			free_Couriers(&g);
+			return NULL;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->wakefd, &ev);
+	}
+	return g;
+}
+
+int start_Couriers(courier_group *g) {
+	int i;
+	if (g == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < g->size; i++) {
+		if ((errno = pthread_create(&g->couriers[i].tid, NULL, &run_Courier, g->couriers+i)) != 0) {
+			perror("mailbox, start_Couriers");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void stop_Couriers(courier_group *g) {
+	int i;
+	uint64_t one = 1;
+	if (g == NULL) return;
+	for (i = 0; i < g->size; i++) {
+		g->couriers[i].stop = 1;
+		(void) write(g->couriers[i].wakefd, &one, sizeof(one));
+	}
+	for (i = 0; i < g->size; i++)
+		pthread_join(g->couriers[i].tid, NULL);
+}
+
+void free_Couriers(courier_group **g) {
+	int i;
+	mailbox *mb, *next;
+	ring_notice *n, *nnext;
+	if (g == NULL || *g == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	for (i = 0; i < (*g)->size; i++) {
+		courier *c = (*g)->couriers+i;
+		for (mb = take_Ready(c); mb != NULL; mb = next) {
+			next = mb->next_ready;
+			release_Mailbox(mb);
+		}
+		close(c->epfd);
+		close(c->wakefd);
+	}
+	for (; (*g)->ring_tail < (*g)->ring_head; (*g)->ring_tail++) {
+		release_Shared((*g)->ring[(*g)->ring_tail % MAILBOX_RING].msg);
+		release_Shared((*g)->ring[(*g)->ring_tail % MAILBOX_RING].orig);
+	}
+	/*Gli esiti non ancora comunicati vanno persi con i corrieri*/
+	for (n = (*g)->notices; n != NULL; n = nnext) {
+		nnext = n->next;
+		release_Shared(n->orig);
+		free(n);
+	}
+	pthread_mutex_destroy(&(*g)->ring_mtx);
+	pthread_mutex_destroy(&(*g)->notice_mtx);
+	pthread_cond_destroy(&(*g)->ring_cond);
+	free((*g)->couriers);
+	free(*g);
+	*g = NULL;
+}
+
+void set_MailboxLimits(courier_group *g, int max_frames, long max_bytes, int policy) {
+	if (g == NULL || max_frames < 0 || max_bytes < 0 || policy < 0 || policy >= MAILBOX_POLICIES) {
+		errno = EINVAL;
+		return;
+	}
+	g->max_frames = max_frames;
+	g->max_bytes = max_bytes;
+	g->policy = policy;
+}
+
+int find_MailboxPolicy(const char *name) {
+	int i;
+	if (name == NULL) return -1;
+	for (i = 0; i < MAILBOX_POLICIES; i++)
+		if (strcmp(name, policy_names[i]) == 0) return i;
+	return -1;
+}
+
+void report_Couriers(courier_group *g, FILE *f) {
+	int i;
+	if (g == NULL || f == NULL) return;
+	fprintf(f, "mailbox: limite %d messaggi, %ld byte, politica %s; interventi:",
+		g->max_frames, g->max_bytes, policy_names[g->policy]);
+	for (i = 0; i < MAILBOX_POLICIES; i++)
+		fprintf(f, " %s %ld", policy_names[i], __atomic_load_n(g->fired+i, __ATOMIC_RELAXED));
+	fprintf(f, "\n");
+	fflush(f);
+}
+
+mailbox *open_Mailbox(courier_group *g, int fd) {
+	mailbox *mb;
+	if (g == NULL || fd < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	mb = Malloc(sizeof(mailbox));
+	mb->fd = fd;
+	mb->head = mb->tail = mb->ctl_head = mb->ctl_tail = NULL;
+	mb->flows = mb->flows_tail = NULL;
+	memset(mb->buckets, 0, sizeof(mb->buckets));
+	mb->wired = mb->offset = mb->frames = 0;
+	mb->bytes = 0;
+	mb->credits = -1;
+	mb->packed = mb->packet = 0;
+	mb->version = 1;
+	mb->scheduled = mb->armed = mb->closing = mb->broken = mb->closed = mb->owns_fd = 0;
+	mb->evicted = 0;
+	mb->spill_fd = -1;
+	mb->spill_frames = 0;
+	mb->spill_read = mb->spill_write = 0;
+	mb->reader = 0;
+	mb->cursor = 0;
+	mb->ring_prev = mb->ring_next = NULL;
+	mb->user = NULL;
+	mb->group = g;
+	mb->refs = 1;
+	mb->next_ready = NULL;
+	pthread_mutex_init(&mb->mtx, NULL);
+	pthread_mutex_lock(&g->mtx);
+		mb->owner = g->couriers + (g->next++ % g->size);
+	pthread_mutex_unlock(&g->mtx);
+	return mb;
+}
+
+/** Accoda f a mb, applicando la politica del gruppo se supera i limiti
+ * (mb->mtx acquisito).
+ * \retval come post_Mailbox */
+static int enqueue_Frame(mailbox *mb, out_frame *f) {
+	courier_group *g = mb->group;
+	const void *flow = f->flow;
+	int size = frameSize(f);
+	/*Dopo MAILBOX_DISCONNECT l'ultimo messaggio per l'utente e` l'errore*/
+	if (mb->broken || mb->closed || mb->evicted) {
+		free_Frame(f);
+		errno = EPIPE;
+		return SEOF;
+	}
+	/*Un messaggio che non entra in un datagramma non potrebbe partire*/
+	if (mb->packet && size > PACKET_MAX) {
+		free_Frame(f);
+		errno = EMSGSIZE;
+		return -1;
+	}
+	/*Finche` ci sono messaggi parcheggiati, i nuovi li seguono. Quelli di
+	 * controllo li precederebbero comunque: non si parcheggiano mai*/
+	if ((mb->spill_frames > 0 && flow != NULL) ||
+		(over_Limits(mb, size) && (flow != NULL || g->policy != MAILBOX_PARK))) {
+		__atomic_add_fetch(g->fired + g->policy, 1, __ATOMIC_RELAXED);
+		switch (g->policy) {
+			case MAILBOX_DROP_NEWEST:
+				free_Frame(f);
+				errno = ENOBUFS;
+				return -1;
+			case MAILBOX_DISCONNECT:
+				evict_Mailbox(mb);
+				free_Frame(f);
+				errno = EPIPE;
+				return SEOF;
+			case MAILBOX_PARK:
+				if (park_Frame(mb, f) == 0) {
+					free_Frame(f);
+					return size;
+				}
+				/*Senza file il messaggio resta in memoria*/
+				perror("mailbox, enqueue_Frame");
+				break;
+			default:
+				while (over_Limits(mb, size) && drop_Oldest(mb)) ;
+				break;
+		}
+	}
+	append_Frame(mb, f);
+	schedule_Mailbox(mb);
+	return size;
+}
+
+/** Accoda f a mb, dopo i broadcast gia` pubblicati.
+ * \retval come post_Mailbox */
+static int post_Frame(mailbox *mb, out_frame *f) {
+	int r;
+	pthread_mutex_lock(&mb->mtx);
+		if (mb->reader && f->flow != NULL) pull_Ring(mb, ring_Head(mb->group), 1);
+		r = enqueue_Frame(mb, f);
+	pthread_mutex_unlock(&mb->mtx);
+	return r;
+}
+
+int post_Mailbox(mailbox *mb, message_t *msg, const void *flow) {
+	if (mb == NULL || msg == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	return post_Frame(mb, new_Frame(mb, msg, flow));
+}
+
+shared_msg *share_Message(message_t *msg) {
+	shared_msg *s;
+	if (msg == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	s = Malloc(sizeof(shared_msg));
+	s->msg = *msg;
+	s->packed.buffer = NULL;
+	s->refs = 1;
+	msg->buffer = NULL;
+	return s;
+}
+
+void release_Shared(shared_msg *s) {
+	if (s == NULL) return;
+	if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+	free(s->msg.buffer);
+	free(s->packed.buffer);
+	free(s);
+}
+
+int post_Shared(mailbox *mb, shared_msg *s, const void *flow) {
+	if (mb == NULL || s == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	return post_Frame(mb, new_SharedFrame(mb, s, flow));
+}
+
+void join_Ring(mailbox *mb) {
+	courier_group *g;
+	if (mb == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	g = mb->group;
+	pthread_mutex_lock(&g->ring_mtx);
+	pthread_mutex_lock(&mb->mtx);
+	if (!mb->reader && !mb->closed) {
+		mb->reader = 1;
+		mb->cursor = g->ring_head;
+		mb->ring_prev = NULL;
+		if ((mb->ring_next = mb->owner->readers) != NULL) mb->ring_next->ring_prev = mb;
+		mb->owner->readers = mb;
+	}
+	pthread_mutex_unlock(&mb->mtx);
+	pthread_mutex_unlock(&g->ring_mtx);
+}
+
+int publish_Ring(courier_group *g, shared_msg *s, shared_msg *orig, const void *flow) {
+	ring_slot *slot;
+	struct timespec ts;
+	uint64_t one = 1;
+	int i;
+	if (g == NULL || s == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&g->ring_mtx);
+		while (g->ring_head - g->ring_tail == MAILBOX_RING) {
+			reclaim_Ring(g);
+			if (g->ring_head - g->ring_tail < MAILBOX_RING) break;
+			/*I cursori piu` lenti appartengono a mailbox che stanno inviando:
+			 * si attende che i corrieri li facciano avanzare*/
+			clock_gettime(CLOCK_REALTIME, &ts);
+			if ((ts.tv_nsec += 1000000) >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			g->ring_waiters++;
+			(void) pthread_cond_timedwait(&g->ring_cond, &g->ring_mtx, &ts);
+			g->ring_waiters--;
+		}
+		slot = g->ring + (g->ring_head % MAILBOX_RING);
+		slot->msg = s;
+		slot->orig = orig;
+		slot->flow = flow;
+		__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+		if (orig != NULL) __atomic_add_fetch(&orig->refs, 1, __ATOMIC_RELAXED);
+		/*La posizione e` pronta prima che i cursori possano raggiungerla*/
+		__atomic_store_n(&g->ring_head, g->ring_head + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&g->ring_mtx);
+	/*Ogni corriere affidera` a se stesso le mailbox che leggono l'anello*/
+	for (i = 0; i < g->size; i++)
+		(void) write(g->couriers[i].wakefd, &one, sizeof(one));
+	return 0;
+}
+
+void hook_Ring(courier_group *g, ring_hook hook) {
+	if (g == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	g->hook = hook;
+}
+
+void user_Mailbox(mailbox *mb, void *user) {
+	if (mb == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	pthread_mutex_lock(&mb->mtx);
+		mb->user = user;
+	pthread_mutex_unlock(&mb->mtx);
+}
+
+void window_Mailbox(mailbox *mb, int window) {
+	if (mb == NULL || window < 0) {
+		errno = EINVAL;
+		return;
+	}
+	pthread_mutex_lock(&mb->mtx);
+		mb->credits = window;
+	pthread_mutex_unlock(&mb->mtx);
+}
+
+void pack_Mailbox(mailbox *mb) {
+	if (mb == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	pthread_mutex_lock(&mb->mtx);
+		mb->packed = 1;
+	pthread_mutex_unlock(&mb->mtx);
+}
+
+void packet_Mailbox(mailbox *mb) {
+	if (mb == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	pthread_mutex_lock(&mb->mtx);
+		mb->packet = 1;
+	pthread_mutex_unlock(&mb->mtx);
+}
+
+void version_Mailbox(mailbox *mb, int version) {
+	if (mb == NULL || version < 1) {
+		errno = EINVAL;
+		return;
+	}
+	pthread_mutex_lock(&mb->mtx);
+		mb->version = version;
+	pthread_mutex_unlock(&mb->mtx);
+}
+
+void credit_Mailbox(mailbox *mb, int n) {
+	if (mb == NULL || n <= 0) return;
+	pthread_mutex_lock(&mb->mtx);
+	if (mb->credits >= 0) {
+		mb->credits += n;
+		/*I messaggi rimasti in attesa dei crediti possono ripartire*/
+		if ((mb->flows != NULL || (mb->reader && mb->cursor < ring_Head(mb->group))) &&
+			!mb->broken && !mb->closed)
+			schedule_Mailbox(mb);
+	}
+	pthread_mutex_unlock(&mb->mtx);
+}
+
+void shutdown_Mailbox(mailbox *mb) {
+	if (mb == NULL) return;
+	leave_Ring(mb, 1);
+	pthread_mutex_lock(&mb->mtx);
+		mb->closing = 1;
+		/*Se il corriere ha ancora messaggi da inviare, lo shutdown spetta a lui*/
+		if (!mb->scheduled && mb->fd >= 0) shutdown(mb->fd, SHUT_RDWR);
+	pthread_mutex_unlock(&mb->mtx);
+}
+
+void close_Mailbox(mailbox **mb, int close_fd) {
+	mailbox *m;
+	if (mb == NULL || (m = *mb) == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	leave_Ring(m, 0);
+	pthread_mutex_lock(&m->mtx);
+	m->closed = 1;
+	if (m->closing && m->scheduled && !m->broken) {
+		/*Il corriere ha ancora messaggi da inviare prima della chiusura*/
+		m->owns_fd = close_fd;
+		pthread_mutex_unlock(&m->mtx);
+	} else {
+		m->broken = 1;
+		drop_Frames(m);
+		if (m->fd >= 0) {
+			(void) epoll_ctl(m->owner->epfd, EPOLL_CTL_DEL, m->fd, NULL);
+			if (close_fd) closeSocket(m->fd);
+		}
+		m->fd = -1;
+		pthread_mutex_unlock(&m->mtx);
+	}
+	release_Mailbox(m);
+	*mb = NULL;
+}
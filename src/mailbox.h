@@ -0,0 +1,415 @@
+/**
+   \file mailbox.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  code di uscita delle connessioni, svuotate da thread di consegna.
+
+Chi invia un messaggio a un utente lo accoda alla sua mailbox e ritorna
+subito, anche se il buffer della socket del destinatario è pieno. Ogni
+mailbox appartiene a un corriere: un thread che invia i messaggi accodati
+raccogliendone il più possibile in una sola sendmsg (scrittura vettoriale
+non bloccante) e, se la socket non accetta altri byte, attende con epoll
+che torni scrivibile.
+
+Il corriere adatta una finestra di raccolta al carico: quando ogni giro di
+invii trova molti messaggi attende qualche microsecondo prima del giro
+successivo, così che ogni sendmsg ne raccolga di più; a basso carico la
+finestra torna a zero e i messaggi partono immediatamente.
+
+I messaggi non vengono inviati nell'ordine in cui sono accodati. Quelli
+di controllo (MSG_EXIT, MSG_ERROR, le risposte a MSG_LIST) hanno una
+corsia prioritaria e partono prima di ogni altro; gli altri sono divisi
+per mittente e serviti a turno (deficit round robin): a ogni turno un
+mittente riceve un credito di MAILBOX_QUANTUM byte e invia messaggi
+finché il credito li copre. Chi inonda un destinatario allunga quindi
+soltanto la propria coda, non quella degli altri mittenti. I messaggi
+dello stesso mittente restano nell'ordine di arrivo. Dalle code i
+messaggi passano, al più MAILBOX_BATCH alla volta, nella lista di quelli
+scelti per l'invio, da cui li prende sendmsg.
+
+Se il client ha negoziato una finestra (vedi credit.h) la mailbox ne
+tiene i crediti: i messaggi di controllo partono comunque, gli altri solo
+finché restano crediti, e in attesa dei successivi si accumulano nella
+mailbox.
+
+I broadcast non vengono accodati a ogni mailbox: sono pubblicati una
+sola volta in un anello condiviso dal gruppo di corrieri, che ogni
+mailbox iscritta legge con un proprio cursore. Il corriere porta nella
+mailbox solo i broadcast che servono ai prossimi invii (nella coda del
+loro mittente, come gli altri messaggi); gli altri restano nell'anello
+senza occupare la mailbox. Un messaggio accodato direttamente prende
+prima i broadcast già pubblicati, così che l'ordine dei messaggi di un
+mittente non cambi. Una posizione dell'anello si libera quando tutti i
+cursori l'hanno superata: se l'anello è pieno, le mailbox rimaste
+indietro di metà anello perché il client non legge ricevono subito tutti
+i loro broadcast, che contano nei limiti descritti sotto; se invece le
+più lente stanno ancora inviando, chi pubblica attende che avanzino.
+Chi pubblica non sa quali mailbox riceveranno il broadcast: l'esito di
+ciascuna (come quello di post_Mailbox) va alla funzione fissata con
+hook_Ring quando la mailbox lo prende dall'anello. Gli esiti positivi le
+arrivano subito, dal thread che ha preso il broadcast (con i lock della
+mailbox); quelli negativi da un corriere, senza alcun lock, perché chi li
+riceve di solito scrive al mittente.
+
+Un utente che non legge non deve poter accumulare memoria senza limite:
+il gruppo di corrieri può fissare un massimo di messaggi e di byte per
+mailbox, con una politica applicata quando un nuovo messaggio lo supera:
+scartare i messaggi più vecchi (del mittente con più byte in attesa),
+scartare quello nuovo, disconnettere
+l'utente dopo avergli inviato un MSG_ERROR, oppure parcheggiare i messaggi
+in un file temporaneo da cui il corriere li riprende quando l'utente torna
+a leggere.
+ */
+#ifndef __MAILBOX_H
+#define __MAILBOX_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "comsock.h"
+#include "proto2.h"
+
+/** Numero massimo di messaggi raccolti in una sendmsg */
+#define MAILBOX_BATCH 32
+/** Messaggi inviati in un giro oltre i quali la finestra di raccolta cresce */
+#define MAILBOX_BUSY 64
+/** Messaggi inviati in un giro sotto i quali la finestra di raccolta cala */
+#define MAILBOX_IDLE 8
+/** Finestra di raccolta massima (microsecondi) */
+#define MAILBOX_WINDOW_MAX 1000
+/** Credito in byte aggiunto a ogni turno di un mittente */
+#define MAILBOX_QUANTUM 1024
+/** Numero di liste di trabocco della tabella dei mittenti di una mailbox */
+#define MAILBOX_FLOWS 16
+/** Broadcast contenuti nell'anello di un gruppo di corrieri */
+#define MAILBOX_RING 1024
+
+/** Politiche per le mailbox che superano i limiti */
+#define MAILBOX_DROP_OLDEST 0
+#define MAILBOX_DROP_NEWEST 1
+#define MAILBOX_DISCONNECT 2
+#define MAILBOX_PARK 3
+/** Numero di politiche */
+#define MAILBOX_POLICIES 4
+/** Messaggio inviato all'utente disconnesso da MAILBOX_DISCONNECT */
+#define MAILBOX_EVICTED "[ERROR] troppi messaggi in attesa di essere ricevuti: connessione chiusa dal server"
+
+struct courier;
+struct courier_group;
+
+/** <H3>Messaggio condiviso</H3>
+ * Un messaggio codificato una sola volta e accodato a piu` mailbox senza
+ * copiarne il buffer, che non va piu` modificato: \c refs conta chi lo
+ * usa ancora (il creatore e i messaggi accodati) e l'ultimo rilascio lo
+ * libera. \c packed e` la sua versione compressa (MSG_PACKED, buffer
+ * NULL se non c'e`), inviata al posto di \c msg alle mailbox che la
+ * accettano.
+ */
+typedef struct shared_msg {
+	message_t msg;
+	message_t packed;
+	int refs;
+} shared_msg;
+
+/** <H3>Messaggio accodato</H3>
+ * - \c header l'intestazione, nel formato della versione della mailbox
+ *   (replyHeader), \c header_size i suoi byte
+ * - \c body il buffer (terminato da '\\0' nella versione 1), \c body_size
+ *   i suoi byte
+ * - \c flow il mittente, NULL per i messaggi di controllo
+ * - \c shared il messaggio condiviso a cui appartiene \c body (NULL se
+ *   \c body e` una copia privata)
+ */
+typedef struct out_frame {
+	char header[PROTO_HEADER_SIZE];
+	int header_size;
+	char *body;
+	int body_size;
+	const void *flow;
+	shared_msg *shared;
+	struct out_frame *next;
+} out_frame;
+
+/** <H3>Broadcast nell'anello</H3>
+ * - \c msg il messaggio (l'anello ne tiene un riferimento)
+ * - \c orig il messaggio originale, passato con gli esiti (NULL: nessun
+ *   esito; l'anello ne tiene un riferimento)
+ * - \c flow il mittente
+ */
+typedef struct {
+	shared_msg *msg;
+	shared_msg *orig;
+	const void *flow;
+} ring_slot;
+
+/** Esito della consegna di un broadcast dell'anello a una mailbox
+ * \param orig il messaggio originale (publish_Ring)
+ * \param flow il mittente
+ * \param user il destinatario (user_Mailbox)
+ * \param result come post_Mailbox; SEOF anche se la mailbox non accettava
+ *        piu` messaggi quando e` arrivata al broadcast */
+typedef void (*ring_hook)(shared_msg *orig, const void *flow, void *user, int result);
+
+/** <H3>Esito negativo in attesa di un corriere</H3>
+ * I campi sono gli argomenti di ring_hook; la notifica tiene un
+ * riferimento a \c orig.
+ */
+typedef struct ring_notice {
+	shared_msg *orig;
+	const void *flow;
+	void *user;
+	int result;
+	struct ring_notice *next;
+} ring_notice;
+
+/** <H3>Coda di un mittente</H3>
+ * - \c key il mittente
+ * - \c head, \c tail i suoi messaggi non ancora scelti, \c bytes i loro byte
+ * - \c deficit il credito residuo del turno
+ * - \c next la coda successiva nel giro, \c hnext nella lista di trabocco
+ */
+typedef struct out_flow {
+	const void *key;
+	out_frame *head;
+	out_frame *tail;
+	long bytes;
+	long deficit;
+	struct out_flow *next;
+	struct out_flow *hnext;
+} out_flow;
+
+/** <H3>Mailbox di una connessione</H3>
+ * - \c fd la socket
+ * - \c head, \c tail i messaggi scelti per l'invio (\c wired), nell'ordine
+ *   in cui vanno scritti; \c offset i byte di head già inviati
+ * - \c ctl_head, \c ctl_tail la corsia dei messaggi di controllo
+ * - \c flows, \c flows_tail il giro delle code dei mittenti con messaggi in
+ *   attesa, \c buckets le stesse code indicizzate per mittente
+ * - \c frames, \c bytes i messaggi e i byte accodati (in tutte le code)
+ * - \c credits i messaggi non di controllo che il client accetta ancora
+ *   (-1: nessuna finestra)
+ * - \c packed 1 se il client accetta i messaggi condivisi compressi
+ * - \c version il formato dei messaggi: 1 (quello di sendMessage) o
+ *   PROTO_VERSION (sendReply, proto2.h)
+ * - \c packet 1 se la socket e` SOCK_SEQPACKET (packet.h)
+ * - \c scheduled 1 se la mailbox è affidata al suo corriere (pronta o in
+ *   attesa che la socket torni scrivibile): il corriere ne tiene un riferimento
+ * - \c armed 1 se il corriere attende che la socket torni scrivibile
+ * - \c closing 1 se dopo l'ultimo messaggio la socket va chiusa (shutdown)
+ * - \c broken 1 se la socket non accetta più messaggi
+ * - \c closed 1 se la mailbox è stata chiusa e non accetta più messaggi
+ * - \c owns_fd 1 se, chiusa la mailbox, spetta al corriere chiudere la socket
+ * - \c evicted 1 se l'utente e` stato disconnesso da MAILBOX_DISCONNECT
+ * - \c spill_fd il file dei messaggi parcheggiati (-1 se non ancora creato),
+ *   \c spill_frames quanti sono, \c spill_read e \c spill_write le
+ *   posizioni di lettura e scrittura nel file
+ * - \c reader 1 se la mailbox legge l'anello dei broadcast, \c cursor il
+ *   prossimo broadcast da leggere, \c ring_prev e \c ring_next le altre
+ *   mailbox del corriere che lo leggono
+ * - \c user il destinatario, per gli esiti dei broadcast (user_Mailbox)
+ * - \c refs i riferimenti alla mailbox
+ */
+typedef struct mailbox {
+	int fd;
+	out_frame *head;
+	out_frame *tail;
+	int wired;
+	int offset;
+	out_frame *ctl_head;
+	out_frame *ctl_tail;
+	out_flow *flows;
+	out_flow *flows_tail;
+	out_flow *buckets[MAILBOX_FLOWS];
+	int frames;
+	long bytes;
+	long credits;
+	int packed;
+	int version;
+	int packet;
+	int scheduled;
+	int armed;
+	int closing;
+	int broken;
+	int closed;
+	int owns_fd;
+	int evicted;
+	int spill_fd;
+	int spill_frames;
+	long spill_read;
+	long spill_write;
+	int reader;
+	long cursor;
+	struct mailbox *ring_prev;
+	struct mailbox *ring_next;
+	void *user;
+	int refs;
+	pthread_mutex_t mtx;
+	struct courier *owner;
+	struct courier_group *group;
+	struct mailbox *next_ready;
+} mailbox;
+
+/** <H3>Corriere</H3>
+ * - \c epfd istanza epoll per le socket non scrivibili, \c wakefd eventfd
+ *   per risvegliarlo quando una mailbox diventa pronta
+ * - \c ready_head, \c ready_tail le mailbox con messaggi da inviare
+ * - \c window la finestra di raccolta corrente (microsecondi)
+ * - \c readers le sue mailbox che leggono l'anello dei broadcast,
+ *   \c ring_seen i broadcast pubblicati quando le ha controllate l'ultima volta
+ */
+typedef struct courier {
+	int epfd;
+	int wakefd;
+	int stop;
+	mailbox *ready_head;
+	mailbox *ready_tail;
+	long window;
+	mailbox *readers;
+	long ring_seen;
+	struct courier_group *group;
+	pthread_mutex_t mtx;
+	pthread_t tid;
+} courier;
+
+/** <H3>Gruppo di corrieri</H3>
+ * - \c max_frames, \c max_bytes i limiti di ogni mailbox (0: nessun limite)
+ * - \c policy la politica applicata a chi li supera
+ * - \c fired[p] quante volte e` intervenuta la politica p: i messaggi
+ *   scartati o parcheggiati, gli utenti disconnessi
+ * - \c ring l'anello dei broadcast: \c ring_head e` il numero di broadcast
+ *   pubblicati, \c ring_tail il primo ancora da liberare; \c ring_mtx
+ *   protegge l'anello e le liste \c readers dei corrieri
+ * - \c ring_waiters quanti attendono su \c ring_cond che l'anello pieno
+ *   si liberi
+ * - \c hook la funzione che riceve gli esiti dei broadcast (NULL: nessuna);
+ *   \c notices, \c notices_tail gli esiti negativi in attesa di un
+ *   corriere, protetti da \c notice_mtx
+ */
+typedef struct courier_group {
+	courier *couriers;
+	int size;
+	unsigned int next;
+	int max_frames;
+	long max_bytes;
+	int policy;
+	long fired[MAILBOX_POLICIES];
+	pthread_mutex_t mtx;
+	ring_slot ring[MAILBOX_RING];
+	long ring_head;
+	long ring_tail;
+	int ring_waiters;
+	pthread_mutex_t ring_mtx;
+	pthread_cond_t ring_cond;
+	ring_hook hook;
+	ring_notice *notices;
+	ring_notice *notices_tail;
+	pthread_mutex_t notice_mtx;
+} courier_group;
+
+/** Crea un gruppo di n corrieri (non ancora avviati).
+ * \retval NULL in caso di errore (sets errno) */
+courier_group *initialize_Couriers(int n);
+
+/** Avvia un thread per ogni corriere.
+ * \retval 0 se tutto ok, -1 in caso di errore */
+int start_Couriers(courier_group *g);
+
+/** Ferma i corrieri: i messaggi non ancora inviati restano nelle mailbox. */
+void stop_Couriers(courier_group *g);
+
+/** Libera il gruppo (i corrieri devono essere fermi). */
+void free_Couriers(courier_group **g);
+
+/** Fissa i limiti delle mailbox del gruppo e la politica applicata a chi
+ * li supera (vale per le mailbox create in seguito).
+ * \param max_frames il massimo di messaggi accodati (0: nessun limite)
+ * \param max_bytes il massimo di byte accodati (0: nessun limite)
+ * \param policy una delle politiche MAILBOX_* */
+void set_MailboxLimits(courier_group *g, int max_frames, long max_bytes, int policy);
+
+/** Restituisce la politica di nome name ("drop-oldest", "drop-newest",
+ * "disconnect", "park"), -1 se non esiste. */
+int find_MailboxPolicy(const char *name);
+
+/** Scrive su f quante volte e` intervenuta ogni politica. */
+void report_Couriers(courier_group *g, FILE *f);
+
+/** Crea la mailbox della socket fd, affidata al prossimo corriere.
+ * \retval NULL in caso di errore (sets errno) */
+mailbox *open_Mailbox(courier_group *g, int fd);
+
+/** Accoda msg (che non viene modificato) alla mailbox, applicando la
+ * politica del gruppo se supera i limiti.
+ * \param flow il mittente (ne identifica la coda), NULL per un messaggio
+ *        di controllo
+ * \retval il numero di byte accodati (o parcheggiati)
+ * \retval SEOF se la socket non accetta più messaggi (anche perche` la
+ *         politica ha appena disconnesso l'utente)
+ * \retval -1 in caso di errore (sets errno; ENOBUFS se il messaggio e` stato
+ *         scartato da MAILBOX_DROP_NEWEST) */
+int post_Mailbox(mailbox *mb, message_t *msg, const void *flow);
+
+/** Crea un messaggio condiviso con il contenuto di msg, di cui prende il
+ * buffer (msg->buffer diventa NULL). Il chiamante ne tiene un riferimento.
+ * \retval NULL in caso di errore (sets errno) */
+shared_msg *share_Message(message_t *msg);
+
+/** Rilascia un riferimento a s: l'ultimo lo libera. */
+void release_Shared(shared_msg *s);
+
+/** Come post_Mailbox, ma la mailbox tiene un riferimento a s invece di
+ * copiarne il buffer. */
+int post_Shared(mailbox *mb, shared_msg *s, const void *flow);
+
+/** Iscrive mb all'anello dei broadcast del suo gruppo: ricevera` quelli
+ * pubblicati da ora in poi, finche` la mailbox non viene chiusa. */
+void join_Ring(mailbox *mb);
+
+/** Pubblica sull'anello di g il broadcast s, inviato senza copiarlo da
+ * tutte le mailbox iscritte (l'anello ne tiene un riferimento).
+ * \param orig il messaggio originale, passato agli esiti (NULL: nessun
+ *        esito); l'anello ne tiene un riferimento
+ * \param flow il mittente
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int publish_Ring(courier_group *g, shared_msg *s, shared_msg *orig, const void *flow);
+
+/** Gli esiti dei broadcast pubblicati su g andranno a hook (va fissata
+ * prima di avviare i corrieri). */
+void hook_Ring(courier_group *g, ring_hook hook);
+
+/** Il destinatario dei messaggi di mb, passato agli esiti dei broadcast
+ * (va fissato prima di join_Ring). */
+void user_Mailbox(mailbox *mb, void *user);
+
+/** Limita i messaggi non di controllo che la mailbox puo` inviare alla
+ * finestra concessa dal client (inizialmente la mailbox non ne ha). */
+void window_Mailbox(mailbox *mb, int window);
+
+/** La mailbox inviera` la versione compressa dei messaggi condivisi che
+ * ne hanno una (inizialmente invia sempre l'originale). */
+void pack_Mailbox(mailbox *mb);
+
+/** La socket della mailbox e` SOCK_SEQPACKET: ogni messaggio parte nel
+ * suo datagramma, con sendmmsg invece di sendmsg, e quelli piu` lunghi di
+ * PACKET_MAX vengono rifiutati (EMSGSIZE). */
+void packet_Mailbox(mailbox *mb);
+
+/** La mailbox inviera` i messaggi nel formato della versione version
+ * (inizialmente in quello di sendMessage): va fissata prima di accodarne. */
+void version_Mailbox(mailbox *mb, int version);
+
+/** Aggiunge n crediti restituiti dal client, riprendendo gli invii. */
+void credit_Mailbox(mailbox *mb, int n);
+
+/** Chiede che la socket venga chiusa (shutdown) dopo l'invio dei messaggi
+ * già accodati, compresi i broadcast già pubblicati. */
+void shutdown_Mailbox(mailbox *mb);
+
+/** Chiude la mailbox, che non accetta altri messaggi. Se era stata chiesta
+ * la chiusura della socket (shutdown_Mailbox) il corriere invia prima i
+ * messaggi accodati; altrimenti vengono scartati.
+ * \param close_fd 1 se la socket va chiusa (close): subito, oppure dal
+ *        corriere dopo l'ultimo messaggio. Nel secondo caso il chiamante non
+ *        deve più usarla. */
+void close_Mailbox(mailbox **mb, int close_fd);
+
+#endif
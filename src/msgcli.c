@@ -10,11 +10,17 @@
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 
 #include "comsock.h"
 #include "genList.h"
 #include "genHash.h"
 #include "errors.h"
+#include "credit.h"
+#include "presence.h"
+#include "userid.h"
+#include "proto2.h"
+#include "packet.h"
 
 /*Formato con il quale l'errore deve essere stampato a schermo*/
 #define ERR_FORMAT "[ERROR] %s"
@@ -38,6 +44,84 @@ static int exit_received = 0;
 static pthread_mutex_t term_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int stop = 0;
 static int socket_descriptor = 0;
+/*Crediti per i messaggi da inviare al server e per quelli ricevuti*/
+static credit_t send_credit;
+static credit_t recv_credit;
+/*Versione degli utenti connessi vista dopo l'iscrizione con %WHO*/
+static presence_t presence;
+/*Identificativi degli utenti, con cui si indirizzano i %ONE (vuota finche`
+ * il server non la invia)*/
+static userid_map user_ids;
+static pthread_mutex_t ids_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*Mutex per le scritture sulla socket, fatte sia da input sia da output*/
+static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*Millisecondi tra due MSG_PING inviati al server (0: nessun battito) e di
+ * silenzio del server dopo i quali lo si considera caduto (0: mai)*/
+static int heartbeat_interval = 0;
+static int idle_timeout = 0;
+/*Tratti della versione 2 del protocollo accettati dal server (-1: i
+ * messaggi viaggiano nel formato della versione 1)*/
+static int proto_features = -1;
+/*1 se la socket e` SOCK_SEQPACKET (opzione -s del server)*/
+static int packet_mode = 0;
+
+/** Invia msg al server nel formato del protocollo negoziato, comprimendo
+ * i testi lunghi se il server lo accetta.
+ * \retval come sendMessage */
+int sendWire(int socket, message_t *msg) {
+	/*Il server chiuderebbe la connessione al datagramma troncato*/
+	if (packet_mode && msg->length >= PACKET_MAX-PROTO_HEADER_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (proto_features < 0) return sendMessage(socket, msg);
+	return sendFrame2(socket, msg, (proto_features & PROTO_PACK) ? PACK_THRESHOLD : 0);
+}
+
+/** Riceve un messaggio dal server nel formato del protocollo negoziato,
+ * con una sola recvmsg se la socket e` SOCK_SEQPACKET.
+ * \retval come receiveMessage */
+int receiveWire(int socket, message_t *msg) {
+	if (packet_mode) return receivePacket(socket, msg, (proto_features >= 0) ? PROTO_VERSION : 1);
+	return (proto_features >= 0) ? receiveReply(socket, msg) : receiveMessage(socket, msg);
+}
+
+/** Invia msg al server in mutua esclusione con gli altri invii.
+ * \retval come sendMessage */
+int sendLocked(int socket, message_t *msg) {
+	int r;
+	pthread_mutex_lock(&send_mutex);
+		r = sendWire(socket, msg);
+	pthread_mutex_unlock(&send_mutex);
+	return r;
+}
+
+/** Mostra un evento di presenza ricevuto dal server; se ne sono andati
+ * persi, chiede al server una nuova istantanea.
+ * \param socket la socket su cui inviare la richiesta
+ * \param msg il MSG_PRESENCE ricevuto
+ * */
+void showPresence(int socket, message_t *msg) {
+	message_t resync;
+	unsigned long version;
+	char event, *names;
+	if (parsePresence(msg, &event, &version, &names) == -1) return;
+	switch (apply_Presence(&presence, event, version)) {
+		case 1:
+			if (event == PRESENCE_SNAPSHOT)
+				fprintf(stdout, "[PRESENCE] connessi: %s\n", names);
+			else
+				fprintf(stdout, "[PRESENCE] %s si e' %s\n", names, (event == PRESENCE_JOIN) ? "connesso" : "disconnesso");
+			fflush(stdout);
+			break;
+		case -1:
+			resync.type = MSG_PRESENCE;
+			resync.buffer = NULL;
+			resync.length = 0;
+			(void) sendLocked(socket, &resync);
+			break;
+	}
+}
 
 /** La funzione message_to_server si occupa di interpretare una stringa
  * inserita da standard input trasformandola in una struttura di tipo
@@ -48,9 +132,9 @@ static int socket_descriptor = 0;
  * 	\return message_t il messaggio da inviare
  * */
 message_t * message_to_server(char *message, int length) {
-	char message_types[3] = {MSG_TO_ONE, MSG_EXIT, MSG_LIST};
-	char *message_command[3], *buffer;
-	int command_number = 3, message_empty[3] = {0, 1, 1};
+	char message_types[4] = {MSG_TO_ONE, MSG_EXIT, MSG_LIST, MSG_PRESENCE};
+	char *message_command[4], *buffer;
+	int command_number = 4, message_empty[4] = {0, 1, 1, 1};
 	/*message_empty contiene 1 se il messaggio in questione deve essere vuoto*/
 	message_t *msg = NULL;
 	if (message == NULL || length < 0) {
@@ -66,6 +150,7 @@ message_t * message_to_server(char *message, int length) {
 	message_command[0] = "%ONE";
 	message_command[1] = "%EXIT";
 	message_command[2] = "%LIST";
+	message_command[3] = "%WHO";
 	
 	msg = Malloc(sizeof(message_t));
 	msg->length = 0;
@@ -95,6 +180,7 @@ message_t * message_to_server(char *message, int length) {
 			fprintf(stderr, ERR_FORMAT, "il comando inserito non e' valido\n");
 			fprintf(stderr, "Comandi disponibili:\n");
 			fprintf(stderr, "%%LIST\t -> mostra la lista degli utenti connessi\n");
+			fprintf(stderr, "%%WHO\t -> mostra gli utenti connessi e poi chi si connette e disconnette\n");
 			fprintf(stderr, "%%ONE nomeutente messaggio\t -> invia un messaggio a 'nomeutente'\n");
 			fprintf(stderr, "%%EXIT\t -> uscita dall'applicazione\n");
 			fprintf(stderr, "Il testo inserito normalmente verra' inviato a tutti gli utenti connessi\n\n");
@@ -212,7 +298,24 @@ void input(int *socket) {
 			if (msg_length < BUFFER_SIZE-1 || string[BUFFER_SIZE-2] == '\n') {
 				msg = message_to_server(buffer, long_msg_size+msg_length-1);
 				if (msg != NULL) {
-					if(sendMessage(*socket, msg) == -1) {
+					long id;
+					/*Se il server ha inviato la mappa, il destinatario si indica per
+					 * identificativo (nella versione 2, se il server lo accetta)*/
+					if (msg->type == MSG_TO_ONE && (proto_features < 0 || (proto_features & PROTO_BY_ID))) {
+						pthread_mutex_lock(&ids_mutex);
+							id = find_UserId(&user_ids, msg->buffer);
+						pthread_mutex_unlock(&ids_mutex);
+						if (id >= 0) (void) addressById(msg, id);
+					}
+					/*Senza crediti si attende che il server ne restituisca*/
+					if (msg->type != MSG_EXIT && msg->type != MSG_PRESENCE &&
+						acquire_Credit(&send_credit) == -1) {
+						free(msg->buffer);
+						free(msg);
+						pthread_mutex_lock(&term_mutex);
+						break;
+					}
+					if(sendLocked(*socket, msg) == -1) {
 						perror("msgcli, input");
 						free(msg->buffer);
 						free(msg);
@@ -270,7 +373,7 @@ void input(int *socket) {
 		msg->type = MSG_EXIT;
 		msg->length = 0;
 		msg->buffer = NULL;
-		switch(sendMessage(*socket, msg)) {
+		switch(sendLocked(*socket, msg)) {
 			case -1:
 				perror("msgcli, input");
 				exit(EXIT_FAILURE);
@@ -298,8 +401,8 @@ void input(int *socket) {
  **/
 void* output(void *s) {
 	int *user_socket = NULL;
-	message_t *msg;
-	int res = 0;
+	message_t *msg, credit;
+	int res = 0, n;
 	if ((user_socket = s) == NULL || *user_socket <= 0) {
 		errno = EINVAL;
 		perror("msgcli, output");
@@ -311,22 +414,64 @@ void* output(void *s) {
 	pthread_mutex_lock(&term_mutex);
 	while(!stop) {
 	pthread_mutex_unlock(&term_mutex);
-		if ((res = receiveMessage(*user_socket, msg)) >= 0) {
+		if ((res = receiveWire(*user_socket, msg)) >= 0) {
+			/*Un messaggio compresso si gestisce come l'originale*/
+			if (msg->type == MSG_PACKED && unpackMessage(msg) == -1) {
+				fprintf(stderr, ERR_FORMAT, "messaggio compresso non valido\n");
+				free(msg->buffer);
+				pthread_mutex_lock(&term_mutex);
+				continue;
+			}
 			if (msg->type == MSG_EXIT) {
 				pthread_mutex_lock(&term_mutex);
 				exit_received = 1;
 				break;
 			}
+			if (msg->type == MSG_CREDIT) {
+				grant_Credit(&send_credit, creditValue(msg));
+				free(msg->buffer);
+				pthread_mutex_lock(&term_mutex);
+				continue;
+			}
+			if (msg->type == MSG_USERIDS) {
+				pthread_mutex_lock(&ids_mutex);
+					free_UserIds(&user_ids);
+					(void) load_UserIds(&user_ids, msg);
+				pthread_mutex_unlock(&ids_mutex);
+				free(msg->buffer);
+				pthread_mutex_lock(&term_mutex);
+				continue;
+			}
+			if (msg->type == MSG_PRESENCE) {
+				showPresence(*user_socket, msg);
+				free(msg->buffer);
+				pthread_mutex_lock(&term_mutex);
+				continue;
+			}
 			fprintf(stdout, "%s\n", msg->buffer);
-			free(msg->buffer);
 			fflush(stdout);
+			/*Restituiamo al server i crediti dei messaggi letti*/
+			if ((msg->type == MSG_TO_ONE || msg->type == MSG_BCAST) &&
+				(n = consume_Credit(&recv_credit)) > 0 &&
+				buildCredit(&credit, MSG_CREDIT, n) == 0) {
+				(void) sendLocked(*user_socket, &credit);
+				free(credit.buffer);
+			}
+			free(msg->buffer);
 		} else {
+			/*Con SO_RCVTIMEO un errore di lettura e` quasi sempre il suo
+			 * scadere (errno non lo dice: perror in receiveMessage lo
+			 * sovrascrive): nemmeno i MSG_PING del server arrivano piu`*/
+			if (res == -1 && idle_timeout > 0)
+				fprintf(stderr, ERR_FORMAT, "Il server non risponde. \n");
 			pthread_mutex_lock(&term_mutex);
 			break;
 		}
 		pthread_mutex_lock(&term_mutex);
 	}
 	pthread_mutex_unlock(&term_mutex);
+	/*Chi attende crediti non ne ricevera` altri*/
+	close_Credit(&send_credit);
 
 	pthread_mutex_lock(&term_mutex);
 	if (!exit_sent) {
@@ -352,6 +497,35 @@ void* output(void *s) {
 	pthread_exit((void *) &res);
 }
 
+/** Thread che invia un MSG_PING al server ogni heartbeat_interval
+ * millisecondi, cosi` che il server sappia che il client e` vivo anche
+ * quando l'utente non scrive nulla.
+ * \param s il fd della socket
+ **/
+void *heartbeat(void *s) {
+	int *user_socket = s;
+	message_t ping;
+	struct timespec pause;
+	ping.type = MSG_PING;
+	ping.length = 0;
+	ping.buffer = NULL;
+	pause.tv_sec = heartbeat_interval / 1000;
+	pause.tv_nsec = (long) (heartbeat_interval % 1000) * 1000000;
+	pthread_mutex_lock(&term_mutex);
+	while (!stop) {
+	pthread_mutex_unlock(&term_mutex);
+		/*nanosleep e` un punto di cancellazione*/
+		nanosleep(&pause, NULL);
+		if (sendLocked(*user_socket, &ping) == -1) {
+			pthread_mutex_lock(&term_mutex);
+			break;
+		}
+		pthread_mutex_lock(&term_mutex);
+	}
+	pthread_mutex_unlock(&term_mutex);
+	return NULL;
+}
+
 /** Procedura che riceve i segnali di terminazione (SIGTERM e SIGSTOP)
  * e avvia la conclusione "dolce" del programma. */
 static void manageTerm(int signum) {
@@ -362,28 +536,46 @@ static void manageTerm(int signum) {
 		msg.type = MSG_EXIT;
 		msg.length = 0;
 		msg.buffer = NULL;
-		(void) sendMessage(socket_descriptor, &msg);
+		(void) sendWire(socket_descriptor, &msg);
 		exit_sent = 1;
 	}
 	pthread_mutex_unlock(&term_mutex);
 }
 
 int main (int argc, char* argv[]) {
-	int i = 0, username_length = 0;
-	char *username = NULL;
+	int i = 0, opt;
+	char *username = NULL, *colon;
 	message_t *connection = NULL;
 	int *res = NULL;
 	struct sigaction act;
 	sigset_t set;
-	pthread_t output_id = 0;
+	pthread_t output_id = 0, heartbeat_id = 0;
+	struct timeval silence;
 	
-	if (argv == NULL || argv[1] == NULL || argc != 2) {
+	while ((opt = getopt(argc, argv, "i:s")) != -1) {
+		if (opt == 's') {
+			packet_mode = 1;
+			continue;
+		}
+		if (opt != 'i') {
+			printf("Sintassi corretta: msgcli [-i intervallo[:silenzio]] [-s] username\n");
+			return -1;
+		}
+		/*-i intervallo[:silenzio], in millisecondi*/
+		heartbeat_interval = atoi(optarg);
+		idle_timeout = ((colon = strchr(optarg, ':')) != NULL) ? atoi(colon+1) : 0;
+		if (heartbeat_interval <= 0 || idle_timeout < 0) {
+			printf("L'intervallo dei battiti deve essere positivo\n");
+			return -1;
+		}
+	}
+	if (argc - optind != 1) {
 		printf("È richiesto un parametro\n");
-		printf("Sintassi corretta: msgcli username\n");
+		printf("Sintassi corretta: msgcli [-i intervallo[:silenzio]] [-s] username\n");
 		return -1;
 	}
 	
-	username = argv[1];
+	username = argv[optind];
 	
 	/**Controlliamo che lo username inserito sia valido.*/
 	i = 0;
@@ -405,7 +597,6 @@ int main (int argc, char* argv[]) {
 		exit(EXIT_FAILURE);
 	}
 	
-	username_length = i+1;
 	bzero(&act, sizeof(act));
 	act.sa_handler = SIG_IGN;
 	if (sigaction(SIGPIPE, &act, NULL) != 0) {
@@ -425,7 +616,8 @@ int main (int argc, char* argv[]) {
 	
 	/** Inizio protocollo di connessione:*/
 	for (i = 0; i < MAX_CONN_ATTEMPT; i++) {
-		if ((socket_descriptor = openConnection(SERVER_SOCKET)) != -1)
+		if ((socket_descriptor = (packet_mode) ? openPacketConnection(SERVER_SOCKET) :
+			openConnection(SERVER_SOCKET)) != -1)
 			break;
 		else 
 			if (i == 0)
@@ -442,12 +634,15 @@ int main (int argc, char* argv[]) {
 		exit(EXIT_FAILURE);
 	}
 	if (i != 0) printf("\nConnessione stabilita.\n");
-	/** Creazione di MSG_CONNECT*/
+	/** Creazione di MSG_CONNECT, che propone la finestra per i messaggi
+	 * che riceveremo e la versione 2 del protocollo, con i battiti se
+	 * richiesti: solo allora il server ci disconnette se taciamo. Non
+	 * proponiamo PROTO_PIPELINE: un server della versione 1 leggerebbe male
+	 * cio` che precede MSG_OK, quindi lo attendiamo sempre*/
 	connection = Malloc(sizeof(message_t));
-	connection->buffer = Malloc(sizeof(char)*(username_length+1));
-	strncpy(connection->buffer, username, username_length+1);
-	connection->type = MSG_CONNECT;
-	connection->length = username_length;
+	buildConnect(connection, username, CREDIT_WINDOW);
+	proposeProto(connection, PROTO_BY_ID | PROTO_PACK |
+		((heartbeat_interval > 0) ? PROTO_HEARTBEAT : 0));
 
 	/** Invio di MSG_CONNECT*/
 	if (sendMessage(socket_descriptor, connection) == -1) {
@@ -458,7 +653,7 @@ int main (int argc, char* argv[]) {
 	free(connection->buffer);
 	
 	/** Attendiamo risposta dal server.*/
-	receiveMessage(socket_descriptor, connection);
+	receiveWire(socket_descriptor, connection);
 	if (connection->type == MSG_ERROR) {
 		fprintf(stdout, "%s\n", connection->buffer);
 		free(connection->buffer);
@@ -473,16 +668,41 @@ int main (int argc, char* argv[]) {
 		fflush(stderr);
 		exit(EXIT_FAILURE);
 	}
+	/*Un MSG_OK vuoto indica che il server non usa il controllo di flusso*/
+	initialize_Credit(&send_credit, creditValue(connection));
+	initialize_Credit(&recv_credit, (send_credit.window > 0) ? CREDIT_WINDOW : 0);
+	initialize_Presence(&presence);
+	if ((proto_features = okProto(connection)) < 0)
+		fprintf(stderr, ERR_FORMAT, "il server non supporta la versione 2 del protocollo\n");
 	free(connection->buffer);
+	/*Il formato dei messaggi si conosce solo ora, con MSG_OK: un server
+	 * della versione 1 leggerebbe male un messaggio inviato prima. La mappa
+	 * degli identificativi arrivera` al thread di output*/
+	connection->type = MSG_USERIDS;
+	connection->buffer = NULL;
+	connection->length = 0;
+	(void) sendWire(socket_descriptor, connection);
 	free(connection);
 	connection = NULL;
 	
 	/** Il client si specializza in due thread, uno che legga i messaggi da 
 	 * inviare, e l'altro che riceva..*/
+	/*Un server con i battiti attivi scrive almeno ogni suo intervallo:
+	 * oltre silenzio millisecondi senza nulla, la lettura fallisce*/
+	if (idle_timeout > 0) {
+		silence.tv_sec = idle_timeout / 1000;
+		silence.tv_usec = (long) (idle_timeout % 1000) * 1000;
+		if (setsockopt(socket_descriptor, SOL_SOCKET, SO_RCVTIMEO, &silence, sizeof(silence)) == -1)
+			perror("msgcli");
+	}
 	if(pthread_create(&output_id, NULL, &output, &socket_descriptor) == -1) {
 		perror("msgcli");
 		exit(EXIT_FAILURE);
 	}
+	if (heartbeat_interval > 0 && pthread_create(&heartbeat_id, NULL, &heartbeat, &socket_descriptor) != 0) {
+		perror("msgcli");
+		exit(EXIT_FAILURE);
+	}
 	/**Svuotiamo la maschera.*/
 	sigemptyset(&set);
 	pthread_sigmask(SIG_SETMASK, &set, NULL);
@@ -493,6 +713,10 @@ int main (int argc, char* argv[]) {
 	
 		
 	pthread_join(output_id, (void *) &res);
+	if (heartbeat_interval > 0) {
+		pthread_cancel(heartbeat_id);
+		pthread_join(heartbeat_id, NULL);
+	}
 	closeSocket(socket_descriptor);
 	
 	fflush(NULL);
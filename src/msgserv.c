@@ -3,6 +3,8 @@
 * 	\author Alessandro Lenzi, Mat. N° 438142, aless.lenzi@gmail.com
 *   \brief il server che gestisce gli utenti del progetto MSG
 */
+/*accept4*/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,12 +17,37 @@
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <limits.h>
+#include <stdint.h>
+#include <arpa/inet.h>
 
 #include "comsock.h"
 #include "genList.h"
 #include "genHash.h"
 #include "errors.h"
 #include "messagebuffer.h"
+#include "eventloop.h"
+#include "asyncsock.h"
+#include "uring.h"
+#include "workpool.h"
+#include "spsc.h"
+#include "coro.h"
+#include "stage.h"
+#include "mailbox.h"
+#include "credit.h"
+#include "cowset.h"
+#include "presence.h"
+#include "userid.h"
+#include "registry.h"
+#include "bloom.h"
+#include "handshake.h"
+#include "timerwheel.h"
+#include "proto2.h"
+#include "packet.h"
 
 /** Impostazioni per i messaggi*/
 /** Formato MSG_TO_ONE */
@@ -40,6 +67,9 @@
 #define ERR_FORMAT "[ERROR] %s: %s"
 /** Caratteri ulteriori necessari per MSG_ERROR */
 #define ERR_FC 10
+/** Spazio per il nome "#id" con cui gli errori indicano un identificativo
+ * inesistente */
+#define USERID_NAME 24
 
 /** Impostazioni per il file di log*/
 /** Modalità apertura del log file */
@@ -58,28 +88,328 @@
 #define STRICT 1
 /** Indirizzo Socket */
 #define SOCKET "./tmp/msgsock"
-/** Costante aggiunta */
-#define ADD 1
-/** Costante rimozione */
-#define REMOVE 0
+
+/** Impostazioni delle modalità del server*/
+/** Modalità un thread per utente */
+#define MODE_THREAD 0
+/** Modalità event loop (epoll) */
+#define MODE_EPOLL 1
+/** Modalità io_uring (ripiega su MODE_EPOLL se il kernel non la supporta) */
+#define MODE_URING 2
+/** Modalità thread-per-core: ogni shard possiede un sottoinsieme degli utenti */
+#define MODE_SHARD 3
+/** Modalità a coroutine: un worker per utente, eseguito come coroutine */
+#define MODE_CORO 4
+/** Capacità delle code tra shard */
+#define SHARD_QUEUE 1024
+/** Elementi scambiati tra shard: nuova connessione (dal dispatcher) */
+#define SHARD_CONNECT 0
+/** Elementi scambiati tra shard: messaggio per un utente dello shard */
+#define SHARD_DELIVER 1
+/** Elementi scambiati tra shard: broadcast per gli utenti dello shard */
+#define SHARD_BCAST 2
+/** Elementi scambiati tra shard: errore da notificare a un utente dello shard */
+#define SHARD_ERROR 3
+/** Messaggi gestiti al massimo da un event loop per ogni risveglio di una connessione */
+#define LOOP_BURST 16
+/** Connessioni accettate al massimo da un dispatcher prima di servire quelle in attesa */
+#define ACCEPT_BURST 64
+/** Durata in millisecondi di un tick della ruota dei battiti */
+#define HEARTBEAT_TICK 100
+/** Invii di un broadcast sottomessi insieme all'anello in modalità MODE_URING */
+#define FANOUT_BATCH 64
+/** Dimensione dei blocchi di record scritti nel log in modalità MODE_URING */
+#define LOG_CHUNK 65536
+/** Destinatari di un broadcast affidati a ciascun task del pool */
+#define BCAST_CHUNK 32
+/** Formato di una socket: il client riceve i messaggi nella versione 2 */
+#define WIRE_V2 0x1
+/** Formato di una socket: il client riceve i messaggi compressi */
+#define WIRE_PACKED 0x2
+/** Formato di una socket: il client ha negoziato i battiti (PROTO_HEARTBEAT) */
+#define WIRE_BEATS 0x4
+/** Numero di stadi della pipeline dei messaggi */
+#define PIPE_STAGES 5
+/** Indici degli stadi della pipeline */
+#define PIPE_DECODE 0
+#define PIPE_ROUTE 1
+#define PIPE_FORMAT 2
+#define PIPE_DELIVER 3
+#define PIPE_LOG 4
+/** Tipi di elemento della pipeline */
+#define PIPE_MESSAGE 0
+#define PIPE_ERROR 1
+#define PIPE_EXIT 2
+#define PIPE_CLOSE 3
+
+/** <H3>Connessione</H3>
+ * Lo stato di una connessione gestita da un event loop
+ * - \c fd la socket dell'utente
+ * - \c hash_element l'elemento della tabella hash dell'utente
+ * - \c session la sessione dell'utente nel registro
+ * - \c reader i byte ricevuti e non ancora interpretati
+ * - \c serial la coda seriale dei messaggi dell'utente (solo con il pool)
+ * - \c exited diventa 1 quando il MSG_EXIT dell'utente e` stato gestito
+ * - \c stopped diventa 1 quando la lettura dei messaggi e` terminata
+ * - \c window la finestra di messaggi concessa al client (0: nessun
+ *   controllo di flusso); \c received i messaggi ricevuti che consumano
+ *   crediti, \c handled quelli gestiti, \c granted i crediti concessi oltre
+ *   alla finestra iniziale
+ * - \c beat il timer dei battiti; \c beat_frames i messaggi letti al
+ *   battito precedente, \c idle i millisecondi da cui il client tace
+ *   (usati solo dalla ruota dei battiti)
+ */
+typedef struct {
+	int fd;
+	elem_t *hash_element;
+	session_rec *session;
+	frame_reader reader;
+	serial_queue *serial;
+	int exited;
+	int stopped;
+	int window;
+	long received;
+	long handled;
+	long granted;
+	wheel_timer beat;
+	unsigned long beat_frames;
+	int idle;
+} connection_t;
+
+/** <H3>Messaggio da gestire</H3>
+ * Task del pool che gestisce un messaggio ricevuto da c.
+ */
+typedef struct {
+	connection_t *c;
+	message_t msg;
+} route_task;
+
+/** <H3>Broadcast in corso sul pool</H3>
+ * - \c msg il messaggio originale (non formattato, per il log)
+ * - \c frame il messaggio formattato, condiviso da tutti i destinatari
+ * - \c sender il mittente, \c sender_session la sua sessione
+ * - \c serial la coda seriale del mittente, sospesa fino al termine;
+ *   NULL se il mittente attende il termine su \c done (pool di consegna)
+ * - \c snap l'istantanea degli utenti connessi, \c users e \c n i suoi
+ *   elementi: i destinatari
+ * - \c remaining i task di consegna non ancora terminati
+ */
+typedef struct {
+	message_t msg;
+	shared_msg *frame;
+	char *sender;
+	session_rec *sender_session;
+	serial_queue *serial;
+	cow_snapshot *snap;
+	elem_t **users;
+	int n;
+	int remaining;
+	pthread_mutex_t done_mtx;
+	pthread_cond_t done;
+} bcast_job;
+
+/** <H3>Consegna di un broadcast</H3>
+ * Task del pool che consegna job ai destinatari users[first .. first+n-1].
+ */
+typedef struct {
+	bcast_job *job;
+	int first;
+	int n;
+} bcast_chunk;
+
+/** <H3>Messaggio formattato nella pipeline</H3>
+ * Condiviso tra le consegne ai destinatari di un messaggio.
+ * - \c msg il messaggio originale (per il log)
+ * - \c formatted il messaggio inviato ai destinatari, accodato alle loro
+ *   mailbox senza copiarlo
+ * - \c refs le consegne non ancora terminate
+ */
+typedef struct {
+	message_t msg;
+	shared_msg *formatted;
+	int refs;
+} pipe_frame;
+
+/** <H3>Messaggio nella pipeline</H3>
+ * Attraversa gli stadi decode, route e format.
+ * - \c kind PIPE_MESSAGE, PIPE_ERROR, PIPE_EXIT o PIPE_CLOSE
+ * - \c c la connessione del mittente, \c sender il suo elemento della tabella hash
+ * - \c msg il messaggio ricevuto, \c receiver il destinatario di un MSG_TO_ONE
+ * - \c target il destinatario di un MSG_TO_ID, gia` risolto da decode
+ * - \c users, \c n i destinatari scelti da route
+ * - \c errcode l'errore da notificare al mittente (PIPE_ERROR)
+ */
+typedef struct {
+	int kind;
+	connection_t *c;
+	elem_t *sender;
+	message_t msg;
+	char *receiver;
+	elem_t *target;
+	elem_t **users;
+	int n;
+	int errcode;
+} pipe_msg;
+
+/** <H3>Consegna nella pipeline</H3>
+ * Attraversa gli stadi deliver e log.
+ * - \c kind come in pipe_msg
+ * - \c frame il messaggio da consegnare a \c user (PIPE_MESSAGE)
+ * - \c about il destinatario originale a cui si riferisce l'errore (PIPE_ERROR)
+ */
+typedef struct {
+	int kind;
+	connection_t *c;
+	elem_t *sender;
+	elem_t *user;
+	pipe_frame *frame;
+	int errcode;
+	char *about;
+} pipe_delivery;
+
+/** <H3>Destinatario di un broadcast</H3>
+ * Un invio sottomesso all'anello e in attesa di completamento
+ * - \c user l'elemento della tabella hash del destinatario
+ * - \c session la sessione del destinatario, acquisita fino al completamento
+ * - \c result il risultato della sendmsg
+ */
+typedef struct {
+	elem_t *user;
+	session_rec *session;
+	int result;
+} fanout_t;
+
+/** <H3>Sessione di un utente in modalità MODE_SHARD</H3>
+ * Appartiene allo shard dell'utente: solo il thread dello shard la usa.
+ * - \c fd la socket, \c name il nome dell'utente (chiave di users_table)
+ * - \c reader i byte ricevuti, \c writer i messaggi da inviare
+ * - \c dirty 1 se la sessione attende di inviare i messaggi accodati
+ * - \c out_armed 1 se il loop attende che la socket torni scrivibile
+ * - \c closed 1 se la sessione e` chiusa e attende di essere liberata
+ * - \c packed 1 se l'utente riceve i messaggi compressi
+ */
+typedef struct {
+	int fd;
+	char *name;
+	frame_reader reader;
+	frame_writer writer;
+	int dirty;
+	int out_armed;
+	int closed;
+	int packed;
+} session_t;
+
+/** <H3>Broadcast condiviso tra gli shard</H3>
+ * Formattato una sola volta dallo shard del mittente.
+ * - \c msg il messaggio originale (per il log)
+ * - \c formatted il messaggio inviato ai destinatari, \c packed la sua
+ *   versione compressa (buffer NULL se non c'e`)
+ * - \c refs gli shard che non lo hanno ancora consegnato
+ */
+typedef struct {
+	message_t msg;
+	message_t formatted;
+	message_t packed;
+	char *sender;
+	int refs;
+} shard_bcast;
+
+/** <H3>Elemento di una coda tra shard</H3>
+ * - \c kind SHARD_CONNECT, SHARD_DELIVER, SHARD_BCAST o SHARD_ERROR
+ * - \c fd la socket dell'utente (SHARD_CONNECT)
+ * - \c sender il mittente (o l'utente da notificare, per SHARD_ERROR)
+ * - \c receiver il destinatario (allocato qui per SHARD_ERROR)
+ * - \c msg il messaggio (SHARD_DELIVER), \c bcast il broadcast (SHARD_BCAST)
+ * - \c features i tratti della versione 2 proposti dall'utente, -1 se
+ *   usa la versione 1 (SHARD_CONNECT)
+ * - \c next elemento successivo nell'arretrato dello shard mittente
+ */
+typedef struct shard_item {
+	int kind;
+	int fd;
+	int errcode;
+	char *sender;
+	char *receiver;
+	message_t msg;
+	shard_bcast *bcast;
+	int features;
+	struct shard_item *next;
+} shard_item;
+
+/** <H3>Shard</H3>
+ * Lo stato privato del loop di indice corrispondente.
+ * - \c inbox[i] la coda dallo shard i; inbox[loop_number+j] quella dal
+ *   dispatcher j
+ * - \c backlog[j] elementi per lo shard j rimasti fuori dalla sua coda piena
+ * - \c notify[j] 1 se lo shard j va risvegliato
+ * - \c sessions le sessioni degli utenti dello shard
+ * - \c sessions_mtx acquisito dallo shard solo per modificare sessions e dagli
+ *   altri shard per leggerla (MSG_LIST)
+ * - \c dirty le sessioni con messaggi da inviare
+ */
+typedef struct {
+	spsc_queue **inbox;
+	shard_item **backlog;
+	shard_item **backlog_tail;
+	int *notify;
+	hashTable_t *sessions;
+	pthread_mutex_t sessions_mtx;
+	session_t **dirty;
+	int dirty_length;
+	int dirty_size;
+} shard_t;
+
+/** <H3>Stato dello scrittore del log in modalità MODE_URING</H3>
+ * Due blocchi di record: mentre uno è in scrittura, l'altro si riempie.
+ * - \c chunk i blocchi, \c length i byte occupati, \c capacity lo spazio allocato
+ * - \c cur il blocco in riempimento
+ * - \c inflight 1 se l'altro blocco è in scrittura
+ */
+typedef struct {
+	uring_t ring;
+	FILE *file;
+	char *chunk[2];
+	int length[2];
+	int capacity[2];
+	int cur;
+	int inflight;
+} uring_log;
 
 /**Tabella Hash degli utenti */
 static hashTable_t* users_table = NULL;
+/** Elementi di users_table indicizzati per identificativo */
+static elem_t **users_by_id = NULL;
+/** Filtro dei nomi degli utenti autorizzati: scarta i nomi sconosciuti
+ * senza cercarli nella tabella hash */
+static bloom_filter *authorized = NULL;
+/** Numero di utenti autorizzati: gli identificativi validi vanno da 0 a
+ * users_number-1 */
+static int users_number = 0;
+/** Mappa degli identificativi (MSG_USERIDS), uguale per tutti i client */
+static shared_msg *userids_frame = NULL;
 /** Mutex per l'accesso alla tabella hash */
 static pthread_mutex_t user_table_mtx = PTHREAD_MUTEX_INITIALIZER;
 /** Condition per l'accesso alla tabella hash */
 static pthread_cond_t user_table_cond = PTHREAD_COND_INITIALIZER;
 /** Variabile libero/occupato per la tabella hash */
 static int UT_inUse = 0;
+/** Utenti connessi (elementi di users_table): chi invia un broadcast ne
+ * scorre un'istantanea senza acquisire la tabella */
+static cow_set *connected_users = NULL;
+/** Utenti iscritti agli eventi di presenza (elementi di users_table) */
+static cow_set *presence_subs = NULL;
 /** Buffer Messaggi */
 static message_buffer *writer_buffer = NULL;
-/** Socket Lock */
-static socket_lock *msg_locks = NULL;
+/** Sessioni degli utenti, indicizzate per identificativo: il payload di
+ * un elemento di users_table punta alla sua */
+static session_rec *sessions = NULL;
 
-/** Lista utenti */
-static char *users_list = NULL;
-/** Lunghezza lista utenti */
-static int users_list_length = 0;
+/** Risposta a MSG_LIST condivisa da tutte le richieste, valida finche`
+ * gli utenti connessi non cambiano */
+static shared_msg *list_frame = NULL;
+/** Generazione dell'istantanea degli utenti connessi da cui e` stata
+ * costruita list_frame */
+static unsigned long list_generation = 0;
 /** Variabile libero/occupato per la lista utenti */
 static int UL_inUse = 0;
 /** Mutex accesso lista utenti */
@@ -87,6 +417,93 @@ static pthread_mutex_t users_list_mtx = PTHREAD_MUTEX_INITIALIZER;
 /** Condition accesso lista utenti */
 static pthread_cond_t users_list_cond = PTHREAD_COND_INITIALIZER;
 
+/** Modalità del server (MODE_THREAD, MODE_EPOLL o MODE_URING) */
+static int server_mode = MODE_THREAD;
+/** Numero di event loop in modalità MODE_EPOLL (0: uno per processore) */
+static int loop_number = 0;
+/** Event loop che gestiscono le connessioni in modalità MODE_EPOLL */
+static loop_group *loops = NULL;
+/** Loop io_uring che gestiscono le connessioni in modalità MODE_URING */
+static uring_group *uring_loops = NULL;
+/** Scheduler delle coroutine in modalità MODE_CORO */
+static coro_group *coros = NULL;
+/** Shard in modalità MODE_SHARD, uno per ogni loop di loops */
+static shard_t *shards = NULL;
+/** Pool che gestisce i messaggi ricevuti (NULL: gestione immediata) */
+static work_pool *pool = NULL;
+/** Numero minimo e massimo di thread del pool (0: pool disattivato) */
+static int pool_min = 0;
+static int pool_max = 0;
+/** Pool che consegna in parallelo i broadcast gestiti fuori dal pool dei
+ * messaggi (NULL: consegna da parte di chi li riceve) */
+static work_pool *fanout_pool = NULL;
+/** Numero di thread del pool di consegna (0: disattivato) */
+static int fanout_threads = 0;
+/** Corrieri che svuotano le mailbox delle connessioni (NULL: i messaggi
+ * vengono scritti direttamente sulle socket) */
+static courier_group *couriers = NULL;
+/** Numero di corrieri (0: mailbox disattivate) */
+static int courier_number = 0;
+/** Limiti di ogni mailbox (messaggi e byte, 0: nessun limite) e politica
+ * applicata a chi li supera (-1: nessun limite impostato) */
+static int mailbox_frames = 0;
+static long mailbox_bytes = 0;
+static int mailbox_policy = -1;
+/** Finestra di messaggi concessa ai client che negoziano il controllo di
+ * flusso (0: controllo di flusso disattivato) */
+static int credit_window = 0;
+/** <H3>Dispatcher</H3>
+ * Un thread che accetta connessioni dalla socket di ascolto condivisa.
+ * - \c id il thread
+ * - \c index la posizione in dispatchers
+ * - \c handshakes le connessioni accettate in attesa del MSG_CONNECT
+ */
+typedef struct {
+	pthread_t id;
+	int index;
+	handshake_set *handshakes;
+} dispatcher_t;
+
+/** I dispatcher */
+static dispatcher_t *dispatchers = NULL;
+/** Numero di dispatcher */
+static int dispatcher_number = 1;
+/** La socket di ascolto, non bloccante, condivisa dai dispatcher */
+static int listen_fd = -1;
+/** Millisecondi concessi a una connessione per inviare il MSG_CONNECT */
+static int handshake_timeout = HANDSHAKE_TIMEOUT;
+/** Ruota dei battiti delle connessioni (NULL: battiti disattivati) */
+static timer_wheel *heartbeats = NULL;
+/** Millisecondi tra due battiti di una connessione, e di silenzio del
+ * client dopo i quali la connessione viene chiusa */
+static int heartbeat_interval = 0;
+static int idle_timeout = 0;
+/** Connessioni chiuse perche` il client taceva o non c'era piu`
+ * (aggiornato dalla ruota) */
+static long idle_closed = 0;
+/** Mailbox delle connessioni, indicizzate per socket */
+static mailbox **mailboxes = NULL;
+/** Numero di elementi di mailboxes */
+static int mailboxes_size = 0;
+/** Lunghezza da cui i messaggi per i client che lo accettano viaggiano
+ * compressi (0: compressione disattivata) */
+static int pack_threshold = 0;
+/** Lunghezza da cui i record di log vengono scritti compressi (0: il log
+ * resta in chiaro) */
+static int log_threshold = 0;
+/** Formato in cui i client ricevono i messaggi (WIRE_V2, WIRE_PACKED),
+ * indicizzato per socket */
+static char *wire_sockets = NULL;
+/** Numero di elementi di wire_sockets */
+static int wire_size = 0;
+/** 1 se le connessioni sono SOCK_SEQPACKET: un messaggio per datagramma */
+static int packet_mode = 0;
+/** Stadi della pipeline: decode, route, format, deliver, log (NULL: pipeline
+ * disattivata) */
+static stage_t *stages[PIPE_STAGES];
+/** Numero di thread di ciascuno stadio (0: pipeline disattivata) */
+static int stage_threads[PIPE_STAGES];
+
 /** Serve a verificare se è stato ricevuto un segnale di uscita */
 static int signal_exit = 0;
 /** Mutex per il controllo di signal_exit*/
@@ -139,6 +556,7 @@ int load_authorized_users(const char *auth_path) {
 	char buf[NICK_SIZE+1];
 	int nick_length;
 	int user_number = 0; 
+	int capacity = 0, i;
 	
 	auth_file = Fopen(auth_path, "r");
 	if (auth_file == NULL) {
@@ -161,108 +579,214 @@ int load_authorized_users(const char *auth_path) {
 					valid = 0;
 					break;
 				}
-				/*Il payload fa riferimento a un'elem_t contenuto nella
-				 * struttura socket_lock, che verrà caricata in un 
-				 * momento successivo. NULL serve a indicare che l'utente
-				 * è disconnesso, ovverosia non c'è una socket lock.*/
+				/*Il payload fa riferimento alla sessione dell'utente nel
+				 * registro, che verrà creato in un momento successivo.*/
 				i++;
 				
 			}
 			if (valid) {
-				if (add_hashElement(users_table,buf,NULL) == 0)
-					user_number++;
-				else
+				if (add_hashElement(users_table,buf,NULL) == 0) {
+					/*L'identificativo e` la posizione nel file*/
+					if (user_number == capacity) {
+						capacity = (capacity == 0) ? 64 : 2*capacity;
+						if ((users_by_id = realloc(users_by_id, sizeof(elem_t*)*capacity)) == NULL) {
+							perror("msgserver, load_authorized_users");
+							exit(EXIT_FAILURE);
+						}
+					}
+					users_by_id[user_number++] = hashElement(users_table, buf);
+				} else
 					perror("msgserver, load_authorized_users");
 
 			} else if (STRICT) {
 				printf("Il file '%s' degli utenti autorizzati contiene caratteri non ammessi\n", auth_path);
 				/*Ovviamente dobbiamo liberarci di tutto lo spazio dinamico allocato.*/
 				free_hashTable(&users_table);
-				freeSL(&msg_locks);
+				free(users_by_id);
+				users_by_id = NULL;
 				return -1;
 			} 
 			valid = 1;	
 		}
 	}
 	fclose(auth_file);
+	users_number = user_number;
+	/*La tabella non cambia piu`: il filtro si costruisce una volta sola*/
+	if ((authorized = initialize_Bloom(user_number)) != NULL)
+		for (i = 0; i < user_number; i++)
+			add_Bloom(authorized, users_by_id[i]->key);
 	return user_number;
 }
 
-/** Aggiorna la stringa contenente la lista degli utenti connessi, 
-* aggiungendo in coda la stringa newuser.
-* \param newuser il nome utente che deve subire una trasformazione nella lista
-* \param mode ADD oppure REMOVE, rispettivamente per connessione e disconnessione		
-* */
-void refreshUserList(char *user, int mode) { 
-	char *old_string = NULL;
-	int nick_length = 0;
-	if (user == NULL || (mode != 0 && mode != 1)) {
-		errno = EINVAL;
-		perror("msgserver, refreshUserList:");
-		return;
+/** Restituisce il formato in cui riceve i messaggi il client della
+ * socket fd (WIRE_V2, WIRE_PACKED).*/
+int wireSocket(int fd) {
+	if (wire_sockets == NULL || fd < 0 || fd >= wire_size) return 0;
+	return __atomic_load_n(wire_sockets+fd, __ATOMIC_ACQUIRE);
+}
+
+/** Indica se il client della socket fd riceve i messaggi compressi.*/
+int packedSocket(int fd) {
+	return (wireSocket(fd) & WIRE_PACKED) != 0;
+}
+
+/** Restituisce la versione del protocollo dei messaggi per il client
+ * della socket fd.*/
+int versionSocket(int fd) {
+	return (wireSocket(fd) & WIRE_V2) ? PROTO_VERSION : 1;
+}
+
+/** Restituisce i tratti della versione 2 che il server accetta, oltre a
+ * supported: la compressione e i battiti, se attivi.*/
+int acceptedFeatures(int supported) {
+	if (pack_threshold > 0) supported |= PROTO_PACK;
+	return (heartbeat_interval > 0) ? supported | PROTO_HEARTBEAT : supported;
+}
+
+/** Aggiunge al messaggio condiviso s, se abbastanza lungo, la versione
+ * compressa: viene preparata una sola volta per tutti i destinatari.*/
+void packShared(shared_msg *s) {
+	if (pack_threshold > 0 && s->msg.length >= pack_threshold)
+		(void) packMessage(&s->msg, &s->packed);
+}
+
+/** Prepara la mappa degli identificativi: i nomi di tutti gli utenti
+ * autorizzati, separati da spazi, in ordine di identificativo.*/
+void buildUserIds(void) {
+	message_t msg;
+	int i, length = 0;
+	char *end;
+	for (i = 0; i < users_number; i++)
+		length += strlen(users_by_id[i]->key)+1;
+	msg.type = MSG_USERIDS;
+	msg.length = (length > 0) ? length-1 : 0;
+	msg.buffer = Malloc(sizeof(char)*(length+1));
+	msg.buffer[0] = '\0';
+	for (i = 0, end = msg.buffer; i < users_number; i++) {
+		if (i > 0) *end++ = ' ';
+		strcpy(end, users_by_id[i]->key);
+		end += strlen(end);
+	}
+	userids_frame = share_Message(&msg);
+	packShared(userids_frame);
+}
+
+/** Restituisce l'elemento della tabella hash dell'utente con identificativo
+ * id, NULL se non esiste.*/
+elem_t *userById(long id) {
+	if (id < 0 || id >= users_number) return NULL;
+	return users_by_id[id];
+}
+
+/** Restituisce l'elemento della tabella hash dell'utente name, NULL se non
+ * e` autorizzato. Quasi tutti i nomi sconosciuti vengono scartati dal
+ * filtro, senza acquisire la tabella.*/
+elem_t *findUser(char *name) {
+	elem_t *e;
+	if (!check_Bloom(authorized, name)) return NULL;
+	tableWait();
+		e = hashElement(users_table, name);
+	tableSignal();
+	return e;
+}
+
+/** Crea il registro delle sessioni e lega ogni utente autorizzato alla
+ * sua, nella posizione del suo identificativo.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int bindSessions(void) {
+	int i;
+	if ((sessions = initialize_Registry(users_number)) == NULL) return -1;
+	for (i = 0; i < users_number; i++) {
+		sessions[i].name = users_by_id[i]->key;
+		users_by_id[i]->payload = sessions+i;
+	}
+	return 0;
+}
+
+/** Scioglie gli utenti dalle loro sessioni e libera il registro: le
+ * sessioni stanno nel registro e la tabella hash non deve liberarle.*/
+void unbindSessions(void) {
+	int i;
+	for (i = 0; i < users_number; i++)
+		users_by_id[i]->payload = NULL;
+	free_Registry(&sessions, users_number);
+}
+
+/** Restituisce una nuova stringa con prefix seguito dai nomi degli utenti
+ * di snap, ciascuno preceduto da uno spazio, nell'ordine in cui si sono
+ * connessi.
+ * \param length se non NULL, vi viene scritta la lunghezza della stringa */
+char *joinNames(cow_snapshot *snap, const char *prefix, int *length) {
+	int i, n = strlen(prefix);
+	char *names, *end;
+	for (i = 0; i < snap->size; i++)
+		n += strlen(((elem_t *) snap->items[i])->key)+1; /*+1 è per lo spazio che precede il nome*/
+	names = Malloc(sizeof(char)*(n+1));
+	strcpy(names, prefix);
+	end = names+strlen(prefix);
+	for (i = 0; i < snap->size; i++) {
+		*end++ = ' ';
+		strcpy(end, ((elem_t *) snap->items[i])->key);
+		end += strlen(end);
 	}
-	nick_length = strlen(user);
+	if (length != NULL) *length = n;
+	return names;
+}
+
+/** Prepara in msg la risposta a MSG_LIST con gli utenti di snap.*/
+void buildList(cow_snapshot *snap, message_t *msg) {
+	msg->type = MSG_LIST;
+	msg->buffer = joinNames(snap, LIST_FORMAT, &msg->length);
+}
+
+/** Restituisce la risposta a MSG_LIST, ricostruita solo se gli utenti
+ * connessi sono cambiati dall'ultima volta: le richieste concorrenti
+ * condividono lo stesso messaggio.
+ * \retval il messaggio, di cui il chiamante tiene un riferimento */
+shared_msg *listFrame(void) {
+	cow_snapshot *snap;
+	shared_msg *frame;
+	message_t msg;
+	snap = acquire_CowSet(connected_users);
 	listWait();
-	old_string = users_list;
-	if (mode == ADD) {
-		users_list_length += nick_length+1; /*+1 è per lo spazio che intercorre tra i nomi*/
-		users_list = Malloc(sizeof(char)* (users_list_length+2));
-		snprintf(users_list, users_list_length+2, "%s %s", old_string, user);
-	} else {
-		char *beginning = NULL, *end = NULL;
-		beginning = strstr(old_string, user);
-		if (beginning == NULL) {
-			listSignal();
-			errno = EINVAL;
-			perror("msgserver, refreshUserList: l'username da rimuovere non è nella lista");
-			return;
+		/*Un'istantanea piu` vecchia di quella in cache e` gia` superata*/
+		if (list_frame == NULL || snap->generation > list_generation) {
+			buildList(snap, &msg);
+			release_Shared(list_frame);
+			list_frame = share_Message(&msg);
+			packShared(list_frame);
+			list_generation = snap->generation;
 		}
-		end = beginning+nick_length;/*Togliamo anche lo spazio, o eventualmente lo \0*/
-		users_list_length -= nick_length;
-		beginning[-1] ='\0';
-		if (end[0] == '\0') { /*Significa che l'utente e` l'ultimo della lista.*/
-			users_list = Malloc(sizeof(char)*(users_list_length));
-			strncpy(users_list, old_string, users_list_length);
-			users_list[users_list_length-1] = '\0';
-		} else {
-			end++; /*Eliminiamo lo spazio dopo l'username che stiamo cancellando*/
-			users_list_length--;
-			users_list = Malloc(sizeof(char)*(users_list_length+1));
-			snprintf(users_list, users_list_length+1, "%s %s", old_string, end);
-		}			
-	}
+		frame = list_frame;
+		__atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
 	listSignal();
-	free(old_string);
+	release_Snapshot(snap);
+	return frame;
 }
 
 
-/**Invia un messaggio di errore corrispondente a errcode all'utente rappresentato nella socket_lock
- * dall'elemento h.
- * \param errcode il codice di errore, 0 < errcode < ERR_NUMBER (costante definita in msglib.h)
- * \param h l'elemento della struttura socket_lock riguardante questo utente.
+/** Prepara il messaggio di errore corrispondente a errcode.
+ * \param errcode il codice di errore, 0 < errcode < ERR_NUMBER
  * \param receiver l'utente a cui era destinato il messaggio in origine
- * 
+ * \param err il messaggio da riempire (il buffer viene allocato qui)
+ *
  * \retval -1 in caso di errore (sets errno)
  * \retval 0 se tutto è andato a buon fine.
  * */
-int sendError(int errcode, elem_t*h, char *receiver) {
-	message_t *err = NULL;
+int buildError(int errcode, char *receiver, message_t *err) {
 	char *errstr = NULL;
-	int *socket = NULL; 
-	if (errcode > ERR_NUMBER || errcode < 0 || receiver == NULL || h == NULL) {
+	if (errcode > ERR_NUMBER || errcode < 0 || receiver == NULL || err == NULL) {
 		errno = EINVAL;
-		perror("msgserv, sendError");
+		perror("msgserv, buildError");
 		return -1;
 	}
-	err = Malloc(sizeof(message_t));
 	err->buffer = NULL;
 	errno = 0;
 	/*Lo spazio viene allocato dalla funzione*/
 	err->length = errorString(errcode, &errstr);
 	if (err->length <= 0 || errstr == NULL) {
-		perror("msgserv, sendError");
+		perror("msgserv, buildError");
 		free(errstr);
-		free(err);
 		return -1;
 	}
 	/*ERR_FC e` una costante che denota il numero di caratteri aggiuntivi
@@ -272,21 +796,225 @@ int sendError(int errcode, elem_t*h, char *receiver) {
 	snprintf(err->buffer, err->length+1, ERR_FORMAT, receiver, errstr);
 	free(errstr);
 	err->type = MSG_ERROR;
+	return 0;
+}
+
+/** Restituisce la mailbox della socket fd, NULL se i messaggi per fd
+ * vengono scritti direttamente sulla socket.*/
+mailbox *findMailbox(int fd) {
+	if (mailboxes == NULL || fd < 0 || fd >= mailboxes_size) return NULL;
+	return __atomic_load_n(mailboxes+fd, __ATOMIC_ACQUIRE);
+}
+
+/** Crea la mailbox della socket di un utente appena connesso (se le
+ * mailbox sono attive).
+ * \retval 0 se tutto ok, -1 in caso di errore */
+int openMailbox(int fd) {
+	mailbox *mb;
+	if (couriers == NULL || fd >= mailboxes_size) return 0;
+	if ((mb = open_Mailbox(couriers, fd)) == NULL) return -1;
+	__atomic_store_n(mailboxes+fd, mb, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/** Chiude la socket fd di una connessione terminata, insieme alla sua
+ * mailbox: se l'utente si e` disconnesso, il corriere chiude la socket dopo
+ * avergli inviato gli ultimi messaggi.
+ * \param close_fd 0 se la socket non va chiusa (MODE_THREAD)
+ * */
+void closeMailbox(int fd, int close_fd) {
+	mailbox *mb;
+	if ((mb = findMailbox(fd)) == NULL) {
+		if (close_fd) closeSocket(fd);
+		return;
+	}
+	__atomic_store_n(mailboxes+fd, NULL, __ATOMIC_RELEASE);
+	close_Mailbox(&mb, close_fd);
+}
+
+/** Scrive direttamente msg sulla socket fd, nel formato del suo client. Su
+ * una socket SOCK_SEQPACKET un messaggio che non entra in un datagramma
+ * viene rifiutato, come fanno la mailbox e gli shard.
+ * \retval come sendReply */
+int replySocket(int fd, message_t *msg) {
+	char header[PROTO_HEADER_SIZE];
+	int version = versionSocket(fd), body;
+	if (packet_mode && replyHeader(header, msg, version, &body) + body > PACKET_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return sendReply(fd, msg, version);
+}
+
+/** Invia msg sulla socket fd, di cui il chiamante ha l'accesso esclusivo:
+ * se la socket ha una mailbox il messaggio vi viene accodato, altrimenti
+ * viene scritto direttamente.
+ * \param sender il nome (la chiave nella tabella hash) del mittente di un
+ *        MSG_TO_ONE o MSG_BCAST: nella mailbox i suoi messaggi si alternano
+ *        con quelli degli altri mittenti. Gli altri messaggi sono di
+ *        controllo e precedono tutti.
+ * Un messaggio lungo per un client che lo accetta viene compresso.
+ * \retval come sendMessage */
+int writeSocket(int fd, message_t *msg, char *sender) {
+	mailbox *mb = findMailbox(fd);
+	const void *flow = (msg->type == MSG_TO_ONE || msg->type == MSG_BCAST) ? sender : NULL;
+	message_t packed;
+	int retval;
+	packed.buffer = NULL;
+	if (pack_threshold > 0 && msg->length >= pack_threshold && packedSocket(fd) &&
+		packMessage(msg, &packed) == 0)
+		msg = &packed;
+	retval = (mb != NULL) ? post_Mailbox(mb, msg, flow) : replySocket(fd, msg);
+	free(packed.buffer);
+	return retval;
+}
+
+/** Come writeSocket, ma invia il messaggio condiviso s: la mailbox ne tiene
+ * un riferimento invece di copiarlo. La versione compressa di s, se c'e`,
+ * va ai client che la accettano.
+ * \retval come sendMessage */
+int writeShared(int fd, shared_msg *s, char *sender) {
+	mailbox *mb;
+	if ((mb = findMailbox(fd)) != NULL)
+		return post_Shared(mb, s, (s->msg.type == MSG_TO_ONE || s->msg.type == MSG_BCAST) ? sender : NULL);
+	return replySocket(fd, (s->packed.buffer != NULL && packedSocket(fd)) ? &s->packed : &s->msg);
+}
+
+/**Invia un messaggio di errore corrispondente a errcode all'utente della sessione s.
+ * \param errcode il codice di errore, 0 < errcode < ERR_NUMBER (costante definita in msglib.h)
+ * \param s la sessione dell'utente
+ * \param receiver l'utente a cui era destinato il messaggio in origine
+ * 
+ * \retval -1 in caso di errore o se l'utente non e` piu` connesso (sets errno)
+ * \retval 0 se tutto è andato a buon fine.
+ * */
+int sendError(int errcode, session_rec *s, char *receiver) {
+	message_t err;
+	int socket;
+	if (s == NULL) {
+		errno = EINVAL;
+		perror("msgserv, sendError");
+		return -1;
+	}
+	if (buildError(errcode, receiver, &err) == -1)
+		return -1;
 	/*Richiediamo di essere gli unici ad accedere alla socket rappresentante l'utente*/
-	requireDirectAccess(msg_locks, h);
-		socket = h->key;
-		(void) sendMessage(*socket, err);
-	releaseDirectAccess(msg_locks, h);
-	free(err->buffer);
-	free(err);
-	err = NULL;
+	if ((socket = acquire_Session(s)) == -1) {
+		free(err.buffer);
+		errno = ENOTCONN;
+		return -1;
+	}
+		(void) writeSocket(socket, &err, NULL);
+	release_Session(s);
+	free(err.buffer);
 	return 0;	
 }
 
+/** Invia un MSG_PING sulla socket fd, di cui il chiamante ha l'accesso
+ * esclusivo, senza bloccare: se la socket non ha spazio il battito si
+ * salta.
+ * \retval 0 se tutto ok, -1 se il MSG_PING non e` stato inviato
+ * \retval SEOF se il client non c'e` piu`: la socket e` rotta */
+int pingSocket(int fd) {
+	message_t ping;
+	char header[PROTO_HEADER_SIZE];
+	mailbox *mb;
+	int head, body;
+	ping.type = MSG_PING;
+	ping.length = 0;
+	ping.buffer = NULL;
+	if ((mb = findMailbox(fd)) != NULL)
+		return post_Mailbox(mb, &ping, NULL);
+	/*Un'intestazione sola: una socket AF_UNIX la accoda tutta o niente*/
+	head = replyHeader(header, &ping, versionSocket(fd), &body);
+	if (send(fd, header, head, MSG_DONTWAIT | MSG_NOSIGNAL) == head) return 0;
+	return (errno == EPIPE || errno == ECONNRESET) ? SEOF : -1;
+}
+
+/** Battito della connessione del timer t, ogni heartbeat_interval
+ * millisecondi: il client riceve un MSG_PING, che gli conferma che il
+ * server e` attivo. La socket viene chiusa, e il gestore della connessione
+ * ne riceve la fine come se il client si fosse disconnesso, se il MSG_PING
+ * trova la socket rotta o se il client, che ha negoziato i battiti
+ * (PROTO_HEARTBEAT), tace (nemmeno un MSG_PING) da idle_timeout
+ * millisecondi. Chi non li ha negoziati puo` solo ascoltare a lungo.
+ * Nessun lock o orologio sul percorso dei messaggi: basta confrontare il
+ * contatore del lettore con quello del battito precedente. La ruota chiama
+ * il battito con il suo lock: se la sessione e` acquisita da chi le sta
+ * scrivendo, il battito salta un giro invece di attenderlo.
+ * \retval i tick dopo cui ripetere il battito, 0 se la socket e` stata chiusa */
+int beatConnection(wheel_timer *t) {
+	connection_t *c = t->data;
+	unsigned long frames = __atomic_load_n(&c->reader.frames, __ATOMIC_RELAXED);
+	int fd, ticks = (heartbeat_interval + HEARTBEAT_TICK - 1) / HEARTBEAT_TICK;
+	if (frames != c->beat_frames) {
+		c->beat_frames = frames;
+		c->idle = 0;
+	} else c->idle += heartbeat_interval;
+	if ((fd = try_Session(c->session)) == -1) return ticks;
+	if (((wireSocket(fd) & WIRE_BEATS) && c->idle >= idle_timeout) || pingSocket(fd) == SEOF) {
+		shutdown(fd, SHUT_RDWR);
+		release_Session(c->session);
+		idle_closed++;
+		return 0;
+	}
+	release_Session(c->session);
+	return ticks;
+}
+
+/** Scrive su f i battiti: le connessioni chiuse per inattivita` (o
+ * perche` il client non c'era piu`) e lo stato della ruota.*/
+void reportHeartbeats(FILE *f) {
+	if (heartbeats == NULL) return;
+	fprintf(f, "battiti: ogni %d ms, chiuse dopo %d ms di silenzio o senza client: %ld\n",
+		heartbeat_interval, idle_timeout, __atomic_load_n(&idle_closed, __ATOMIC_RELAXED));
+	report_Wheel(heartbeats, f);
+}
+
+/** Conta un messaggio del client di c appena gestito e, ogni meta`
+ * finestra, gli restituisce i crediti corrispondenti con un MSG_CREDIT.
+ * \param c la connessione del mittente
+ * */
+void creditClient(connection_t *c) {
+	message_t credit;
+	int half;
+	if (c->window == 0 || c->exited) return;
+	half = (c->window+1)/2;
+	if (__atomic_add_fetch(&c->handled, 1, __ATOMIC_ACQ_REL) % half != 0) return;
+	if (buildCredit(&credit, MSG_CREDIT, half) == -1) return;
+	/*I crediti valgono da subito: il client potrebbe usarli prima che
+	 * la scrittura ritorni*/
+	__atomic_add_fetch(&c->granted, half, __ATOMIC_ACQ_REL);
+	if (acquire_Session(c->session) != -1) {
+		(void) writeSocket(c->fd, &credit, NULL);
+		release_Session(c->session);
+	}
+	free(credit.buffer);
+}
+
+/** Conta un messaggio ricevuto dal client di c che consuma crediti.
+ * \retval 0 se il messaggio rientra nella finestra concessa
+ * \retval -1 se il client l'ha superata: gli viene inviato un MSG_ERROR e
+ *         la connessione va chiusa
+ * */
+int chargeClient(connection_t *c) {
+	message_t err;
+	if (c->window == 0) return 0;
+	if (++c->received - __atomic_load_n(&c->granted, __ATOMIC_ACQUIRE) <= c->window)
+		return 0;
+	err.type = MSG_ERROR;
+	err.buffer = CREDIT_EXCEEDED;
+	err.length = strlen(err.buffer);
+	if (acquire_Session(c->session) != -1) {
+		(void) writeSocket(c->fd, &err, NULL);
+		release_Session(c->session);
+	}
+	return -1;
+}
+
 /** La funzione sendSocketError sostituisce sendError nella fase di connessione
  * preliminare dell'utente. Puo' essere utilizzata solo se la socket su cui 
- * questi e` in ascolto non e` stata ancora inserita all'interno della struttura
- * msg_locks.
+ * questi e` in ascolto non appartiene ancora a una sessione del registro.
  * \param errcode il numero che identifica l'errore all'interno del sisetma
  * \param socket il fd della socket su cui inviare il messaggio di errore.
  * 
@@ -296,17 +1024,11 @@ int sendError(int errcode, elem_t*h, char *receiver) {
 int sendSocketError(int errcode, int socket) {
 	message_t *err = NULL;
 	char *errstr = NULL;
-	elem_t*el;
 	if (errcode < 0 || errcode > ERR_NUMBER) {
 		errno = EINVAL;
 		perror("msgserv, sendSocketError");
 		return -1;
 	}
-	if ((el = findSL(msg_locks, socket)) != NULL) {
-		errno = EINVAL;
-		perror("msgserv, sendSocketError può essere usato solo se la socket non è inserita nella struttura socket lock");
-		return sendError(errcode, el, "UNKNOWN USER");
-	}
 	err = Malloc(sizeof(message_t));
 	err->buffer = NULL;
 	err->length = errorString(errcode, &errstr); /*Lo spazio viene allocato dalla funzione*/
@@ -360,28 +1082,6 @@ char* normalizeToOne(message_t*msg) {
 	return receiver;
 }
 
-/** Riceve una struttura messaggio inviata dal client, che sia del tipo
- * MSG_LIST e la normalizza, ponendo nel buffer la risposta al comando.
- * \param message_t *msg, il messaggio da analizzare (tipo:MSG_LIST)
- * 
- * \retval 0 on success
- * \retval -1 in caso di errore (sets errno)
- * */
-int normalizeList(message_t*msg) {
-	if(msg == NULL) {
-		errno = EINVAL;
-		perror("msgserver, normalizeList");
-		return -1;
-	}
-	
-	listWait();
-		msg->length = users_list_length;
-		msg->buffer = Malloc(sizeof(char)*(msg->length+1));
-		strncpy(msg->buffer, users_list, msg->length+1);
-	listSignal();
-	return 0;
-}
-
 /** Riceve una struttura messaggio (che è già stata analizzata dal server)
  * e la formatta perchè venga inviata al client. 
  * \param msg, il messaggio da formattare
@@ -423,6 +1123,115 @@ int formatMessage(message_t *msg, char *sender) {
 	return 0;	
 }
 
+/** Aggiorna i contatori della sessione s, acquisita, con il risultato
+ * retval di una consegna.*/
+static inline void countDelivery(session_rec *s, int retval) {
+	if (retval > 0) s->delivered++;
+	else if (retval == -1) s->failed++;
+}
+
+/** Invia un messaggio gia` formattato all'utente rappresentato nella
+ * tabella hash da hash_element.
+ * \param msg il messaggio da inviare (non viene modificato)
+ * \param sender il mittente (la sua chiave nella tabella hash)
+ * \param hash_element l'elemento della hash che rappresenta l'utente
+ *
+ * \retval come sendClient
+ * */
+int deliverFrame(message_t *msg, char *sender, elem_t *hash_element) {
+	session_rec *s = hash_element->payload;
+	int retval, socket;
+	/*L'utente è disconnesso*/
+	if ((socket = acquire_Session(s)) == -1) return -2;
+		retval = writeSocket(socket, msg, sender);
+		countDelivery(s, retval);
+	release_Session(s);
+	return retval;
+}
+
+/** Come deliverFrame, ma consegna il messaggio condiviso frame.
+ * \retval come sendClient
+ * */
+int deliverShared(shared_msg *frame, char *sender, elem_t *hash_element) {
+	session_rec *s = hash_element->payload;
+	int retval, socket;
+	/*L'utente è disconnesso*/
+	if ((socket = acquire_Session(s)) == -1) return -2;
+		retval = writeShared(socket, frame, sender);
+		countDelivery(s, retval);
+	release_Session(s);
+	return retval;
+}
+
+/** Registra nel log la consegna a receiver del messaggio msg (non
+ * formattato) di sender. write_Buffer copia il record: non serve allocarlo.
+ * */
+void logDelivery(message_t *msg, char *sender, char *receiver) {
+	message_t_expanded rec;
+	rec.type = msg->type;
+	rec.sender = sender;
+	rec.receiver = receiver;
+	rec.length = msg->length;
+	rec.buffer = msg->buffer;
+	write_Buffer(writer_buffer, &rec);
+}
+
+/** Formatta una sola volta il broadcast msg di sender in un messaggio
+ * condiviso da tutti i destinatari.
+ * \retval NULL in caso di errore (sets errno) */
+shared_msg *shareBroadcast(message_t *msg, char *sender) {
+	message_t out = *msg;
+	/*Per MSG_BCAST formatMessage alloca un nuovo buffer e lascia intatto msg*/
+	shared_msg *frame;
+	if (formatMessage(&out, sender) == -1) return NULL;
+	frame = share_Message(&out);
+	packShared(frame);
+	return frame;
+}
+
+/** Iscrive l'utente di hash_element agli eventi di presenza (se non lo e`
+ * gia`) e gli invia l'istantanea degli utenti connessi. L'iscrizione
+ * precede l'istantanea: gli eventi successivi non vanno persi, e quelli
+ * che la precedono il client li riconosce dalla versione.*/
+void subscribePresence(elem_t *hash_element) {
+	cow_snapshot *snap;
+	shared_msg *frame;
+	message_t msg;
+	char *names;
+	int length;
+	(void) add_CowSet(presence_subs, hash_element);
+	snap = acquire_CowSet(connected_users);
+		names = joinNames(snap, "", &length);
+		if (buildPresence(&msg, PRESENCE_SNAPSHOT, snap->generation, (length > 0) ? names+1 : NULL) == 0) {
+			frame = share_Message(&msg);
+			(void) deliverShared(frame, NULL, hash_element);
+			release_Shared(frame);
+		}
+		free(names);
+	release_Snapshot(snap);
+}
+
+/** Invia agli iscritti l'evento di presenza event (PRESENCE_JOIN o
+ * PRESENCE_LEAVE) dell'utente di hash_element, che ha portato gli utenti
+ * connessi alla versione version.*/
+void notifyPresence(char event, elem_t *hash_element, long version) {
+	cow_snapshot *snap;
+	shared_msg *frame;
+	message_t msg;
+	int i;
+	if (version < 0) return;
+	snap = acquire_CowSet(presence_subs);
+	/*Un solo messaggio, condiviso da tutti gli iscritti*/
+	if (snap->size > 0 && buildPresence(&msg, event, version, hash_element->key) == 0) {
+		frame = share_Message(&msg);
+		for (i = 0; i < snap->size; i++)
+			if (snap->items[i] != hash_element)
+				(void) deliverShared(frame, NULL, snap->items[i]);
+		release_Shared(frame);
+	}
+	release_Snapshot(snap);
+}
+
 /** Invia un messaggio msg all'utente rappresentato nella tabella hash
  * da hash_element.
  * \param msg il messggio da inviare
@@ -435,16 +1244,16 @@ int formatMessage(message_t *msg, char *sender) {
  * */
 int sendClient(message_t*msg, char *sender, elem_t*hash_element) {
 	int retval = 0;
-	message_t_expanded *exp;
-	elem_t**p, *h;
-	int *socket;
+	message_t original;
+	session_rec *s;
+	int socket;
 	if (hash_element == NULL || msg == NULL || (sender == NULL && msg->type != MSG_EXIT)) {
 		errno = EINVAL;
 		perror("msgserver, sendClient");
 		return -1;
 	}
 	/*L'utente è disconnesso*/
-	if ((p = hash_element->payload) == NULL || (h = *p) == NULL) return -2;
+	if (!online_Session(s = hash_element->payload)) return -2;
 	
 	if (msg->type == MSG_ERROR) {
 		errno = EINVAL;
@@ -452,30 +1261,29 @@ int sendClient(message_t*msg, char *sender, elem_t*hash_element) {
 		return -1;
 	}
 	if (msg->type == MSG_EXIT) {
-		requireDirectAccess(msg_locks, h); /*Richiediamo accesso unico alla struttura h*/
-			h = *p;
-			socket = h->key;
-			retval = sendMessage(*socket, msg);
-		releaseDirectAccess(msg_locks, h);
+		if ((socket = acquire_Session(s)) == -1) return -2;
+			retval = writeSocket(socket, msg, NULL);
+		release_Session(s);
 		return 0;
 	}
-	exp = expand_message(msg, sender, hash_element->key); /*Viene allocato un messaggio esteso*/
+	/*formatMessage libera il buffer di un MSG_TO_ONE, che serve pero` al log*/
+	original = *msg;
+	if (msg->type == MSG_TO_ONE) {
+		original.buffer = Malloc(sizeof(char)*(msg->length+1));
+		memcpy(original.buffer, msg->buffer, msg->length+1);
+	}
 	
 	if (formatMessage(msg, sender) == -1) {
-		free_Message(exp);
+		if (original.buffer != msg->buffer) free(original.buffer);
 		return -1;
 	}
 	
-	requireDirectAccess(msg_locks, h); /*Richiediamo accesso unico alla struttura h*/
-		h = *p;
-		socket = h->key;
-		retval = sendMessage(*socket, msg);
-	releaseDirectAccess(msg_locks, h); /*Rilasciamo l'accesso alla struttura h*/
+	retval = deliverFrame(msg, sender, hash_element);
 	
 	if (retval && (msg->type == MSG_TO_ONE || msg->type == MSG_BCAST))
-		write_Buffer(writer_buffer,exp);
+		logDelivery(&original, sender, hash_element->key);
 
-	free_Message(exp);
+	if (msg->type == MSG_TO_ONE) free(original.buffer);
 	return retval;
 } 
 
@@ -486,9 +1294,10 @@ int sendClient(message_t*msg, char *sender, elem_t*hash_element) {
  * \retval -1 se fallisce
  * */
 int disconnectUser(char *username) {
-	elem_t **payload, *sl;
+	mailbox *mb;
 	elem_t *h;
-	int *socket;
+	int socket;
+	long version;
 	message_t endmsg;
 	if (username == NULL) {
 		errno = EINVAL;
@@ -505,39 +1314,77 @@ int disconnectUser(char *username) {
 		}
 	pthread_mutex_unlock(&delete_mtx);
 	
-	/*Rimozione dell'utente dalla lista*/
-	refreshUserList(username, REMOVE);
-	
 	tableWait();
 		/*Ricerca dell'elemento nella tabella hash*/
 		h = hashElement(users_table, username);
-		if (h == NULL || h->payload == NULL) {
+		/*Da qui nessuno puo` piu` acquisire la sessione: la socket e` nostra*/
+		if (h == NULL || (socket = close_Session(h->payload)) == -1) {
 			errno = EINVAL;
 			fprintf(stderr, "[ERROR] l'utente %s risulta gia` disconnesso\n", username);
 			tableSignal();
 			return -1;	
 		}
-		payload = h->payload;
-		sl = *payload;
-		h->payload = NULL; /*Indicazione di "utente disconnesso"*/
+		version = remove_CowSet(connected_users, h);
 	tableSignal();
+	(void) remove_CowSet(presence_subs, h);
+	notifyPresence(PRESENCE_LEAVE, h, version);
 	/*Preparazione e invio del messaggio di uscita*/
 	endmsg.buffer = NULL;
 	endmsg.length = 0;
 	endmsg.type = MSG_EXIT;
 	
-	socketWait(msg_locks);
-		socket = sl->key;
-		(void) sendMessage(*socket, &endmsg);
-		shutdown(*socket, SHUT_RDWR);
-		if(removeSLE(msg_locks, sl) < 0) 
-			perror("msgcli, disconnectUser");
-	socketSignal(msg_locks);
-	
-	free(payload);
+	(void) writeSocket(socket, &endmsg, NULL);
+	/*Con la mailbox, lo shutdown segue l'invio dei messaggi accodati*/
+	if ((mb = findMailbox(socket)) != NULL) shutdown_Mailbox(mb);
+	else shutdown(socket, SHUT_RDWR);
 	return 0;
 }
 
+/** Prepara il record di log di msg: la riga LOG_FORMAT oppure, se il testo
+ * e` lungo almeno log_threshold byte e la compressione lo accorcia,
+ * "mittente:destinatario:" seguito da un byte nullo, dalla lunghezza in
+ * network order del corpo di un MSG_PACKED (lunghezza originale, blocco LZ,
+ * tipo), dal corpo e da '\n'. Il testo non contiene byte nulli: il primo
+ * distingue i record compressi.
+ * \param length vi viene scritta la lunghezza del record
+ * \retval il record, allocato */
+char *logRecord(message_t_expanded *msg, int *length) {
+	message_t text, packed;
+	uint32_t net;
+	char *rec;
+	int head;
+	text.type = msg->type;
+	text.buffer = msg->buffer;
+	text.length = strlen(msg->buffer);
+	if (log_threshold > 0 && text.length >= log_threshold && packMessage(&text, &packed) == 0) {
+		head = strlen(msg->sender) + strlen(msg->receiver) + 2;
+		*length = head + 1 + sizeof(uint32_t) + packed.length + 1;
+		rec = Malloc(sizeof(char)*(*length+1));
+		sprintf(rec, "%s:%s:", msg->sender, msg->receiver);
+		net = htonl(packed.length);
+		memcpy(rec+head+1, &net, sizeof(uint32_t));
+		memcpy(rec+head+1+sizeof(uint32_t), packed.buffer, packed.length);
+		rec[*length-1] = '\n';
+		rec[*length] = '\0';
+		free(packed.buffer);
+		return rec;
+	}
+	*length = snprintf(NULL, 0, LOG_FORMAT, msg->sender, msg->receiver, msg->buffer);
+	rec = Malloc(sizeof(char)*(*length+1));
+	snprintf(rec, *length+1, LOG_FORMAT, msg->sender, msg->receiver, msg->buffer);
+	return rec;
+}
+
+/** Scrive nel file di log il record di msg.*/
+void writeLog(FILE *log_file, message_t_expanded *msg) {
+	int length;
+	char *rec = logRecord(msg, &length);
+	pthread_cleanup_push(&free, rec);
+	fwrite(rec, sizeof(char), length, log_file);
+	fflush(log_file);
+	pthread_cleanup_pop(1);
+}
+
 /** Si occupa di svuotare il buffer, terminando la scrittura sul file di log
  * e di chiudere log_file.
  * \param a	il puntatore al file utilizzato come log
@@ -549,8 +1396,7 @@ void writer_clean(void *a) {
 	while(writer_buffer->length > 0) { /*Quando è a zero, termina. Altrimenti si sospenderebbe a tempo indefinito*/
 		msg = read_Buffer(writer_buffer);
 		if (msg->type == MSG_BCAST || msg->type == MSG_TO_ONE){
-			fprintf(log_file, "%s:%s:%s\n", msg->sender, msg->receiver, msg->buffer);
-			fflush(log_file);
+			writeLog(log_file, msg);
 		} else {
 			printf("msgserver: sono accettati solo messaggi broadcast e verso singoli utenti");
 		}
@@ -583,10 +1429,8 @@ void* writer(void * log_path) {
 			/*Questo cleanup è specificato per prevenire allocazioni di memoria nel caso in cui
 			 * arrivi un segnale di terminazione mentre il worker ancora esegue.*/
 			pthread_cleanup_push(&free_Message, (void*) msg);
-			if (msg->type == MSG_BCAST || msg->type == MSG_TO_ONE)	{
-				fprintf(log_file, "%s:%s:%s\n", msg->sender, msg->receiver, msg->buffer);
-				fflush(log_file);
-			}
+			if (msg->type == MSG_BCAST || msg->type == MSG_TO_ONE)
+				writeLog(log_file, msg);
 			pthread_cleanup_pop(1);
 		}				
 	}
@@ -594,252 +1438,1890 @@ void* writer(void * log_path) {
 	return (void *) 0;
 }
 
-/*Worker si specializzerà in più thread (uno per ogni utente*/
-void *worker(void *h) {
-	message_t msg;
-	elem_t *hash_element = h;
-	elem_t **sl;
-	char *username;
-	int *user_socket;
-	if (hash_element == NULL || hash_element->key == NULL || hash_element->payload == NULL){
-		errno = EINVAL;
-		perror("msgserver, worker");
-		pthread_exit((void *) -1);
-	}
-	
-	sl = hash_element->payload; /*Elemento socket_lock relativo all'utente*/
-	user_socket = (*sl)->key;
-	username = hash_element->key;
-	
-	while(1) {
-		int res;
-		if ((res = receiveMessage(*user_socket, &msg)) >= 0) { /*Allocazione di msg.buffer*/
-			char *receiver;
-			switch (msg.type) {
-				case MSG_TO_ONE:
-					receiver = normalizeToOne(&msg);
-					break;
-				case MSG_EXIT:
-					disconnectUser(username);
-					pthread_exit((void*)0);
-				case MSG_LIST:
-					normalizeList(&msg); 
-					receiver = username;/*Il destinatario del messaggio che invieremo è l'utente stesso che l'ha mandato.*/
-					break;
-				case MSG_BCAST: /*Il formato dovrebbe già essere consistente*/
-					break;
-				default:
-					errno = EINVAL; 
-					continue;
-			}
-						
-			if (msg.type == MSG_TO_ONE && receiver == NULL) { /*Evidentemente il messaggio non aveva una sintassi corretta.*/
-				free(msg.buffer);
-				sendError(6, hash_element->payload, username);
-				continue;
-			}
-			/*Ora abbiamo un messaggio "normale" da gestire. Verrà formattato in
-			 * maniera differente a seconda del tipo.*/
-			if (msg.type == MSG_BCAST) {
-				char * original_buffer = msg.buffer;
-				int original_length = msg.length, i;
-				/*Scorrimento HASH*/
-				for (i = 0; i < users_table->size; i++) {
-				tableWait();
-					if (users_table->table[i] != NULL) {
-						elem_t *aux = users_table->table[i]->head;
-						while (aux != NULL) {
-							elem_t **rsl;
-							rsl = aux->payload;
-							tableSignal();
-							if (rsl != NULL && *rsl != NULL) {
-								/*Niente di ciò dovrebbe mai poter accadere. */
-								switch (sendClient(&msg, username, aux)) {
-									case -2:
-										sendError(3, *sl, receiver); break;
-									case -1:
-										sendError(5, *sl, receiver); break;
-									default:
-										break;
-								}	
-								/*Ritorniamo al formato precedente*/
-								free(msg.buffer);
-								msg.buffer = original_buffer;
-								msg.length = original_length;
-							}
-							tableWait();
-							aux = aux->next;
-						}
-					}
-					tableSignal();
-				}
-				free(original_buffer);
-			} else {
-				elem_t *k;
-				tableWait();
-					k = hashElement(users_table, receiver);
-				tableSignal();
-				if (k == NULL) {
-					sendError(3, *sl, receiver);
-				} else {
-					switch (sendClient(&msg, username, k)) {
-						case -2:
-							sendError(3, *sl, receiver); break;
-						case -1:
-							sendError(5, *sl, receiver); break;
-					}
-				}
-				free(msg.buffer);
-				if (msg.type != MSG_LIST) /*Nel caso contrario, liberiamo "mai".*/
-					free(receiver);
-						
+/** Completa gli invii di un gruppo di destinatari di un broadcast: ne
+ * attende i completamenti, rilascia le sessioni, registra nel log i messaggi
+ * consegnati e segnala al mittente quelli falliti.
+ * \param r l'anello su cui sono stati sottomessi gli invii
+ * \param f i destinatari (l'user_data di ogni invio e` l'indice in f + 1)
+ * \param n il numero di destinatari
+ * \param msg il messaggio originale (non formattato)
+ * \param sender il mittente
+ * \param sender_session la sessione del mittente
+ * */
+void flushFanout(uring_t *r, fanout_t *f, int n, message_t *msg, char *sender, session_rec *sender_session) {
+	struct io_uring_cqe *cqe;
+	int i, done = 0;
+	if (n == 0) return;
+	if (submit_Uring(r, n) == -1) perror("msgserv, flushFanout");
+	while (done < n) {
+		if ((cqe = peek_Cqe(r)) == NULL) {
+			if (submit_Uring(r, 1) == -1 && errno != EINTR) {
+				perror("msgserv, flushFanout");
+				break;
 			}
-		} else {
-			if (res == SEOF) {
-				disconnectUser(username);
-				pthread_exit((void*)-1);
-			} else if (errno != EINTR) {
-				disconnectUser(username);
-				perror("msgserver, worker");
-				pthread_exit((void *)-1);
-			}		
+			continue;
+		}
+		if (cqe->user_data > 0 && cqe->user_data <= (__u64) n) {
+			f[cqe->user_data-1].result = cqe->res;
+			done++;
 		}
+		seen_Cqe(r);
+	}
+	for (i = 0; i < n; i++) {
+		countDelivery(f[i].session, (f[i].result > 0) ? f[i].result : -1);
+		release_Session(f[i].session);
+	}
+	/*Solo ora, senza sessioni acquisite, possiamo scrivere al mittente*/
+	for (i = 0; i < n; i++) {
+		if (f[i].result > 0)
+			logDelivery(msg, sender, f[i].user->key);
+		else
+			sendError(5, sender_session, f[i].user->key);
 	}
-	pthread_exit((void *) 0);
 }
 
-/** Thread che si occupa della ricezione delle connessioni e della creazione, 
- * per ogni utente, di un thread che gestisca le richieste di questi.
- */
-void* dispatcher(void *args) {
-	message_t msg;
-	elem_t* element;
-	int fd;
-	/** Iniziamo tentando di creare la socket. Qualora non fosse possibile,
-	 * continuare non ha senso. CreateServerChannel fa già tutti i tentativi
-	 * possibili per connettersi da se.*/
-	if((fd = createServerChannel(SOCKET)) <= 0) {
-		perror("msgserver, dispatcher");
-		printf("Tentativo di creazione della socket %s fallito.\n", SOCKET);
-		exit(-1);
-	}
-	pthread_cleanup_push(&CloseSocket, &fd);
-	listWait();
-		users_list_length = strlen(LIST_FORMAT);
-		users_list = Malloc(sizeof(char)*(users_list_length+1)); /*Viene pulito all'uscita del programma, essendo una struttura globale*/
-		strncpy(users_list, LIST_FORMAT, users_list_length+1);
-	listSignal();
-	/* Il ciclo infinito seguente riceve le connessioni, e se rispettano
-	 * il protocollo le accetta. Inoltre, non appena è possibile, passa
-	 * le competenze al thread worker dell'utente connesso*/
-	while (1) {
-		pthread_t worker_id;
-		int current_socket; 
-		
-		/*Non è stato possibile stabilire la connessione iniziale*/
-		if ((current_socket = acceptConnection(fd)) == -1) {
-			perror("msgserver, dispatcher");
-			continue;
+/** Prepara in m il frame di msg, nel formato della versione version
+ * (replyHeader), per tutte le sendmsg di un broadcast.
+ * \param iov i due vettori del frame: intestazione e buffer
+ * \param header l'intestazione (almeno PROTO_HEADER_SIZE byte) */
+void fanoutFrame(struct msghdr *m, struct iovec *iov, char *header, message_t *msg, int version) {
+	int body;
+	iov[0].iov_base = header;
+	iov[0].iov_len = replyHeader(header, msg, version, &body);
+	iov[1].iov_base = msg->buffer;
+	iov[1].iov_len = body;
+	memset(m, 0, sizeof(*m));
+	m->msg_iov = iov;
+	m->msg_iovlen = 2;
+}
+
+/** Confronta due destinatari di un broadcast per indirizzo della sessione.*/
+static int compareFanout(const void *a, const void *b) {
+	uintptr_t x = (uintptr_t) ((const fanout_t *) a)->session;
+	uintptr_t y = (uintptr_t) ((const fanout_t *) b)->session;
+	return (x > y) - (x < y);
+}
+
+/** Invia un broadcast a tutti gli utenti connessi tramite io_uring: il
+ * messaggio viene formattato una sola volta e gli invii sono sottomessi
+ * all'anello a gruppi di FANOUT_BATCH, con una sola system call per gruppo.
+ * Ogni gruppo acquisisce le sessioni dei suoi destinatari in ordine di
+ * indirizzo e le rilascia tutte prima del gruppo successivo: l'ordine
+ * dell'istantanea no, cambia quando un utente esce e rientra, e due
+ * broadcast concorrenti potrebbero attendersi a vicenda.
+ * \param r l'anello da usare per gli invii
+ * \param msg il messaggio ricevuto (non formattato)
+ * \param sender il mittente
+ * \param sender_session la sessione del mittente
+ * */
+void broadcastUring(uring_t *r, message_t *msg, char *sender, session_rec *sender_session) {
+	fanout_t f[FANOUT_BATCH];
+	message_t out = *msg, packed;
+	char header[4][PROTO_HEADER_SIZE];
+	struct iovec iov[4][2];
+	struct msghdr m[4];
+	cow_snapshot *snap;
+	int i, j, n, k, wire;
+	if (formatMessage(&out, sender) == -1) return;
+	/*Il frame e` identico per tutti i destinatari con lo stesso formato: un
+	 * msghdr condiviso per versione, e per la versione compressa se i
+	 * client che la accettano ne hanno una (indici WIRE_V2 e WIRE_PACKED)*/
+	packed.buffer = NULL;
+	if (pack_threshold > 0 && out.length >= pack_threshold) (void) packMessage(&out, &packed);
+	for (i = 0; i < 4; i++)
+		fanoutFrame(m+i, iov[i], header[i], (packed.buffer != NULL && (i & WIRE_PACKED)) ? &packed : &out,
+			(i & WIRE_V2) ? PROTO_VERSION : 1);
+	snap = acquire_CowSet(connected_users);
+	for (i = 0; i < snap->size; ) {
+		for (n = 0; n < FANOUT_BATCH && i < snap->size; n++, i++) {
+			f[n].user = snap->items[i];
+			f[n].session = f[n].user->payload;
+			f[n].result = -1;
 		}
-		
-		/*Il primo messaggio ricevuto, una volta stabilita la connessione,
-		 * deve essere del tipo MSG_CONNECT, altrimenti si procede a mostrare
-		 * un errore, in quanto il protocollo non è stato rispettato.*/
-		
-		if (receiveMessage(current_socket, &msg) >= 0 && msg.type == MSG_CONNECT) { 
-			
-			/*Il messaggio iniziale non è valido. L'utente dovrà tentare a riconnettersi*/
-			if (msg.length == 0) {
-				sendSocketError(current_socket, 0);
-				closeSocket(current_socket);
-				free(msg.buffer);
+		qsort(f, n, sizeof(fanout_t), &compareFanout);
+		/*Restano in f, nello stesso ordine, i destinatari con un invio*/
+		for (j = k = 0; j < n; j++) {
+			struct io_uring_sqe *sqe;
+			int socket;
+			if ((socket = acquire_Session(f[j].session)) == -1) continue;
+			if ((sqe = get_Sqe(r)) == NULL) {
+				release_Session(f[j].session);
 				continue;
 			}
-						
-			/* Se si trova un record nella tabella hash, allora il nome
-			 * utente inserito è valido. Tuttavia, potrebbe darsi che 
-			 * ci sia un'altro utente connesso con lo stesso nome. In tal caso,
-			 * ovviamente, mandiamo un messaggio di errore e andiamo oltre*/
-			 
-			/*Qua non è necessario accedere in mutua esclusione, a meno che non si verifichino delle parti
-			 * interne. Questo perché non è prevista la cancellazione di una chiave dalla tabella hash*/
-			if ((element = hashElement(users_table, msg.buffer)) != NULL) {
-				elem_t **sl_pointer;
-				int connected = 0;
-				char *username = msg.buffer;
-				tableWait();
-					connected = ((elem_t **) element->payload) != NULL;
-				tableSignal();
-				if (connected) {
-					elem_t **tmp;
-					tmp = element->payload;
-					if (tmp == NULL || *tmp == NULL) {
-						connected = 0;
-					} else {
-						socketWait(msg_locks);
-							connected = connected && (*tmp != NULL);
-						socketSignal(msg_locks);
+			wire = wireSocket(socket);
+			prep_Sendmsg(sqe, socket, m + (wire & (WIRE_V2 | WIRE_PACKED)), k+1);
+			f[k++] = f[j];
+		}
+		flushFanout(r, f, k, msg, sender, sender_session);
+	}
+	release_Snapshot(snap);
+	free(out.buffer);
+	free(packed.buffer);
+}
+
+/** Esito della consegna tramite l'anello del broadcast orig di flow
+ * all'utente user (un elemento di users_table): come per i broadcast
+ * consegnati uno per uno, la consegna viene registrata nel log oppure il
+ * mittente riceve l'errore 3 (l'utente non riceve piu` messaggi) o 5.*/
+void ringDelivery(shared_msg *orig, const void *flow, void *user, int result) {
+	elem_t *receiver = user, *sender;
+	if (receiver == NULL) return;
+	if (result > 0) {
+		logDelivery(&orig->msg, (char *) flow, receiver->key);
+		return;
+	}
+	if ((sender = hashElement(users_table, (void *) flow)) != NULL)
+		sendError((result == SEOF) ? 3 : 5, sender->payload, receiver->key);
+}
+
+/** Invia un broadcast tramite le mailbox: il messaggio, formattato una sola
+ * volta, viene pubblicato sull'anello da cui lo legge la mailbox di ogni
+ * utente connesso. L'esito per ciascuno arriva a ringDelivery.
+ * \param msg il messaggio ricevuto (non formattato): se viene pubblicato,
+ *        il suo buffer passa all'anello (e msg->buffer diventa NULL)
+ * \param sender il mittente
+ * */
+void broadcastRing(message_t *msg, char *sender) {
+	shared_msg *frame, *orig;
+	if ((frame = shareBroadcast(msg, sender)) == NULL) return;
+	orig = share_Message(msg);
+	if (publish_Ring(couriers, frame, orig, sender) == -1)
+		perror("msgserv, broadcastRing");
+	release_Shared(orig);
+	release_Shared(frame);
+}
+
+void broadcastParallel(message_t *msg, char *sender, session_rec *sender_session);
+
+/** Gestisce un messaggio ricevuto dall'utente rappresentato da hash_element:
+ * lo interpreta, lo inoltra ai destinatari e ne libera il buffer.
+ * E` il corpo comune a worker e agli event loop.
+ * \param hash_element l'elemento della tabella hash del mittente
+ * \param session la sessione del mittente
+ * \param msg il messaggio ricevuto
+ * \param batch anello su cui inviare in blocco i broadcast, NULL per
+ * inviarli uno alla volta (o tramite il pool di consegna, se attivo)
+ *
+ * \retval 0 se l'utente resta connesso
+ * \retval 1 se l'utente si e` disconnesso (MSG_EXIT)
+ * */
+int handleMessage(elem_t *hash_element, session_rec *session, message_t *msg, uring_t *batch) {
+	char *username = hash_element->key;
+	char *receiver = NULL;
+	elem_t *target = NULL;
+	char unknown[USERID_NAME];
+	long id;
+	switch (msg->type) {
+		case MSG_TO_ONE:
+			receiver = normalizeToOne(msg);
+			break;
+		case MSG_TO_ID:
+			/*Il destinatario si trova per indice: il nome non va copiato ne` cercato*/
+			if ((id = takeUserId(msg)) == -1) {
+				free(msg->buffer);
+				sendError(6, session, username);
+				return 0;
+			}
+			if ((target = userById(id)) == NULL) {
+				free(msg->buffer);
+				snprintf(unknown, USERID_NAME, "#%ld", id);
+				sendError(3, session, unknown);
+				return 0;
+			}
+			receiver = target->key;
+			break;
+		case MSG_EXIT:
+			disconnectUser(username);
+			return 1;
+		case MSG_LIST: {
+			shared_msg *list;
+			free(msg->buffer);
+			/*La risposta è condivisa: all'utente ne va solo un riferimento*/
+			list = listFrame();
+			if (deliverShared(list, username, hash_element) == -1)
+				sendError(5, session, username);
+			release_Shared(list);
+			return 0;
+		}
+		case MSG_BCAST: /*Il formato dovrebbe già essere consistente*/
+			break;
+		default:
+			errno = EINVAL; 
+			free(msg->buffer);
+			return 0;
+	}
+				
+	if (msg->type == MSG_TO_ONE && receiver == NULL) { /*Evidentemente il messaggio non aveva una sintassi corretta.*/
+		free(msg->buffer);
+		sendError(6, session, username);
+		return 0;
+	}
+	/*Ora abbiamo un messaggio "normale" da gestire. Verrà formattato in
+	 * maniera differente a seconda del tipo.*/
+	if (msg->type == MSG_BCAST && couriers != NULL) {
+		broadcastRing(msg, username);
+		free(msg->buffer);
+	} else if (msg->type == MSG_BCAST && batch != NULL) {
+		broadcastUring(batch, msg, username, session);
+		free(msg->buffer);
+	} else if (msg->type == MSG_BCAST && fanout_pool != NULL) {
+		broadcastParallel(msg, username, session);
+		free(msg->buffer);
+	} else if (msg->type == MSG_BCAST) {
+		shared_msg *frame;
+		cow_snapshot *snap;
+		int i;
+		/*Il messaggio viene formattato una sola volta e il buffer condiviso
+		 * da tutti i destinatari: l'ultimo che lo rilascia lo libera*/
+		if ((frame = shareBroadcast(msg, username)) == NULL) {
+			free(msg->buffer);
+			return 0;
+		}
+		/*Scorrimento degli utenti connessi*/
+		snap = acquire_CowSet(connected_users);
+		for (i = 0; i < snap->size; i++) {
+			elem_t *aux = snap->items[i];
+			/*Un utente disconnesso dopo l'istantanea riceve l'errore 3*/
+			switch (deliverShared(frame, username, aux)) {
+				case -2:
+					sendError(3, session, aux->key); break;
+				case -1:
+					sendError(5, session, aux->key); break;
+				case 0:
+					break;
+				default:
+					logDelivery(msg, username, aux->key);
+					break;
+			}
+		}
+		release_Snapshot(snap);
+		release_Shared(frame);
+		free(msg->buffer);
+	} else {
+		elem_t *k = (target != NULL) ? target : findUser(receiver);
+		if (k == NULL) {
+			sendError(3, session, receiver);
+		} else {
+			switch (sendClient(msg, username, k)) {
+				case -2:
+					sendError(3, session, receiver); break;
+				case -1:
+					sendError(5, session, receiver); break;
+			}
+		}
+		free(msg->buffer);
+		/*Il nome di un destinatario per identificativo e` la chiave nella tabella*/
+		if (target == NULL) free(receiver);
+	}
+	return 0;
+}
+
+/** Accoda al blocco in riempimento il record di log di msg e lo libera.*/
+void appendLog(uring_log *w, message_t_expanded *msg) {
+	int c = w->cur, n;
+	char *rec;
+	if (msg->type == MSG_BCAST || msg->type == MSG_TO_ONE) {
+		rec = logRecord(msg, &n);
+		if (w->length[c] + n + 1 > w->capacity[c]) {
+			char *old = w->chunk[c];
+			w->capacity[c] = w->length[c] + n + 1 + LOG_CHUNK;
+			w->chunk[c] = Malloc(sizeof(char)*w->capacity[c]);
+			memcpy(w->chunk[c], old, w->length[c]);
+			free(old);
+		}
+		memcpy(w->chunk[c]+w->length[c], rec, n);
+		w->length[c] += n;
+		free(rec);
+	}
+	free_Message(msg);
+}
+
+/** Attende il completamento della scrittura in corso, riprendendo da dove
+ * si era fermata nel caso (raro, su file) di scrittura parziale.*/
+void completeLog(uring_log *w) {
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	int c = 1 - w->cur, done = 0, res;
+	while (w->inflight) {
+		if (submit_Uring(&w->ring, 1) == -1 || (cqe = peek_Cqe(&w->ring)) == NULL) {
+			perror("msgserv, completeLog");
+			break;
+		}
+		res = cqe->res;
+		seen_Cqe(&w->ring);
+		if (res < 0) {
+			errno = -res;
+			perror("msgserv, completeLog");
+			break;
+		}
+		done += res;
+		if (done >= w->length[c] || (sqe = get_Sqe(&w->ring)) == NULL) break;
+		prep_Write(sqe, fileno(w->file), w->chunk[c]+done, w->length[c]-done, 1);
+	}
+	w->length[c] = 0;
+	w->inflight = 0;
+}
+
+/** Sottomette la scrittura del blocco in riempimento, senza attenderla, e
+ * passa a riempire l'altro.*/
+void submitLog(uring_log *w) {
+	struct io_uring_sqe *sqe;
+	if ((sqe = get_Sqe(&w->ring)) == NULL) {
+		perror("msgserv, submitLog");
+		return;
+	}
+	prep_Write(sqe, fileno(w->file), w->chunk[w->cur], w->length[w->cur], 1);
+	if (submit_Uring(&w->ring, 0) == -1) {
+		perror("msgserv, submitLog");
+		return;
+	}
+	w->inflight = 1;
+	w->cur = 1 - w->cur;
+}
+
+/** Cleanup dello scrittore io_uring: completa la scrittura in corso, rilascia
+ * l'anello e lascia a writer_clean lo svuotamento del buffer.*/
+void uringWriter_clean(void *a) {
+	uring_log *w = a;
+	completeLog(w);
+	free_Uring(&w->ring);
+	free(w->chunk[0]);
+	free(w->chunk[1]);
+	writer_clean(w->file);
+}
+
+/** Variante di writer per la modalità MODE_URING: i record vengono
+ * raccolti in blocchi e scritti nel log tramite io_uring, cosi` che la
+ * scrittura di un blocco proceda mentre si riempie il successivo.
+ * \param log_path il file di log su cui scrivere
+ * */
+void* uringWriter(void * log_path) {
+	uring_log w;
+	int i;
+	if (log_path == NULL) {
+		errno = EINVAL;
+		perror("msgserv, uringWriter");
+		pthread_exit((void *) -1);
+	}
+	w.file = Fopen((const char *) log_path, LOG_OPENING_MODE);
+	if (w.file == NULL) {
+		perror("msgserver, uringWriter");
+		printf("Il file di log '%s' specificato non è valido.\n", (char *) log_path);
+		exit(-1);
+	}
+	if (initialize_Uring(&w.ring, 8) == -1) {
+		perror("msgserver, uringWriter");
+		exit(-1);
+	}
+	for (i = 0; i < 2; i++) {
+		w.capacity[i] = LOG_CHUNK;
+		w.chunk[i] = Malloc(sizeof(char)*LOG_CHUNK);
+		w.length[i] = 0;
+	}
+	w.cur = w.inflight = 0;
+	pthread_cleanup_push(&uringWriter_clean, &w);
+	while(1) {
+		/*Senza scritture in corso ci si puo` sospendere in attesa di un record
+		 * (read_Buffer e` l'unico punto di cancellazione del ciclo)*/
+		if (!w.inflight)
+			appendLog(&w, read_Buffer(writer_buffer));
+		while (writer_buffer->length > 0 && w.length[w.cur] < LOG_CHUNK)
+			appendLog(&w, read_Buffer(writer_buffer));
+		if (w.inflight) completeLog(&w);
+		if (w.length[w.cur] > 0) submitLog(&w);
+	}
+	pthread_cleanup_pop(1);
+	return (void *) 0;
+}
+
+/** Consegna una parte dei destinatari di un broadcast. L'ultimo task a
+ * terminare libera il broadcast e riattiva la coda del mittente.*/
+void broadcastChunk(void *arg) {
+	bcast_chunk *chunk = arg;
+	bcast_job *job = chunk->job;
+	serial_queue *serial;
+	int i;
+	for (i = chunk->first; i < chunk->first + chunk->n; i++) {
+		switch (deliverShared(job->frame, job->sender, job->users[i])) {
+			case -2:
+				sendError(3, job->sender_session, job->users[i]->key); break;
+			case -1:
+				sendError(5, job->sender_session, job->users[i]->key); break;
+			case 0:
+				break;
+			default:
+				logDelivery(&job->msg, job->sender, job->users[i]->key);
+				break;
+		}
+	}
+	free(chunk);
+	if (job->serial == NULL) {
+		/*Il mittente attende il termine e liberera` il broadcast*/
+		pthread_mutex_lock(&job->done_mtx);
+			if (--job->remaining == 0) pthread_cond_signal(&job->done);
+		pthread_mutex_unlock(&job->done_mtx);
+		return;
+	}
+	if (__atomic_sub_fetch(&job->remaining, 1, __ATOMIC_SEQ_CST) > 0) return;
+	serial = job->serial;
+	release_Shared(job->frame);
+	free(job->msg.buffer);
+	release_Snapshot(job->snap);
+	free(job);
+	resume_Serial(serial);
+}
+
+/** Prepara il broadcast msg del mittente sender: raccoglie i
+ * destinatari connessi e formatta il messaggio una sola volta.
+ * \retval NULL se non ci sono destinatari o in caso di errore (il buffer
+ *         di msg resta al chiamante) */
+bcast_job *newBroadcast(message_t *msg, char *sender, session_rec *sender_session) {
+	bcast_job *job;
+	job = Malloc(sizeof(bcast_job));
+	job->msg = *msg;
+	job->frame = NULL;
+	job->sender = sender;
+	job->sender_session = sender_session;
+	job->serial = NULL;
+	/*I destinatari sono gli elementi dell'istantanea: nessuna copia*/
+	job->snap = acquire_CowSet(connected_users);
+	job->users = (elem_t **) job->snap->items;
+	job->n = job->snap->size;
+	/*Il messaggio viene formattato una sola volta, per tutti i gruppi*/
+	if (job->n == 0 || (job->frame = shareBroadcast(msg, sender)) == NULL) {
+		release_Snapshot(job->snap);
+		free(job);
+		return NULL;
+	}
+	return job;
+}
+
+/** Divide i destinatari di job in gruppi di al piu` chunk utenti, ognuno
+ * consegnato da un task di p.*/
+void submitBroadcast(work_pool *p, bcast_job *job, int chunk) {
+	int i;
+	job->remaining = (job->n + chunk - 1) / chunk;
+	for (i = 0; i < job->n; i += chunk) {
+		bcast_chunk *c = Malloc(sizeof(bcast_chunk));
+		c->job = job;
+		c->first = i;
+		c->n = (job->n - i < chunk) ? job->n - i : chunk;
+		submit_Task(p, &broadcastChunk, c);
+	}
+}
+
+/** Invia un broadcast tramite il pool di consegna: i destinatari connessi
+ * sono divisi tra i suoi thread (in gruppi di al piu` BCAST_CHUNK, che i
+ * thread inattivi possono rubare) e il mittente attende che tutti siano
+ * stati serviti, cosi` che i suoi messaggi successivi non sorpassino il
+ * broadcast.
+ * \param msg il messaggio ricevuto (non formattato, resta al chiamante)
+ * \param sender il mittente
+ * \param sender_session la sessione del mittente
+ * */
+void broadcastParallel(message_t *msg, char *sender, session_rec *sender_session) {
+	bcast_job *job;
+	int chunk, state;
+	if ((job = newBroadcast(msg, sender, sender_session)) == NULL) return;
+	/*Ogni thread riceve la sua parte; con molti utenti i gruppi restano
+	 * piccoli, cosi` che chi finisce prima aiuti gli altri*/
+	chunk = (job->n + fanout_threads - 1) / fanout_threads;
+	if (chunk > BCAST_CHUNK) chunk = BCAST_CHUNK;
+	pthread_mutex_init(&job->done_mtx, NULL);
+	pthread_cond_init(&job->done, NULL);
+	/*I task useranno job fino all'ultimo: l'attesa non va interrotta*/
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	submitBroadcast(fanout_pool, job, chunk);
+	pthread_mutex_lock(&job->done_mtx);
+		while (job->remaining > 0)
+			pthread_cond_wait(&job->done, &job->done_mtx);
+	pthread_mutex_unlock(&job->done_mtx);
+	pthread_setcancelstate(state, NULL);
+	pthread_mutex_destroy(&job->done_mtx);
+	pthread_cond_destroy(&job->done);
+	release_Shared(job->frame);
+	release_Snapshot(job->snap);
+	free(job);
+}
+
+/** Invia un broadcast tramite il pool: i destinatari connessi sono divisi
+ * in gruppi di BCAST_CHUNK, ognuno consegnato da un task che gli altri
+ * thread possono rubare. La coda del mittente resta sospesa finche` tutti
+ * i gruppi non sono stati consegnati, cosi` che i suoi messaggi successivi
+ * non possano sorpassare il broadcast.
+ * \param c la connessione del mittente
+ * \param msg il messaggio ricevuto (il buffer passa al broadcast)
+ * */
+void broadcastPool(connection_t *c, message_t *msg) {
+	bcast_job *job;
+	if ((job = newBroadcast(msg, c->hash_element->key, c->session)) == NULL) {
+		free(msg->buffer);
+		return;
+	}
+	job->serial = c->serial;
+	hold_Serial(c->serial);
+	submitBroadcast(pool, job, BCAST_CHUNK);
+}
+
+/** Task del pool che gestisce un messaggio ricevuto, nell'ordine di arrivo
+ * rispetto agli altri messaggi dello stesso utente.*/
+void routeTask(void *arg) {
+	route_task *t = arg;
+	connection_t *c = t->c;
+	if (c->exited)
+		free(t->msg.buffer);
+	else if (t->msg.type == MSG_BCAST && couriers == NULL)
+		broadcastPool(c, &t->msg);
+	else if (handleMessage(c->hash_element, c->session, &t->msg, NULL) == 1)
+		c->exited = 1;
+	creditClient(c);
+	free(t);
+}
+
+void closeConnection(connection_t *c);
+
+/** Chiave di un utente negli stadi della pipeline: i suoi elementi sono
+ * gestiti, nell'ordine di arrivo, sempre dallo stesso thread dello stadio.*/
+unsigned int pipeKey(elem_t *user) {
+	return hash_string(user->key, UINT_MAX);
+}
+
+/** Rilascia una consegna di frame: l'ultima libera il messaggio.*/
+void releaseFrame(pipe_frame *frame) {
+	if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+	release_Shared(frame->formatted);
+	free(frame->msg.buffer);
+	free(frame);
+}
+
+/** Notifica al mittente di un messaggio un errore, se e` ancora connesso.*/
+void pipeError(int errcode, elem_t *sender, char *about) {
+	(void) sendError(errcode, sender->payload, about);
+}
+
+/** Passa d allo stadio deliver, nella coda del suo destinatario.*/
+void pipeDeliver(pipe_delivery *d) {
+	if (enqueue_Stage(stages[PIPE_DELIVER], pipeKey(d->user), d) == 0) return;
+	/*Il server sta terminando*/
+	if (d->frame != NULL) releaseFrame(d->frame);
+	free(d->about);
+	free(d);
+}
+
+/** Passa m allo stadio next, nella coda del mittente.*/
+void pipeForward(int next, pipe_msg *m) {
+	if (enqueue_Stage(stages[next], pipeKey(m->sender), m) == 0) return;
+	/*Il server sta terminando: la connessione viene abbandonata*/
+	free(m->msg.buffer);
+	free(m->receiver);
+	free(m->users);
+	free(m);
+}
+
+/** Stadio decode: interpreta il messaggio ricevuto (destinatario di un
+ * MSG_TO_ONE, risposta a un MSG_LIST).*/
+void decodeStage(void *item) {
+	pipe_msg *m = item;
+	long id;
+	if (m->kind == PIPE_MESSAGE) {
+		switch (m->msg.type) {
+			case MSG_TO_ONE:
+				if ((m->receiver = normalizeToOne(&m->msg)) == NULL) {
+					/*Evidentemente il messaggio non aveva una sintassi corretta.*/
+					m->kind = PIPE_ERROR;
+					m->errcode = 6;
+				}
+				break;
+			case MSG_TO_ID:
+				if ((id = takeUserId(&m->msg)) == -1) {
+					m->kind = PIPE_ERROR;
+					m->errcode = 6;
+				} else if ((m->target = userById(id)) == NULL) {
+					m->kind = PIPE_ERROR;
+					m->errcode = 3;
+					m->receiver = Malloc(sizeof(char)*USERID_NAME);
+					snprintf(m->receiver, USERID_NAME, "#%ld", id);
+				}
+				break;
+			case MSG_LIST:
+				/*La risposta viene presa dalla cache nello stadio format*/
+				free(m->msg.buffer);
+				m->msg.buffer = NULL;
+				m->msg.length = 0;
+				break;
+			case MSG_BCAST:
+				break;
+			case MSG_EXIT:
+				m->kind = PIPE_EXIT;
+				break;
+			default:
+				creditClient(m->c);
+				free(m->msg.buffer);
+				free(m);
+				return;
+		}
+		if (m->msg.type != MSG_EXIT) creditClient(m->c);
+		if (m->kind != PIPE_MESSAGE) {
+			free(m->msg.buffer);
+			m->msg.buffer = NULL;
+		}
+	}
+	pipeForward(PIPE_ROUTE, m);
+}
+
+/** Stadio route: sceglie i destinatari del messaggio.*/
+void routeStage(void *item) {
+	pipe_msg *m = item;
+	int i, size = BCAST_CHUNK;
+	if (m->kind != PIPE_MESSAGE) {
+		pipeForward(PIPE_FORMAT, m);
+		return;
+	}
+	m->users = Malloc(sizeof(elem_t*)*size);
+	if (m->msg.type == MSG_LIST) {
+		m->users[m->n++] = m->sender;
+	} else if (m->msg.type == MSG_TO_ONE) {
+		if ((m->users[0] = m->target) == NULL)
+			m->users[0] = findUser(m->receiver);
+		if (m->users[0] != NULL) m->n = 1;
+		else {
+			m->kind = PIPE_ERROR;
+			m->errcode = 3;
+		}
+	} else {
+		cow_snapshot *snap = acquire_CowSet(connected_users);
+		if (snap->size > size) {
+			size = snap->size;
+			m->users = realloc(m->users, sizeof(elem_t*)*size);
+			if (m->users == NULL) {
+				perror("msgserv, routeStage");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (i = 0; i < snap->size; i++)
+			m->users[m->n++] = snap->items[i];
+		release_Snapshot(snap);
+	}
+	pipeForward(PIPE_FORMAT, m);
+}
+
+/** Stadio format: formatta il messaggio una sola volta e crea una
+ * consegna per ogni destinatario.*/
+void formatStage(void *item) {
+	pipe_msg *m = item;
+	pipe_frame *frame;
+	pipe_delivery *d;
+	message_t out;
+	int i;
+	if (m->kind != PIPE_MESSAGE || m->n == 0) {
+		if (m->kind != PIPE_MESSAGE) {
+			d = Malloc(sizeof(pipe_delivery));
+			d->kind = m->kind;
+			d->c = m->c;
+			d->sender = d->user = m->sender;
+			d->frame = NULL;
+			d->errcode = m->errcode;
+			/*Per MSG_LIST il destinatario originale e` il mittente stesso*/
+			d->about = m->receiver;
+			m->receiver = NULL;
+			if (d->kind == PIPE_ERROR && d->about == NULL) {
+				d->about = Malloc(sizeof(char)*(strlen(m->sender->key)+1));
+				strcpy(d->about, m->sender->key);
+			}
+			pipeDeliver(d);
+		}
+		free(m->msg.buffer);
+		free(m->receiver);
+		free(m->users);
+		free(m);
+		return;
+	}
+	frame = Malloc(sizeof(pipe_frame));
+	frame->msg = out = m->msg;
+	/*formatMessage libera il buffer di un MSG_TO_ONE, che serve pero` al log*/
+	if (m->msg.type == MSG_TO_ONE) {
+		out.buffer = Malloc(sizeof(char)*(m->msg.length+1));
+		memcpy(out.buffer, m->msg.buffer, m->msg.length+1);
+	}
+	if (m->msg.type == MSG_LIST) {
+		/*La risposta a MSG_LIST e` gia` pronta, condivisa con le altre richieste*/
+		frame->formatted = listFrame();
+	} else if (formatMessage(&out, m->sender->key) == -1) {
+		if (out.buffer != frame->msg.buffer)
+			free(out.buffer);
+		free(frame->msg.buffer);
+		free(frame);
+		frame = NULL;
+	} else {
+		frame->formatted = share_Message(&out);
+		packShared(frame->formatted);
+	}
+	if (frame != NULL) {
+		frame->refs = m->n;
+		for (i = 0; i < m->n; i++) {
+			d = Malloc(sizeof(pipe_delivery));
+			d->kind = PIPE_MESSAGE;
+			d->c = NULL;
+			d->sender = m->sender;
+			d->user = m->users[i];
+			d->frame = frame;
+			d->errcode = 0;
+			d->about = NULL;
+			pipeDeliver(d);
+		}
+	}
+	free(m->receiver);
+	free(m->users);
+	free(m);
+}
+
+/** Stadio deliver: invia il messaggio al destinatario. Gestisce anche la
+ * fine delle connessioni, che segue cosi` le consegne gia` accodate.*/
+void deliverStage(void *item) {
+	pipe_delivery *d = item;
+	switch (d->kind) {
+		case PIPE_ERROR:
+			pipeError(d->errcode, d->sender, d->about);
+			break;
+		case PIPE_EXIT:
+			if (!d->c->exited) disconnectUser(d->sender->key);
+			d->c->exited = 1;
+			break;
+		case PIPE_CLOSE:
+			closeConnection(d->c);
+			break;
+		default:
+			switch (deliverShared(d->frame->formatted, d->sender->key, d->user)) {
+				case -2:
+					pipeError(3, d->sender, d->user->key); break;
+				case -1:
+					pipeError(5, d->sender, d->user->key); break;
+				case 0:
+					break;
+				default:
+					if (d->frame->msg.type == MSG_LIST) break;
+					/*Il log e` l'ultimo stadio: se rifiuta la consegna, la liberiamo qui*/
+					if (enqueue_Stage(stages[PIPE_LOG], pipeKey(d->user), d) == 0) return;
+					break;
+			}
+			releaseFrame(d->frame);
+	}
+	free(d->about);
+	free(d);
+}
+
+/** Stadio log: registra un messaggio consegnato.*/
+void logStage(void *item) {
+	pipe_delivery *d = item;
+	logDelivery(&d->frame->msg, d->sender->key, d->user->key);
+	releaseFrame(d->frame);
+	free(d);
+}
+
+/** Accoda allo stadio decode un elemento della connessione c.
+ * \param c la connessione del mittente
+ * \param kind PIPE_MESSAGE o PIPE_CLOSE
+ * \param msg il messaggio ricevuto (il buffer passa alla pipeline), NULL per PIPE_CLOSE
+ * */
+void pipeSubmit(connection_t *c, int kind, message_t *msg) {
+	pipe_msg *m = Malloc(sizeof(pipe_msg));
+	m->kind = kind;
+	m->c = c;
+	m->sender = c->hash_element;
+	m->msg.type = MSG_OK;
+	m->msg.buffer = NULL;
+	m->msg.length = 0;
+	if (msg != NULL) m->msg = *msg;
+	m->receiver = NULL;
+	m->target = NULL;
+	m->users = NULL;
+	m->n = 0;
+	m->errcode = 0;
+	pipeForward(PIPE_DECODE, m);
+}
+
+/** Avvia gli stadi della pipeline.
+ * \retval 0 se tutto ok, -1 in caso di errore */
+int initialize_Pipeline(void) {
+	static const char *names[PIPE_STAGES] = {"decode", "route", "format", "deliver", "log"};
+	static const stage_handler handlers[PIPE_STAGES] = {&decodeStage, &routeStage, &formatStage, &deliverStage, &logStage};
+	int i;
+	for (i = 0; i < PIPE_STAGES; i++)
+		if ((stages[i] = initialize_Stage(names[i], stage_threads[i], handlers[i])) == NULL)
+			return -1;
+	/*Gli stadi vengono avviati a partire dall'ultimo: ognuno trova attivo
+	 * quello a cui passa i propri elementi.*/
+	for (i = PIPE_STAGES-1; i >= 0; i--)
+		if (start_Stage(stages[i]) == -1)
+			return -1;
+	return 0;
+}
+
+/** Scrive su f le misure di ogni stadio della pipeline.*/
+void reportPipeline(FILE *f) {
+	int i;
+	if (stages[0] == NULL) return;
+	for (i = 0; i < PIPE_STAGES; i++)
+		report_Stage(stages[i], f);
+	fflush(f);
+}
+
+/** Ferma la pipeline: ogni stadio termina dopo aver svuotato le proprie
+ * code, nell'ordine in cui gli elementi li attraversano.*/
+void free_Pipeline(void) {
+	int i;
+	for (i = 0; i < PIPE_STAGES; i++)
+		stop_Stage(stages[i]);
+	reportPipeline(stdout);
+	for (i = 0; i < PIPE_STAGES; i++)
+		free_Stage(&stages[i]);
+}
+
+/** Passa un messaggio ricevuto da c al suo gestore: lo gestisce subito
+ * oppure, se il pool e` attivo, lo accoda come task alla coda seriale
+ * della connessione, se e` attiva la pipeline lo accoda al suo primo stadio.
+ * \param c la connessione che ha ricevuto il messaggio
+ * \param msg il messaggio (il buffer passa al gestore)
+ * \param batch come in handleMessage (ignorato con il pool, la pipeline e le mailbox)
+ *
+ * \retval 1 se la connessione non deve leggere altri messaggi (MSG_EXIT, o
+ *         il client ha superato la finestra concessa)
+ * \retval 0 altrimenti
+ * */
+int dispatchMessage(connection_t *c, message_t *msg, uring_t *batch) {
+	route_task *t;
+	mailbox *mb;
+	/*I crediti restituiti dal client riprendono gli invii della sua mailbox*/
+	if (msg->type == MSG_CREDIT) {
+		if ((mb = findMailbox(c->fd)) != NULL) credit_Mailbox(mb, creditValue(msg));
+		free(msg->buffer);
+		return c->stopped;
+	}
+	/*Come MSG_CREDIT, l'iscrizione alla presenza e la richiesta degli
+	 * identificativi non consumano crediti*/
+	if (msg->type == MSG_PRESENCE) {
+		free(msg->buffer);
+		subscribePresence(c->hash_element);
+		return c->stopped;
+	}
+	if (msg->type == MSG_USERIDS) {
+		free(msg->buffer);
+		(void) deliverShared(userids_frame, NULL, c->hash_element);
+		return c->stopped;
+	}
+	if (msg->type != MSG_EXIT && chargeClient(c) == -1) {
+		free(msg->buffer);
+		return c->stopped = 1;
+	}
+	if (stages[PIPE_DECODE] != NULL) {
+		if (msg->type == MSG_EXIT) c->stopped = 1;
+		pipeSubmit(c, PIPE_MESSAGE, msg);
+		return c->stopped;
+	}
+	/*Gli invii raccolti nell'anello scavalcherebbero le mailbox*/
+	if (couriers != NULL) batch = NULL;
+	if (pool == NULL) {
+		if (handleMessage(c->hash_element, c->session, msg, batch) == 1)
+			c->exited = c->stopped = 1;
+		else
+			creditClient(c);
+		return c->stopped;
+	}
+	t = Malloc(sizeof(route_task));
+	t->c = c;
+	t->msg = *msg;
+	if (msg->type == MSG_EXIT) c->stopped = 1;
+	submit_Serial(c->serial, &routeTask, t);
+	return c->stopped;
+}
+
+/** Chiude una connessione: se l'utente non ha inviato MSG_EXIT lo
+ * disconnette, poi chiude la socket e libera la connessione.*/
+void closeConnection(connection_t *c) {
+	serial_queue *serial = c->serial;
+	/*Da qui la ruota non tocca piu` c*/
+	cancel_Timer(heartbeats, &c->beat);
+	if (!c->exited)
+		disconnectUser(c->hash_element->key);
+	/*In modalità MODE_THREAD la socket non viene chiusa*/
+	closeMailbox(c->fd, server_mode != MODE_THREAD);
+	free_Reader(&c->reader);
+	free(c);
+	if (serial != NULL) release_Serial(serial);
+}
+
+/** Task del pool che chiude una connessione dopo i suoi messaggi.*/
+void closeTask(void *arg) {
+	closeConnection(arg);
+}
+
+/** Termina la lettura da c: la connessione viene chiusa subito oppure, con
+ * il pool o la pipeline, dopo la gestione dei messaggi gia` accodati.*/
+void endConnection(connection_t *c) {
+	c->stopped = 1;
+	if (stages[PIPE_DECODE] != NULL) pipeSubmit(c, PIPE_CLOSE, NULL);
+	else if (pool == NULL) closeConnection(c);
+	else submit_Serial(c->serial, &closeTask, c);
+}
+
+/*Worker si specializzerà in più thread (uno per ogni utente*/
+void *worker(void *h) {
+	message_t msg;
+	connection_t *c = h;
+	struct pollfd pfd;
+	if (c == NULL || c->hash_element == NULL || c->hash_element->key == NULL){
+		errno = EINVAL;
+		perror("msgserver, worker");
+		pthread_exit((void *) -1);
+	}
+	pfd.fd = c->fd;
+	pfd.events = POLLIN;
+	/*Il lettore conta anche i MSG_PING, che receiveMessage non mostrerebbe:
+	 * cosi` i battiti sanno se il client e` vivo*/
+	while(1) {
+		int res;
+		if ((res = readFrame(c->fd, &c->reader, &msg)) == 1) { /*Allocazione di msg.buffer*/
+			if (dispatchMessage(c, &msg, NULL) == 1)
+				break;
+		} else if (res == 0) {
+			if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+				perror("msgserver, worker");
+				break;
+			}
+		} else {
+			if (res == -1) perror("msgserver, worker");
+			break;
+		}
+	}
+	endConnection(c);
+	pthread_exit((void *) 0);
+}
+
+/** Il worker di un utente in modalità MODE_CORO: lo stesso ciclo di
+ * worker, ma eseguito come coroutine. Quando non ci sono messaggi completi
+ * la coroutine cede lo scheduler invece di bloccare il thread.
+ * \param a la connessione dell'utente
+ * */
+void coroWorker(void *a) {
+	connection_t *c = a;
+	message_t msg;
+	int res, handled = 0;
+	while (1) {
+		if ((res = readFrame(c->fd, &c->reader, &msg)) == 1) {
+			if (dispatchMessage(c, &msg, NULL) == 1)
+				break;
+			/*Un utente con molti messaggi in arrivo non monopolizza lo scheduler*/
+			if (++handled % LOOP_BURST == 0) yield_Coro();
+		} else if (res == 0) {
+			if (wait_Coro(c->fd, EPOLLIN | EPOLLRDHUP) == -1)
+				break;
+		} else {
+			if (res == -1) perror("msgserver, coroWorker");
+			break;
+		}
+	}
+	endConnection(c);
+}
+
+/** Gestore degli eventi di una connessione in modalita` epoll: legge
+ * tutti i messaggi completi disponibili e li passa a handleMessage.
+ * Alla disconnessione rimuove la socket dal loop e la chiude.
+ * \param l il loop a cui appartiene la connessione
+ * \param data la struttura connection_t della connessione
+ * \param events la maschera degli eventi epoll
+ * */
+void connectionEvent(event_loop *l, void *data, unsigned int events) {
+	connection_t *c = data;
+	message_t msg;
+	int res = 0, handled = 0;
+	(void) events;
+	/*Limitiamo i messaggi gestiti per risveglio, cosi` che un solo
+	 * utente non monopolizzi il loop: epoll e` level triggered e ci
+	 * risegnalera` la socket se restano dati da leggere.*/
+	while (handled < LOOP_BURST && (res = readFrame(c->fd, &c->reader, &msg)) == 1) {
+		handled++;
+		if (dispatchMessage(c, &msg, NULL) == 1)
+			break;
+	}
+	/*I messaggi gia` letti dalla socket vanno gestiti subito: epoll non
+	 * ci risveglierebbe per loro, ma solo per nuovi dati.*/
+	while (res == 1 && !c->stopped && (res = nextFrame(&c->reader, &msg)) == 1)
+		(void) dispatchMessage(c, &msg, NULL);
+	if (!c->stopped && (res == 0 || res == 1)) return;
+	if (res == -1) perror("msgserver, connectionEvent");
+	/*MSG_EXIT, SEOF o errore: la socket non appartiene piu` al loop*/
+	remove_LoopFd(l, c->fd);
+	endConnection(c);
+}
+
+/** Gestore dei dati ricevuti da una connessione in modalità MODE_URING:
+ * accoda i byte al lettore della connessione e passa a dispatchMessage i
+ * messaggi completi. Quando la ricezione termina chiude la connessione.
+ * \param l il loop io_uring a cui appartiene la connessione
+ * \param data la struttura connection_t della connessione
+ * \param bytes i byte ricevuti
+ * \param n il numero di byte ricevuti, <= 0 alla fine della ricezione
+ * */
+void uringEvent(uring_loop *l, void *data, const char *bytes, int n) {
+	connection_t *c = data;
+	message_t msg;
+	int res;
+	if (n > 0) {
+		if (c->stopped) return;
+		feedReader(&c->reader, bytes, n);
+		while ((res = nextFrame(&c->reader, &msg)) == 1) {
+			if (dispatchMessage(c, &msg, &l->send_ring) == 1)
+				break;
+		}
+		/*Un messaggio non valido chiude la connessione: la ricezione in
+		 * corso termina e ci riporta qui con n == 0*/
+		if (res == -1) {
+			perror("msgserver, uringEvent");
+			shutdown(c->fd, SHUT_RDWR);
+		}
+		return;
+	}
+	if (n < 0) {
+		errno = -n;
+		perror("msgserver, uringEvent");
+	}
+	endConnection(c);
+}
+
+/** Affida un utente appena connesso al suo gestore: un nuovo thread
+ * worker in modalità MODE_THREAD, una coroutine in modalità MODE_CORO,
+ * uno degli event loop nelle altre modalità.
+ * \param element l'elemento della tabella hash dell'utente
+ * \param session la sessione dell'utente
+ * \param fd la socket dell'utente
+ * \param window la finestra di messaggi concessa all'utente (0: nessun
+ *        controllo di flusso)
+ * \param version la versione del protocollo dei messaggi dell'utente
+ *
+ * \retval 0 se tutto ok
+ * \retval -1 in caso di errore (sets errno)
+ * */
+int startUser(elem_t *element, session_rec *session, int fd, int window, int version) {
+	pthread_t worker_id;
+	connection_t *c;
+	c = Malloc(sizeof(connection_t));
+	c->fd = fd;
+	c->window = window;
+	c->received = c->handled = c->granted = 0;
+	c->hash_element = element;
+	c->session = session;
+	c->exited = c->stopped = 0;
+	c->serial = (pool != NULL) ? new_Serial(pool) : NULL;
+	initialize_Reader(&c->reader);
+	c->reader.version = version;
+	c->reader.packet = packet_mode;
+	c->beat.next = NULL;
+	c->beat.data = c;
+	c->beat_frames = 0;
+	c->idle = 0;
+	/*Il timer si arma prima che la connessione passi al suo gestore, che
+	 * potrebbe chiuderla subito*/
+	if (heartbeats != NULL)
+		set_Timer(heartbeats, &c->beat, (heartbeat_interval + HEARTBEAT_TICK - 1) / HEARTBEAT_TICK);
+	if (server_mode == MODE_THREAD) {
+		if ((errno = pthread_create(&worker_id, NULL, &worker, c)) != 0) {
+			cancel_Timer(heartbeats, &c->beat);
+			free_Reader(&c->reader);
+			if (c->serial != NULL) release_Serial(c->serial);
+			free(c);
+			return -1;
+		}
+		pthread_detach(worker_id);
+		return 0;
+	}
+	if (server_mode == MODE_CORO) {
+		if (spawn_Coro(coros, &coroWorker, c) == -1) {
+			cancel_Timer(heartbeats, &c->beat);
+			free_Reader(&c->reader);
+			if (c->serial != NULL) release_Serial(c->serial);
+			free(c);
+			return -1;
+		}
+		return 0;
+	}
+	/*Da questo momento la connessione appartiene al loop che la riceve*/
+	if ((server_mode == MODE_URING && add_UringFd(uring_loops, fd, c) == NULL) ||
+		(server_mode == MODE_EPOLL && add_LoopFd(loops, fd, c) == NULL)) {
+		cancel_Timer(heartbeats, &c->beat);
+		free_Reader(&c->reader);
+		if (c->serial != NULL) release_Serial(c->serial);
+		free(c);
+		return -1;
+	}
+	return 0;
+}
+
+/** Copia del payload delle sessioni di uno shard: un contenitore per il
+ * puntatore, cosi` che la rimozione dalla tabella non liberi la sessione.*/
+void *copySession(void *a) {
+	session_t **p;
+	if (a == NULL) return NULL;
+	p = Malloc(sizeof(session_t*));
+	*p = a;
+	return p;
+}
+
+/** Lo shard a cui appartiene l'utente name */
+int shardOf(char *name) {
+	return hash_string(name, loop_number);
+}
+
+/** Restituisce la sessione dell'utente name se appartiene allo shard s ed
+ * e` aperta, NULL altrimenti. Va chiamata dal thread dello shard.*/
+session_t *findSession(shard_t *s, char *name) {
+	elem_t *e = hashElement(s->sessions, name);
+	session_t *ss;
+	if (e == NULL || (ss = *((session_t **) e->payload))->closed) return NULL;
+	return ss;
+}
+
+/** Accoda un elemento per lo shard dst. Se la coda e` piena l'elemento
+ * resta nell'arretrato di l, che ritentera` prima di ogni attesa.*/
+void shardPost(event_loop *l, int dst, shard_item *it) {
+	shard_t *s = shards + l->id;
+	it->next = NULL;
+	if (s->backlog[dst] == NULL && push_Spsc(shards[dst].inbox[l->id], it) == 0) {
+		s->notify[dst] = 1;
+		return;
+	}
+	if (s->backlog[dst] == NULL) s->backlog[dst] = it;
+	else s->backlog_tail[dst]->next = it;
+	s->backlog_tail[dst] = it;
+}
+
+/** Accoda msg alla sessione ss; l'invio vero e proprio avviene prima della
+ * prossima attesa del loop, insieme agli altri messaggi accodati.
+ * \retval 0 se il messaggio e` stato accodato
+ * \retval -1 se non e` stato accodato (come queueFrame, sets errno) */
+int sessionQueue(shard_t *s, session_t *ss, message_t *msg) {
+	if (queueFrame(&ss->writer, msg) == -1) return -1;
+	if (ss->dirty) return 0;
+	ss->dirty = 1;
+	if (s->dirty_length == s->dirty_size) {
+		s->dirty_size *= 2;
+		if ((s->dirty = realloc(s->dirty, sizeof(session_t*)*s->dirty_size)) == NULL) {
+			perror("msgserv, sessionQueue");
+			exit(EXIT_FAILURE);
+		}
+	}
+	s->dirty[s->dirty_length++] = ss;
+	return 0;
+}
+
+/** Invia i messaggi accodati a ss; se la socket e` piena attende EPOLLOUT.*/
+void sessionFlush(event_loop *l, session_t *ss) {
+	int res = flushWriter(ss->fd, &ss->writer);
+	if (res == 0 && !ss->out_armed) {
+		ss->out_armed = 1;
+		modify_LoopFd(l, ss->fd, ss, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+	} else if (res == 1 && ss->out_armed) {
+		ss->out_armed = 0;
+		modify_LoopFd(l, ss->fd, ss, EPOLLIN | EPOLLRDHUP);
+	}
+	/*In caso di errore sara` la lettura a rilevare la chiusura*/
+}
+
+/** Notifica l'errore errcode relativo a receiver all'utente to, sul suo shard.*/
+void shardError(event_loop *l, int errcode, char *to, char *receiver) {
+	int dst = shardOf(to);
+	if (dst == l->id) {
+		session_t *ss = findSession(shards+l->id, to);
+		message_t err;
+		if (ss != NULL && buildError(errcode, receiver, &err) == 0) {
+			sessionQueue(shards+l->id, ss, &err);
+			free(err.buffer);
+		}
+	} else {
+		shard_item *it = Malloc(sizeof(shard_item));
+		it->kind = SHARD_ERROR;
+		it->errcode = errcode;
+		it->sender = to;
+		it->receiver = Malloc(sizeof(char)*(strlen(receiver)+1));
+		strcpy(it->receiver, receiver);
+		shardPost(l, dst, it);
+	}
+}
+
+/** Consegna msg (non formattato) da sender a receiver, utente di questo
+ * shard, e ne libera il buffer.*/
+void shardDeliver(event_loop *l, char *sender, char *receiver, message_t *msg) {
+	session_t *ss = findSession(shards+l->id, receiver);
+	message_t_expanded *exp;
+	message_t packed;
+	int res;
+	if (ss == NULL) {
+		free(msg->buffer);
+		shardError(l, 3, sender, receiver);
+		return;
+	}
+	exp = expand_message(msg, sender, receiver);
+	if (formatMessage(msg, sender) == -1) {
+		free(msg->buffer);
+		free_Message(exp);
+		shardError(l, 5, sender, receiver);
+		return;
+	}
+	if (ss->packed && pack_threshold > 0 && msg->length >= pack_threshold &&
+		packMessage(msg, &packed) == 0) {
+		res = sessionQueue(shards+l->id, ss, &packed);
+		free(packed.buffer);
+	} else
+		res = sessionQueue(shards+l->id, ss, msg);
+	/*Un messaggio che non entra in un datagramma non e` stato consegnato*/
+	if (res == -1)
+		shardError(l, 5, sender, receiver);
+	else
+		write_Buffer(writer_buffer, exp);
+	free_Message(exp);
+	free(msg->buffer);
+}
+
+/** Rilascia il riferimento di uno shard al broadcast b: l'ultimo lo libera.*/
+void releaseBroadcast(shard_bcast *b) {
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+	free(b->msg.buffer);
+	free(b->formatted.buffer);
+	free(b->packed.buffer);
+	free(b);
+}
+
+/** Consegna b agli utenti di questo shard e ne rilascia il riferimento.*/
+void shardBroadcast(event_loop *l, shard_bcast *b) {
+	shard_t *s = shards + l->id;
+	int i;
+	for (i = 0; i < (int) s->sessions->size; i++) {
+		elem_t *aux;
+		if (s->sessions->table[i] == NULL) continue;
+		for (aux = s->sessions->table[i]->head; aux != NULL; aux = aux->next) {
+			session_t *ss = *((session_t **) aux->payload);
+			if (ss->closed) continue;
+			if (sessionQueue(s, ss, (ss->packed && b->packed.buffer != NULL) ? &b->packed : &b->formatted) == -1)
+				shardError(l, 5, b->sender, ss->name);
+			else
+				logDelivery(&b->msg, b->sender, ss->name);
+		}
+	}
+	releaseBroadcast(b);
+}
+
+/** Prepara in msg la lista degli utenti connessi, raccolta da tutti gli shard.*/
+void shardList(message_t *msg) {
+	int i, j, length = strlen(LIST_FORMAT), size = length+1;
+	char *list = Malloc(sizeof(char)*size);
+	strcpy(list, LIST_FORMAT);
+	for (i = 0; i < loop_number; i++) {
+		pthread_mutex_lock(&shards[i].sessions_mtx);
+		for (j = 0; j < (int) shards[i].sessions->size; j++) {
+			elem_t *aux;
+			if (shards[i].sessions->table[j] == NULL) continue;
+			for (aux = shards[i].sessions->table[j]->head; aux != NULL; aux = aux->next) {
+				int n = strlen(aux->key);
+				if (length + n + 2 > size) {
+					size = 2*(length + n + 2);
+					if ((list = realloc(list, sizeof(char)*size)) == NULL) {
+						perror("msgserv, shardList");
+						exit(EXIT_FAILURE);
 					}
-				}				
-				if (connected) {					
-					sendSocketError(2,current_socket);
-					closeSocket(current_socket);
-					free(msg.buffer);
-					continue;
 				}
+				list[length++] = ' ';
+				strcpy(list+length, aux->key);
+				length += n;
+			}
+		}
+		pthread_mutex_unlock(&shards[i].sessions_mtx);
+	}
+	msg->type = MSG_LIST;
+	msg->buffer = list;
+	msg->length = length;
+}
+
+/** Chiude la sessione ss; se notify e` 1 invia prima all'utente MSG_EXIT.
+ * La memoria viene liberata prima della prossima attesa del loop.*/
+void closeSession(event_loop *l, session_t *ss, int notify) {
+	shard_t *s = shards + l->id;
+	if (notify) {
+		message_t endmsg;
+		endmsg.type = MSG_EXIT;
+		endmsg.length = 0;
+		endmsg.buffer = NULL;
+		queueFrame(&ss->writer, &endmsg);
+		(void) flushWriter(ss->fd, &ss->writer);
+	}
+	pthread_mutex_lock(&s->sessions_mtx);
+		remove_hashElement(s->sessions, ss->name);
+	pthread_mutex_unlock(&s->sessions_mtx);
+	remove_LoopFd(l, ss->fd);
+	shutdown(ss->fd, SHUT_RDWR);
+	closeSocket(ss->fd);
+	ss->closed = 1;
+	/*Se la sessione e` tra quelle da inviare la libera shardHook*/
+	if (!ss->dirty) {
+		free_Reader(&ss->reader);
+		free_Writer(&ss->writer);
+		free(ss);
+	}
+}
+
+/** Gestisce un messaggio ricevuto da ss.
+ * \retval 1 se l'utente ha inviato MSG_EXIT, 0 altrimenti */
+int shardMessage(event_loop *l, session_t *ss, message_t *msg) {
+	char *receiver;
+	elem_t *e;
+	shard_bcast *b;
+	int i;
+	switch (msg->type) {
+		case MSG_TO_ONE:
+			if ((receiver = normalizeToOne(msg)) == NULL) {
+				free(msg->buffer);
+				shardError(l, 6, ss->name, ss->name);
+				return 0;
+			}
+			/*users_table non viene modificata in questa modalità*/
+			if (!check_Bloom(authorized, receiver) || (e = hashElement(users_table, receiver)) == NULL) {
+				free(msg->buffer);
+				shardError(l, 3, ss->name, receiver);
+			} else if (shardOf(e->key) == l->id) {
+				shardDeliver(l, ss->name, e->key, msg);
+			} else {
+				shard_item *it = Malloc(sizeof(shard_item));
+				it->kind = SHARD_DELIVER;
+				it->sender = ss->name;
+				it->receiver = e->key;
+				it->msg = *msg;
+				shardPost(l, shardOf(e->key), it);
+			}
+			free(receiver);
+			return 0;
+		case MSG_BCAST:
+			b = Malloc(sizeof(shard_bcast));
+			b->msg = *msg;
+			b->formatted = *msg;
+			b->sender = ss->name;
+			if (formatMessage(&b->formatted, ss->name) == -1) {
+				free(msg->buffer);
+				free(b);
+				return 0;
+			}
+			/*Compresso, se serve, una sola volta per tutti gli shard*/
+			b->packed.buffer = NULL;
+			if (pack_threshold > 0 && b->formatted.length >= pack_threshold)
+				(void) packMessage(&b->formatted, &b->packed);
+			b->refs = loop_number;
+			for (i = 0; i < loop_number; i++) {
+				if (i != l->id) {
+					shard_item *it = Malloc(sizeof(shard_item));
+					it->kind = SHARD_BCAST;
+					it->bcast = b;
+					shardPost(l, i, it);
+				}
+			}
+			shardBroadcast(l, b);
+			return 0;
+		case MSG_LIST:
+			free(msg->buffer);
+			shardList(msg);
+			sessionQueue(shards+l->id, ss, msg);
+			free(msg->buffer);
+			return 0;
+		case MSG_EXIT:
+			free(msg->buffer);
+			return 1;
+		default:
+			free(msg->buffer);
+			return 0;
+	}
+}
+
+/** Apre la sessione dell'utente name sulla socket fd, se non e` gia`
+ * connesso. features sono i tratti della versione 2 proposti dall'utente
+ * (-1: versione 1).*/
+void shardConnect(event_loop *l, int fd, char *name, int features) {
+	shard_t *s = shards + l->id;
+	session_t *ss;
+	message_t ok;
+	if (hashElement(s->sessions, name) != NULL) {
+		sendSocketError(2, fd);
+		closeSocket(fd);
+		return;
+	}
+	ok.type = MSG_OK;
+	ok.length = 0;
+	ok.buffer = NULL;
+	/*Gli shard non risolvono gli identificativi dei destinatari*/
+	if (features >= 0) features &= acceptedFeatures(PROTO_PIPELINE);
+	if (features >= 0 && acceptProto(&ok, features) == -1) features = -1;
+	if (sendMessage(fd, &ok) < 0) {
+		free(ok.buffer);
+		closeSocket(fd);
+		return;
+	}
+	free(ok.buffer);
+	ss = Malloc(sizeof(session_t));
+	ss->fd = fd;
+	ss->name = name;
+	ss->dirty = ss->out_armed = ss->closed = 0;
+	ss->packed = (features >= 0 && (features & PROTO_PACK));
+	initialize_Reader(&ss->reader);
+	initialize_Writer(&ss->writer);
+	if (features >= 0) ss->reader.version = ss->writer.version = PROTO_VERSION;
+	ss->reader.packet = ss->writer.packet = packet_mode;
+	pthread_mutex_lock(&s->sessions_mtx);
+		add_hashElement(s->sessions, name, ss);
+	pthread_mutex_unlock(&s->sessions_mtx);
+	if (attach_LoopFd(l, fd, ss) == -1) {
+		perror("msgserv, shardConnect");
+		closeSession(l, ss, 0);
+		return;
+	}
+	printf("Connessione di %s accettata\n", name);
+}
+
+/** Gestore degli eventi di una sessione in modalità MODE_SHARD.
+ * \param l il loop (shard) della sessione
+ * \param data la sessione
+ * \param events la maschera degli eventi epoll
+ * */
+void shardEvent(event_loop *l, void *data, unsigned int events) {
+	session_t *ss = data;
+	message_t msg;
+	int res = 0, handled = 0;
+	if (events & EPOLLOUT) sessionFlush(l, ss);
+	if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) return;
+	while (handled < LOOP_BURST && (res = readFrame(ss->fd, &ss->reader, &msg)) == 1) {
+		handled++;
+		if (shardMessage(l, ss, &msg) == 1) {
+			closeSession(l, ss, 1);
+			return;
+		}
+	}
+	while (res == 1 && (res = nextFrame(&ss->reader, &msg)) == 1) {
+		if (shardMessage(l, ss, &msg) == 1) {
+			closeSession(l, ss, 1);
+			return;
+		}
+	}
+	if (res == 0 || res == 1) return;
+	if (res == -1) perror("msgserver, shardEvent");
+	closeSession(l, ss, 0);
+}
+
+/** Eseguita da ogni shard prima di attendere gli eventi: gestisce gli
+ * elementi ricevuti dagli altri shard e dai dispatcher, invia i messaggi
+ * accodati alle sessioni e risveglia gli shard a cui ha scritto.
+ * \retval il timeout della prossima attesa: breve se resta un arretrato */
+int shardHook(event_loop *l) {
+	shard_t *s = shards + l->id;
+	shard_item *it;
+	int i, pending = 0;
+	for (i = 0; i < loop_number+dispatcher_number; i++) {
+		while ((it = pop_Spsc(s->inbox[i])) != NULL) {
+			switch (it->kind) {
+				case SHARD_CONNECT:
+					shardConnect(l, it->fd, it->sender, it->features); break;
+				case SHARD_DELIVER:
+					shardDeliver(l, it->sender, it->receiver, &it->msg); break;
+				case SHARD_BCAST:
+					shardBroadcast(l, it->bcast); break;
+				case SHARD_ERROR:
+					shardError(l, it->errcode, it->sender, it->receiver);
+					free(it->receiver);
+					break;
+			}
+			free(it);
+		}
+	}
+	for (i = 0; i < s->dirty_length; i++) {
+		session_t *ss = s->dirty[i];
+		ss->dirty = 0;
+		if (ss->closed) {
+			free_Reader(&ss->reader);
+			free_Writer(&ss->writer);
+			free(ss);
+		} else
+			sessionFlush(l, ss);
+	}
+	s->dirty_length = 0;
+	for (i = 0; i < loop_number; i++) {
+		while ((it = s->backlog[i]) != NULL && push_Spsc(shards[i].inbox[l->id], it) == 0) {
+			s->backlog[i] = it->next;
+			s->notify[i] = 1;
+		}
+		if (s->backlog[i] != NULL) pending = 1;
+		if (s->notify[i]) {
+			s->notify[i] = 0;
+			wake_Loop(loops->loops+i);
+		}
+	}
+	return pending ? 1 : -1;
+}
+
+/** Affida la socket fd dell'utente name, che ha proposto i tratti
+ * features della versione 2 (-1: versione 1), al suo shard (chiamata dal
+ * dispatcher di indice producer).*/
+void shardUser(char *name, int fd, int features, int producer) {
+	int dst = shardOf(name);
+	shard_item *it = Malloc(sizeof(shard_item));
+	it->kind = SHARD_CONNECT;
+	it->fd = fd;
+	it->sender = name;
+	it->features = features;
+	/*Il dispatcher e` l'unico produttore di inbox[loop_number+producer]*/
+	while (push_Spsc(shards[dst].inbox[loop_number+producer], it) == -1)
+		sched_yield();
+	wake_Loop(loops->loops+dst);
+}
+
+/** Crea gli shard e i loop che li eseguono.
+ * \retval 0 se tutto ok, -1 in caso di errore */
+int initialize_Shards(void) {
+	int i, j;
+	if ((loops = initialize_Loops(loop_number, &shardEvent)) == NULL)
+		return -1;
+	set_LoopHook(loops, &shardHook);
+	shards = Malloc(sizeof(shard_t)*loop_number);
+	for (i = 0; i < loop_number; i++) {
+		shard_t *s = shards+i;
+		s->inbox = Malloc(sizeof(spsc_queue*)*(loop_number+dispatcher_number));
+		for (j = 0; j < loop_number+dispatcher_number; j++)
+			if ((s->inbox[j] = initialize_Spsc(SHARD_QUEUE)) == NULL) return -1;
+		s->backlog = Malloc(sizeof(shard_item*)*loop_number);
+		s->backlog_tail = Malloc(sizeof(shard_item*)*loop_number);
+		s->notify = Malloc(sizeof(int)*loop_number);
+		for (j = 0; j < loop_number; j++) {
+			s->backlog[j] = s->backlog_tail[j] = NULL;
+			s->notify[j] = 0;
+		}
+		s->sessions = new_hashTable(HASH_SIZE, compareString, copyString, copySession, hash_string);
+		pthread_mutex_init(&s->sessions_mtx, NULL);
+		s->dirty_size = 16;
+		s->dirty_length = 0;
+		s->dirty = Malloc(sizeof(session_t*)*s->dirty_size);
+	}
+	return start_Loops(loops);
+}
+
+/** Libera un elemento rimasto in una coda tra shard, con quanto porta
+ * secondo il tipo: la socket di SHARD_CONNECT, il messaggio di
+ * SHARD_DELIVER, il riferimento al broadcast di SHARD_BCAST, la copia del
+ * destinatario di SHARD_ERROR. I nomi degli utenti sono chiavi di
+ * users_table e non vanno liberati.*/
+void free_ShardItem(shard_item *it) {
+	switch (it->kind) {
+		case SHARD_CONNECT:
+			closeSocket(it->fd); break;
+		case SHARD_DELIVER:
+			free(it->msg.buffer); break;
+		case SHARD_BCAST:
+			releaseBroadcast(it->bcast); break;
+		case SHARD_ERROR:
+			free(it->receiver); break;
+	}
+	free(it);
+}
+
+/** Chiude tutte le sessioni degli shard (i loop devono essere gia` fermi)
+ * e ne libera le risorse.*/
+void free_Shards(void) {
+	int i, j;
+	shard_item *it;
+	for (i = 0; i < loop_number; i++) {
+		shard_t *s = shards+i;
+		/*Le sessioni chiuse non sono piu` in sessions, le altre vengono
+		 * liberate sotto: dirty va scorsa prima*/
+		for (j = 0; j < s->dirty_length; j++)
+			if (s->dirty[j]->closed) {
+				free_Reader(&s->dirty[j]->reader);
+				free_Writer(&s->dirty[j]->writer);
+				free(s->dirty[j]);
+			}
+		for (j = 0; j < (int) s->sessions->size; j++) {
+			elem_t *aux;
+			if (s->sessions->table[j] == NULL) continue;
+			for (aux = s->sessions->table[j]->head; aux != NULL; aux = aux->next) {
+				session_t *ss = *((session_t **) aux->payload);
+				message_t endmsg;
+				endmsg.type = MSG_EXIT;
+				endmsg.length = 0;
+				endmsg.buffer = NULL;
+				queueFrame(&ss->writer, &endmsg);
+				(void) flushWriter(ss->fd, &ss->writer);
+				shutdown(ss->fd, SHUT_RDWR);
+				closeSocket(ss->fd);
+				free_Reader(&ss->reader);
+				free_Writer(&ss->writer);
+				free(ss);
+			}
+		}
+		for (j = 0; j < loop_number+dispatcher_number; j++) {
+			while ((it = pop_Spsc(s->inbox[j])) != NULL) free_ShardItem(it);
+			free_Spsc(&s->inbox[j]);
+		}
+		for (j = 0; j < loop_number; j++)
+			while ((it = s->backlog[j]) != NULL) {
+				s->backlog[j] = it->next;
+				free_ShardItem(it);
+			}
+		free_hashTable(&s->sessions);
+		free(s->inbox);
+		free(s->backlog);
+		free(s->backlog_tail);
+		free(s->notify);
+		free(s->dirty);
+	}
+	free(shards);
+	shards = NULL;
+}
+
+/** Cleanup per un anello io_uring*/
+void FreeUring(void *r) {
+	free_Uring(r);
+}
+
+/** Restituisce la prossima connessione accettata dalla accept multishot
+ * armata sulla socket di ascolto fd (la riarma se il kernel l'ha terminata).
+ * Non attende: il fd dell'anello diventa leggibile quando ci sono
+ * completamenti, e il dispatcher lo attende con poll insieme alle
+ * connessioni in attesa del MSG_CONNECT. Ogni dispatcher ha il suo anello,
+ * e il kernel distribuisce tra questi le connessioni.
+ * \param r l'anello del dispatcher
+ * \param fd la socket di ascolto
+ * \param armed 1 se la accept multishot e` attiva
+ *
+ * \retval il fd della nuova connessione
+ * \retval -1 in caso di errore, o se non ci sono connessioni (errno = EAGAIN)
+ * */
+int acceptUring(uring_t *r, int fd, int *armed) {
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int res;
+	while (1) {
+		if (!*armed) {
+			if ((sqe = get_Sqe(r)) == NULL) return -1;
+			prep_MultishotAccept(sqe, fd, 1);
+			if (submit_Uring(r, 0) == -1) return -1;
+			*armed = 1;
+		}
+		if ((cqe = peek_Cqe(r)) != NULL) {
+			res = cqe->res;
+			if (!(cqe->flags & IORING_CQE_F_MORE)) *armed = 0;
+			seen_Cqe(r);
+			if (res >= 0) return res;
+			errno = -res;
+			return -1;
+		}
+		/*Un'ondata di connessioni puo` aver riempito la coda dei completamenti*/
+		if (submit_Uring(r, 0) == -1) return -1;
+		if (peek_Cqe(r) != NULL) continue;
+		errno = EAGAIN;
+		return -1;
+	}
+}
+
+/** Gestisce il primo messaggio msg ricevuto sulla socket current_socket,
+ * appena accettata: se e` un MSG_CONNECT valido connette l'utente e ne
+ * avvia la gestione, altrimenti chiude la socket. Il buffer di msg viene
+ * liberato. Piu` dispatcher possono eseguirla insieme: la sessione
+ * dell'utente viene riservata con claim_Session, senza lock globali.
+ * \param current_socket la socket della connessione
+ * \param msg il primo messaggio ricevuto
+ * \param arg il dispatcher_t che ha accettato la connessione
+ * */
+void connectUser(int current_socket, message_t *msg, void *arg) {
+	dispatcher_t *d = arg;
+	elem_t* element;
+	long version;
+	/*Il primo messaggio ricevuto, una volta stabilita la connessione,
+	 * deve essere del tipo MSG_CONNECT, altrimenti si procede a mostrare
+	 * un errore, in quanto il protocollo non è stato rispettato.*/
+	if (msg->type != MSG_CONNECT) {
+		closeSocket(current_socket);
+		free(msg->buffer);
+		return;
+	}
+	/*Il messaggio iniziale non è valido. L'utente dovrà tentare a riconnettersi*/
+	if (msg->length == 0) {
+		sendSocketError(current_socket, 0);
+		closeSocket(current_socket);
+		free(msg->buffer);
+		return;
+	}
 				
-				msg.buffer = NULL;
-				msg.length = 0;
-				msg.type = MSG_OK;
-			
-				sendMessage(current_socket, &msg);
+	/* Se si trova un record nella tabella hash, allora il nome
+	 * utente inserito è valido. Tuttavia, potrebbe darsi che 
+	 * ci sia un'altro utente connesso con lo stesso nome. In tal caso,
+	 * ovviamente, mandiamo un messaggio di errore e andiamo oltre*/
+	 
+	/*Qua non è necessario accedere in mutua esclusione, a meno che non si verifichino delle parti
+	 * interne. Questo perché non è prevista la cancellazione di una chiave dalla tabella hash*/
+	element = check_Bloom(authorized, msg->buffer) ? hashElement(users_table, msg->buffer) : NULL;
+	if (element != NULL && server_mode == MODE_SHARD) {
+		/*E` lo shard dell'utente a verificare che non sia gia` connesso*/
+		shardUser(element->key, current_socket, connectProto(msg), d->index);
+		free(msg->buffer);
+	} else if (element != NULL) {
+		session_rec *session = element->payload;
+		int window = 0, features;
+		char *username = msg->buffer;
+		/*Tra i dispatcher che connettono lo stesso utente uno solo
+		 * riserva la sessione: gli altri trovano l'utente connesso*/
+		if (claim_Session(session) == -1) {
+			sendSocketError(2,current_socket);
+			closeSocket(current_socket);
+			free(msg->buffer);
+			return;
+		}
 		
-				refreshUserList(username, ADD);
-				
-				
-				sl_pointer = insertSL(msg_locks, current_socket, 0);
-				tableWait();
-					element->payload = sl_pointer;
-				tableSignal();
+		/*Il controllo di flusso vale se il client ha proposto una finestra*/
+		if (credit_window > 0) window = connectWindow(msg);
+		features = connectProto(msg);
+		msg->buffer = NULL;
+		msg->length = 0;
+		msg->type = MSG_OK;
+		/*MSG_OK porta la finestra concessa al client*/
+		if (window > 0 && buildCredit(msg, MSG_OK, credit_window) == -1)
+			window = 0;
+		/*e accetta la versione 2, se proposta: il client scrive gia` nel
+		 * nuovo formato dopo MSG_CONNECT, o lo fara` dopo MSG_OK*/
+		if (features >= 0) features &= acceptedFeatures(PROTO_PIPELINE | PROTO_BY_ID);
+		if (features >= 0 && acceptProto(msg, features) == -1)
+			features = -1;
+		/*Dopo MSG_OK il client riceve i messaggi nella versione accettata.
+		 * La socket puo` essere stata di un client con un altro formato*/
+		if (wire_sockets != NULL && current_socket < wire_size)
+			__atomic_store_n(wire_sockets+current_socket, (features < 0) ? 0 :
+				WIRE_V2 | ((features & PROTO_PACK) ? WIRE_PACKED : 0) |
+				((features & PROTO_HEARTBEAT) ? WIRE_BEATS : 0), __ATOMIC_RELEASE);
 	
-				if (element->payload == NULL) {
-					perror("msgserver, dispatcher:");
-					continue;
-				}
+		sendMessage(current_socket, msg);
+		free(msg->buffer);
 
-				sl_pointer = element->payload;
-				if (pthread_create(&worker_id, NULL, &worker, element) == -1) {
-					perror("msgserver, dispatcher: ");
-					releaseDirectAccess(msg_locks, *sl_pointer);
-					removeSL(msg_locks, current_socket);
-					refreshUserList(username, REMOVE);
-					printf("Connessione rifiutata\n");
-					free(username);
-					continue;
-				}
-				pthread_detach(worker_id);
-				printf("Connessione di %s accettata\n", username);
-				free(username);
-				continue;					
-				
-			} else {
-				sendSocketError(1, current_socket);
-				closeSocket(current_socket);
-				free(msg.buffer);				
-			}		
-			
-		} else {
+		/*La mailbox deve esistere prima che altri possano scrivere all'utente*/
+		if (openMailbox(current_socket) == -1) {
+			perror("msgserver, dispatcher: ");
+			unclaim_Session(session);
 			closeSocket(current_socket);
-			free(msg.buffer);
+			free(username);
+			return;
+		}
+		if (window > 0) window_Mailbox(findMailbox(current_socket), window);
+		if (packedSocket(current_socket) && findMailbox(current_socket) != NULL)
+			pack_Mailbox(findMailbox(current_socket));
+		if (packet_mode && findMailbox(current_socket) != NULL)
+			packet_Mailbox(findMailbox(current_socket));
+		if (features >= 0 && findMailbox(current_socket) != NULL)
+			version_Mailbox(findMailbox(current_socket), PROTO_VERSION);
+		/*Nessun altro tocca la sessione finche` il worker non parte:
+		 * disconnectUser richiede un worker, cancelWorkers attende i
+		 * dispatcher. Bastano i lock di ring, sessione e insieme.*/
+		/*L'utente riceve i broadcast da quando risulta connesso*/
+		if (couriers != NULL) {
+			user_Mailbox(findMailbox(current_socket), element);
+			join_Ring(findMailbox(current_socket));
 		}
+		(void) open_Session(session, current_socket);
+		version = add_CowSet(connected_users, element);
+		notifyPresence(PRESENCE_JOIN, element, version);
+
+		if (startUser(element, session, current_socket, (window > 0) ? credit_window : 0,
+			(features >= 0) ? PROTO_VERSION : 1) == -1) {
+			perror("msgserver, dispatcher: ");
+			(void) close_Session(session);
+			version = remove_CowSet(connected_users, element);
+			notifyPresence(PRESENCE_LEAVE, element, version);
+			closeMailbox(current_socket, 0);
+			printf("Connessione rifiutata\n");
+			free(username);
+			return;
+		}
+		printf("Connessione di %s accettata\n", username);
+		free(username);
+	} else {
+		sendSocketError(1, current_socket);
+		closeSocket(current_socket);
+		free(msg->buffer);				
+	}
+}
+
+/** Accetta le connessioni in coda sulla socket di ascolto fd, senza
+ * bloccare e al piu` ACCEPT_BURST alla volta, e le aggiunge a quelle in
+ * attesa del MSG_CONNECT del dispatcher d. Se un altro dispatcher ha gia`
+ * svuotato la coda, accept4 fallisce con EAGAIN e si torna ad attendere.
+ * \param d il dispatcher
+ * \param fd la socket di ascolto (non bloccante)
+ * \param r l'anello del dispatcher (solo in modalità MODE_URING)
+ * \param armed 1 se la accept multishot e` attiva (solo in modalità MODE_URING)
+ * */
+void acceptPending(dispatcher_t *d, int fd, uring_t *r, int *armed) {
+	int i, current_socket;
+	for (i = 0; i < ACCEPT_BURST; i++) {
+		if (server_mode == MODE_URING)
+			current_socket = acceptUring(r, fd, armed);
+		else
+			/*Le socket accettate non ereditano O_NONBLOCK: restano bloccanti*/
+			current_socket = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		/*Non è stato possibile stabilire la connessione iniziale*/
+		if (current_socket == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("msgserver, dispatcher");
+			return;
+		}
+		add_Handshake(d->handshakes, current_socket);
+	}
+}
+
+/** Thread che si occupa della ricezione delle connessioni e della creazione, 
+ * per ogni utente, di un thread che gestisca le richieste di questi.
+ * Nessuna attesa blocca il thread: una sola poll attende sia nuove
+ * connessioni sia i MSG_CONNECT di quelle gia` accettate, ognuna delle
+ * quali ha un tempo limite per inviarlo. Piu` dispatcher condividono la
+ * socket di ascolto, ognuno con le proprie connessioni in attesa.
+ * \param args il dispatcher_t del thread
+ */
+void* dispatcher(void *args) {
+	dispatcher_t *d = args;
+	int armed = 0, state;
+	uring_t accept_ring;
+	accept_ring.fd = -1;
+	if (server_mode == MODE_URING && initialize_Uring(&accept_ring, 16) == -1) {
+		perror("msgserver, dispatcher");
+		exit(-1);
+	}
+	pthread_cleanup_push(&FreeUring, &accept_ring);
+	/* Il ciclo infinito seguente riceve le connessioni, e se rispettano
+	 * il protocollo le accetta. Inoltre, non appena è possibile, passa
+	 * le competenze al thread worker dell'utente connesso*/
+	while (1) {
+		acceptPending(d, listen_fd, &accept_ring, &armed);
+		/*poll e` un punto di cancellazione*/
+		if (poll_Handshakes(d->handshakes, (server_mode == MODE_URING) ? accept_ring.fd : listen_fd) == -1 && errno != EINTR)
+			perror("msgserver, dispatcher");
+		/*Un utente non resta mai connesso a meta`*/
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+		serve_Handshakes(d->handshakes, &connectUser, d);
+		pthread_setcancelstate(state, NULL);
 	}
 	pthread_cleanup_pop(1);
 	pthread_exit((void *) 0);
 }
 
+/** Scrive su f le misure degli accessi di ogni dispatcher. */
+void reportDispatchers(FILE *f) {
+	int i;
+	for (i = 0; i < dispatcher_number; i++) {
+		if (dispatcher_number > 1) fprintf(f, "dispatcher %d, ", i);
+		report_Handshakes(dispatchers[i].handshakes, f);
+	}
+}
+
 /** Funzione chiamata dal gestore dei segnali quando si riceve SIGBUS o
  * SIGSEGV*/
 void manageMemorySignals(int sig) {
+	(void) sig;
 	write(2, "Errore interno nell'accesso alla memoria\n", 41);
 	exit(EXIT_FAILURE);
 }
@@ -849,9 +3331,7 @@ void manageMemorySignals(int sig) {
  * per ognuno degli utenti connessi.
  *  */
 void cancelWorkers() {
-	int i = 0;  
-	elem_t *aux = NULL;
-	elem_t **pld = NULL;
+	int i = 0, socket;
 	message_t endmsg;
 	pthread_mutex_lock(&delete_mtx);
 		signal_exit = 1;
@@ -869,60 +3349,205 @@ void cancelWorkers() {
 	while (UT_inUse) pthread_cond_wait(&user_table_cond, &user_table_mtx);
 	UT_inUse = 1;
 	pthread_mutex_unlock(&user_table_mtx);
-	for (i = 0; i < users_table->size; i++) {
-		if (users_table->table[i] != NULL) {
-			aux = users_table->table[i]->head;
-			while (aux != NULL) {
-				if ((pld = aux->payload) != NULL)
-					/*Indicazione di "utente disconnesso"*/
-					free(aux->payload);
-					aux->payload = NULL;
-				aux = aux->next;
-			}
-		}
+	/*Chiusura delle sessioni, invio messaggi di uscita e shutdown: dopo
+	 * close_Session la socket di ogni utente appartiene solo a noi*/
+	endmsg.buffer = NULL;
+	endmsg.type = MSG_EXIT;
+	endmsg.length = 0;
+	for (i = 0; i < users_number; i++) {
+		if ((socket = close_Session(sessions+i)) == -1) continue;
+		remove_CowSet(connected_users, users_by_id[i]);
+		(void) sendReply(socket, &endmsg, versionSocket(socket));
+		shutdown(socket, SHUT_RDWR);
 	}
 	tableSignal();
-	/*Scorrimento della struttura socket lock, invio messaggi di uscita e eliminazione*/
-	if((errno = pthread_mutex_trylock(&msg_locks->mtx)) != 0) {
-		if (errno == EBUSY) {
-			pthread_mutex_unlock(&msg_locks->mtx);
-			pthread_mutex_lock(&msg_locks->mtx);
-		}
-	}
-	while (msg_locks->inUse > 0) {
-		pthread_cond_wait(&msg_locks->cond_locks, &msg_locks->mtx);
-	}
-	msg_locks->edit = 1;
-	pthread_mutex_unlock(&msg_locks->mtx);
-	/*
-	pthread_mutex_lock(&msg_locks->mtx);
-		pthread_cond_signal(&msg_locks->cond_locks);
-	pthread_mutex_unlock(&msg_locks->mtx);
-	*/
-		aux = msg_locks->locks->head;
-		while (aux != NULL) {
-			int *socket;			
-			endmsg.buffer = NULL;
-			endmsg.type = MSG_EXIT;
-			endmsg.length = 0;
-			socket = aux->key;
-			(void) sendMessage(*socket, &endmsg);
-			shutdown(*socket, SHUT_RDWR);
-			aux = aux->next;
-	}
-	pthread_mutex_lock(&msg_locks->mtx);
-		msg_locks->edit = 0;
-	pthread_mutex_unlock(&msg_locks->mtx);
+}
+
+/** Stampa la sintassi corretta del server*/
+void usage(void) {
+	printf("Sintassi corretta: $msgserv [-m thread|epoll|uring|shard|coro] [-t numero_loop] [-w min_thread] [-W max_thread] [-b thread_consegna] [-p thread_stadi] [-o numero_corrieri] [-q messaggi:kbyte:politica] [-c finestra] [-k millisecondi] [-a numero_dispatcher] [-i intervallo[:inattività]] [-z soglia] [-l soglia] [-s] file_utenti_autorizzati file_log\n");
+	printf("  -m modalità di gestione delle connessioni: un thread per utente (default),\n");
+	printf("     event loop epoll oppure io_uring (se il kernel non lo supporta si usa epoll),\n");
+	printf("     oppure un thread per processore, ciascuno con i propri utenti (shard),\n");
+	printf("     oppure un worker per utente eseguito come coroutine (coro)\n");
+	printf("  -t numero di event loop (o di shard, o di scheduler delle coroutine)\n");
+	printf("     (default: uno per processore)\n");
+	printf("  -w gestisce i messaggi con un pool di almeno min_thread thread\n");
+	printf("  -W numero massimo di thread del pool (default: il doppio di min_thread)\n");
+	printf("  -b consegna ogni broadcast in parallelo con thread_consegna thread\n");
+	printf("     (con -w se ne occupa il pool, con -o le mailbox, con -m uring l'anello)\n");
+	printf("  -p gestisce i messaggi con una pipeline di stadi decode:route:format:deliver:log,\n");
+	printf("     indicando i thread di ciascuno (un solo numero vale per tutti);\n");
+	printf("     SIGUSR1 stampa la coda e il tempo di servizio di ogni stadio\n");
+	printf("  -o accoda i messaggi di ogni utente in una mailbox, svuotata da uno\n");
+	printf("     di numero_corrieri thread di consegna\n");
+	printf("  -q limita ogni mailbox a messaggi:kbyte (0: nessun limite) e sceglie cosa fare\n");
+	printf("     di chi li supera: drop-oldest, drop-newest, disconnect oppure park (su disco)\n");
+	printf("  -c concede ai client che negoziano il controllo di flusso una finestra di\n");
+	printf("     messaggi, restituita con MSG_CREDIT man mano che vengono gestiti\n");
+	printf("  -k millisecondi concessi a una nuova connessione per inviare MSG_CONNECT\n");
+	printf("     (default %d): chi tace oltre viene chiuso senza bloccare gli altri accessi\n", HANDSHAKE_TIMEOUT);
+	printf("  -a numero di thread dispatcher che accettano le connessioni (default 1)\n");
+	printf("  -i invia un MSG_PING a ogni client ogni intervallo millisecondi e chiude chi,\n");
+	printf("     avendo negoziato i battiti, non invia nulla per inattività millisecondi\n");
+	printf("     (default: tre intervalli)\n");
+	printf("  -z comprime i messaggi di almeno soglia byte per i client che lo accettano\n");
+	printf("     (i broadcast una sola volta per tutti i destinatari)\n");
+	printf("  -l scrive compressi nel log i messaggi di almeno soglia byte, come i\n");
+	printf("     MSG_PACKED: mittente:destinatario:, un byte nullo, la lunghezza e il corpo\n");
+	printf("  -s usa una socket SOCK_SEQPACKET: un messaggio per datagramma, letti e\n");
+	printf("     inviati a gruppi con recvmmsg e sendmmsg (non con -m uring)\n");
 }
 
 int main(int argc, char* argv[]) {
-	int e;
+	int e, opt;
 	sigset_t set;
 	struct sigaction sa;
-	pthread_t writer_id, dispatcher_id;	
-	if (argc != 3) {
+	int i;
+	pthread_t writer_id;
+	while ((opt = getopt(argc, argv, "m:t:w:W:b:p:o:q:c:k:a:i:z:l:s")) != -1) {
+		switch (opt) {
+			case 'm':
+				if (strcmp(optarg, "thread") == 0) server_mode = MODE_THREAD;
+				else if (strcmp(optarg, "epoll") == 0) server_mode = MODE_EPOLL;
+				else if (strcmp(optarg, "uring") == 0) server_mode = MODE_URING;
+				else if (strcmp(optarg, "shard") == 0) server_mode = MODE_SHARD;
+				else if (strcmp(optarg, "coro") == 0) server_mode = MODE_CORO;
+				else {
+					printf("Modalità '%s' sconosciuta\n", optarg);
+					usage();
+					return -1;
+				}
+				break;
+			case 't':
+				if ((loop_number = atoi(optarg)) <= 0) {
+					printf("Il numero di event loop deve essere positivo\n");
+					usage();
+					return -1;
+				}
+				break;
+			case 'w':
+				if ((pool_min = atoi(optarg)) <= 0) {
+					printf("Il numero di thread del pool deve essere positivo\n");
+					usage();
+					return -1;
+				}
+				break;
+			case 'W':
+				if ((pool_max = atoi(optarg)) <= 0) {
+					printf("Il numero di thread del pool deve essere positivo\n");
+					usage();
+					return -1;
+				}
+				break;
+			case 'b':
+				if ((fanout_threads = atoi(optarg)) <= 0) {
+					printf("Il numero di thread di consegna deve essere positivo\n");
+					usage();
+					return -1;
+				}
+				break;
+			case 'o':
+				if ((courier_number = atoi(optarg)) <= 0) {
+					printf("Il numero di corrieri deve essere positivo\n");
+					usage();
+					return -1;
+				}
+				break;
+			case 'q': {
+				char policy[32];
+				if (sscanf(optarg, "%d:%ld:%31s", &mailbox_frames, &mailbox_bytes, policy) != 3 ||
+					mailbox_frames < 0 || mailbox_bytes < 0 ||
+					(mailbox_policy = find_MailboxPolicy(policy)) == -1) {
+					printf("Limiti delle mailbox '%s' non validi\n", optarg);
+					usage();
+					return -1;
+				}
+				mailbox_bytes *= 1024;
+				break;
+			}
+			case 'c':
+				if ((credit_window = atoi(optarg)) <= 0) {
+					printf("La finestra del controllo di flusso deve essere positiva\n");
+					usage();
+					return -1;
+				}
+				break;
+			case 'k':
+				if ((handshake_timeout = atoi(optarg)) <= 0) {
+					printf("Il tempo concesso per la connessione deve essere positivo\n");
+					usage();
+					return -1;
+				}
+				break;
+			case 'a':
+				if ((dispatcher_number = atoi(optarg)) <= 0) {
+					printf("Il numero di dispatcher deve essere positivo\n");
+					usage();
+					return -1;
+				}
+				break;
+			case 'i': {
+				char *colon = strchr(optarg, ':');
+				heartbeat_interval = atoi(optarg);
+				/*Di default si tollerano tre battiti senza risposta*/
+				idle_timeout = (colon != NULL) ? atoi(colon+1) : 3*heartbeat_interval;
+				if (heartbeat_interval <= 0 || idle_timeout < heartbeat_interval) {
+					printf("L'intervallo dei battiti deve essere positivo e non superiore al tempo di inattività\n");
+					usage();
+					return -1;
+				}
+				break;
+			}
+			case 's':
+				packet_mode = 1;
+				break;
+			case 'z':
+				if ((pack_threshold = atoi(optarg)) <= 0) {
+					printf("La soglia di compressione deve essere positiva\n");
+					usage();
+					return -1;
+				}
+				break;
+			case 'l':
+				if ((log_threshold = atoi(optarg)) <= 0) {
+					printf("La soglia di compressione del log deve essere positiva\n");
+					usage();
+					return -1;
+				}
+				break;
+			case 'p': {
+				int i, n;
+				n = sscanf(optarg, "%d:%d:%d:%d:%d", stage_threads, stage_threads+1,
+					stage_threads+2, stage_threads+3, stage_threads+4);
+				/*Un solo numero vale per tutti gli stadi*/
+				for (i = (n == 1) ? 1 : PIPE_STAGES; i < PIPE_STAGES; i++)
+					stage_threads[i] = stage_threads[0];
+				for (i = 0; i < PIPE_STAGES; i++)
+					if ((n != 1 && n != PIPE_STAGES) || stage_threads[i] <= 0) {
+						printf("Il numero di thread di ogni stadio deve essere positivo\n");
+						usage();
+						return -1;
+					}
+				break;
+			}
+			default:
+				usage();
+				return -1;
+		}
+	}
+	if (pool_max > 0 && pool_min == 0) pool_min = 1;
+	if (pool_min > 0 && pool_max < pool_min)
+		pool_max = (pool_max > 0) ? pool_min : 2*pool_min;
+	/*I buffer forniti all'anello sono piu` piccoli di un datagramma*/
+	if (packet_mode && server_mode == MODE_URING) {
+		printf("La modalità uring non supporta le socket SOCK_SEQPACKET\n");
+		usage();
+		return -1;
+	}
+	if (argc - optind != 2) {
 		printf("Sono richiesti due parametri\n");
-		printf("Sintassi corretta: $msgserv file_utenti_autorizzati file_log\n");
+		usage();
 		return -1;
 	}
 	/*Ignoriamo tutti i segnali: questo comportamento sarà ereditato dai
@@ -954,45 +3579,215 @@ int main(int argc, char* argv[]) {
 		exit(-1);
 	}		
 	writer_buffer = initialize_Buffer(writer_buffer_SIZE);
-	msg_locks = initializeSL();
-	if(load_authorized_users(argv[1]) <= 0) {
+	connected_users = initialize_CowSet();
+	presence_subs = initialize_CowSet();
+	if(load_authorized_users(argv[optind]) <= 0) {
 		printf("Il caricamento del file utenti autorizzati non è andato a buon fine.\n");
 		return -1;
 	}
+	buildUserIds();
+	if (bindSessions() == -1) {
+		perror("msgserv, main");
+		return -1;
+	}
 		
-	if(pthread_create(&writer_id, NULL, &writer, argv[2]) == -1) {
+	if (pool_min > 0 && server_mode == MODE_SHARD) {
+		printf("Il pool di thread non si applica alla modalità shard\n");
+		usage();
+		return -1;
+	}
+	if (stage_threads[0] > 0 && (pool_min > 0 || server_mode == MODE_SHARD)) {
+		printf("La pipeline non si applica alla modalità shard né insieme al pool\n");
+		usage();
 		return -1;
 	}
+	if (fanout_threads > 0 && (pool_min > 0 || stage_threads[0] > 0 || server_mode == MODE_SHARD)) {
+		printf("Il pool di consegna non si applica alla modalità shard né insieme al pool o alla pipeline\n");
+		usage();
+		return -1;
+	}
+	/*I limiti e la finestra dei client si applicano alle mailbox: in
+	 * mancanza di -o basta un corriere*/
+	if ((mailbox_policy != -1 || credit_window > 0) && courier_number == 0) courier_number = 1;
+	if (courier_number > 0 && server_mode == MODE_SHARD) {
+		printf("Le mailbox (e con esse -q e -c) non si applicano alla modalità shard\n");
+		usage();
+		return -1;
+	}
+	if (heartbeat_interval > 0 && server_mode == MODE_SHARD) {
+		printf("I battiti non si applicano alla modalità shard\n");
+		usage();
+		return -1;
+	}
+	if (courier_number > 0) {
+		if ((mailboxes_size = sysconf(_SC_OPEN_MAX)) <= 0) mailboxes_size = 1024;
+		mailboxes = Malloc(sizeof(mailbox*)*mailboxes_size);
+		memset(mailboxes, 0, sizeof(mailbox*)*mailboxes_size);
+		if ((couriers = initialize_Couriers(courier_number)) != NULL)
+			hook_Ring(couriers, &ringDelivery);
+		if (couriers == NULL || start_Couriers(couriers) == -1) {
+			printf("Impossibile avviare i corrieri\n");
+			return -1;
+		}
+		if (mailbox_policy != -1)
+			set_MailboxLimits(couriers, mailbox_frames, mailbox_bytes, mailbox_policy);
+	}
+	/*In modalità shard lo dice la sessione dell'utente*/
+	if (server_mode != MODE_SHARD) {
+		if ((wire_size = sysconf(_SC_OPEN_MAX)) <= 0) wire_size = 1024;
+		wire_sockets = Malloc(sizeof(char)*wire_size);
+		memset(wire_sockets, 0, sizeof(char)*wire_size);
+	}
+	if (stage_threads[0] > 0 && initialize_Pipeline() == -1) {
+		printf("Impossibile avviare la pipeline\n");
+		return -1;
+	}
+	if (pool_min > 0 && (pool = initialize_Pool(pool_min, pool_max)) == NULL) {
+		printf("Impossibile avviare il pool di thread\n");
+		return -1;
+	}
+	if (fanout_threads > 0 && (fanout_pool = initialize_Pool(fanout_threads, fanout_threads)) == NULL) {
+		printf("Impossibile avviare il pool di consegna\n");
+		return -1;
+	}
+	if (loop_number == 0 && (loop_number = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+		loop_number = 1;
+	if (server_mode == MODE_URING && (!uring_Supported() ||
+		(uring_loops = initialize_UringLoops(loop_number, &uringEvent)) == NULL || start_UringLoops(uring_loops) == -1)) {
+		printf("io_uring non disponibile: si utilizza la modalità epoll\n");
+		server_mode = MODE_EPOLL;
+	}
 	
-	if(pthread_create(&dispatcher_id, NULL,&dispatcher, NULL) == -1) {
+	if(pthread_create(&writer_id, NULL, (server_mode == MODE_URING) ? &uringWriter : &writer, argv[optind+1]) == -1) {
 		return -1;
 	}
+	
+	if (server_mode == MODE_EPOLL) {
+		if ((loops = initialize_Loops(loop_number, &connectionEvent)) == NULL || start_Loops(loops) == -1) {
+			printf("Impossibile avviare gli event loop\n");
+			return -1;
+		}
+	}
+	if (server_mode == MODE_CORO && ((coros = initialize_Coro(loop_number)) == NULL || start_Coro(coros) == -1)) {
+		printf("Impossibile avviare gli scheduler delle coroutine\n");
+		return -1;
+	}
+	if (server_mode == MODE_SHARD && initialize_Shards() == -1) {
+		printf("Impossibile avviare gli shard\n");
+		return -1;
+	}
+	
+	/** Iniziamo tentando di creare la socket. Qualora non fosse possibile,
+	 * continuare non ha senso. CreateServerChannel fa già tutti i tentativi
+	 * possibili per connettersi da se.*/
+	if((listen_fd = (packet_mode) ? createPacketChannel(SOCKET) : createServerChannel(SOCKET)) <= 0) {
+		perror("msgserver, main");
+		printf("Tentativo di creazione della socket %s fallito.\n", SOCKET);
+		exit(-1);
+	}
+	/*I dispatcher accettano a turno dalla stessa socket: nessuno deve
+	 * bloccarsi se un altro ha gia` preso la connessione*/
+	if (fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("msgserver, main");
+		exit(-1);
+	}
+	/*Un solo thread fa scadere i battiti di tutte le connessioni*/
+	if (heartbeat_interval > 0 && ((heartbeats = initialize_Wheel(HEARTBEAT_TICK, &beatConnection)) == NULL ||
+		start_Wheel(heartbeats) == -1)) {
+		printf("Impossibile avviare i battiti\n");
+		return -1;
+	}
+	dispatchers = Malloc(sizeof(dispatcher_t)*dispatcher_number);
+	for (i = 0; i < dispatcher_number; i++) {
+		dispatchers[i].index = i;
+		dispatchers[i].handshakes = initialize_Handshakes(handshake_timeout, packet_mode);
+		if ((errno = pthread_create(&dispatchers[i].id, NULL, &dispatcher, dispatchers+i)) != 0) {
+			perror("msgserver, main");
+			return -1;
+		}
+	}
 	/*Eliminiamo dalla maschera tutti i segnali*/
 	sigemptyset(&set);
 	sigaddset(&set, SIGINT);
 	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR1);
 	if(pthread_sigmask(SIG_SETMASK,&set,NULL) == -1) {
 		perror("msgcli, main, impossibile mascherare i segnali");
 		exit(-1);
 	}
 	
-	sigwait(&set, &e); /*Attendiamo SIGTERM o SIGINT per fermarci.*/
+	/*Attendiamo SIGTERM o SIGINT per fermarci; SIGUSR1 chiede le misure
+	 * degli stadi della pipeline, gli interventi sulle mailbox, le
+	 * consegne delle sessioni, gli accessi e i battiti.*/
+	while (sigwait(&set, &e) == 0 && e == SIGUSR1) {
+		reportPipeline(stdout);
+		report_Couriers(couriers, stdout);
+		report_Registry(sessions, users_number, stdout);
+		reportDispatchers(stdout);
+		reportHeartbeats(stdout);
+	}
 	printf("UL: %d, UT: %d\n", UL_inUse, UT_inUse);
-	printf("SLE: %d, SLWE: %d, SLU: %d, SLWU: %d\n", msg_locks->edit, msg_locks->waitingEdit, msg_locks->inUse, msg_locks->waitingUse);
+	report_Registry(sessions, users_number, stdout);
 	
 	printf("Terminazione del server\n");
-	pthread_cancel(dispatcher_id);	
+	for (i = 0; i < dispatcher_number; i++)
+		pthread_cancel(dispatchers[i].id);
 	
 	unlink(SOCKET);
-	pthread_join(dispatcher_id, NULL);
+	for (i = 0; i < dispatcher_number; i++)
+		pthread_join(dispatchers[i].id, NULL);
 	printf("tornato dal dispatcher\n");
+	closeSocket(listen_fd);
+	reportDispatchers(stdout);
+	for (i = 0; i < dispatcher_number; i++)
+		free_Handshakes(&dispatchers[i].handshakes);
+	free(dispatchers);
+	/*I battiti non chiudono piu` connessioni: ora lo fa cancelWorkers*/
+	if (heartbeats != NULL) {
+		stop_Wheel(heartbeats);
+		reportHeartbeats(stdout);
+	}
+	/*Da qui i messaggi di uscita vengono scritti direttamente sulle socket*/
+	if (couriers != NULL)
+		stop_Couriers(couriers);
 	cancelWorkers(); /*Ritorna una volta che tutti i worker sono stati terminati*/
+	if (loops != NULL) {
+		stop_Loops(loops);
+		if (shards != NULL) free_Shards();
+		free_Loops(&loops);
+	}
+	if (coros != NULL) {
+		stop_Coro(coros);
+		free_Coro(&coros);
+	}
+	if (uring_loops != NULL) {
+		stop_UringLoops(uring_loops);
+		free_UringLoops(&uring_loops);
+	}
+	if (stages[PIPE_DECODE] != NULL)
+		free_Pipeline();
+	if (pool != NULL)
+		free_Pool(&pool);
+	if (fanout_pool != NULL)
+		free_Pool(&fanout_pool);
+	if (couriers != NULL) {
+		report_Couriers(couriers, stdout);
+		free_Couriers(&couriers);
+	}
 	pthread_cancel(writer_id);
 	pthread_join(writer_id, NULL);
 	printf("tornato dal writer\n"); 
 	free_Buffer(&writer_buffer);
-	freeSL(&msg_locks);
+	unbindSessions();
+	free_Bloom(&authorized);
 	free_hashTable(&users_table);
-	free(users_list);	
+	free_CowSet(&connected_users);
+	free_CowSet(&presence_subs);
+	release_Shared(userids_frame);
+	free(users_by_id);
+	release_Shared(list_frame);
+	free(mailboxes);
+	free(wire_sockets);
+	free_Wheel(&heartbeats);
 	exit(0);
 }
@@ -0,0 +1,137 @@
+/**
+   \file packet.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione del trasporto SOCK_SEQPACKET.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "errors.h"
+#include "asyncsock.h"
+#include "proto2.h"
+#include "packet.h"
+
+/** Prepara in a l'indirizzo della socket path.
+ * \retval 0 se tutto ok, SNAMETOOLONG se path eccede UNIX_PATH_MAX */
+static int packetAddress(struct sockaddr_un *a, char *path) {
+	if (path == NULL || strlen(path) >= UNIX_PATH_MAX) {
+		errno = EINVAL;
+		return SNAMETOOLONG;
+	}
+	memset(a, 0, sizeof(*a));
+	a->sun_family = AF_UNIX;
+	strncpy(a->sun_path, path, UNIX_PATH_MAX-1);
+	return 0;
+}
+
+int createPacketChannel(char *path) {
+	struct sockaddr_un a;
+	int s, e;
+	if (packetAddress(&a, path) != 0) return SNAMETOOLONG;
+	if ((s = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+		perror("packet, createPacketChannel");
+		return -1;
+	}
+	(void) unlink(path);
+	if (bind(s, (struct sockaddr *) &a, sizeof(a)) == -1 || listen(s, SOMAXCONN) == -1) {
+		e = errno;
+		perror("packet, createPacketChannel");
+		close(s);
+		(void) unlink(path);
+		errno = e;
+		return -1;
+	}
+	return s;
+}
+
+int openPacketConnection(char *path) {
+	struct sockaddr_un a;
+	int s, e;
+	if (packetAddress(&a, path) != 0) return SNAMETOOLONG;
+	if ((s = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+		perror("packet, openPacketConnection");
+		return -1;
+	}
+	if (connect(s, (struct sockaddr *) &a, sizeof(a)) == -1) {
+		e = errno;
+		close(s);
+		errno = e;
+		return -1;
+	}
+	return s;
+}
+
+int receivePacket(int sc, message_t *msg, int version) {
+	struct iovec iov;
+	struct msghdr mh;
+	ssize_t n;
+	char *p;
+	int body;
+	if (msg == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	/*Il messaggio non e` noto prima della lettura: il buffer ha posto per
+	 * il piu` lungo, e il corpo viene copiato dopo*/
+	p = Malloc(sizeof(char)*PACKET_MAX);
+	do {
+		iov.iov_base = p;
+		iov.iov_len = PACKET_MAX;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		while ((n = recvmsg(sc, &mh, 0)) == -1 && errno == EINTR);
+		if (n <= 0) {
+			free(p);
+			if (n == 0) return SEOF;
+			perror("packet, receivePacket");
+			return -1;
+		}
+		if (mh.msg_flags & MSG_TRUNC) {
+			free(p);
+			errno = EMSGSIZE;
+			return -1;
+		}
+		if (version >= PROTO_VERSION) {
+			/*Un datagramma contiene esattamente un messaggio*/
+			if (n < 3 || frameSize2(p, n) != n) {
+				free(p);
+				errno = EPROTO;
+				return -1;
+			}
+			if (decodeFrame2(p, n, msg) == -1) {
+				free(p);
+				return -1;
+			}
+			body = msg->length;
+		} else {
+			msg->type = p[0];
+			memcpy(&msg->length, p+sizeof(char), sizeof(int));
+			/*Come in sendMessage, il corpo viaggia con il terminatore*/
+			body = (msg->length > 0) ? msg->length+1 : 0;
+			if (n < (ssize_t) HEADER_SIZE || msg->length < 0 || n != (ssize_t) HEADER_SIZE + body) {
+				free(p);
+				errno = EPROTO;
+				return -1;
+			}
+			msg->buffer = NULL;
+			if (body > 0) {
+				msg->buffer = Malloc(sizeof(char)*body);
+				memcpy(msg->buffer, p+HEADER_SIZE, body);
+				msg->buffer[msg->length] = '\0';
+				if (msg->buffer[msg->length-1] == '\n')
+					msg->buffer[--msg->length] = '\0';
+			}
+		}
+		if (msg->type == MSG_PING) free(msg->buffer);
+	} while (msg->type == MSG_PING);
+	free(p);
+	return body;
+}
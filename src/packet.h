@@ -0,0 +1,50 @@
+/**
+   \file packet.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  trasporto SOCK_SEQPACKET: un messaggio per datagramma.
+
+Server e client sono sempre sulla stessa macchina: con una socket
+AF_UNIX di tipo SOCK_SEQPACKET il kernel conserva i confini dei
+messaggi. Ogni messaggio, nello stesso formato di sendMessage (o di
+sendFrame2 e sendReply, proto2.h), viaggia in un datagramma: si scrive
+con una sola sendmsg e si legge per intero con una sola recvmsg, senza
+ricomporre l'intestazione e il corpo da più letture. Un datagramma non viene mai
+spezzato: una scrittura non bloccante lo invia tutto o niente.
+
+Un messaggio non può superare PACKET_MAX byte (intestazione compresa):
+chi invia rifiuta quelli più lunghi (EMSGSIZE), chi riceve chiude la
+connessione se ne trova uno troncato. Più datagrammi per la stessa
+socket si inviano e si ricevono insieme con sendmmsg e recvmmsg, al più
+PACKET_BATCH per system call.
+ */
+#ifndef __PACKET_H
+#define __PACKET_H
+
+#include "comsock.h"
+
+/** Byte massimi di un datagramma (un messaggio, intestazione compresa) */
+#define PACKET_MAX 65536
+/** Datagrammi inviati o ricevuti con una sola sendmmsg o recvmmsg */
+#define PACKET_BATCH 8
+
+/** Crea la socket SOCK_SEQPACKET su cui il server accetta le connessioni,
+ * come createServerChannel.
+ * \retval la socket, SNAMETOOLONG se path eccede UNIX_PATH_MAX
+ * \retval -1 in caso di errore (sets errno) */
+int createPacketChannel(char *path);
+
+/** Si connette alla socket SOCK_SEQPACKET del server, come openConnection
+ * ma con un solo tentativo.
+ * \retval la socket, SNAMETOOLONG se path eccede UNIX_PATH_MAX
+ * \retval -1 in caso di errore (sets errno) */
+int openPacketConnection(char *path);
+
+/** Legge un messaggio dal server, che occupa un intero datagramma, con
+ * una sola recvmsg: nel formato di sendMessage per la versione 1, in
+ * quello di sendReply (proto2.h) per la 2. Come receiveMessage i MSG_PING
+ * vengono scartati e il '\\n' finale viene tolto.
+ * \retval come receiveMessage (-1 con errno EMSGSIZE o EPROTO se il
+ *         datagramma non contiene un messaggio valido) */
+int receivePacket(int sc, message_t *msg, int version);
+
+#endif
@@ -0,0 +1,74 @@
+/**
+   \file presence.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione degli eventi di presenza.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "errors.h"
+#include "presence.h"
+
+/** Cifre sufficienti per un unsigned long, con l'evento */
+#define PRESENCE_DIGITS 22
+
+int buildPresence(message_t *msg, char event, unsigned long version, const char *names) {
+	int size;
+	if (msg == NULL || (event != PRESENCE_SNAPSHOT && event != PRESENCE_JOIN && event != PRESENCE_LEAVE)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (names == NULL) names = "";
+	size = PRESENCE_DIGITS+1+strlen(names)+1;
+	msg->type = MSG_PRESENCE;
+	msg->buffer = Malloc(sizeof(char)*size);
+	msg->length = snprintf(msg->buffer, size, (names[0] != '\0') ? "%c%lu %s" : "%c%lu", event, version, names);
+	return 0;
+}
+
+int parsePresence(message_t *msg, char *event, unsigned long *version, char **names) {
+	char *end;
+	if (msg == NULL || msg->buffer == NULL || msg->length < 2) {
+		errno = EINVAL;
+		return -1;
+	}
+	*event = msg->buffer[0];
+	if (*event != PRESENCE_SNAPSHOT && *event != PRESENCE_JOIN && *event != PRESENCE_LEAVE) {
+		errno = EINVAL;
+		return -1;
+	}
+	errno = 0;
+	*version = strtoul(msg->buffer+1, &end, 10);
+	if (errno != 0 || end == msg->buffer+1) {
+		errno = EINVAL;
+		return -1;
+	}
+	*names = (*end == ' ') ? end+1 : end;
+	return 0;
+}
+
+void initialize_Presence(presence_t *p) {
+	if (p == NULL) return;
+	p->version = 0;
+	p->synced = 0;
+}
+
+int apply_Presence(presence_t *p, char event, unsigned long version) {
+	if (p == NULL) return 0;
+	if (event == PRESENCE_SNAPSHOT) {
+		p->version = version;
+		p->synced = 1;
+		return 1;
+	}
+	/*Prima dell'istantanea, o dopo un buco, gli eventi non servono*/
+	if (!p->synced || version <= p->version) return 0;
+	if (version != p->version+1) {
+		p->synced = 0;
+		return -1;
+	}
+	p->version = version;
+	return 1;
+}
@@ -0,0 +1,62 @@
+/**
+   \file presence.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  sottoscrizione alla presenza degli utenti connessi.
+
+Un client si iscrive inviando un MSG_PRESENCE vuoto. Il server gli
+risponde con un'istantanea, un MSG_PRESENCE il cui buffer è "=v a b c":
+la versione v dell'insieme degli utenti connessi seguita dai loro nomi.
+Da lì in poi, a ogni connessione o disconnessione, invia "+v nome" o
+"-v nome", dove v è la versione prodotta dall'evento: le versioni
+crescono di uno a ogni evento. Gli eventi con versione non successiva a
+quella già nota si ignorano; un client che vede saltare una versione ha
+perso un evento e si risincronizza inviando di nuovo MSG_PRESENCE, a cui
+il server risponde con una nuova istantanea (l'iscrizione resta una).
+
+MSG_PRESENCE è un messaggio di controllo in entrambe le direzioni: non
+consuma crediti.
+ */
+#ifndef __PRESENCE_H
+#define __PRESENCE_H
+
+#include "comsock.h"
+
+/** iscrizione (client) ed eventi di presenza (server) */
+#define MSG_PRESENCE 'V'
+/** Istantanea degli utenti connessi */
+#define PRESENCE_SNAPSHOT '='
+/** Connessione di un utente */
+#define PRESENCE_JOIN '+'
+/** Disconnessione di un utente */
+#define PRESENCE_LEAVE '-'
+
+/** <H3>Presenza vista da un client</H3>
+ * - \c version l'ultima versione applicata
+ * - \c synced 1 se si è ricevuta un'istantanea e nessun evento è andato perso
+ */
+typedef struct {
+	unsigned long version;
+	int synced;
+} presence_t;
+
+/** Prepara in msg un MSG_PRESENCE per l'evento event (PRESENCE_SNAPSHOT,
+ * PRESENCE_JOIN o PRESENCE_LEAVE) che porta alla versione version; names
+ * sono i nomi separati da spazi (NULL: nessuno). Il buffer viene allocato.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int buildPresence(message_t *msg, char event, unsigned long version, const char *names);
+
+/** Interpreta un MSG_PRESENCE ricevuto dal server: names punta ai nomi
+ * dentro il buffer di msg (stringa vuota se non ce ne sono).
+ * \retval 0 se tutto ok, -1 se il messaggio non è valido (sets errno) */
+int parsePresence(message_t *msg, char *event, unsigned long *version, char **names);
+
+/** Inizializza la presenza vista da un client non ancora iscritto. */
+void initialize_Presence(presence_t *p);
+
+/** Applica a p l'evento event con versione version.
+ * \retval 1 se l'evento è nuovo e va mostrato
+ * \retval 0 se è già superato (o si attende un'istantanea)
+ * \retval -1 se ne è andato perso qualcuno: va richiesta un'istantanea */
+int apply_Presence(presence_t *p, char event, unsigned long version);
+
+#endif
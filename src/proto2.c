@@ -0,0 +1,395 @@
+/**
+   \file proto2.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione della versione 2 del protocollo.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+#include "errors.h"
+#include "userid.h"
+#include "lz.h"
+#include "proto2.h"
+
+/** Cifre sufficienti per "versione:tratti" */
+#define PROTO_DIGITS 24
+
+int putVarint(char *p, uint32_t v) {
+	int n = 0;
+	while (v >= 0x80) {
+		p[n++] = (char) ((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (char) v;
+	return n;
+}
+
+int getVarint(const char *p, int available, uint32_t *v) {
+	uint32_t value = 0;
+	int n;
+	for (n = 0; n < available && n < VARINT_SIZE; n++) {
+		value |= (uint32_t) (p[n] & 0x7f) << (7*n);
+		if ((p[n] & 0x80) == 0) {
+			*v = value;
+			return n+1;
+		}
+	}
+	return (n == VARINT_SIZE) ? -1 : 0;
+}
+
+/** Accoda al buffer di msg, dopo il '\\0' che chiude i suoi length byte,
+ * il campo "versione:tratti". */
+static void appendProto(message_t *msg, int features) {
+	int length = (msg->buffer != NULL) ? msg->length : 0;
+	if ((msg->buffer = realloc(msg->buffer, sizeof(char)*(length+1+PROTO_DIGITS+1))) == NULL) {
+		perror("proto2, appendProto");
+		exit(EXIT_FAILURE);
+	}
+	msg->buffer[length] = '\0';
+	msg->length = length+1+snprintf(msg->buffer+length+1, PROTO_DIGITS+1, "%d:%d", PROTO_VERSION, features);
+}
+
+/** Legge il campo "versione:tratti" che segue i primi fields campi del
+ * buffer di msg.
+ * \retval i tratti, -1 se il campo manca o la versione non è la 2 */
+static int parseProto(message_t *msg, int fields) {
+	int offset = 0, version, features;
+	if (msg == NULL || msg->buffer == NULL) return -1;
+	while (fields-- > 0) {
+		if (offset >= msg->length) return -1;
+		offset += strlen(msg->buffer+offset)+1;
+	}
+	if (offset >= msg->length ||
+		sscanf(msg->buffer+offset, "%d:%d", &version, &features) != 2 ||
+		version < PROTO_VERSION || features < 0)
+		return -1;
+	return features;
+}
+
+int proposeProto(message_t *msg, int features) {
+	if (msg == NULL || msg->buffer == NULL || msg->type != MSG_CONNECT || features < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	/*Il nome e la finestra (anche vuota) restano i primi campi: un server
+	 * della versione 1 li legge come sempre*/
+	appendProto(msg, features);
+	return 0;
+}
+
+int connectProto(message_t *msg) {
+	/*Il campo segue il nome e la finestra*/
+	return parseProto(msg, 2);
+}
+
+int acceptProto(message_t *msg, int features) {
+	if (msg == NULL || msg->type != MSG_OK || features < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	appendProto(msg, features);
+	return 0;
+}
+
+int okProto(message_t *msg) {
+	/*Il campo segue la finestra concessa, anche vuota*/
+	return parseProto(msg, 1);
+}
+
+int frameSize2(const char *p, int available) {
+	uint32_t body;
+	int n;
+	if (available < 3) return 0;
+	if ((n = getVarint(p+2, available-2, &body)) == 0) return 0;
+	if (n == -1 || body > PROTO_MAX_BODY) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return 2 + n + (int) body;
+}
+
+int decodeFrame2(const char *p, int size, message_t *msg) {
+	const char *end = p+size, *name = NULL;
+	uint32_t body, id = 0, name_length = 0, raw = 0, net;
+	int flags = (unsigned char) p[1], to = flags & (PROTO_TO_NAME | PROTO_TO_ID), n, head, text_length;
+	msg->type = p[0];
+	/*L'intestazione e` gia` stata validata da frameSize2*/
+	p += 2;
+	p += getVarint(p, end-p, &body);
+	/*Il destinatario e` uno solo, e solo un MSG_TO_ONE ne ha uno*/
+	if ((flags & ~(PROTO_TO_NAME | PROTO_TO_ID | PROTO_PACKED)) != 0 ||
+		to == (PROTO_TO_NAME | PROTO_TO_ID) ||
+		(to != 0 && msg->type != MSG_TO_ONE)) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (to == PROTO_TO_ID) {
+		if ((n = getVarint(p, end-p, &id)) <= 0) {
+			errno = EPROTO;
+			return -1;
+		}
+		p += n;
+	} else if (to == PROTO_TO_NAME) {
+		if ((n = getVarint(p, end-p, &name_length)) <= 0 || name_length == 0 ||
+			name_length > (uint32_t) (end-p-n) || memchr(p+n, '\0', name_length) != NULL) {
+			errno = EPROTO;
+			return -1;
+		}
+		name = p+n;
+		p += n+name_length;
+	}
+	/*Un testo compresso porta prima la sua lunghezza originale*/
+	if (flags & PROTO_PACKED) {
+		if ((n = getVarint(p, end-p, &raw)) <= 0 || raw == 0 || raw > PROTO_MAX_BODY) {
+			errno = EPROTO;
+			return -1;
+		}
+		p += n;
+		text_length = raw;
+	} else text_length = end-p;
+	head = (to == PROTO_TO_ID) ? USERID_SIZE : (to == PROTO_TO_NAME) ? (int) name_length+1 : 0;
+	if (head + text_length == 0) {
+		msg->length = 0;
+		msg->buffer = NULL;
+		return 0;
+	}
+	/*Il testo va direttamente al suo posto, dopo il destinatario*/
+	msg->buffer = Malloc(sizeof(char)*(head+text_length+1));
+	if (!(flags & PROTO_PACKED))
+		memcpy(msg->buffer+head, p, text_length);
+	else if (lzDecompress(p, end-p, msg->buffer+head, raw) == -1) {
+		free(msg->buffer);
+		msg->buffer = NULL;
+		return -1;
+	}
+	/*Come in receiveMessage, si toglie il '\n' finale*/
+	if (text_length > 0 && msg->buffer[head+text_length-1] == '\n') text_length--;
+	if (to == PROTO_TO_ID) {
+		/*Lo stesso formato di un MSG_TO_ID della versione 1*/
+		if (text_length == 0) {
+			free(msg->buffer);
+			msg->buffer = NULL;
+			errno = EPROTO;
+			return -1;
+		}
+		net = htonl(id);
+		memcpy(msg->buffer, &net, USERID_SIZE);
+		msg->type = MSG_TO_ID;
+	} else if (to == PROTO_TO_NAME) {
+		memcpy(msg->buffer, name, name_length);
+		msg->buffer[name_length] = '\0';
+	}
+	msg->length = head+text_length;
+	msg->buffer[msg->length] = '\0';
+	return 0;
+}
+
+/** Scrive su sc i count vettori di iov, riprendendo una scrittura
+ * interrotta da dove si e` fermata (iov viene modificato).
+ * \retval 0 se tutto ok, SEOF se il peer ha chiuso la connessione
+ * \retval -1 in caso di errore (sets errno) */
+static int writeAll(int sc, struct iovec *iov, int count) {
+	int i = 0, w;
+	while (i < count) {
+		if ((w = writev(sc, iov+i, count-i)) == -1) {
+			if (errno == EINTR) continue;
+			return (errno == EPIPE) ? SEOF : -1;
+		}
+		while (i < count && (size_t) w >= iov[i].iov_len) {
+			w -= iov[i].iov_len;
+			iov[i++].iov_len = 0;
+		}
+		if (i < count) {
+			iov[i].iov_base = (char *) iov[i].iov_base + w;
+			iov[i].iov_len -= w;
+		}
+	}
+	return 0;
+}
+
+/** Legge da sc esattamente n byte.
+ * \retval 0 se tutto ok, SEOF se il peer ha chiuso la connessione
+ * \retval -1 in caso di errore (sets errno) */
+static int readAll(int sc, char *p, int n) {
+	int r;
+	while (n > 0) {
+		if ((r = read(sc, p, n)) == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (r == 0) return SEOF;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+int sendFrame2(int sc, message_t *msg, int threshold) {
+	char header[PROTO_HEADER_SIZE+VARINT_SIZE+VARINT_SIZE];
+	struct iovec iov[3];
+	uint32_t id, name_length = 0;
+	int head = 2, field = 0, text_length, total, n, k;
+	char *text, *packed = NULL;
+	if (msg == NULL || (msg->length > 0 && msg->buffer == NULL)) {
+		errno = EINVAL;
+		return -1;
+	}
+	header[0] = msg->type;
+	header[1] = 0;
+	text = msg->buffer;
+	text_length = (msg->buffer != NULL) ? msg->length : 0;
+	/*Il campo del destinatario (l'identificativo o la lunghezza del nome)
+	 * si scrive dopo la lunghezza del corpo, che dipende da lui*/
+	if (msg->type == MSG_TO_ID && text_length > USERID_SIZE) {
+		memcpy(&id, msg->buffer, USERID_SIZE);
+		header[0] = MSG_TO_ONE;
+		header[1] = PROTO_TO_ID;
+		field = putVarint(header+PROTO_HEADER_SIZE, ntohl(id));
+		text += USERID_SIZE;
+		text_length -= USERID_SIZE;
+	} else if (msg->type == MSG_TO_ONE && text_length > 0) {
+		name_length = strlen(msg->buffer);
+		header[1] = PROTO_TO_NAME;
+		field = putVarint(header+PROTO_HEADER_SIZE, name_length);
+		text += name_length+1;
+		text_length -= (text_length > (int) name_length) ? (int) name_length+1 : text_length;
+	}
+	/*Il testo compresso, preceduto dalla lunghezza originale, deve essere
+	 * piu` corto dell'originale*/
+	if (threshold > 0 && text_length >= threshold) {
+		packed = Malloc(sizeof(char)*text_length);
+		n = putVarint(packed, text_length);
+		if ((k = lzCompress(text, text_length, packed+n, text_length-n-1)) >= 0) {
+			header[1] |= PROTO_PACKED;
+			text = packed;
+			text_length = n+k;
+		}
+	}
+	head += putVarint(header+2, field+name_length+text_length);
+	memmove(header+head, header+PROTO_HEADER_SIZE, field);
+	iov[0].iov_base = header;
+	iov[0].iov_len = head+field;
+	iov[1].iov_base = msg->buffer;
+	iov[1].iov_len = name_length;
+	iov[2].iov_base = text;
+	iov[2].iov_len = text_length;
+	total = head+field+name_length+text_length;
+	n = writeAll(sc, iov, 3);
+	free(packed);
+	return (n < 0) ? n : total;
+}
+
+int replyHeader(char *header, message_t *msg, int version, int *body) {
+	int length = (msg->length > 0 && msg->buffer != NULL) ? msg->length : 0;
+	header[0] = msg->type;
+	if (version < PROTO_VERSION) {
+		memcpy(header+sizeof(char), &msg->length, sizeof(int));
+		*body = (length > 0) ? length+1 : 0;
+		return sizeof(char)+sizeof(int);
+	}
+	header[1] = 0;
+	*body = length;
+	return 2 + putVarint(header+2, length);
+}
+
+int sendReply(int sc, message_t *msg, int version) {
+	char header[PROTO_HEADER_SIZE];
+	struct iovec iov[2];
+	int body, r;
+	if (msg == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	iov[0].iov_base = header;
+	iov[0].iov_len = replyHeader(header, msg, version, &body);
+	iov[1].iov_base = msg->buffer;
+	iov[1].iov_len = body;
+	/*Una sola writev: su una socket SOCK_SEQPACKET e` un solo datagramma*/
+	return ((r = writeAll(sc, iov, 2)) < 0) ? r : body;
+}
+
+int receiveReply(int sc, message_t *msg) {
+	char header[PROTO_HEADER_SIZE], *frame;
+	int n, size, r;
+	if (msg == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	do {
+		/*La lunghezza si legge un byte alla volta: nessun byte del
+		 * messaggio successivo resta in un buffer di questa funzione*/
+		if ((r = readAll(sc, header, 3)) < 0) return r;
+		for (n = 3; header[n-1] & 0x80; n++) {
+			if (n == PROTO_HEADER_SIZE) {
+				errno = EPROTO;
+				return -1;
+			}
+			if ((r = readAll(sc, header+n, 1)) < 0) return r;
+		}
+		if ((size = frameSize2(header, n)) == -1) return -1;
+		frame = Malloc(sizeof(char)*size);
+		memcpy(frame, header, n);
+		if ((r = readAll(sc, frame+n, size-n)) == 0)
+			r = decodeFrame2(frame, size, msg);
+		free(frame);
+		if (r < 0) return r;
+		if (msg->type == MSG_PING) free(msg->buffer);
+	} while (msg->type == MSG_PING);
+	return msg->length;
+}
+
+int packMessage(message_t *msg, message_t *packed) {
+	uint32_t net;
+	int k;
+	if (msg == NULL || packed == NULL || msg->buffer == NULL || msg->length <= USERID_SIZE+2) {
+		errno = EINVAL;
+		return -1;
+	}
+	/*Lunghezza originale, blocco e tipo devono stare nei byte dell'originale*/
+	packed->buffer = Malloc(sizeof(char)*(msg->length+1));
+	if ((k = lzCompress(msg->buffer, msg->length, packed->buffer+USERID_SIZE, msg->length-USERID_SIZE-2)) == -1) {
+		free(packed->buffer);
+		packed->buffer = NULL;
+		return -1;
+	}
+	net = htonl(msg->length);
+	memcpy(packed->buffer, &net, USERID_SIZE);
+	packed->buffer[USERID_SIZE+k] = msg->type;
+	packed->length = USERID_SIZE+k+1;
+	packed->buffer[packed->length] = '\0';
+	packed->type = MSG_PACKED;
+	return 0;
+}
+
+int unpackMessage(message_t *msg) {
+	uint32_t net, raw;
+	char *buffer;
+	if (msg == NULL || msg->type != MSG_PACKED || msg->buffer == NULL || msg->length < USERID_SIZE+2) {
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(&net, msg->buffer, USERID_SIZE);
+	if ((raw = ntohl(net)) == 0 || raw > PROTO_MAX_BODY) {
+		errno = EPROTO;
+		return -1;
+	}
+	buffer = Malloc(sizeof(char)*(raw+1));
+	if (lzDecompress(msg->buffer+USERID_SIZE, msg->length-USERID_SIZE-1, buffer, raw) == -1) {
+		free(buffer);
+		return -1;
+	}
+	buffer[raw] = '\0';
+	msg->type = msg->buffer[msg->length-1];
+	free(msg->buffer);
+	msg->buffer = buffer;
+	msg->length = raw;
+	if (msg->buffer[msg->length-1] == '\n')
+		msg->buffer[--msg->length] = '\0';
+	return 0;
+}
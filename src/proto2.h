@@ -0,0 +1,163 @@
+/**
+   \file proto2.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  versione 2 del protocollo: intestazione compatta, lunghezze
+   varint e destinatario in un campo esplicito.
+
+La versione si negozia con MSG_CONNECT, che resta nel formato di
+sendMessage. Il client accoda alla finestra dei crediti (dopo il suo
+'\\0', anche se la finestra è vuota) la proposta "2:tratti", in cifre
+decimali; il server che la accetta accoda a sua volta "2:tratti" al
+buffer del suo MSG_OK, dopo il '\\0' della finestra concessa: i tratti
+sono quelli proposti che il server supporta. Un server che non conosce la
+proposta la ignora, e un client che non la riceve indietro resta alla
+versione 1.
+
+Dopo MSG_CONNECT i messaggi dal client al server viaggiano così:
+  - 1 byte: il tipo, come nella versione 1
+  - 1 byte: i flag del destinatario (PROTO_TO_NAME o PROTO_TO_ID) e del
+    testo (PROTO_PACKED)
+  - varint: la lunghezza del corpo, al più PROTO_MAX_BODY
+  - il corpo: il destinatario (per PROTO_TO_ID il suo identificativo in
+    varint, per PROTO_TO_NAME la lunghezza del nome in varint seguita dal
+    nome), poi il testo, senza terminatore.
+
+I varint sono little endian a 7 bit per byte (LEB128): il bit alto indica
+che segue un altro byte. Un messaggio breve ha 3 byte di intestazione
+invece di 5 e non porta il '\\0' finale; il lettore conosce la lunghezza
+di ogni campo prima di leggerlo e non cerca terminatori nel testo.
+
+Dopo MSG_OK, che resta nel formato di sendMessage, anche i messaggi dal
+server al client viaggiano nel formato della versione 2, con i flag
+nulli: il corpo è il buffer, senza il '\\0' finale. Li scrive sendReply
+(o chi ne prepara l'intestazione con replyHeader) e li legge
+receiveReply.
+
+Con il tratto PROTO_PACK i testi lunghi possono viaggiare compressi (lz.h)
+in entrambe le direzioni. Dal client, un messaggio con il flag
+PROTO_PACKED ha come testo la lunghezza originale in varint seguita dal
+blocco compresso. Dal server arriva un MSG_PACKED il cui buffer è la
+lunghezza originale (4 byte, in network byte order), il blocco compresso
+e infine il tipo originale: l'ultimo byte non è mai '\\n', e
+receiveMessage non lo toglie. Chi comprime invia il messaggio originale
+se la compressione non lo accorcia.
+ */
+#ifndef __PROTO2_H
+#define __PROTO2_H
+
+#include <stdint.h>
+
+#include "comsock.h"
+
+/** Versione del protocollo negoziata con MSG_CONNECT */
+#define PROTO_VERSION 2
+/** Tratto: il client invia messaggi subito dopo MSG_CONNECT, senza
+ * attendere MSG_OK */
+#define PROTO_PIPELINE 0x1
+/** Tratto: il destinatario di un messaggio può essere un identificativo
+ * (userid.h) */
+#define PROTO_BY_ID 0x2
+/** Tratto: i testi lunghi possono viaggiare compressi */
+#define PROTO_PACK 0x4
+/** Tratto: il client invia MSG_PING con regolarita`, e il server lo
+ * disconnette se tace troppo a lungo */
+#define PROTO_HEARTBEAT 0x8
+
+/** Flag del destinatario: nome */
+#define PROTO_TO_NAME 0x1
+/** Flag del destinatario: identificativo */
+#define PROTO_TO_ID 0x2
+/** Flag del testo: compresso */
+#define PROTO_PACKED 0x4
+
+/** messaggio compresso inviato dal server */
+#define MSG_PACKED 'Z'
+/** Lunghezza di default dei testi da cui si comprime */
+#define PACK_THRESHOLD 512
+
+/** Byte massimi di un varint a 32 bit */
+#define VARINT_SIZE 5
+/** Byte massimi dell'intestazione (tipo, flag, lunghezza) */
+#define PROTO_HEADER_SIZE (2+VARINT_SIZE)
+/** Lunghezza massima del corpo di un messaggio */
+#define PROTO_MAX_BODY (1 << 24)
+
+/** Scrive v in p come varint.
+ * \retval i byte scritti (al più VARINT_SIZE) */
+int putVarint(char *p, uint32_t v);
+
+/** Legge un varint dai primi available byte di p.
+ * \retval i byte letti, 0 se il varint non è completo, -1 se è più lungo
+ *         di VARINT_SIZE byte */
+int getVarint(const char *p, int available, uint32_t *v);
+
+/** Accoda al MSG_CONNECT msg (costruito da buildConnect) la proposta
+ * della versione 2 con i tratti features.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int proposeProto(message_t *msg, int features);
+
+/** Restituisce i tratti proposti da un MSG_CONNECT, -1 se il client non
+ * ha proposto la versione 2. */
+int connectProto(message_t *msg);
+
+/** Accoda al MSG_OK msg (vuoto o costruito da buildCredit) l'accettazione
+ * della versione 2 con i tratti features.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int acceptProto(message_t *msg, int features);
+
+/** Restituisce i tratti accettati da un MSG_OK, -1 se il server non ha
+ * accettato la versione 2. */
+int okProto(message_t *msg);
+
+/** Calcola la lunghezza del messaggio che inizia in p, di cui sono
+ * disponibili available byte.
+ * \retval i byte del messaggio, 0 se l'intestazione non è completa
+ * \retval -1 se l'intestazione non è valida (sets errno) */
+int frameSize2(const char *p, int available);
+
+/** Copia in msg il messaggio completo di size byte che inizia in p,
+ * nello stesso formato di receiveMessage: un destinatario per nome dà un
+ * MSG_TO_ONE "nome\\0testo", uno per identificativo un MSG_TO_ID. Un testo
+ * compresso viene decompresso.
+ * \retval 0 se tutto ok, -1 se il messaggio non è valido (sets errno) */
+int decodeFrame2(const char *p, int size, message_t *msg);
+
+/** Invia msg alla socket sc nel formato della versione 2: MSG_TO_ONE con
+ * buffer "nome\\0testo" e MSG_TO_ID diventano messaggi con il destinatario
+ * esplicito. I testi di almeno threshold byte (0: nessuno) viaggiano
+ * compressi, se la compressione li accorcia. Alloca memoria solo per
+ * comprimere: con threshold 0 si può chiamare da un gestore di segnali.
+ * \retval come sendMessage */
+int sendFrame2(int sc, message_t *msg, int threshold);
+
+/** Scrive in header l'intestazione di un messaggio dal server al client,
+ * nel formato della versione version: tipo e lunghezza come sendMessage
+ * per la 1, tipo, flag nulli e lunghezza in varint per la 2.
+ * \param header almeno PROTO_HEADER_SIZE byte
+ * \param body i byte del buffer di msg che seguono l'intestazione (con il
+ *        '\\0' finale solo nella versione 1)
+ * \retval i byte dell'intestazione */
+int replyHeader(char *header, message_t *msg, int version, int *body);
+
+/** Invia msg alla socket sc con una sola scrittura, nel formato dei
+ * messaggi dal server al client della versione version (replyHeader).
+ * \retval come sendMessage */
+int sendReply(int sc, message_t *msg, int version);
+
+/** Legge un messaggio dal server nel formato della versione 2. Come
+ * receiveMessage i MSG_PING vengono scartati e il '\\n' finale viene tolto.
+ * \retval la lunghezza del buffer, SEOF se il server ha chiuso la
+ *         connessione, -1 in caso di errore (sets errno) */
+int receiveReply(int sc, message_t *msg);
+
+/** Prepara in packed il MSG_PACKED che porta msg compresso (il buffer
+ * viene allocato qui).
+ * \retval 0 se tutto ok, -1 se la compressione non accorcia msg */
+int packMessage(message_t *msg, message_t *packed);
+
+/** Sostituisce il MSG_PACKED msg con il messaggio originale, togliendogli
+ * il '\\n' finale come receiveMessage.
+ * \retval 0 se tutto ok, -1 se il messaggio non è valido (errno = EPROTO) */
+int unpackMessage(message_t *msg);
+
+#endif
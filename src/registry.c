@@ -0,0 +1,137 @@
+/**
+   \file registry.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione del registro delle sessioni.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "errors.h"
+#include "registry.h"
+
+session_rec *initialize_Registry(int size) {
+	session_rec *r;
+	int i;
+	if (size <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((errno = posix_memalign((void **) &r, REGISTRY_LINE, sizeof(session_rec)*size)) != 0) {
+		perror("registry, initialize_Registry");
+		return NULL;
+	}
+	for (i = 0; i < size; i++) {
+		if ((errno = pthread_mutex_init(&r[i].lock, NULL)) != 0) {
+			perror("registry, initialize_Registry");
+			while (--i >= 0) pthread_mutex_destroy(&r[i].lock);
+			free(r);
+			return NULL;
+		}
+		r[i].fd = -1;
+		r[i].state = SESSION_OFFLINE;
+		r[i].delivered = r[i].failed = 0;
+		r[i].name = NULL;
+	}
+	return r;
+}
+
+int claim_Session(session_rec *s) {
+	int expected = SESSION_OFFLINE;
+	/*close_Session rende la sessione SESSION_OFFLINE solo dopo averne tolto
+	 * la socket: chi la riserva la trova libera*/
+	if (!__atomic_compare_exchange_n(&s->state, &expected, SESSION_CONNECTING, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		errno = EBUSY;
+		return -1;
+	}
+	return 0;
+}
+
+void unclaim_Session(session_rec *s) {
+	int expected = SESSION_CONNECTING;
+	(void) __atomic_compare_exchange_n(&s->state, &expected, SESSION_OFFLINE, 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+int open_Session(session_rec *s, int fd) {
+	pthread_mutex_lock(&s->lock);
+		if (s->state != SESSION_CONNECTING) {
+			pthread_mutex_unlock(&s->lock);
+			errno = EBUSY;
+			return -1;
+		}
+		s->fd = fd;
+		__atomic_store_n(&s->state, SESSION_ONLINE, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+}
+
+int close_Session(session_rec *s) {
+	int fd;
+	pthread_mutex_lock(&s->lock);
+		if (s->state != SESSION_ONLINE) {
+			pthread_mutex_unlock(&s->lock);
+			errno = ENOENT;
+			return -1;
+		}
+		fd = s->fd;
+		s->fd = -1;
+		__atomic_store_n(&s->state, SESSION_OFFLINE, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&s->lock);
+	return fd;
+}
+
+int acquire_Session(session_rec *s) {
+	pthread_mutex_lock(&s->lock);
+	if (s->state != SESSION_ONLINE) {
+		pthread_mutex_unlock(&s->lock);
+		return -1;
+	}
+	return s->fd;
+}
+
+int try_Session(session_rec *s) {
+	if (pthread_mutex_trylock(&s->lock) != 0) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (s->state != SESSION_ONLINE) {
+		pthread_mutex_unlock(&s->lock);
+		errno = ENOENT;
+		return -1;
+	}
+	return s->fd;
+}
+
+void release_Session(session_rec *s) {
+	pthread_mutex_unlock(&s->lock);
+}
+
+int online_Session(session_rec *s) {
+	return __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) == SESSION_ONLINE;
+}
+
+void report_Registry(session_rec *r, int size, FILE *f) {
+	unsigned long delivered = 0, failed = 0;
+	int i, online = 0;
+	if (r == NULL) return;
+	for (i = 0; i < size; i++) {
+		delivered += r[i].delivered;
+		failed += r[i].failed;
+		online += online_Session(r+i);
+	}
+	fprintf(f, "sessioni: %d utenti, %d connessi; consegnati %lu, falliti %lu\n", size, online, delivered, failed);
+	fflush(f);
+}
+
+void free_Registry(session_rec **r, int size) {
+	int i;
+	if (r == NULL || *r == NULL) return;
+	for (i = 0; i < size; i++)
+		pthread_mutex_destroy(&(*r)[i].lock);
+	free(*r);
+	*r = NULL;
+}
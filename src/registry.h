@@ -0,0 +1,93 @@
+/**
+   \file registry.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  registro delle sessioni degli utenti, indicizzato per identificativo.
+
+Il registro è un array contiguo con una sessione per ogni utente
+autorizzato, nella posizione del suo identificativo. Ogni sessione occupa
+esattamente una linea di cache e contiene tutto ciò che serve per
+consegnarle un messaggio: il lock, la socket, lo stato, i contatori e il
+nome. Le sessioni non vengono mai liberate finché il server resta attivo:
+chi ne ha il puntatore può sempre acquisirla, e scopre così se l'utente è
+ancora connesso.
+ */
+#ifndef __REGISTRY_H
+#define __REGISTRY_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+/** Dimensione di una linea di cache */
+#define REGISTRY_LINE 64
+/** L'utente non è connesso */
+#define SESSION_OFFLINE 0
+/** L'utente è connesso */
+#define SESSION_ONLINE 1
+/** Un dispatcher sta connettendo l'utente */
+#define SESSION_CONNECTING 2
+
+/** <H3>Sessione di un utente</H3>
+ * - \c lock garantisce a chi scrive sulla socket l'accesso esclusivo
+ * - \c fd la socket dell'utente, -1 se non è connesso
+ * - \c state SESSION_ONLINE, SESSION_OFFLINE o SESSION_CONNECTING
+ * - \c delivered i messaggi consegnati, \c failed quelli non consegnati
+ *   per un errore (aggiornati con \c lock acquisito)
+ * - \c name il nome dell'utente (la sua chiave nella tabella hash)
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	int fd;
+	int state;
+	unsigned int delivered;
+	unsigned int failed;
+	char *name;
+} __attribute__((aligned(REGISTRY_LINE))) session_rec;
+
+/** Crea un registro di size sessioni, tutte SESSION_OFFLINE e senza nome.
+ * \retval NULL in caso di errore (sets errno) */
+session_rec *initialize_Registry(int size);
+
+/** Riserva la sessione s a chi sta connettendo l'utente, senza acquisire
+ * il lock: tra più dispatcher che connettono lo stesso utente uno solo
+ * riesce.
+ * \retval 0 se tutto ok, -1 se l'utente è connesso o in connessione (errno = EBUSY) */
+int claim_Session(session_rec *s);
+
+/** Annulla la riserva della sessione s presa con claim_Session. */
+void unclaim_Session(session_rec *s);
+
+/** Rende connessa la sessione s, riservata con claim_Session, sulla socket fd.
+ * \retval 0 se tutto ok, -1 se la sessione non era riservata (errno = EBUSY) */
+int open_Session(session_rec *s, int fd);
+
+/** Rende disconnessa la sessione s. Dopo il ritorno nessuno può più
+ * acquisirla: la socket resta al chiamante, che può scriverci senza lock.
+ * \retval la socket dell'utente, -1 se non era connesso (errno = ENOENT) */
+int close_Session(session_rec *s);
+
+/** Acquisisce la sessione s, se l'utente è connesso.
+ * \retval la socket dell'utente: la sessione resta acquisita fino a release_Session
+ * \retval -1 se l'utente non è connesso (la sessione non viene acquisita) */
+int acquire_Session(session_rec *s);
+
+/** Come acquire_Session, ma senza attendere chi ha gia` acquisito s: per
+ * chi non può bloccarsi, come i timer della ruota (timerwheel.h).
+ * \retval la socket dell'utente: la sessione resta acquisita fino a release_Session
+ * \retval -1 se l'utente non è connesso (errno = ENOENT) o se la sessione
+ *         è già acquisita (errno = EBUSY) */
+int try_Session(session_rec *s);
+
+/** Rilascia la sessione s, acquisita con acquire_Session. */
+void release_Session(session_rec *s);
+
+/** Restituisce 1 se l'utente di s è connesso, 0 altrimenti. */
+int online_Session(session_rec *s);
+
+/** Scrive su f i messaggi consegnati e non consegnati dalle size sessioni
+ * del registro r. */
+void report_Registry(session_rec *r, int size, FILE *f);
+
+/** Libera il registro (le sessioni devono essere tutte disconnesse). */
+void free_Registry(session_rec **r, int size);
+
+#endif
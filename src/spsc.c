@@ -0,0 +1,68 @@
+/**
+   \file spsc.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione della coda SPSC.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "errors.h"
+#include "spsc.h"
+
+spsc_queue *initialize_Spsc(unsigned long size) {
+	spsc_queue *q;
+	unsigned long capacity = 2;
+	if (size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (capacity < size) capacity <<= 1;
+	if ((errno = posix_memalign((void **) &q, SPSC_LINE, sizeof(spsc_queue))) != 0) {
+		perror("spsc, initialize_Spsc");
+		return NULL;
+	}
+	q->items = Malloc(sizeof(void*)*capacity);
+	q->mask = capacity-1;
+	q->head = q->tail = 0;
+	q->head_cache = q->tail_cache = 0;
+	return q;
+}
+
+int push_Spsc(spsc_queue *q, void *item) {
+	unsigned long tail = q->tail;
+	if (tail - q->head_cache > q->mask) {
+		q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if (tail - q->head_cache > q->mask) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	q->items[tail & q->mask] = item;
+	/*L'elemento deve essere visibile prima del nuovo tail*/
+	__atomic_store_n(&q->tail, tail+1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void *pop_Spsc(spsc_queue *q) {
+	unsigned long head = q->head;
+	void *item;
+	if (head == q->tail_cache) {
+		q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if (head == q->tail_cache) return NULL;
+	}
+	item = q->items[head & q->mask];
+	__atomic_store_n(&q->head, head+1, __ATOMIC_RELEASE);
+	return item;
+}
+
+void free_Spsc(spsc_queue **q) {
+	if (q == NULL || *q == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	free((*q)->items);
+	free(*q);
+	*q = NULL;
+}
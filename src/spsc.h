@@ -0,0 +1,46 @@
+/**
+   \file spsc.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  coda circolare senza lock per un solo produttore e un solo consumatore.
+
+La coda contiene puntatori. Il produttore scrive solo tail, il consumatore
+solo head: i due indici stanno su linee di cache diverse e ciascun lato
+tiene una copia locale dell'indice altrui, che rilegge solo quando la coda
+sembra piena (o vuota).
+ */
+#ifndef __SPSC_H
+#define __SPSC_H
+
+/** Dimensione di una linea di cache */
+#define SPSC_LINE 64
+
+/** <H3>Coda SPSC</H3>
+ * - \c items gli elementi, \c mask la capacità meno uno (potenza di due)
+ * - \c head prossimo elemento da estrarre, \c tail_cache l'ultimo tail letto
+ * - \c tail prossima posizione libera, \c head_cache l'ultimo head letto
+ */
+typedef struct {
+	void **items;
+	unsigned long mask;
+	unsigned long head __attribute__((aligned(SPSC_LINE)));
+	unsigned long tail_cache;
+	unsigned long tail __attribute__((aligned(SPSC_LINE)));
+	unsigned long head_cache;
+} spsc_queue;
+
+/** Crea una coda con almeno size posizioni.
+ * \retval NULL in caso di errore (sets errno) */
+spsc_queue *initialize_Spsc(unsigned long size);
+
+/** Inserisce item (non NULL) nella coda. Va chiamata solo dal produttore.
+ * \retval 0 se tutto ok, -1 se la coda è piena (errno = EAGAIN) */
+int push_Spsc(spsc_queue *q, void *item);
+
+/** Estrae il prossimo elemento. Va chiamata solo dal consumatore.
+ * \retval NULL se la coda è vuota */
+void *pop_Spsc(spsc_queue *q);
+
+/** Libera la coda (non gli elementi eventualmente presenti). */
+void free_Spsc(spsc_queue **q);
+
+#endif
@@ -0,0 +1,180 @@
+/**
+   \file stage.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione degli stadi della pipeline.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "errors.h"
+#include "stage.h"
+
+/** Argomento di un thread dello stadio */
+typedef struct {
+	stage_t *st;
+	int index;
+} stage_arg;
+
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *run_Stage(void *a) {
+	stage_arg *arg = a;
+	stage_t *st = arg->st;
+	stage_queue *q = st->queues + arg->index;
+	void *item;
+	long long start;
+	free(arg);
+	while (1) {
+		pthread_mutex_lock(&q->mtx);
+		while (q->count == 0 && !st->stop)
+			pthread_cond_wait(&q->not_empty, &q->mtx);
+		if (q->count == 0) {
+			/*stop e coda vuota*/
+			pthread_mutex_unlock(&q->mtx);
+			break;
+		}
+		item = q->items[q->head];
+		q->head = (q->head+1) % STAGE_QUEUE;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+		pthread_mutex_unlock(&q->mtx);
+		start = now_ns();
+		st->handler(item);
+		__atomic_add_fetch(&st->busy_ns, now_ns() - start, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&st->processed, 1, __ATOMIC_RELAXED);
+	}
+	return (void *) 0;
+}
+
+stage_t *initialize_Stage(const char *name, int threads, stage_handler handler) {
+	stage_t *st;
+	int i;
+	if (name == NULL || threads < 1 || handler == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	st = Malloc(sizeof(stage_t));
+	st->name = Malloc(sizeof(char)*(strlen(name)+1));
+	strcpy(st->name, name);
+	st->threads = threads;
+	st->handler = handler;
+	st->stop = 0;
+	st->processed = 0;
+	st->busy_ns = 0;
+	st->max_depth = 0;
+	st->tids = Malloc(sizeof(pthread_t)*threads);
+	st->queues = Malloc(sizeof(stage_queue)*threads);
+	for (i = 0; i < threads; i++) {
+		stage_queue *q = st->queues+i;
+		q->items = Malloc(sizeof(void*)*STAGE_QUEUE);
+		q->head = q->count = 0;
+		pthread_mutex_init(&q->mtx, NULL);
+		pthread_cond_init(&q->not_empty, NULL);
+		pthread_cond_init(&q->not_full, NULL);
+	}
+	return st;
+}
+
+int start_Stage(stage_t *st) {
+	int i;
+	if (st == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < st->threads; i++) {
+		stage_arg *arg = Malloc(sizeof(stage_arg));
+		arg->st = st;
+		arg->index = i;
+		if ((errno = pthread_create(st->tids+i, NULL, &run_Stage, arg)) != 0) {
+			perror("stage, start_Stage");
+			free(arg);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int enqueue_Stage(stage_t *st, unsigned int key, void *item) {
+	stage_queue *q;
+	int depth;
+	if (st == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	q = st->queues + (key % st->threads);
+	pthread_mutex_lock(&q->mtx);
+	while (q->count == STAGE_QUEUE && !st->stop)
+		pthread_cond_wait(&q->not_full, &q->mtx);
+	if (st->stop) {
+		pthread_mutex_unlock(&q->mtx);
+		errno = ECANCELED;
+		return -1;
+	}
+	q->items[(q->head+q->count) % STAGE_QUEUE] = item;
+	depth = ++q->count;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->mtx);
+	if (depth > __atomic_load_n(&st->max_depth, __ATOMIC_RELAXED))
+		__atomic_store_n(&st->max_depth, depth, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int depth_Stage(stage_t *st) {
+	int i, depth = 0;
+	if (st == NULL) return 0;
+	for (i = 0; i < st->threads; i++) {
+		pthread_mutex_lock(&st->queues[i].mtx);
+		depth += st->queues[i].count;
+		pthread_mutex_unlock(&st->queues[i].mtx);
+	}
+	return depth;
+}
+
+void report_Stage(stage_t *st, FILE *f) {
+	long processed;
+	long long busy;
+	if (st == NULL || f == NULL) return;
+	processed = __atomic_load_n(&st->processed, __ATOMIC_RELAXED);
+	busy = __atomic_load_n(&st->busy_ns, __ATOMIC_RELAXED);
+	fprintf(f, "stadio %-8s thread %2d  in coda %5d (max %5d)  elaborati %9ld  servizio medio %8.2f us\n",
+		st->name, st->threads, depth_Stage(st), st->max_depth, processed,
+		(processed > 0) ? busy / 1000.0 / processed : 0.0);
+}
+
+void stop_Stage(stage_t *st) {
+	int i;
+	if (st == NULL) return;
+	for (i = 0; i < st->threads; i++) {
+		pthread_mutex_lock(&st->queues[i].mtx);
+		st->stop = 1;
+		pthread_cond_broadcast(&st->queues[i].not_empty);
+		pthread_cond_broadcast(&st->queues[i].not_full);
+		pthread_mutex_unlock(&st->queues[i].mtx);
+	}
+	for (i = 0; i < st->threads; i++)
+		pthread_join(st->tids[i], NULL);
+}
+
+void free_Stage(stage_t **st) {
+	int i;
+	if (st == NULL || *st == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	for (i = 0; i < (*st)->threads; i++)
+		free((*st)->queues[i].items);
+	free((*st)->queues);
+	free((*st)->tids);
+	free((*st)->name);
+	free(*st);
+	*st = NULL;
+}
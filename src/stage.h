@@ -0,0 +1,83 @@
+/**
+   \file stage.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  stadi di una pipeline: code limitate servite da thread dedicati.
+
+Uno stadio ha un certo numero di thread, ciascuno con la propria coda
+limitata. Ogni elemento viene accodato insieme a una chiave e finisce
+sempre nella coda dello stesso thread (chiave modulo numero di thread):
+gli elementi con la stessa chiave sono quindi serviti nell'ordine di
+arrivo. Se la coda è piena chi accoda attende, così che uno stadio lento
+rallenti quelli che lo precedono invece di accumulare memoria.
+
+Ogni stadio misura la profondità delle proprie code e il tempo speso dal
+suo gestore per ciascun elemento.
+ */
+#ifndef __STAGE_H
+#define __STAGE_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+/** Capacità della coda di ciascun thread di uno stadio */
+#define STAGE_QUEUE 256
+
+/** Gestore di uno stadio: elabora (e consuma) un elemento */
+typedef void (*stage_handler)(void *item);
+
+/** <H3>Coda di un thread dello stadio</H3> */
+typedef struct {
+	void **items;
+	int head;
+	int count;
+	pthread_mutex_t mtx;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} stage_queue;
+
+/** <H3>Stadio</H3>
+ * - \c name il nome, usato nei resoconti
+ * - \c threads il numero di thread, ciascuno con la coda \c queues[i]
+ * - \c stop diventa 1 quando lo stadio deve svuotare le code e terminare
+ * - \c processed gli elementi elaborati, \c busy_ns il tempo speso a farlo
+ * - \c max_depth la massima profondità osservata di una coda
+ */
+typedef struct {
+	char *name;
+	int threads;
+	stage_queue *queues;
+	pthread_t *tids;
+	stage_handler handler;
+	int stop;
+	long processed;
+	long long busy_ns;
+	int max_depth;
+} stage_t;
+
+/** Crea uno stadio di threads thread che elaborano gli elementi con handler.
+ * \retval NULL in caso di errore (sets errno) */
+stage_t *initialize_Stage(const char *name, int threads, stage_handler handler);
+
+/** Avvia i thread dello stadio.
+ * \retval 0 se tutto ok, -1 in caso di errore */
+int start_Stage(stage_t *st);
+
+/** Accoda item al thread dello stadio scelto da key, attendendo se la sua
+ * coda è piena.
+ * \retval 0 se tutto ok, -1 se lo stadio sta terminando (errno = ECANCELED) */
+int enqueue_Stage(stage_t *st, unsigned int key, void *item);
+
+/** Numero di elementi attualmente in coda nello stadio. */
+int depth_Stage(stage_t *st);
+
+/** Scrive su f una riga con le misure dello stadio. */
+void report_Stage(stage_t *st, FILE *f);
+
+/** Chiede ai thread di terminare dopo aver svuotato le code e ne attende
+ * l'uscita. */
+void stop_Stage(stage_t *st);
+
+/** Libera lo stadio (che deve essere fermo). */
+void free_Stage(stage_t **st);
+
+#endif
@@ -0,0 +1,89 @@
+/**
+   \file
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief test filtro di Bloom
+
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <mcheck.h>
+
+#include "bloom.h"
+
+/* chiavi inserite, e altrettante mai inserite */
+#define KEYS 100000
+/* falsi positivi tollerati, per diecimila verifiche */
+#define FALSE_POSITIVES 100
+
+int main (void) {
+  bloom_filter *b;
+  char key[32];
+  int i, fp;
+
+  mtrace();
+
+  /*** inizio test creazione ***/
+  if ( initialize_Bloom(0) != NULL || initialize_Bloom(-1) != NULL ) {
+    fprintf(stderr,"initialize_Bloom: dimensione non valida accettata\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( ( b = initialize_Bloom(KEYS) ) == NULL ) {
+    fprintf(stderr,"initialize_Bloom: impossibile creare\n");
+    exit(EXIT_FAILURE);
+  }
+  /* blocchi allineati alla linea di cache, in numero potenza di due */
+  if ( (uintptr_t) b->blocks % BLOOM_LINE != 0 || ( b->mask & (b->mask+1) ) != 0 ||
+       (b->mask+1) * BLOOM_LINE * 8 < (unsigned long) KEYS * BLOOM_BITS ) {
+    fprintf(stderr,"initialize_Bloom: blocchi non validi\n");
+    exit(EXIT_FAILURE);
+  }
+  /* un filtro vuoto non contiene nulla, uno assente tutto */
+  for ( i = 0; i < KEYS; i++ ) {
+    sprintf(key,"utente%d",i);
+    if ( check_Bloom(b,key) != 0 || check_Bloom(NULL,key) != 1 ) {
+      fprintf(stderr,"check_Bloom: %s: risposta errata\n",key);
+      exit(EXIT_FAILURE);
+    }
+  }
+  /*** fine test creazione ***/
+
+  /*** inizio test inserimento ***/
+  for ( i = 0; i < KEYS; i++ ) {
+    sprintf(key,"utente%d",i);
+    add_Bloom(b,key);
+  }
+  add_Bloom(b,"");
+  /* nessun falso negativo */
+  for ( i = 0; i < KEYS; i++ ) {
+    sprintf(key,"utente%d",i);
+    if ( check_Bloom(b,key) != 1 ) {
+      fprintf(stderr,"check_Bloom: %s: falso negativo\n",key);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if ( check_Bloom(b,"") != 1 ) {
+    fprintf(stderr,"check_Bloom: chiave vuota: falso negativo\n");
+    exit(EXIT_FAILURE);
+  }
+  /* pochi falsi positivi con il carico previsto */
+  for ( i = 0, fp = 0; i < KEYS; i++ ) {
+    sprintf(key,"ospite%d",i);
+    fp += check_Bloom(b,key);
+  }
+  if ( fp > FALSE_POSITIVES * (KEYS / 10000) ) {
+    fprintf(stderr,"check_Bloom: %d falsi positivi su %d\n",fp,KEYS);
+    exit(EXIT_FAILURE);
+  }
+  /*** fine test inserimento ***/
+
+  free_Bloom(&b);
+  if ( b != NULL ) {
+    fprintf(stderr,"free_Bloom: puntatore non azzerato\n");
+    exit(EXIT_FAILURE);
+  }
+  free_Bloom(&b);
+
+  return 0;
+}
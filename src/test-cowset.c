@@ -0,0 +1,158 @@
+/**
+   \file
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief test insieme copy-on-write
+
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <mcheck.h>
+
+#include "cowset.h"
+
+/* elementi dell'insieme */
+#define SIZE 64
+/* modifiche durante la lettura concorrente */
+#define CHANGES 100000
+#define READERS 4
+
+static int items[SIZE];
+static cow_set *set;
+static int stop = 0;
+
+/* verifica un'istantanea: elementi noti e senza ripetizioni */
+int check_snapshot(cow_snapshot *snap) {
+  int seen[SIZE], i, k;
+
+  if ( snap->size < 0 || snap->size > SIZE ) return -1;
+  memset(seen,0,sizeof(seen));
+  for ( i = 0; i < snap->size; i++ ) {
+    k = (int *) snap->items[i] - items;
+    if ( k < 0 || k >= SIZE || seen[k]++ ) return -1;
+  }
+  return 0;
+}
+
+/* lettore: scorre le istantanee senza lock, la generazione non cala mai */
+void *reader(void *arg) {
+  cow_snapshot *snap;
+  unsigned long last = 0;
+  long reads = 0;
+
+  (void) arg;
+  while ( !__atomic_load_n(&stop,__ATOMIC_ACQUIRE) ) {
+    snap = acquire_CowSet(set);
+    if ( check_snapshot(snap) == -1 || snap->generation < last ) {
+      fprintf(stderr,"acquire_CowSet: istantanea non valida (generazione %lu)\n",snap->generation);
+      exit(EXIT_FAILURE);
+    }
+    last = snap->generation;
+    release_Snapshot(snap);
+    reads++;
+  }
+  return (void *) reads;
+}
+
+int main (void) {
+  cow_snapshot *old, *snap;
+  pthread_t tid[READERS];
+  long generation, g;
+  int i;
+
+  mtrace();
+
+  /*** inizio test creazione ***/
+  if ( ( set = initialize_CowSet() ) == NULL ) {
+    fprintf(stderr,"initialize_CowSet: impossibile creare\n");
+    exit(EXIT_FAILURE);
+  }
+  snap = acquire_CowSet(set);
+  if ( snap->size != 0 ) {
+    fprintf(stderr,"initialize_CowSet: insieme non vuoto\n");
+    exit(EXIT_FAILURE);
+  }
+  release_Snapshot(snap);
+  /*** fine test creazione ***/
+
+  /*** inizio test aggiunte e rimozioni ***/
+  generation = 0;
+  for ( i = 0; i < SIZE; i++ ) {
+    if ( ( g = add_CowSet(set,items+i) ) <= generation ) {
+      fprintf(stderr,"add_CowSet: %d: generazione %ld dopo %ld\n",i,g,generation);
+      exit(EXIT_FAILURE);
+    }
+    generation = g;
+  }
+  errno = 0;
+  if ( add_CowSet(set,items) != -1 || errno != EEXIST ) {
+    fprintf(stderr,"add_CowSet: elemento ripetuto accettato\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( add_CowSet(set,NULL) != -1 ) {
+    fprintf(stderr,"add_CowSet: elemento NULL accettato\n");
+    exit(EXIT_FAILURE);
+  }
+  /* un'istantanea acquisita non cambia con l'insieme */
+  old = acquire_CowSet(set);
+  for ( i = 0; i < SIZE; i += 2 )
+    if ( remove_CowSet(set,items+i) == -1 ) {
+      fprintf(stderr,"remove_CowSet: %d: non trovato\n",i);
+      exit(EXIT_FAILURE);
+    }
+  errno = 0;
+  if ( remove_CowSet(set,items) != -1 || errno != ENOENT ) {
+    fprintf(stderr,"remove_CowSet: elemento assente rimosso\n");
+    exit(EXIT_FAILURE);
+  }
+  snap = acquire_CowSet(set);
+  if ( old->size != SIZE || check_snapshot(old) == -1 ) {
+    fprintf(stderr,"acquire_CowSet: istantanea acquisita modificata\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( snap->size != SIZE/2 || check_snapshot(snap) == -1 || snap->generation <= old->generation ) {
+    fprintf(stderr,"remove_CowSet: istantanea corrente errata\n");
+    exit(EXIT_FAILURE);
+  }
+  for ( i = 0; i < snap->size; i++ )
+    if ( ( (int *) snap->items[i] - items ) % 2 == 0 ) {
+      fprintf(stderr,"remove_CowSet: elemento rimosso ancora presente\n");
+      exit(EXIT_FAILURE);
+    }
+  release_Snapshot(snap);
+  release_Snapshot(old);
+  /*** fine test aggiunte e rimozioni ***/
+
+  /*** inizio test lettori concorrenti ***/
+  for ( i = 0; i < READERS; i++ )
+    if ( pthread_create(tid+i,NULL,reader,NULL) != 0 ) {
+      fprintf(stderr,"pthread_create: impossibile creare il lettore %d\n",i);
+      exit(EXIT_FAILURE);
+    }
+  for ( i = 0; i < CHANGES; i++ ) {
+    /* gli elementi pari entrano ed escono a turno */
+    int k = 2 * (i % (SIZE/2));
+    if ( ( i / (SIZE/2) ) % 2 == 0 ? add_CowSet(set,items+k) == -1 : remove_CowSet(set,items+k) == -1 ) {
+      fprintf(stderr,"cow_set: modifica %d fallita\n",i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  __atomic_store_n(&stop,1,__ATOMIC_RELEASE);
+  for ( i = 0; i < READERS; i++ ) pthread_join(tid[i],NULL);
+  /*** fine test lettori concorrenti ***/
+
+  /*** inizio test distruzione ***/
+  /* l'istantanea trattenuta sopravvive all'insieme */
+  snap = acquire_CowSet(set);
+  free_CowSet(&set);
+  if ( set != NULL || check_snapshot(snap) == -1 ) {
+    fprintf(stderr,"free_CowSet: istantanea non valida\n");
+    exit(EXIT_FAILURE);
+  }
+  release_Snapshot(snap);
+  /*** fine test distruzione ***/
+
+  return 0;
+}
@@ -0,0 +1,210 @@
+/**
+   \file
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief test compressione LZ e varint della versione 2
+
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <mcheck.h>
+
+#include "lz.h"
+#include "proto2.h"
+
+/* come LZ_MATCH_LIMIT in lz.c: sotto questa lunghezza solo letterali */
+#define MATCH_LIMIT 12
+/* piu` lungo di 15+255: le lunghezze proseguono su piu` byte */
+#define LONG 10000
+#define CAP(n) ((n) + (n)/255 + 16)
+
+static char src[LONG], block[CAP(LONG)], dst[LONG+1];
+
+static char *sentence = "Trentatre' trentini entrarono in Trento tutti e trentatre' trotterellando. ";
+
+/* comprime e decomprime n byte di src, restituisce i byte del blocco */
+int round_trip(const char *what, int n) {
+  int k;
+
+  if ( ( k = lzCompress(src,n,block,CAP(n)) ) <= 0 ) {
+    fprintf(stderr,"lzCompress: %s %d: fallita\n",what,n);
+    exit(EXIT_FAILURE);
+  }
+  memset(dst,0,sizeof(dst));
+  if ( lzDecompress(block,k,dst,n) != n || memcmp(src,dst,n) != 0 ) {
+    fprintf(stderr,"lzDecompress: %s %d: testo diverso\n",what,n);
+    exit(EXIT_FAILURE);
+  }
+  /* la lunghezza originale deve essere esatta */
+  if ( lzDecompress(block,k,dst,n+1) != -1 || ( n > 0 && lzDecompress(block,k,dst,n-1) != -1 ) ) {
+    fprintf(stderr,"lzDecompress: %s %d: accetta una lunghezza sbagliata\n",what,n);
+    exit(EXIT_FAILURE);
+  }
+  /* un blocco troncato non e` mai valido */
+  for ( ; k > 1; k-- )
+    if ( lzDecompress(block,k-1,dst,n) != -1 ) {
+      fprintf(stderr,"lzDecompress: %s %d: accetta %d byte del blocco\n",what,n,k-1);
+      exit(EXIT_FAILURE);
+    }
+  return k;
+}
+
+/* un blocco costruito a mano deve essere rifiutato con EPROTO */
+#define REJECT(what,b,raw) reject(what,b,sizeof(b)-1,raw)
+void reject(const char *what, const char *b, int n, int raw) {
+  errno = 0;
+  if ( lzDecompress(b,n,dst,raw) != -1 || errno != EPROTO ) {
+    fprintf(stderr,"lzDecompress: %s: blocco accettato\n",what);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* scrive e rilegge v, che deve occupare size byte */
+void varint(uint32_t v, int size) {
+  char p[VARINT_SIZE];
+  uint32_t w;
+
+  if ( putVarint(p,v) != size ) {
+    fprintf(stderr,"putVarint: %u: non occupa %d byte\n",v,size);
+    exit(EXIT_FAILURE);
+  }
+  if ( getVarint(p,size,&w) != size || w != v ) {
+    fprintf(stderr,"getVarint: %u: valore diverso\n",v);
+    exit(EXIT_FAILURE);
+  }
+  /* finche` il varint non e` completo non si legge nulla */
+  if ( getVarint(p,size-1,&w) != 0 ) {
+    fprintf(stderr,"getVarint: %u: letto senza l'ultimo byte\n",v);
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main (void) {
+  int i, n, k;
+  unsigned seed = 1;
+  uint32_t v;
+  char b[600], head[2+VARINT_SIZE+1];
+
+  mtrace();
+
+  /*** inizio test testi brevi ***/
+  /* sotto MATCH_LIMIT il blocco ha solo letterali, anche se il testo si ripete */
+  for ( n = 0; n <= 3*MATCH_LIMIT; n++ ) {
+    for ( i = 0; i < n; i++ ) src[i] = "ab"[i%2];
+    round_trip("ripetuto",n);
+    for ( i = 0; i < n; i++ ) src[i] = sentence[i];
+    round_trip("frase",n);
+  }
+  for ( n = 0; n < MATCH_LIMIT; n++ ) {
+    for ( i = 0; i < n; i++ ) src[i] = 'a';
+    if ( lzCompress(src,n,block,CAP(n)) != n+1 ) {
+      fprintf(stderr,"lzCompress: %d byte: non solo letterali\n",n);
+      exit(EXIT_FAILURE);
+    }
+  }
+  /*** fine test testi brevi ***/
+
+  /*** inizio test lunghezze lunghe ***/
+  /* una sola ripetizione lunga: il resto della lunghezza occupa molti byte */
+  memset(src,'a',LONG);
+  if ( ( k = round_trip("ripetizione lunga",LONG) ) > LONG/200 ) {
+    fprintf(stderr,"lzCompress: ripetizione lunga: %d byte\n",k);
+    exit(EXIT_FAILURE);
+  }
+  /* letterali casuali: nessuna ripetizione, tutti letterali */
+  for ( i = 0; i < LONG; i++ ) {
+    seed = seed * 1103515245 + 12345;
+    src[i] = (char) (seed >> 16);
+  }
+  round_trip("letterali",LONG);
+  round_trip("letterali",15+255);
+  round_trip("letterali",15+255+1);
+  /* frasi ripetute con letterali in mezzo */
+  for ( i = 0, n = 0; n + 100 < LONG; i++ ) {
+    n += sprintf(src+n,"%s%d ",sentence,i);
+  }
+  if ( ( k = round_trip("frasi",n) ) >= n/2 ) {
+    fprintf(stderr,"lzCompress: frasi: %d byte su %d\n",k,n);
+    exit(EXIT_FAILURE);
+  }
+  /* il blocco non sta nello spazio concesso */
+  if ( lzCompress(src,n,block,k-1) != -1 ) {
+    fprintf(stderr,"lzCompress: blocco oltre lo spazio concesso\n");
+    exit(EXIT_FAILURE);
+  }
+  /*** fine test lunghezze lunghe ***/
+
+  /*** inizio test blocchi malevoli ***/
+  if ( lzDecompress(block,0,dst,0) != -1 ) {
+    fprintf(stderr,"lzDecompress: blocco vuoto accettato\n");
+    exit(EXIT_FAILURE);
+  }
+  /* distanza nulla o prima dell'inizio del testo */
+  REJECT("distanza nulla","\x10" "a" "\x00\x00" "\x50" "aaaaa",10);
+  REJECT("distanza oltre l'inizio","\x10" "a" "\x02\x00" "\x50" "aaaaa",10);
+  /* ripetizione piu` lunga del testo originale */
+  REJECT("ripetizione lunga","\x1f" "a" "\x01\x00" "\xff\xff" "\x00" "\x50" "aaaaa",100);
+  /* letterali piu` lunghi del blocco o del testo originale */
+  REJECT("letterali oltre il blocco","\x50" "aaa",5);
+  b[0] = (char) 0xf0;
+  memset(b+1,0xff,sizeof(b)-1);
+  reject("lunghezza infinita",b,sizeof(b),LONG);
+  REJECT("letterali oltre il testo","\x50" "aaaaa",4);
+  /* blocco che non finisce con soli letterali */
+  REJECT("ripetizione finale","\x10" "a" "\x01\x00",5);
+  REJECT("distanza troncata","\x10" "a" "\x01",5);
+  /*** fine test blocchi malevoli ***/
+
+  /*** inizio test varint ***/
+  varint(0,1);
+  varint(127,1);
+  varint(128,2);
+  varint(16383,2);
+  varint(16384,3);
+  varint((1 << 21) - 1,3);
+  varint(1 << 21,4);
+  varint((1 << 28) - 1,4);
+  varint(1 << 28,5);
+  varint(UINT32_MAX,5);
+  /* piu` di VARINT_SIZE byte */
+  memset(b,0x80,VARINT_SIZE+1);
+  if ( getVarint(b,VARINT_SIZE+1,&v) != -1 || getVarint(b,VARINT_SIZE-1,&v) != 0 ) {
+    fprintf(stderr,"getVarint: varint troppo lungo\n");
+    exit(EXIT_FAILURE);
+  }
+  /*** fine test varint ***/
+
+  /*** inizio test frameSize2 ***/
+  head[0] = MSG_BCAST;
+  head[1] = 0;
+  if ( frameSize2(head,2) != 0 ) {
+    fprintf(stderr,"frameSize2: intestazione incompleta\n");
+    exit(EXIT_FAILURE);
+  }
+  k = putVarint(head+2,PROTO_MAX_BODY);
+  if ( frameSize2(head,2+k) != 2+k+PROTO_MAX_BODY || frameSize2(head,1+k) != 0 ) {
+    fprintf(stderr,"frameSize2: corpo massimo\n");
+    exit(EXIT_FAILURE);
+  }
+  k = putVarint(head+2,PROTO_MAX_BODY+1);
+  errno = 0;
+  if ( frameSize2(head,2+k) != -1 || errno != EMSGSIZE ) {
+    fprintf(stderr,"frameSize2: corpo oltre PROTO_MAX_BODY\n");
+    exit(EXIT_FAILURE);
+  }
+  k = putVarint(head+2,UINT32_MAX);
+  if ( frameSize2(head,2+k) != -1 ) {
+    fprintf(stderr,"frameSize2: lunghezza negativa\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(head+2,0x80,VARINT_SIZE);
+  if ( frameSize2(head,2+VARINT_SIZE) != -1 ) {
+    fprintf(stderr,"frameSize2: varint troppo lungo\n");
+    exit(EXIT_FAILURE);
+  }
+  /*** fine test frameSize2 ***/
+
+  return 0;
+}
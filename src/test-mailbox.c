@@ -0,0 +1,356 @@
+/**
+   \file
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief test mailbox: politiche per chi supera i limiti, turni dei mittenti,
+   crediti ed esiti dei broadcast
+
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <mcheck.h>
+
+#include "comsock.h"
+#include "mailbox.h"
+
+/* byte del testo dei messaggi di prova */
+#define TEXT 500
+/* attesa massima di un messaggio (millisecondi) */
+#define WAIT 2000
+
+/* i mittenti: conta solo l'indirizzo */
+static const char flow_a = 'A', flow_b = 'B';
+
+static courier_group *group;
+static mailbox *mb;
+static int fds[2];
+/* esiti dei broadcast: positivi, -1, SEOF */
+static int outcomes[3];
+
+/* crea un gruppo con un corriere (non avviato) e la mailbox di una coppia di socket */
+void setup(int max_frames, long max_bytes, int policy) {
+  if ( ( group = initialize_Couriers(1) ) == NULL ) {
+    fprintf(stderr,"initialize_Couriers: impossibile creare\n");
+    exit(EXIT_FAILURE);
+  }
+  set_MailboxLimits(group,max_frames,max_bytes,policy);
+  if ( socketpair(AF_UNIX,SOCK_STREAM,0,fds) == -1 || ( mb = open_Mailbox(group,fds[0]) ) == NULL ) {
+    fprintf(stderr,"open_Mailbox: impossibile creare\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void teardown(void) {
+  if ( mb != NULL ) close_Mailbox(&mb,1);
+  stop_Couriers(group);
+  free_Couriers(&group);
+  close(fds[1]);
+}
+
+/* accoda il messaggio seq del mittente flow (NULL: di controllo) */
+int post(const char *flow, int seq) {
+  char buf[TEXT+1];
+  message_t msg;
+  int n;
+
+  n = sprintf(buf,"%c %d ",( flow != NULL ) ? *flow : 'C',seq);
+  memset(buf+n,'x',TEXT-n);
+  buf[TEXT] = '\0';
+  msg.type = ( flow != NULL ) ? MSG_TO_ONE : MSG_ERROR;
+  msg.length = TEXT;
+  msg.buffer = buf;
+  return post_Mailbox(mb,&msg,flow);
+}
+
+/* pubblica sull'anello il broadcast seq di B, destinato ad A */
+void publish(int seq) {
+  shared_msg *s;
+  message_t msg;
+  int n;
+
+  msg.buffer = malloc(TEXT+1);
+  n = sprintf(msg.buffer,"B %d ",seq);
+  memset(msg.buffer+n,'x',TEXT-n);
+  msg.buffer[TEXT] = '\0';
+  msg.type = MSG_BCAST;
+  msg.length = TEXT;
+  s = share_Message(&msg);
+  if ( publish_Ring(group,s,s,&flow_b) == -1 ) {
+    fprintf(stderr,"publish_Ring: impossibile pubblicare\n");
+    exit(EXIT_FAILURE);
+  }
+  release_Shared(s);
+}
+
+/* conta l'esito di un broadcast */
+void outcome(shared_msg *orig, const void *flow, void *user, int result) {
+  if ( orig->msg.type != MSG_BCAST || flow != &flow_b || user != &flow_a ) {
+    fprintf(stderr,"ring_hook: esito di un altro messaggio\n");
+    exit(EXIT_FAILURE);
+  }
+  __atomic_add_fetch(outcomes + ( ( result > 0 ) ? 0 : ( result == SEOF ) ? 2 : 1 ),1,__ATOMIC_RELAXED);
+}
+
+/* attende che gli esiti di tipo k siano n */
+void expect_outcomes(int k, int n) {
+  int t;
+
+  for ( t = 0; t < WAIT && __atomic_load_n(outcomes+k,__ATOMIC_RELAXED) < n; t += 10 ) usleep(10000);
+  if ( __atomic_load_n(outcomes+k,__ATOMIC_RELAXED) != n ) {
+    fprintf(stderr,"ring_hook: %d esiti di tipo %d invece di %d\n",outcomes[k],k,n);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* riceve il prossimo messaggio dall'altro capo e ne ricava mittente e numero
+   \retval 0 se e` arrivato, -1 se non arriva nulla entro wait millisecondi, SEOF a fine connessione */
+int receive(char *flow, int *seq, int wait) {
+  struct pollfd p;
+  message_t msg;
+  int r;
+
+  p.fd = fds[1];
+  p.events = POLLIN;
+  if ( poll(&p,1,wait) <= 0 ) return -1;
+  if ( ( r = receiveMessage(fds[1],&msg) ) == SEOF || r == -1 ) return SEOF;
+  if ( msg.type == MSG_ERROR && strcmp(msg.buffer,MAILBOX_EVICTED) == 0 ) {
+    *flow = 'E';
+    *seq = 0;
+  } else if ( msg.length != TEXT || sscanf(msg.buffer,"%c %d",flow,seq) != 2 ) {
+    fprintf(stderr,"receiveMessage: messaggio alterato\n");
+    exit(EXIT_FAILURE);
+  }
+  free(msg.buffer);
+  return 0;
+}
+
+/* il prossimo messaggio deve essere il numero seq di flow */
+void expect(char flow, int seq) {
+  char f;
+  int s;
+
+  if ( receive(&f,&s,WAIT) != 0 || f != flow || s != seq ) {
+    fprintf(stderr,"mailbox: atteso %c %d\n",flow,seq);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* non devono arrivare altri messaggi */
+void expect_nothing(void) {
+  char f;
+  int s;
+
+  if ( receive(&f,&s,200) == 0 ) {
+    fprintf(stderr,"mailbox: messaggio inatteso %c %d\n",f,s);
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main (void) {
+  int i;
+
+  mtrace();
+
+  /*** inizio test nomi delle politiche ***/
+  if ( find_MailboxPolicy("drop-oldest") != MAILBOX_DROP_OLDEST ||
+       find_MailboxPolicy("drop-newest") != MAILBOX_DROP_NEWEST ||
+       find_MailboxPolicy("disconnect") != MAILBOX_DISCONNECT ||
+       find_MailboxPolicy("park") != MAILBOX_PARK || find_MailboxPolicy("nessuna") != -1 ) {
+    fprintf(stderr,"find_MailboxPolicy: nomi errati\n");
+    exit(EXIT_FAILURE);
+  }
+  /*** fine test nomi delle politiche ***/
+
+  /*** inizio test drop-newest ***/
+  /* il corriere e` fermo: i messaggi restano nella mailbox */
+  setup(10,0,MAILBOX_DROP_NEWEST);
+  for ( i = 0; i < 15; i++ ) {
+    errno = 0;
+    if ( ( post(&flow_a,i) > 0 ) != ( i < 10 ) || ( i >= 10 && errno != ENOBUFS ) ) {
+      fprintf(stderr,"drop-newest: messaggio %d\n",i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if ( group->fired[MAILBOX_DROP_NEWEST] != 5 ) {
+    fprintf(stderr,"drop-newest: %ld interventi\n",group->fired[MAILBOX_DROP_NEWEST]);
+    exit(EXIT_FAILURE);
+  }
+  start_Couriers(group);
+  for ( i = 0; i < 10; i++ ) expect('A',i);
+  expect_nothing();
+  teardown();
+  /*** fine test drop-newest ***/
+
+  /*** inizio test drop-oldest ***/
+  /* si scarta il piu` vecchio del mittente con piu` byte in attesa */
+  setup(10,0,MAILBOX_DROP_OLDEST);
+  for ( i = 0; i < 8; i++ ) post(&flow_a,i);
+  for ( i = 0; i < 6; i++ )
+    if ( post(&flow_b,i) <= 0 ) {
+      fprintf(stderr,"drop-oldest: messaggio %d rifiutato\n",i);
+      exit(EXIT_FAILURE);
+    }
+  /* i messaggi di controllo non contano fra quelli da scartare */
+  post(NULL,0);
+  if ( group->fired[MAILBOX_DROP_OLDEST] != 5 ) {
+    fprintf(stderr,"drop-oldest: %ld interventi\n",group->fired[MAILBOX_DROP_OLDEST]);
+    exit(EXIT_FAILURE);
+  }
+  start_Couriers(group);
+  expect('C',0);
+  {
+    int next[2] = { 0, 0 }, n = 0, s;
+    char f;
+    while ( receive(&f,&s,200) == 0 ) {
+      if ( ( f != 'A' && f != 'B' ) || s < next[f-'A'] ) {
+        fprintf(stderr,"drop-oldest: ordine errato (%c %d)\n",f,s);
+        exit(EXIT_FAILURE);
+      }
+      next[f-'A'] = s+1;
+      n++;
+    }
+    /* sopravvivono gli ultimi di ogni mittente */
+    if ( n != 9 || next[0] != 8 || next[1] != 6 ) {
+      fprintf(stderr,"drop-oldest: ricevuti %d messaggi\n",n);
+      exit(EXIT_FAILURE);
+    }
+  }
+  teardown();
+  /*** fine test drop-oldest ***/
+
+  /*** inizio test disconnect ***/
+  setup(5,0,MAILBOX_DISCONNECT);
+  for ( i = 0; i < 5; i++ ) post(&flow_a,i);
+  errno = 0;
+  if ( post(&flow_a,5) != SEOF || post(&flow_a,6) != SEOF || group->fired[MAILBOX_DISCONNECT] != 1 ) {
+    fprintf(stderr,"disconnect: utente non disconnesso\n");
+    exit(EXIT_FAILURE);
+  }
+  start_Couriers(group);
+  /* l'utente riceve solo l'errore, poi la connessione si chiude */
+  expect('E',0);
+  {
+    char f;
+    int s;
+    if ( receive(&f,&s,WAIT) != SEOF ) {
+      fprintf(stderr,"disconnect: connessione non chiusa\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  teardown();
+  /*** fine test disconnect ***/
+
+  /*** inizio test park ***/
+  /* oltre i limiti i messaggi vanno su disco e tornano nell'ordine di arrivo */
+  setup(4,3*TEXT,MAILBOX_PARK);
+  for ( i = 0; i < 50; i++ )
+    if ( post(( i % 2 ) ? &flow_a : &flow_b,i) <= 0 ) {
+      fprintf(stderr,"park: messaggio %d rifiutato\n",i);
+      exit(EXIT_FAILURE);
+    }
+  post(NULL,0);
+  if ( group->fired[MAILBOX_PARK] == 0 || mb->spill_frames == 0 ) {
+    fprintf(stderr,"park: nessun messaggio parcheggiato\n");
+    exit(EXIT_FAILURE);
+  }
+  start_Couriers(group);
+  expect('C',0);
+  {
+    int next[2] = { 1, 0 }, n = 0, s;
+    char f;
+    while ( receive(&f,&s,500) == 0 ) {
+      if ( ( f != 'A' && f != 'B' ) || s != next[f-'A'] ) {
+        fprintf(stderr,"park: ordine errato (%c %d)\n",f,s);
+        exit(EXIT_FAILURE);
+      }
+      next[f-'A'] = s+2;
+      n++;
+    }
+    if ( n != 50 ) {
+      fprintf(stderr,"park: ricevuti %d messaggi su 50\n",n);
+      exit(EXIT_FAILURE);
+    }
+  }
+  teardown();
+  /*** fine test park ***/
+
+  /*** inizio test turni dei mittenti ***/
+  /* un credito di MAILBOX_QUANTUM byte copre due messaggi di prova */
+  setup(0,0,MAILBOX_DROP_NEWEST);
+  for ( i = 0; i < 10; i++ ) post(&flow_a,i);
+  post(&flow_b,0);
+  post(&flow_b,1);
+  post(NULL,0);
+  start_Couriers(group);
+  /* il controllo passa per primo, B non attende tutti i messaggi di A */
+  expect('C',0);
+  expect('A',0);
+  expect('A',1);
+  expect('B',0);
+  expect('B',1);
+  for ( i = 2; i < 10; i++ ) expect('A',i);
+  expect_nothing();
+  teardown();
+  /*** fine test turni dei mittenti ***/
+
+  /*** inizio test crediti ***/
+  setup(0,0,MAILBOX_DROP_NEWEST);
+  window_Mailbox(mb,3);
+  for ( i = 0; i < 5; i++ ) post(&flow_a,i);
+  post(NULL,0);
+  start_Couriers(group);
+  expect('C',0);
+  for ( i = 0; i < 3; i++ ) expect('A',i);
+  expect_nothing();
+  credit_Mailbox(mb,2);
+  expect('A',3);
+  expect('A',4);
+  /* senza crediti partono solo i messaggi di controllo */
+  post(&flow_a,5);
+  post(NULL,1);
+  expect('C',1);
+  expect_nothing();
+  credit_Mailbox(mb,1);
+  expect('A',5);
+  expect_nothing();
+  teardown();
+  /*** fine test crediti ***/
+
+  /*** inizio test esiti dei broadcast ***/
+  setup(2,0,MAILBOX_DROP_NEWEST);
+  hook_Ring(group,&outcome);
+  user_Mailbox(mb,(void *) &flow_a);
+  join_Ring(mb);
+  for ( i = 0; i < 5; i++ ) publish(i);
+  /* un messaggio diretto prende prima i broadcast: due entrano, tre no */
+  if ( post(&flow_a,0) != -1 || outcomes[0] != 2 ) {
+    fprintf(stderr,"ring_hook: %d broadcast accodati invece di 2\n",outcomes[0]);
+    exit(EXIT_FAILURE);
+  }
+  /* gli esiti negativi arrivano da un corriere */
+  if ( outcomes[1] != 0 ) {
+    fprintf(stderr,"ring_hook: esiti negativi senza corriere\n");
+    exit(EXIT_FAILURE);
+  }
+  start_Couriers(group);
+  expect('B',0);
+  expect('B',1);
+  expect_nothing();
+  expect_outcomes(1,3);
+  /* chi lascia l'anello perde i broadcast non ancora presi: senza crediti
+     il corriere non li prende */
+  window_Mailbox(mb,0);
+  publish(5);
+  publish(6);
+  close_Mailbox(&mb,1);
+  expect_outcomes(2,2);
+  expect_outcomes(0,2);
+  teardown();
+  /*** fine test esiti dei broadcast ***/
+
+  return 0;
+}
@@ -0,0 +1,134 @@
+/**
+   \file
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief test coda SPSC senza lock
+
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <mcheck.h>
+
+#include "spsc.h"
+
+/* elementi passati dal produttore al consumatore */
+#define ITEMS 2000000
+/* una coda piccola, cosi` che si riempia spesso */
+#define SIZE 64
+
+static spsc_queue *queue;
+
+/* produttore: gli interi da 1 a ITEMS, in ordine, attendendo se la coda e` piena */
+void *producer(void *arg) {
+  uintptr_t i;
+
+  (void) arg;
+  for ( i = 1; i <= ITEMS; i++ )
+    while ( push_Spsc(queue,(void *) i) == -1 ) {
+      if ( errno != EAGAIN ) {
+        fprintf(stderr,"push_Spsc: errore %d\n",errno);
+        exit(EXIT_FAILURE);
+      }
+      sched_yield();
+    }
+  return NULL;
+}
+
+int main (void) {
+  pthread_t tid;
+  uintptr_t i, next;
+  void *p;
+  int k;
+
+  mtrace();
+
+  /*** inizio test creazione ***/
+  if ( initialize_Spsc(0) != NULL ) {
+    fprintf(stderr,"initialize_Spsc: dimensione nulla accettata\n");
+    exit(EXIT_FAILURE);
+  }
+  /* la capacita` e` la potenza di due successiva, almeno 2 */
+  if ( ( queue = initialize_Spsc(1) ) == NULL || queue->mask != 1 ) {
+    fprintf(stderr,"initialize_Spsc: capacita` errata per 1\n");
+    exit(EXIT_FAILURE);
+  }
+  free_Spsc(&queue);
+  if ( ( queue = initialize_Spsc(SIZE-3) ) == NULL || queue->mask != SIZE-1 ) {
+    fprintf(stderr,"initialize_Spsc: capacita` errata per %d\n",SIZE-3);
+    exit(EXIT_FAILURE);
+  }
+  /* indici su linee di cache diverse */
+  if ( (uintptr_t) queue % SPSC_LINE != 0 ||
+       (char *) &queue->tail - (char *) &queue->head < SPSC_LINE ) {
+    fprintf(stderr,"initialize_Spsc: indici sulla stessa linea\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( pop_Spsc(queue) != NULL ) {
+    fprintf(stderr,"pop_Spsc: coda nuova non vuota\n");
+    exit(EXIT_FAILURE);
+  }
+  /*** fine test creazione ***/
+
+  /*** inizio test coda piena e vuota ***/
+  /* piu` giri, cosi` che gli indici superino la capacita` */
+  for ( k = 0; k < 5; k++ ) {
+    for ( i = 1; i <= SIZE; i++ )
+      if ( push_Spsc(queue,(void *) i) == -1 ) {
+        fprintf(stderr,"push_Spsc: coda piena dopo %lu elementi\n",(unsigned long) i-1);
+        exit(EXIT_FAILURE);
+      }
+    errno = 0;
+    if ( push_Spsc(queue,(void *) i) != -1 || errno != EAGAIN ) {
+      fprintf(stderr,"push_Spsc: inserimento oltre la capacita`\n");
+      exit(EXIT_FAILURE);
+    }
+    for ( i = 1; i <= SIZE; i++ )
+      if ( ( p = pop_Spsc(queue) ) != (void *) i ) {
+        fprintf(stderr,"pop_Spsc: %p invece di %lu\n",p,(unsigned long) i);
+        exit(EXIT_FAILURE);
+      }
+    if ( pop_Spsc(queue) != NULL ) {
+      fprintf(stderr,"pop_Spsc: elemento da una coda vuota\n");
+      exit(EXIT_FAILURE);
+    }
+    /* un elemento in piu` sposta l'inizio del giro successivo */
+    push_Spsc(queue,(void *) 1);
+    pop_Spsc(queue);
+  }
+  /*** fine test coda piena e vuota ***/
+
+  /*** inizio test produttore e consumatore ***/
+  if ( pthread_create(&tid,NULL,producer,NULL) != 0 ) {
+    fprintf(stderr,"pthread_create: impossibile creare il produttore\n");
+    exit(EXIT_FAILURE);
+  }
+  for ( next = 1; next <= ITEMS; ) {
+    if ( ( p = pop_Spsc(queue) ) == NULL ) {
+      sched_yield();
+      continue;
+    }
+    if ( p != (void *) next ) {
+      fprintf(stderr,"pop_Spsc: %p invece di %lu\n",p,(unsigned long) next);
+      exit(EXIT_FAILURE);
+    }
+    next++;
+  }
+  pthread_join(tid,NULL);
+  if ( pop_Spsc(queue) != NULL ) {
+    fprintf(stderr,"pop_Spsc: elementi oltre quelli prodotti\n");
+    exit(EXIT_FAILURE);
+  }
+  /*** fine test produttore e consumatore ***/
+
+  free_Spsc(&queue);
+  if ( queue != NULL ) {
+    fprintf(stderr,"free_Spsc: puntatore non azzerato\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return 0;
+}
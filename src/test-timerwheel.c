@@ -0,0 +1,146 @@
+/**
+   \file
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief test ruota gerarchica di timer
+
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mcheck.h>
+
+#include "timerwheel.h"
+
+/* timer armati prima di avviare la ruota */
+#define N 200000
+/* timer riarmati dalla loro funzione, PERIOD tick alla volta, ROUNDS volte */
+#define PERIODIC 1000
+#define PERIOD 7
+#define ROUNDS 10
+/* timer spostati e disarmati mentre la ruota gira */
+#define MOVED 1000
+#define CANCELLED 1000
+#define TOTAL (N+PERIODIC+MOVED+CANCELLED)
+/* scadenza massima in tick: oltre WHEEL_SLOTS^2 per ridistribuire dal livello 2 */
+#define MAXDELAY 5000
+/* a cavallo dei giri dei livelli */
+static int edges[] = { 1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097, 4159, 4160, 4161, MAXDELAY, 0 };
+
+static timer_wheel *wheel;
+static wheel_timer *timers;
+static unsigned long *expected;
+static int *fired, wrong = 0, done = 0;
+
+/* funzione dei timer: la ruota e` bloccata, now e` gia` il tick successivo */
+int expire(wheel_timer *t) {
+  long i = t - timers;
+
+  fired[i]++;
+  if ( wheel->now - 1 != expected[i] ) wrong++;
+  if ( i >= N && i < N+PERIODIC && fired[i] < ROUNDS ) {
+    expected[i] = wheel->now + PERIOD;
+    return PERIOD;
+  }
+  __atomic_add_fetch(&done,1,__ATOMIC_RELEASE);
+  return 0;
+}
+
+/* arma il timer i dopo ticks tick e ne registra la scadenza */
+void arm(int i, int ticks) {
+  set_Timer(wheel,timers+i,ticks);
+  pthread_mutex_lock(&wheel->mtx);
+  expected[i] = timers[i].expires;
+  pthread_mutex_unlock(&wheel->mtx);
+}
+
+int main (void) {
+  int i, wait;
+  unsigned seed = 1;
+
+  mtrace();
+
+  /*** inizio test creazione ***/
+  if ( initialize_Wheel(0,expire) != NULL || initialize_Wheel(1,NULL) != NULL ) {
+    fprintf(stderr,"initialize_Wheel: accetta parametri non validi\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( ( wheel = initialize_Wheel(1,expire) ) == NULL ) {
+    fprintf(stderr,"initialize_Wheel: impossibile creare\n");
+    exit(EXIT_FAILURE);
+  }
+  timers = calloc(TOTAL,sizeof(wheel_timer));
+  expected = calloc(TOTAL,sizeof(unsigned long));
+  fired = calloc(TOTAL,sizeof(int));
+  if ( timers == NULL || expected == NULL || fired == NULL ) {
+    fprintf(stderr,"calloc: memoria esaurita\n");
+    exit(EXIT_FAILURE);
+  }
+  /*** fine test creazione ***/
+
+  /*** inizio test armamento ***/
+  for ( i = 0; edges[i] != 0; i++ ) arm(i,edges[i]);
+  for ( ; i < N; i++ ) {
+    seed = seed * 1103515245 + 12345;
+    arm(i,1 + (seed >> 8) % MAXDELAY);
+  }
+  for ( ; i < N+PERIODIC; i++ ) arm(i,1 + i % PERIOD);
+  /* armati due volte: la seconda sposta il timer */
+  for ( ; i < TOTAL; i++ ) {
+    arm(i,MAXDELAY);
+    arm(i,MAXDELAY);
+  }
+  if ( wheel->armed != TOTAL ) {
+    fprintf(stderr,"set_Timer: armati %ld timer su %d\n",wheel->armed,TOTAL);
+    exit(EXIT_FAILURE);
+  }
+  /*** fine test armamento ***/
+
+  /*** inizio test scadenze ***/
+  if ( start_Wheel(wheel) == -1 ) {
+    fprintf(stderr,"start_Wheel: impossibile avviare\n");
+    exit(EXIT_FAILURE);
+  }
+  /* mentre la ruota gira, anche durante le ridistribuzioni */
+  usleep(100000);
+  for ( i = N+PERIODIC; i < N+PERIODIC+MOVED; i++ ) arm(i,50 + i % 4200);
+  for ( ; i < TOTAL; i++ ) cancel_Timer(wheel,timers+i);
+  for ( wait = 0; __atomic_load_n(&done,__ATOMIC_ACQUIRE) < TOTAL-CANCELLED && wait < 2*MAXDELAY; wait += 10 )
+    usleep(10000);
+  /* i disarmati non devono scadere nemmeno in ritardo */
+  usleep(100000);
+  stop_Wheel(wheel);
+
+  for ( i = 0; i < TOTAL; i++ ) {
+    int rounds = ( i < N+PERIODIC && i >= N ) ? ROUNDS : ( i >= N+PERIODIC+MOVED ) ? 0 : 1;
+    if ( fired[i] != rounds ) {
+      fprintf(stderr,"timer %d: scaduto %d volte invece di %d\n",i,fired[i],rounds);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if ( wrong != 0 ) {
+    fprintf(stderr,"advance_Wheel: %d scadenze al tick sbagliato\n",wrong);
+    exit(EXIT_FAILURE);
+  }
+  if ( wheel->armed != 0 || wheel->fired != N+PERIODIC*ROUNDS+MOVED ) {
+    fprintf(stderr,"timer: armati %ld, scaduti %ld\n",wheel->armed,wheel->fired);
+    exit(EXIT_FAILURE);
+  }
+  /* i timer oltre WHEEL_SLOTS tick sono passati dai livelli superiori */
+  if ( wheel->cascaded < N/2 ) {
+    fprintf(stderr,"cascade_Wheel: solo %ld timer ridistribuiti\n",wheel->cascaded);
+    exit(EXIT_FAILURE);
+  }
+  /*** fine test scadenze ***/
+
+  free_Wheel(&wheel);
+  if ( wheel != NULL ) {
+    fprintf(stderr,"free_Wheel: puntatore non azzerato\n");
+    exit(EXIT_FAILURE);
+  }
+  free(timers);
+  free(expected);
+  free(fired);
+
+  return 0;
+}
@@ -0,0 +1,192 @@
+/**
+   \file timerwheel.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione della ruota gerarchica di timer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "errors.h"
+#include "timerwheel.h"
+
+/** Toglie t dalla lista in cui si trova. */
+static void unlink_Timer(wheel_timer *t) {
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+/** Inserisce t, con la scadenza gia` impostata, nella casella che gli
+ * spetta: il livello e` il primo che copre la distanza dalla scadenza. */
+static void place_Timer(timer_wheel *w, wheel_timer *t) {
+	unsigned long delta = t->expires - w->now;
+	wheel_timer *head;
+	int level = 0;
+	/*Una scadenza gia` passata va nella casella del tick corrente*/
+	if ((long) delta < 0) {
+		t->expires = w->now;
+		delta = 0;
+	}
+	while (level < WHEEL_LEVELS-1 && delta >= 1UL << (WHEEL_BITS*(level+1))) level++;
+	if (delta >= 1UL << (WHEEL_BITS*WHEEL_LEVELS)) {
+		t->expires = w->now + (1UL << (WHEEL_BITS*WHEEL_LEVELS)) - 1;
+	}
+	head = &w->slots[level][(t->expires >> (WHEEL_BITS*level)) & (WHEEL_SLOTS-1)];
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+/** Ridistribuisce nei livelli inferiori i timer della casella index del
+ * livello level.
+ * \retval index (0 se il livello ha compiuto un giro) */
+static int cascade_Wheel(timer_wheel *w, int level, int index) {
+	wheel_timer *head = &w->slots[level][index], *t;
+	while ((t = head->next) != head) {
+		unlink_Timer(t);
+		place_Timer(w, t);
+		w->cascaded++;
+	}
+	return index;
+}
+
+/** Fa avanzare la ruota di un tick, chiamando la funzione dei timer
+ * scaduti (la ruota e` bloccata). */
+static void advance_Wheel(timer_wheel *w) {
+	wheel_timer expired, *t;
+	int index = w->now & (WHEEL_SLOTS-1), level = 1, ticks;
+	/*All'inizio di un giro del livello 0 si scende di un livello la
+	 * casella successiva del livello 1, e cosi` via verso l'alto*/
+	if (index == 0)
+		while (level < WHEEL_LEVELS &&
+			cascade_Wheel(w, level, (w->now >> (WHEEL_BITS*level)) & (WHEEL_SLOTS-1)) == 0)
+			level++;
+	/*La casella del tick corrente si stacca prima di chiamare le funzioni:
+	 * un timer riarmato finisce in una casella futura*/
+	expired.next = expired.prev = &expired;
+	if (w->slots[0][index].next != &w->slots[0][index]) {
+		expired.next = w->slots[0][index].next;
+		expired.prev = w->slots[0][index].prev;
+		expired.next->prev = expired.prev->next = &expired;
+		w->slots[0][index].next = w->slots[0][index].prev = &w->slots[0][index];
+	}
+	w->now++;
+	while ((t = expired.next) != &expired) {
+		unlink_Timer(t);
+		w->armed--;
+		w->fired++;
+		if ((ticks = w->fn(t)) > 0) {
+			t->expires = w->now + ticks;
+			place_Timer(w, t);
+			w->armed++;
+		}
+	}
+}
+
+/** Thread della ruota: ogni tick la fa avanzare, recuperando i tick persi
+ * se le funzioni dei timer hanno richiesto piu` di un tick. */
+static void *run_Wheel(void *arg) {
+	timer_wheel *w = arg;
+	struct timespec next, start;
+	unsigned long target;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+	while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+		next.tv_nsec += (long) w->tick * 1000000;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+		/*Il tick a cui la ruota deve arrivare si calcola dall'orologio,
+		 * cosi` che i ritardi non si accumulino*/
+		target = ((next.tv_sec - start.tv_sec)*1000 + (next.tv_nsec - start.tv_nsec)/1000000) / w->tick;
+		pthread_mutex_lock(&w->mtx);
+			while ((long) (target - w->now) > 0) advance_Wheel(w);
+		pthread_mutex_unlock(&w->mtx);
+	}
+	return NULL;
+}
+
+timer_wheel *initialize_Wheel(int tick, wheel_fn fn) {
+	timer_wheel *w;
+	int i, j;
+	if (tick <= 0 || fn == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	w = Malloc(sizeof(timer_wheel));
+	if ((errno = pthread_mutex_init(&w->mtx, NULL)) != 0) {
+		perror("timerwheel, initialize_Wheel");
+		free(w);
+		return NULL;
+	}
+	for (i = 0; i < WHEEL_LEVELS; i++)
+		for (j = 0; j < WHEEL_SLOTS; j++)
+			w->slots[i][j].next = w->slots[i][j].prev = &w->slots[i][j];
+	w->now = 0;
+	w->tick = tick;
+	w->fn = fn;
+	w->armed = w->fired = w->cascaded = 0;
+	w->stop = 0;
+	return w;
+}
+
+int start_Wheel(timer_wheel *w) {
+	if (w == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((errno = pthread_create(&w->tid, NULL, &run_Wheel, w)) != 0) {
+		perror("timerwheel, start_Wheel");
+		return -1;
+	}
+	return 0;
+}
+
+void set_Timer(timer_wheel *w, wheel_timer *t, int ticks) {
+	if (w == NULL || t == NULL) return;
+	pthread_mutex_lock(&w->mtx);
+		if (t->next != NULL) unlink_Timer(t);
+		else w->armed++;
+		t->expires = w->now + ((ticks > 0) ? ticks : 1);
+		place_Timer(w, t);
+	pthread_mutex_unlock(&w->mtx);
+}
+
+void cancel_Timer(timer_wheel *w, wheel_timer *t) {
+	if (w == NULL || t == NULL) return;
+	pthread_mutex_lock(&w->mtx);
+		if (t->next != NULL) {
+			unlink_Timer(t);
+			w->armed--;
+		}
+	pthread_mutex_unlock(&w->mtx);
+}
+
+void report_Wheel(timer_wheel *w, FILE *f) {
+	if (w == NULL) return;
+	pthread_mutex_lock(&w->mtx);
+		fprintf(f, "timer: armati %ld, scaduti %ld, ridistribuiti %ld (tick %d ms)\n",
+			w->armed, w->fired, w->cascaded, w->tick);
+	pthread_mutex_unlock(&w->mtx);
+	fflush(f);
+}
+
+void stop_Wheel(timer_wheel *w) {
+	if (w == NULL) return;
+	__atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(w->tid, NULL);
+}
+
+void free_Wheel(timer_wheel **w) {
+	if (w == NULL || *w == NULL) return;
+	pthread_mutex_destroy(&(*w)->mtx);
+	free(*w);
+	*w = NULL;
+}
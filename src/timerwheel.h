@@ -0,0 +1,99 @@
+/**
+   \file timerwheel.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  ruota gerarchica di timer, fatta avanzare da un solo thread.
+
+Il tempo avanza a scatti (tick) di durata fissa. La ruota ha WHEEL_LEVELS
+livelli di WHEEL_SLOTS caselle: il livello 0 contiene i timer che scadono
+nei prossimi WHEEL_SLOTS tick, una casella per tick; ogni casella del
+livello k copre WHEEL_SLOTS volte i tick di una casella del livello k-1.
+Quando il livello inferiore compie un giro, i timer della casella
+corrispondente del livello superiore vengono ridistribuiti più in basso.
+Armare e disarmare un timer costa O(1), qualunque sia il numero dei timer,
+e un solo thread serve tutti i timer della ruota.
+
+I timer sono contenuti nelle strutture di chi li usa: la ruota non alloca
+nulla dopo la creazione.
+ */
+#ifndef __TIMERWHEEL_H
+#define __TIMERWHEEL_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+/** Bit dell'indice di una casella */
+#define WHEEL_BITS 6
+/** Caselle di ogni livello */
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+/** Livelli della ruota: coprono WHEEL_SLOTS^WHEEL_LEVELS tick */
+#define WHEEL_LEVELS 4
+
+/** <H3>Timer</H3>
+ * - \c next, \c prev la lista della casella in cui si trova (next è NULL
+ *   se il timer non è armato)
+ * - \c expires il tick della scadenza
+ * - \c data il dato di chi ha armato il timer
+ */
+typedef struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer *prev;
+	unsigned long expires;
+	void *data;
+} wheel_timer;
+
+/** Funzione chiamata alla scadenza di un timer, dal thread della ruota e
+ * con la ruota bloccata: non deve bloccarsi né toccare la ruota.
+ * \param t il timer scaduto (già disarmato)
+ * \retval i tick dopo i quali riarmare t, 0 per lasciarlo disarmato */
+typedef int (*wheel_fn)(wheel_timer *t);
+
+/** <H3>Ruota di timer</H3>
+ * - \c slots le caselle: ognuna è la sentinella di una lista circolare
+ * - \c now il tick corrente
+ * - \c tick la durata di un tick in millisecondi
+ * - \c fn la funzione chiamata alla scadenza dei timer
+ * - \c armed i timer armati, \c fired quelli scaduti, \c cascaded i
+ *   trasferimenti da un livello al successivo
+ * - \c stop diventa 1 quando il thread deve terminare
+ * - \c mtx protegge la ruota
+ */
+typedef struct {
+	wheel_timer slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	unsigned long now;
+	int tick;
+	wheel_fn fn;
+	long armed;
+	long fired;
+	long cascaded;
+	int stop;
+	pthread_t tid;
+	pthread_mutex_t mtx;
+} timer_wheel;
+
+/** Crea una ruota con tick di tick millisecondi (non ancora avviata).
+ * \retval NULL in caso di errore (sets errno) */
+timer_wheel *initialize_Wheel(int tick, wheel_fn fn);
+
+/** Avvia il thread che fa avanzare la ruota.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int start_Wheel(timer_wheel *w);
+
+/** Arma t (o lo riarma, se era già armato) perché scada dopo ticks tick
+ * (almeno uno). */
+void set_Timer(timer_wheel *w, wheel_timer *t, int ticks);
+
+/** Disarma t, se armato: al ritorno la sua funzione non è in esecuzione
+ * e non verrà più chiamata. */
+void cancel_Timer(timer_wheel *w, wheel_timer *t);
+
+/** Scrive su f i timer armati e scaduti della ruota w. */
+void report_Wheel(timer_wheel *w, FILE *f);
+
+/** Ferma il thread della ruota e ne attende la terminazione: i timer
+ * restano armati ma non scadono più. */
+void stop_Wheel(timer_wheel *w);
+
+/** Libera la ruota (il thread deve essere fermo). */
+void free_Wheel(timer_wheel **w);
+
+#endif
@@ -0,0 +1,502 @@
+/**
+   \file uring.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione dell'accesso minimale a io_uring.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "errors.h"
+#include "uring.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr) {
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+int initialize_Uring(uring_t *r, unsigned entries) {
+	struct io_uring_params p;
+	int old_errno;
+	if (r == NULL || entries == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(uring_t));
+	if ((r->fd = uring_setup(entries, &p)) == -1)
+		return -1;
+	r->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	/*Con IORING_FEAT_SINGLE_MMAP le due code condividono la stessa mappatura*/
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+		r->cq_size = r->sq_size;
+	}
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) goto error;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ptr = r->sq_ptr;
+	else {
+		r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = NULL;
+			goto error;
+		}
+	}
+	r->sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto error;
+	}
+	r->sq_head = (unsigned *) ((char *) r->sq_ptr + p.sq_off.head);
+	r->sq_tail = (unsigned *) ((char *) r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) ((char *) r->sq_ptr + p.sq_off.array);
+	r->sq_entries = p.sq_entries;
+	r->cq_head = (unsigned *) ((char *) r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *) ((char *) r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ptr + p.cq_off.cqes);
+	r->sqe_tail = r->sqe_submitted = *r->sq_tail;
+	return 0;
+error:
+	old_errno = errno;
+	if (r->sq_ptr == MAP_FAILED) r->sq_ptr = NULL;
+	free_Uring(r);
+	errno = old_errno;
+	return -1;
+}
+
+void free_Uring(uring_t *r) {
+	if (r == NULL || r->fd <= 0) return;
+	if (r->sqes != NULL) munmap(r->sqes, r->sq_entries*sizeof(struct io_uring_sqe));
+	if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+	if (r->sq_ptr != NULL) munmap(r->sq_ptr, r->sq_size);
+	close(r->fd);
+	r->fd = -1;
+}
+
+struct io_uring_sqe *get_Sqe(uring_t *r) {
+	struct io_uring_sqe *sqe;
+	unsigned index;
+	/*La coda è piena: pubblichiamo quanto preparato e riproviamo*/
+	while (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		if (submit_Uring(r, 0) == -1 && errno != EBUSY && errno != EAGAIN)
+			return NULL;
+	}
+	index = r->sqe_tail & *r->sq_mask;
+	sqe = r->sqes + index;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	r->sq_array[index] = index;
+	r->sqe_tail++;
+	return sqe;
+}
+
+int submit_Uring(uring_t *r, unsigned wait_nr) {
+	unsigned to_submit = r->sqe_tail - r->sqe_submitted;
+	int n;
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	do {
+		/*GETEVENTS anche senza attese: sposta nella coda i completamenti
+		 * che il kernel aveva parcheggiato quando era piena*/
+		n = uring_enter(r->fd, to_submit, wait_nr, IORING_ENTER_GETEVENTS);
+	} while (n == -1 && errno == EINTR);
+	if (n > 0) r->sqe_submitted += n;
+	return n;
+}
+
+struct io_uring_cqe *peek_Cqe(uring_t *r) {
+	unsigned head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return r->cqes + (head & *r->cq_mask);
+}
+
+void seen_Cqe(uring_t *r) {
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int register_Buffers(uring_t *r, uring_buffers *b, unsigned short group) {
+	struct io_uring_buf_reg reg;
+	size_t ring_size = URING_BUFFERS*sizeof(struct io_uring_buf);
+	int i;
+	if (r == NULL || b == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	b->ring = mmap(NULL, ring_size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+	if (b->ring == MAP_FAILED) return -1;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) b->ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = group;
+	if (uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		int old_errno = errno;
+		munmap(b->ring, ring_size);
+		errno = old_errno;
+		return -1;
+	}
+	b->group = group;
+	b->tail = 0;
+	b->memory = Malloc(sizeof(char)*URING_BUFFERS*URING_BUFFER_SIZE);
+	for (i = 0; i < URING_BUFFERS; i++)
+		recycle_Buffer(b, i);
+	return 0;
+}
+
+void recycle_Buffer(uring_buffers *b, unsigned short bid) {
+	struct io_uring_buf *buf = &b->ring->bufs[b->tail & (URING_BUFFERS-1)];
+	buf->addr = (unsigned long) (b->memory + bid*URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	b->tail++;
+	__atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+char *buffer_Data(uring_buffers *b, unsigned short bid) {
+	return b->memory + bid*URING_BUFFER_SIZE;
+}
+
+void free_Buffers(uring_t *r, uring_buffers *b) {
+	struct io_uring_buf_reg reg;
+	if (r == NULL || b == NULL || b->memory == NULL) return;
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = b->group;
+	(void) uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	munmap(b->ring, URING_BUFFERS*sizeof(struct io_uring_buf));
+	free(b->memory);
+	b->memory = NULL;
+}
+
+void prep_MultishotAccept(struct io_uring_sqe *sqe, int fd, unsigned long long data) {
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = data;
+}
+
+void prep_MultishotRecv(struct io_uring_sqe *sqe, int fd, unsigned short group, unsigned long long data) {
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = group;
+	sqe->user_data = data;
+}
+
+void prep_Sendmsg(struct io_uring_sqe *sqe, int fd, struct msghdr *m, unsigned long long data) {
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) m;
+	sqe->len = 1;
+	/*MSG_WAITALL: il kernel completa da se` gli invii parziali su stream*/
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = data;
+}
+
+void prep_Write(struct io_uring_sqe *sqe, int fd, const void *buf, unsigned length, unsigned long long data) {
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) buf;
+	sqe->len = length;
+	sqe->off = (unsigned long long) -1; /*posizione corrente (IORING_FEAT_RW_CUR_POS)*/
+	sqe->user_data = data;
+}
+
+void prep_Read(struct io_uring_sqe *sqe, int fd, void *buf, unsigned length, unsigned long long data) {
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) buf;
+	sqe->len = length;
+	sqe->off = (unsigned long long) -1;
+	sqe->user_data = data;
+}
+
+void prep_CancelFd(struct io_uring_sqe *sqe, int fd) {
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = 0;
+}
+
+int uring_Supported(void) {
+	uring_t r;
+	uring_buffers b;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int sv[2], ok = 0;
+	if (initialize_Uring(&r, 8) == -1) return 0;
+	if (register_Buffers(&r, &b, 0) == -1) {
+		free_Uring(&r);
+		return 0;
+	}
+	/*Una recv multishot su una coppia di socket deve restituire il byte
+	 * scritto lasciando la richiesta attiva (IORING_CQE_F_MORE)*/
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+		if ((sqe = get_Sqe(&r)) != NULL) {
+			prep_MultishotRecv(sqe, sv[0], b.group, 1);
+			if (write(sv[1], "", 1) == 1 && submit_Uring(&r, 1) >= 0 && (cqe = peek_Cqe(&r)) != NULL) {
+				ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) && (cqe->flags & IORING_CQE_F_BUFFER);
+				seen_Cqe(&r);
+			}
+		}
+		close(sv[0]);
+		close(sv[1]);
+	}
+	free_Buffers(&r, &b);
+	free_Uring(&r);
+	return ok;
+}
+
+/** user_data riservato ai completamenti che non richiedono gestione */
+#define URING_IGNORE 0
+/** user_data riservato alla lettura dell'eventfd di risveglio */
+#define URING_WAKE 1
+
+/** Arma la lettura dell'eventfd di risveglio del loop */
+static void arm_Wake(uring_loop *l) {
+	struct io_uring_sqe *sqe;
+	if ((sqe = get_Sqe(&l->ring)) != NULL)
+		prep_Read(sqe, l->wakefd, &l->wakeval, sizeof(l->wakeval), URING_WAKE);
+}
+
+/** Arma la recv multishot di una sorgente */
+static void arm_Source(uring_loop *l, uring_source *src) {
+	struct io_uring_sqe *sqe;
+	if ((sqe = get_Sqe(&l->ring)) != NULL)
+		prep_MultishotRecv(sqe, src->fd, l->buffers.group, (unsigned long) src);
+}
+
+/** Toglie src dalle sorgenti armate del loop e la libera */
+static void drop_Source(uring_loop *l, uring_source *src) {
+	if (src->prev == NULL) l->sources = src->next;
+	else src->prev->next = src->next;
+	if (src->next != NULL) src->next->prev = src->prev;
+	free(src);
+}
+
+/** Scarta i completamenti gia` arrivati */
+static void drain_Cqes(uring_t *r) {
+	while (peek_Cqe(r) != NULL) seen_Cqe(r);
+}
+
+/** Alla terminazione del loop cancella le ricezioni ancora armate, cosi`
+ * che il kernel rilasci le socket, e libera tutte le sorgenti, anche
+ * quelle in arrivo mai armate. L'handler non viene chiamato: le
+ * connessioni appartengono a chi le ha registrate. */
+static void cancel_Sources(uring_loop *l) {
+	struct io_uring_sqe *sqe;
+	uring_source *src, *list;
+	unsigned pending = 0;
+	for (src = l->sources; src != NULL; src = src->next) {
+		if ((sqe = get_Sqe(&l->ring)) == NULL) {
+			/*Coda piena: sottomette le cancellazioni preparate e ne
+			 * attende gli esiti prima di proseguire*/
+			(void) submit_Uring(&l->ring, pending);
+			drain_Cqes(&l->ring);
+			pending = 0;
+			if ((sqe = get_Sqe(&l->ring)) == NULL) break;
+		}
+		prep_CancelFd(sqe, src->fd);
+		pending++;
+	}
+	if (pending > 0) (void) submit_Uring(&l->ring, pending);
+	drain_Cqes(&l->ring);
+	while (l->sources != NULL) drop_Source(l, l->sources);
+	pthread_mutex_lock(&l->mtx);
+		list = l->incoming;
+		l->incoming = NULL;
+	pthread_mutex_unlock(&l->mtx);
+	while (list != NULL) {
+		src = list;
+		list = list->next;
+		free(src);
+	}
+}
+
+/** Corpo del thread di un loop io_uring */
+static void *run_UringLoop(void *arg) {
+	uring_loop *l = arg;
+	struct io_uring_cqe *cqe;
+	arm_Wake(l);
+	while (!l->stop) {
+		if (submit_Uring(&l->ring, 1) == -1 && errno != EBUSY) {
+			perror("uring, run_UringLoop");
+			break;
+		}
+		while ((cqe = peek_Cqe(&l->ring)) != NULL) {
+			unsigned long long data = cqe->user_data;
+			unsigned flags = cqe->flags;
+			int res = cqe->res;
+			uring_source *src;
+			seen_Cqe(&l->ring);
+			if (data == URING_IGNORE) continue;
+			if (data == URING_WAKE) {
+				uring_source *list;
+				pthread_mutex_lock(&l->mtx);
+					list = l->incoming;
+					l->incoming = NULL;
+				pthread_mutex_unlock(&l->mtx);
+				while (list != NULL) {
+					src = list;
+					list = list->next;
+					src->prev = NULL;
+					src->next = l->sources;
+					if (l->sources != NULL) l->sources->prev = src;
+					l->sources = src;
+					arm_Source(l, src);
+				}
+				arm_Wake(l);
+				continue;
+			}
+			src = (uring_source *) (unsigned long) data;
+			if (res > 0) {
+				unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+				l->handler(l, src->data, buffer_Data(&l->buffers, bid), res);
+				recycle_Buffer(&l->buffers, bid);
+				if (!(flags & IORING_CQE_F_MORE)) arm_Source(l, src);
+			} else if (res == -ENOBUFS) {
+				/*Tutti i buffer erano occupati: la multishot e` terminata e va riarmata*/
+				arm_Source(l, src);
+			} else {
+				l->handler(l, src->data, NULL, res);
+				drop_Source(l, src);
+			}
+		}
+	}
+	cancel_Sources(l);
+	return (void *) 0;
+}
+
+uring_group *initialize_UringLoops(int n, uring_handler handler) {
+	uring_group *g;
+	uring_loop *l;
+	int i, acquired;
+	if (n < 1 || handler == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	g = Malloc(sizeof(uring_group));
+	g->loops = Malloc(sizeof(uring_loop)*n);
+	g->size = 0;
+	g->next = 0;
+	pthread_mutex_init(&g->mtx, NULL);
+	for (i = 0; i < n; i++) {
+		l = g->loops+i;
+		l->stop = 0;
+		l->id = i;
+		l->handler = handler;
+		l->incoming = NULL;
+		l->sources = NULL;
+		pthread_mutex_init(&l->mtx, NULL);
+		/*acquired conta i passi riusciti, che in caso di errore vanno
+		 * disfatti; free_UringLoops libera i loop gia` completi*/
+		acquired = 0;
+		if (initialize_Uring(&l->ring, URING_ENTRIES) == -1) goto error;
+		acquired++;
+		if (initialize_Uring(&l->send_ring, URING_ENTRIES) == -1) goto error;
+		acquired++;
+		if (register_Buffers(&l->ring, &l->buffers, 0) == -1) goto error;
+		acquired++;
+		if ((l->wakefd = eventfd(0, EFD_CLOEXEC)) == -1) goto error;
+		g->size++;
+	}
+	return g;
+error:
+	perror("uring, initialize_UringLoops");
+	l = g->loops + g->size;
+	if (acquired > 2) free_Buffers(&l->ring, &l->buffers);
+	if (acquired > 1) free_Uring(&l->send_ring);
+	if (acquired > 0) free_Uring(&l->ring);
+	free_UringLoops(&g);
+	return NULL;
+}
+
+int start_UringLoops(uring_group *g) {
+	int i;
+	if (g == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < g->size; i++) {
+		if ((errno = pthread_create(&g->loops[i].tid, NULL, &run_UringLoop, g->loops+i)) != 0) {
+			perror("uring, start_UringLoops");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+uring_loop *add_UringFd(uring_group *g, int fd, void *data) {
+	uring_loop *l;
+	uring_source *src;
+	uint64_t one = 1;
+	if (g == NULL || fd < 0 || data == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	pthread_mutex_lock(&g->mtx);
+		l = g->loops + (g->next++ % g->size);
+	pthread_mutex_unlock(&g->mtx);
+	src = Malloc(sizeof(uring_source));
+	src->fd = fd;
+	src->data = data;
+	/*L'anello appartiene al thread del loop: gli passiamo il fd e lo svegliamo*/
+	pthread_mutex_lock(&l->mtx);
+		src->next = l->incoming;
+		l->incoming = src;
+	pthread_mutex_unlock(&l->mtx);
+	if (write(l->wakefd, &one, sizeof(one)) == -1) {
+		perror("uring, add_UringFd");
+		return NULL;
+	}
+	return l;
+}
+
+void stop_UringLoops(uring_group *g) {
+	int i;
+	uint64_t one = 1;
+	if (g == NULL) return;
+	for (i = 0; i < g->size; i++) {
+		g->loops[i].stop = 1;
+		(void) write(g->loops[i].wakefd, &one, sizeof(one));
+	}
+	for (i = 0; i < g->size; i++)
+		pthread_join(g->loops[i].tid, NULL);
+}
+
+void free_UringLoops(uring_group **g) {
+	int i;
+	if (g == NULL || *g == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	for (i = 0; i < (*g)->size; i++) {
+		uring_loop *l = (*g)->loops+i;
+		free_Buffers(&l->ring, &l->buffers);
+		free_Uring(&l->ring);
+		free_Uring(&l->send_ring);
+		close(l->wakefd);
+	}
+	free((*g)->loops);
+	free(*g);
+	*g = NULL;
+}
@@ -0,0 +1,189 @@
+/**
+   \file uring.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  accesso minimale a io_uring tramite le system call del kernel.
+
+La libreria non dipende da liburing: mappa direttamente le code di
+sottomissione e di completamento e offre solo le operazioni usate dal
+server (accept e recv multishot con buffer forniti, sendmsg, write, read).
+Prima di usarla conviene verificare con uring_Supported() che il kernel
+offra tutte le funzionalità richieste.
+ */
+#ifndef __URING_H
+#define __URING_H
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/** Numero di voci delle code di un anello */
+#define URING_ENTRIES 256
+/** Numero di buffer forniti al kernel per le recv multishot */
+#define URING_BUFFERS 256
+/** Dimensione di ciascun buffer fornito */
+#define URING_BUFFER_SIZE 4096
+
+/** <H3>Anello io_uring</H3>
+ * - \c fd il file descriptor restituito da io_uring_setup
+ * - \c sq_* puntatori ai campi condivisi della coda di sottomissione
+ * - \c cq_* puntatori ai campi condivisi della coda di completamento
+ * - \c sqe_tail le sottomissioni preparate ma non ancora pubblicate
+ * - \c sqe_submitted le sottomissioni già passate al kernel
+ */
+typedef struct {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sqe_tail, sqe_submitted;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+} uring_t;
+
+/** <H3>Buffer forniti</H3>
+ * Un gruppo di buffer che il kernel sceglie autonomamente per le recv
+ * multishot (IOSQE_BUFFER_SELECT).
+ * - \c ring l'anello condiviso dei buffer
+ * - \c memory lo spazio dei buffer
+ * - \c group l'identificativo del gruppo
+ */
+typedef struct {
+	struct io_uring_buf_ring *ring;
+	char *memory;
+	unsigned short group;
+	unsigned short tail;
+} uring_buffers;
+
+struct uring_loop;
+
+/** Funzione che riceve i dati letti da un fd registrato in un uring_loop.
+ * \param l il loop che ha ricevuto i dati
+ * \param data il dato associato al fd al momento della registrazione
+ * \param bytes i byte ricevuti (validi solo durante la chiamata)
+ * \param n il numero di byte ricevuti; se n <= 0 la ricezione e` terminata
+ * (0 se il peer ha chiuso, -errno in caso di errore) e questa e` l'ultima
+ * chiamata relativa a data */
+typedef void (*uring_handler)(struct uring_loop *l, void *data, const char *bytes, int n);
+
+/** Un fd registrato in un loop e il suo dato; \c next e \c prev lo
+ * collegano alle sorgenti armate del loop (prima, \c next a quelle in
+ * arrivo) */
+typedef struct uring_source {
+	int fd;
+	void *data;
+	struct uring_source *next;
+	struct uring_source *prev;
+} uring_source;
+
+/** <H3>Loop io_uring</H3>
+ * Ogni loop riceve i dati dei propri fd tramite recv multishot.
+ * - \c ring l'anello delle ricezioni
+ * - \c send_ring un secondo anello che l'handler puo` usare per inviare
+ *   in blocco (ad esempio i broadcast), attendendone i completamenti
+ * - \c buffers i buffer forniti al kernel per le ricezioni
+ * - \c wakefd eventfd usato per risvegliare il loop
+ * - \c incoming fd registrati da altri thread e non ancora armati
+ * - \c sources fd con la ricezione armata, le cui richieste vengono
+ *   cancellate quando il loop termina
+ */
+typedef struct uring_loop {
+	uring_t ring;
+	uring_t send_ring;
+	uring_buffers buffers;
+	int wakefd;
+	unsigned long long wakeval;
+	int stop;
+	int id;
+	uring_handler handler;
+	pthread_t tid;
+	pthread_mutex_t mtx;
+	uring_source *incoming;
+	uring_source *sources;
+} uring_loop;
+
+/** <H3>Gruppo di loop io_uring</H3> */
+typedef struct {
+	uring_loop *loops;
+	int size;
+	unsigned int next;
+	pthread_mutex_t mtx;
+} uring_group;
+
+/** Verifica che il kernel supporti io_uring con accept/recv multishot e
+ * buffer forniti, provandole su una coppia di socket.
+ * \retval 1 se supportato, 0 altrimenti */
+int uring_Supported(void);
+
+/** Inizializza l'anello r con entries voci.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int initialize_Uring(uring_t *r, unsigned entries);
+
+/** Rilascia l'anello r. */
+void free_Uring(uring_t *r);
+
+/** Restituisce una voce di sottomissione libera (azzerata), pubblicando
+ * al kernel quelle già preparate se la coda è piena.
+ * \retval NULL in caso di errore */
+struct io_uring_sqe *get_Sqe(uring_t *r);
+
+/** Pubblica le voci preparate e attende almeno wait_nr completamenti.
+ * \retval il numero di voci sottomesse, -1 in caso di errore (sets errno) */
+int submit_Uring(uring_t *r, unsigned wait_nr);
+
+/** Restituisce il prossimo completamento disponibile, NULL se non ce ne sono. */
+struct io_uring_cqe *peek_Cqe(uring_t *r);
+
+/** Segnala che il completamento restituito da peek_Cqe è stato consumato. */
+void seen_Cqe(uring_t *r);
+
+/** Registra un gruppo di URING_BUFFERS buffer forniti nell'anello r.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int register_Buffers(uring_t *r, uring_buffers *b, unsigned short group);
+
+/** Restituisce al kernel il buffer bid dopo averne consumato i dati. */
+void recycle_Buffer(uring_buffers *b, unsigned short bid);
+
+/** Puntatore ai dati del buffer bid. */
+char *buffer_Data(uring_buffers *b, unsigned short bid);
+
+/** Rilascia i buffer forniti del gruppo b. */
+void free_Buffers(uring_t *r, uring_buffers *b);
+
+/** Prepara una accept multishot sulla socket di ascolto fd. */
+void prep_MultishotAccept(struct io_uring_sqe *sqe, int fd, unsigned long long data);
+
+/** Prepara una recv multishot su fd che usa i buffer del gruppo group. */
+void prep_MultishotRecv(struct io_uring_sqe *sqe, int fd, unsigned short group, unsigned long long data);
+
+/** Prepara una sendmsg su fd. */
+void prep_Sendmsg(struct io_uring_sqe *sqe, int fd, struct msghdr *m, unsigned long long data);
+
+/** Prepara una write di length byte su fd alla posizione corrente del file. */
+void prep_Write(struct io_uring_sqe *sqe, int fd, const void *buf, unsigned length, unsigned long long data);
+
+/** Prepara una read di length byte da fd. */
+void prep_Read(struct io_uring_sqe *sqe, int fd, void *buf, unsigned length, unsigned long long data);
+
+/** Prepara la cancellazione delle richieste pendenti su fd. */
+void prep_CancelFd(struct io_uring_sqe *sqe, int fd);
+
+/** Crea un gruppo di n loop io_uring (non ancora avviati).
+ * \retval NULL in caso di errore (sets errno) */
+uring_group *initialize_UringLoops(int n, uring_handler handler);
+
+/** Avvia un thread per ogni loop del gruppo.
+ * \retval 0 se tutto ok, -1 in caso di errore */
+int start_UringLoops(uring_group *g);
+
+/** Affida fd al prossimo loop del gruppo, che vi armera` una recv multishot.
+ * \retval il loop scelto, NULL in caso di errore */
+uring_loop *add_UringFd(uring_group *g, int fd, void *data);
+
+/** Chiede ai loop di terminare e ne attende l'uscita. */
+void stop_UringLoops(uring_group *g);
+
+/** Libera le risorse del gruppo (i loop devono essere gia` fermi). */
+void free_UringLoops(uring_group **g);
+
+#endif
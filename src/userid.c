@@ -0,0 +1,104 @@
+/**
+   \file userid.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione degli identificativi numerici degli utenti.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "errors.h"
+#include "userid.h"
+
+int addressById(message_t *msg, uint32_t id) {
+	int name_length, text_length;
+	uint32_t net = htonl(id);
+	if (msg == NULL || msg->buffer == NULL || msg->type != MSG_TO_ONE) {
+		errno = EINVAL;
+		return -1;
+	}
+	name_length = strlen(msg->buffer);
+	text_length = strlen(msg->buffer+name_length+1);
+	if (text_length == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	/*Il buffer e` ancora "nome\0testo\0": si fa spazio all'identificativo, se serve*/
+	if (name_length+1 < USERID_SIZE &&
+		(msg->buffer = realloc(msg->buffer, sizeof(char)*(USERID_SIZE+text_length+1))) == NULL) {
+		perror("userid, addressById");
+		exit(EXIT_FAILURE);
+	}
+	memmove(msg->buffer+USERID_SIZE, msg->buffer+name_length+1, text_length+1);
+	memcpy(msg->buffer, &net, USERID_SIZE);
+	msg->length = USERID_SIZE+text_length;
+	msg->type = MSG_TO_ID;
+	return 0;
+}
+
+long takeUserId(message_t *msg) {
+	uint32_t net;
+	if (msg == NULL || msg->buffer == NULL || msg->length <= USERID_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&net, msg->buffer, USERID_SIZE);
+	/*Il testo torna all'inizio del buffer, che resta quello ricevuto*/
+	msg->length -= USERID_SIZE;
+	memmove(msg->buffer, msg->buffer+USERID_SIZE, msg->length+1);
+	msg->type = MSG_TO_ONE;
+	return ntohl(net);
+}
+
+/** Confronta due voci per nome (per qsort e bsearch). */
+static int compare_Entries(const void *a, const void *b) {
+	return strcmp(((const userid_entry *) a)->name, ((const userid_entry *) b)->name);
+}
+
+int load_UserIds(userid_map *map, message_t *msg) {
+	char *name, *save = NULL;
+	int size = 0;
+	if (map == NULL || msg == NULL || msg->buffer == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	map->names = msg->buffer;
+	msg->buffer = NULL;
+	map->entries = NULL;
+	map->size = 0;
+	for (name = strtok_r(map->names, " ", &save); name != NULL; name = strtok_r(NULL, " ", &save)) {
+		if (map->size == size) {
+			size = (size == 0) ? 64 : 2*size;
+			if ((map->entries = realloc(map->entries, sizeof(userid_entry)*size)) == NULL) {
+				perror("userid, load_UserIds");
+				exit(EXIT_FAILURE);
+			}
+		}
+		map->entries[map->size].name = name;
+		map->entries[map->size].id = map->size;
+		map->size++;
+	}
+	qsort(map->entries, map->size, sizeof(userid_entry), compare_Entries);
+	return 0;
+}
+
+long find_UserId(userid_map *map, const char *name) {
+	userid_entry key, *e;
+	if (map == NULL || map->size == 0 || name == NULL) return -1;
+	key.name = (char *) name;
+	if ((e = bsearch(&key, map->entries, map->size, sizeof(userid_entry), compare_Entries)) == NULL)
+		return -1;
+	return e->id;
+}
+
+void free_UserIds(userid_map *map) {
+	if (map == NULL) return;
+	free(map->entries);
+	free(map->names);
+	map->entries = NULL;
+	map->names = NULL;
+	map->size = 0;
+}
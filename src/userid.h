@@ -0,0 +1,76 @@
+/**
+   \file userid.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  identificativi numerici degli utenti.
+
+Ogni utente autorizzato ha un identificativo a 32 bit: la sua posizione
+nel file degli utenti autorizzati, a partire da 0. Gli identificativi
+sono densi e non cambiano finché il server resta attivo.
+
+Un client chiede la mappa nome→identificativo con un MSG_USERIDS vuoto;
+il server risponde con un MSG_USERIDS il cui buffer contiene tutti i
+nomi, separati da spazi, in ordine di identificativo. Da lì in poi il
+client può indirizzare un messaggio con MSG_TO_ID: il buffer è
+l'identificativo del destinatario (4 byte, in network byte order) seguito
+dal testo, che non può essere vuoto: così l'ultimo byte è sempre del
+testo, e receiveMessage può togliergli il '\\n' finale come agli altri
+messaggi. Il server risolve il destinatario con un accesso a un array,
+senza copiarne il nome né cercarlo nella tabella hash.
+
+MSG_USERIDS è un messaggio di controllo in entrambe le direzioni: non
+consuma crediti. MSG_TO_ID li consuma come MSG_TO_ONE.
+ */
+#ifndef __USERID_H
+#define __USERID_H
+
+#include <stdint.h>
+
+#include "comsock.h"
+
+/** richiesta (client) e mappa (server) degli identificativi */
+#define MSG_USERIDS 'I'
+/** messaggio a un solo utente, indirizzato per identificativo */
+#define MSG_TO_ID 'D'
+/** Byte dell'identificativo in coda a un MSG_TO_ID */
+#define USERID_SIZE 4
+
+/** <H3>Voce della mappa degli identificativi</H3> */
+typedef struct {
+	char *name;
+	uint32_t id;
+} userid_entry;
+
+/** <H3>Mappa nome→identificativo di un client</H3>
+ * - \c names il buffer del MSG_USERIDS, diviso in nomi
+ * - \c entries le voci, ordinate per nome
+ * - \c size il numero di voci
+ */
+typedef struct {
+	char *names;
+	userid_entry *entries;
+	int size;
+} userid_map;
+
+/** Trasforma il MSG_TO_ONE msg (buffer "nome\\0testo") in un MSG_TO_ID
+ * per il destinatario id.
+ * \retval 0 se tutto ok, -1 in caso di errore o testo vuoto (sets errno) */
+int addressById(message_t *msg, uint32_t id);
+
+/** Toglie da un MSG_TO_ID ricevuto l'identificativo del destinatario: il
+ * buffer resta il solo testo, con la sua lunghezza, e il tipo diventa
+ * MSG_TO_ONE. Il testo viene spostato nello stesso buffer.
+ * \retval l'identificativo, -1 se il messaggio non è valido (errno = EINVAL) */
+long takeUserId(message_t *msg);
+
+/** Costruisce in map la mappa portata dal MSG_USERIDS msg, di cui prende
+ * il buffer (msg->buffer diventa NULL).
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int load_UserIds(userid_map *map, message_t *msg);
+
+/** Restituisce l'identificativo di name, -1 se la mappa non lo contiene. */
+long find_UserId(userid_map *map, const char *name);
+
+/** Libera le voci della mappa, che resta vuota. */
+void free_UserIds(userid_map *map);
+
+#endif
@@ -0,0 +1,350 @@
+/**
+   \file workpool.c
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  implementazione del pool di thread con work stealing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "errors.h"
+#include "workpool.h"
+
+/** Capacità iniziale di una deque */
+#define DEQUE_SIZE 64
+
+/** Slot del thread del pool corrente (-1 se il thread non appartiene al pool) */
+static __thread int pool_slot = -1;
+/** Pool a cui appartiene il thread corrente */
+static __thread work_pool *pool_self = NULL;
+
+/** Argomento di un thread del pool */
+typedef struct {
+	work_pool *pool;
+	int slot;
+} worker_arg;
+
+static void initialize_Deque(task_deque *d) {
+	d->items = Malloc(sizeof(task_t)*DEQUE_SIZE);
+	d->capacity = DEQUE_SIZE;
+	d->top = d->count = 0;
+	pthread_mutex_init(&d->mtx, NULL);
+}
+
+/** Inserisce un task in fondo alla deque, raddoppiandone la capacità se piena */
+static void push_Bottom(task_deque *d, task_fn fn, void *arg) {
+	task_t *t;
+	pthread_mutex_lock(&d->mtx);
+	if (d->count == d->capacity) {
+		task_t *old = d->items;
+		int i;
+		d->items = Malloc(sizeof(task_t)*d->capacity*2);
+		for (i = 0; i < d->count; i++)
+			d->items[i] = old[(d->top+i) % d->capacity];
+		free(old);
+		d->top = 0;
+		d->capacity *= 2;
+	}
+	t = d->items + (d->top+d->count) % d->capacity;
+	t->fn = fn;
+	t->arg = arg;
+	d->count++;
+	pthread_mutex_unlock(&d->mtx);
+}
+
+/** Preleva il task più recente (usata dal proprietario della deque) */
+static int pop_Bottom(task_deque *d, task_t *t) {
+	int found = 0;
+	pthread_mutex_lock(&d->mtx);
+	if (d->count > 0) {
+		d->count--;
+		*t = d->items[(d->top+d->count) % d->capacity];
+		found = 1;
+	}
+	pthread_mutex_unlock(&d->mtx);
+	return found;
+}
+
+/** Preleva il task più vecchio (usata dai thread che rubano) */
+static int pop_Top(task_deque *d, task_t *t) {
+	int found = 0;
+	pthread_mutex_lock(&d->mtx);
+	if (d->count > 0) {
+		*t = d->items[d->top];
+		d->top = (d->top+1) % d->capacity;
+		d->count--;
+		found = 1;
+	}
+	pthread_mutex_unlock(&d->mtx);
+	return found;
+}
+
+/** Cerca un task: prima nella propria deque, poi in quella condivisa e
+ * infine rubandolo alle altre a partire da una posizione pseudo-casuale.*/
+static int take_Task(work_pool *p, int slot, unsigned *seed, task_t *t) {
+	int i, start;
+	if (pop_Bottom(p->deques+slot, t)) return 1;
+	if (pop_Top(p->deques+p->max, t)) return 1;
+	start = rand_r(seed) % p->max;
+	for (i = 0; i < p->max; i++) {
+		int victim = (start+i) % p->max;
+		if (victim != slot && pop_Top(p->deques+victim, t)) return 1;
+	}
+	return 0;
+}
+
+static void *pool_worker(void *a) {
+	worker_arg *arg = a;
+	work_pool *p = arg->pool;
+	int slot = arg->slot;
+	unsigned seed = (unsigned) slot * 2654435761u;
+	task_t t;
+	free(arg);
+	pool_slot = slot;
+	pool_self = p;
+	while (1) {
+		if (take_Task(p, slot, &seed, &t)) {
+			__atomic_sub_fetch(&p->pending, 1, __ATOMIC_SEQ_CST);
+			t.fn(t.arg);
+			continue;
+		}
+		pthread_mutex_lock(&p->mtx);
+		__atomic_add_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+		while (!p->stop && __atomic_load_n(&p->pending, __ATOMIC_SEQ_CST) == 0) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += POOL_IDLE_MS / 1000;
+			ts.tv_nsec += (POOL_IDLE_MS % 1000) * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			/*Un thread in eccesso rimasto inattivo a lungo termina*/
+			if (pthread_cond_timedwait(&p->cond, &p->mtx, &ts) == ETIMEDOUT &&
+				p->threads > p->min && __atomic_load_n(&p->pending, __ATOMIC_SEQ_CST) == 0)
+				break;
+		}
+		__atomic_sub_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+		if (p->stop || __atomic_load_n(&p->pending, __ATOMIC_SEQ_CST) == 0) {
+			p->threads--;
+			p->active[slot] = 0;
+			pthread_cond_broadcast(&p->done);
+			pthread_mutex_unlock(&p->mtx);
+			return (void *) 0;
+		}
+		pthread_mutex_unlock(&p->mtx);
+	}
+}
+
+/** Avvia un thread in uno slot libero. Da chiamare con p->mtx acquisito.*/
+static int spawn_Worker(work_pool *p) {
+	pthread_t tid;
+	worker_arg *arg;
+	int slot;
+	for (slot = 0; slot < p->max && p->active[slot]; slot++);
+	if (slot == p->max) return -1;
+	arg = Malloc(sizeof(worker_arg));
+	arg->pool = p;
+	arg->slot = slot;
+	if ((errno = pthread_create(&tid, NULL, &pool_worker, arg)) != 0) {
+		free(arg);
+		return -1;
+	}
+	pthread_detach(tid);
+	p->active[slot] = 1;
+	p->threads++;
+	return 0;
+}
+
+work_pool *initialize_Pool(int min, int max) {
+	work_pool *p;
+	int i;
+	if (min < 1 || max < min) {
+		errno = EINVAL;
+		return NULL;
+	}
+	p = Malloc(sizeof(work_pool));
+	p->min = min;
+	p->max = max;
+	p->threads = p->idle = p->stop = 0;
+	p->pending = 0;
+	p->deques = Malloc(sizeof(task_deque)*(max+1));
+	p->active = Malloc(sizeof(int)*max);
+	for (i = 0; i <= max; i++)
+		initialize_Deque(p->deques+i);
+	for (i = 0; i < max; i++)
+		p->active[i] = 0;
+	pthread_mutex_init(&p->mtx, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	pthread_cond_init(&p->done, NULL);
+	pthread_mutex_lock(&p->mtx);
+	for (i = 0; i < min; i++) {
+		if (spawn_Worker(p) == -1) {
+			pthread_mutex_unlock(&p->mtx);
+			perror("workpool, initialize_Pool");
+			free_Pool(&p);
+			return NULL;
+		}
+	}
+	pthread_mutex_unlock(&p->mtx);
+	return p;
+}
+
+int submit_Task(work_pool *p, task_fn fn, void *arg) {
+	long pending;
+	if (p == NULL || fn == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	/*Un thread del pool tiene per se` i task che genera: gli altri li rubano*/
+	if (pool_self == p && pool_slot >= 0)
+		push_Bottom(p->deques+pool_slot, fn, arg);
+	else
+		push_Bottom(p->deques+p->max, fn, arg);
+	pending = __atomic_add_fetch(&p->pending, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&p->idle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&p->mtx);
+		pthread_cond_signal(&p->cond);
+		pthread_mutex_unlock(&p->mtx);
+	} else if (pending > (long) POOL_PENDING_PER_THREAD * p->threads && p->threads < p->max) {
+		pthread_mutex_lock(&p->mtx);
+		if (p->threads < p->max && !p->stop)
+			(void) spawn_Worker(p);
+		pthread_mutex_unlock(&p->mtx);
+	}
+	return 0;
+}
+
+long pending_Tasks(work_pool *p) {
+	if (p == NULL) return 0;
+	return __atomic_load_n(&p->pending, __ATOMIC_SEQ_CST);
+}
+
+void free_Pool(work_pool **p) {
+	int i;
+	if (p == NULL || *p == NULL) {
+		errno = EINVAL;
+		return;
+	}
+	pthread_mutex_lock(&(*p)->mtx);
+	(*p)->stop = 1;
+	pthread_cond_broadcast(&(*p)->cond);
+	while ((*p)->threads > 0)
+		pthread_cond_wait(&(*p)->done, &(*p)->mtx);
+	pthread_mutex_unlock(&(*p)->mtx);
+	for (i = 0; i <= (*p)->max; i++)
+		free((*p)->deques[i].items);
+	free((*p)->deques);
+	free((*p)->active);
+	free(*p);
+	*p = NULL;
+}
+
+serial_queue *new_Serial(work_pool *p) {
+	serial_queue *s;
+	if (p == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	s = Malloc(sizeof(serial_queue));
+	s->head = s->tail = NULL;
+	s->length = s->scheduled = s->holds = s->parked = 0;
+	s->refs = 1;
+	s->pool = p;
+	pthread_mutex_init(&s->mtx, NULL);
+	return s;
+}
+
+/** Task del pool che esegue in ordine i task di una coda seriale. Dopo
+ * SERIAL_BUDGET task si risottomette, per non monopolizzare il thread.*/
+static void drain_Serial(void *arg) {
+	serial_queue *s = arg;
+	task_t *t;
+	int n;
+	for (n = 0; n < SERIAL_BUDGET; n++) {
+		pthread_mutex_lock(&s->mtx);
+		if (s->holds > 0) {
+			/*Sospesa: sara` resume_Serial a rimetterla in esecuzione*/
+			s->parked = 1;
+			pthread_mutex_unlock(&s->mtx);
+			return;
+		}
+		if ((t = s->head) == NULL) {
+			s->scheduled = 0;
+			pthread_mutex_unlock(&s->mtx);
+			release_Serial(s);
+			return;
+		}
+		if ((s->head = t->next) == NULL) s->tail = NULL;
+		s->length--;
+		pthread_mutex_unlock(&s->mtx);
+		t->fn(t->arg);
+		free(t);
+	}
+	submit_Task(s->pool, &drain_Serial, s);
+}
+
+int submit_Serial(serial_queue *s, task_fn fn, void *arg) {
+	task_t *t;
+	int schedule = 0;
+	if (s == NULL || fn == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	t = Malloc(sizeof(task_t));
+	t->fn = fn;
+	t->arg = arg;
+	t->next = NULL;
+	pthread_mutex_lock(&s->mtx);
+	if (s->tail == NULL) s->head = t;
+	else s->tail->next = t;
+	s->tail = t;
+	s->length++;
+	if (!s->scheduled) {
+		/*Finche' e` in esecuzione la coda ha un riferimento in piu`*/
+		s->scheduled = 1;
+		s->refs++;
+		schedule = 1;
+	}
+	pthread_mutex_unlock(&s->mtx);
+	if (schedule) return submit_Task(s->pool, &drain_Serial, s);
+	return 0;
+}
+
+void hold_Serial(serial_queue *s) {
+	pthread_mutex_lock(&s->mtx);
+	s->holds++;
+	pthread_mutex_unlock(&s->mtx);
+}
+
+void resume_Serial(serial_queue *s) {
+	int schedule = 0;
+	pthread_mutex_lock(&s->mtx);
+	if (--s->holds == 0 && s->parked) {
+		s->parked = 0;
+		schedule = 1;
+	}
+	pthread_mutex_unlock(&s->mtx);
+	if (schedule) submit_Task(s->pool, &drain_Serial, s);
+}
+
+void retain_Serial(serial_queue *s) {
+	pthread_mutex_lock(&s->mtx);
+	s->refs++;
+	pthread_mutex_unlock(&s->mtx);
+}
+
+void release_Serial(serial_queue *s) {
+	int refs;
+	pthread_mutex_lock(&s->mtx);
+	refs = --s->refs;
+	pthread_mutex_unlock(&s->mtx);
+	if (refs == 0) {
+		pthread_mutex_destroy(&s->mtx);
+		free(s);
+	}
+}
@@ -0,0 +1,129 @@
+/**
+   \file workpool.h
+   \author Alessandro Lenzi, aless.lenzi@gmail.com
+   \brief  pool di thread con work stealing e code seriali.
+
+Ogni thread del pool possiede una deque: i task generati da un thread del
+pool vengono inseriti in fondo alla sua deque e da lì ripresi (LIFO), mentre
+i thread inattivi li rubano dalla cima delle deque altrui (FIFO). I task
+sottomessi dall'esterno finiscono in una deque condivisa da cui tutti rubano.
+Il numero di thread varia tra un minimo e un massimo in base ai task in
+attesa.
+
+Una serial_queue garantisce che i propri task vengano eseguiti uno alla
+volta e nell'ordine di sottomissione, pur girando sui thread del pool.
+ */
+#ifndef __WORKPOOL_H
+#define __WORKPOOL_H
+
+#include <pthread.h>
+
+/** Task in attesa per thread oltre i quali il pool aggiunge un thread */
+#define POOL_PENDING_PER_THREAD 16
+/** Millisecondi di inattività dopo i quali un thread in eccesso termina */
+#define POOL_IDLE_MS 2000
+/** Task eseguiti da una serial_queue prima di cedere il thread */
+#define SERIAL_BUDGET 32
+
+/** Un task: la funzione da eseguire e il suo argomento */
+typedef void (*task_fn)(void *arg);
+
+typedef struct task {
+	task_fn fn;
+	void *arg;
+	struct task *next;
+} task_t;
+
+/** <H3>Deque di task</H3>
+ * Buffer circolare protetto da mutex.
+ * - \c items i task, \c capacity la loro capacità
+ * - \c top indice del prossimo task da rubare
+ * - \c count il numero di task presenti
+ */
+typedef struct {
+	task_t *items;
+	int capacity;
+	int top;
+	int count;
+	pthread_mutex_t mtx;
+} task_deque;
+
+/** <H3>Pool di thread</H3>
+ * - \c deques una deque per ogni possibile thread (max) più quella condivisa
+ * - \c active 1 se lo slot corrispondente ha un thread in esecuzione
+ * - \c min, \c max limiti sul numero di thread
+ * - \c threads thread in esecuzione, \c idle thread in attesa di task
+ * - \c pending task sottomessi e non ancora eseguiti
+ */
+typedef struct {
+	task_deque *deques;
+	int *active;
+	int min;
+	int max;
+	int threads;
+	int idle;
+	long pending;
+	int stop;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	pthread_cond_t done;
+} work_pool;
+
+/** <H3>Coda seriale</H3>
+ * - \c head, \c tail i task in attesa
+ * - \c length il loro numero
+ * - \c scheduled 1 se la coda è affidata a un thread del pool
+ * - \c holds numero di sospensioni in corso (hold_Serial)
+ * - \c parked 1 se la coda e` ferma in attesa di resume_Serial
+ * - \c refs riferimenti alla coda
+ */
+typedef struct {
+	task_t *head;
+	task_t *tail;
+	int length;
+	int scheduled;
+	int holds;
+	int parked;
+	int refs;
+	work_pool *pool;
+	pthread_mutex_t mtx;
+} serial_queue;
+
+/** Crea un pool con min thread, che possono crescere fino a max.
+ * \retval NULL in caso di errore (sets errno) */
+work_pool *initialize_Pool(int min, int max);
+
+/** Sottomette un task al pool.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int submit_Task(work_pool *p, task_fn fn, void *arg);
+
+/** Numero di task in attesa nel pool. */
+long pending_Tasks(work_pool *p);
+
+/** Termina i thread del pool (i task ancora in attesa non vengono eseguiti)
+ * e ne libera le risorse. */
+void free_Pool(work_pool **p);
+
+/** Crea una coda seriale sul pool p, con un riferimento. */
+serial_queue *new_Serial(work_pool *p);
+
+/** Sottomette un task alla coda seriale s.
+ * \retval 0 se tutto ok, -1 in caso di errore (sets errno) */
+int submit_Serial(serial_queue *s, task_fn fn, void *arg);
+
+/** Sospende la coda s al termine del task in esecuzione: i task successivi
+ * non partono finché non viene chiamata resume_Serial. Va chiamata
+ * dall'interno di un task di s. */
+void hold_Serial(serial_queue *s);
+
+/** Rimuove una sospensione della coda s. */
+void resume_Serial(serial_queue *s);
+
+/** Acquisisce un riferimento alla coda s. */
+void retain_Serial(serial_queue *s);
+
+/** Rilascia un riferimento alla coda s, che viene liberata quando non ne
+ * restano e non ha task in esecuzione. */
+void release_Serial(serial_queue *s);
+
+#endif